@@ -44,10 +44,21 @@
 #include <Dbt.h>		//Need this for definitions of WM_DEVICECHANGE messages
 
 #include <ctime>
+#include <cstdio>
 #include <sstream>
 #include <iostream>
 
 #include <msclr\marshal_cppstd.h>
+#include <vcclr.h>		//PtrToStringChars()
+
+#include "hexcore\DeviceImage.h"
+#include "hexcore\HexImage.h"
+#include "hexcore\HexParser.h"
+#include "hexcore\HexTables.h"
+#include "hexcore\HexWriter.h"
+#include "hexcore\PacketPlan.h"
+#include "hexcore\TransferEngine.h"
+#include "hexcore\VerifyCompare.h"
 
 #pragma region Constants
  //Modify this value to match the VID and PID in your USB device descriptor.
@@ -152,6 +163,37 @@
 
 //This is the number of bytes per line of the 
 #define HEX_FILE_BYTES_PER_LINE 16
+
+//Data bytes per record of exported hex files (up to HEX_WRITER_MAX_RECORD_LENGTH)
+#define HEX_EXPORT_BYTES_PER_LINE HEX_FILE_BYTES_PER_LINE
+//Uncomment to leave the erased memory out of exported hex files
+//#define HEX_EXPORT_SKIP_ERASED
+//**************************************************************************
+
+//*********************** TRANSFER WINDOW **********************************
+//Reports kept in flight at most by read, verify and program, up to
+//  TRANSFER_MAX_SLOTS (1 = lock-step, one report at a time); below this the
+//  transfer engine sizes the window on the latency it observes
+#define TRANSFER_WINDOW_PACKETS		TRANSFER_MAX_SLOTS
+//A report still pending after this many ms means the device is NAKing:
+//  the rest of the transfer runs lock-step
+#define TRANSFER_NAK_TIMEOUT		250
+//Latency budgets (ms): the wait before a device is reported stalled
+//  follows the latencies measured on it, between a floor and a ceiling;
+//  the initial one holds until the first answer.  A command waits for its
+//  answer, an erase for the answer to the report that follows it, a
+//  stream for each completion of the transfer engine
+#define BUDGET_COMMAND_FLOOR		200
+#define BUDGET_COMMAND_CEILING		5000
+#define BUDGET_COMMAND_INITIAL		2000
+//An erase used to wait on a blocking ReadFile with no limit, and it is
+//  never retried: the first one is given the 15 s of the Python tool
+#define BUDGET_ERASE_FLOOR			1000
+#define BUDGET_ERASE_CEILING		60000
+#define BUDGET_ERASE_INITIAL		15000
+#define BUDGET_STREAM_FLOOR			(2 * TRANSFER_NAK_TIMEOUT)
+#define BUDGET_STREAM_CEILING		5000
+#define BUDGET_STREAM_INITIAL		2000
 //**************************************************************************
 
 //*********************** Device Family Definitions ************************
@@ -361,6 +403,244 @@ typedef union _BOOTLOADER_COMMAND
 
 #pragma endregion
 
+#pragma region Transfer Port
+//HexCore::TransferPort on a pair of overlapped handles to the HID device:
+//  an OVERLAPPED and an event per slot for the OUT reports, and one read
+//  kept pending across timeouts for the IN reports.  Every wait also
+//  watches the cancel event, which lives as long as the port so that the
+//  UI thread can set it while a worker opens or closes the handles
+class OverlappedHidPort : public HexCore::TransferPort
+{
+public:
+	OverlappedHidPort()
+		: writeHandle(INVALID_HANDLE_VALUE), readHandle(INVALID_HANDLE_VALUE), readEvent(NULL), readPending(false)
+	{
+		unsigned int i;
+
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			writeEvents[i] = NULL;
+			writing[i] = false;
+		}
+		cancelEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+
+	~OverlappedHidPort()
+	{
+		Close();
+		if (cancelEvent != NULL)
+		{
+			CloseHandle(cancelEvent);
+		}
+	}
+
+	//Ends the waits in progress, and every later one, with
+	//  TRANSFER_CANCELLED until Rearm; may be called from any thread.  The
+	//  transfers stay in flight until Cancel or Close
+	void Interrupt(void)
+	{
+		SetEvent(cancelEvent);
+	}
+
+	void Rearm(void)
+	{
+		ResetEvent(cancelEvent);
+	}
+
+	//Opens the write and read handles; false when a handle or an event
+	//  could not be created, the port is then closed
+	bool Open(LPCTSTR devicePath)
+	{
+		unsigned int i;
+
+		Close();
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			writeEvents[i] = CreateEvent(NULL, TRUE, TRUE, NULL);
+		}
+		readEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+		writeHandle = CreateFile(devicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+		readHandle = CreateFile(devicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
+
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			if (writeEvents[i] == NULL)
+			{
+				Close();
+				return false;
+			}
+		}
+		if ((readEvent == NULL) || (writeHandle == INVALID_HANDLE_VALUE) || (readHandle == INVALID_HANDLE_VALUE))
+		{
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	//Cancels the transfers in flight and frees the handles and the events
+	void Close(void)
+	{
+		unsigned int i;
+
+		Cancel();
+		if (writeHandle != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(writeHandle);
+			writeHandle = INVALID_HANDLE_VALUE;
+		}
+		if (readHandle != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(readHandle);
+			readHandle = INVALID_HANDLE_VALUE;
+		}
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			if (writeEvents[i] != NULL)
+			{
+				CloseHandle(writeEvents[i]);
+				writeEvents[i] = NULL;
+			}
+		}
+		if (readEvent != NULL)
+		{
+			CloseHandle(readEvent);
+			readEvent = NULL;
+		}
+	}
+
+	bool StartWrite(unsigned int slot, const unsigned char* report)
+	{
+		memset(&writeOverlapped[slot], 0, sizeof(OVERLAPPED));
+		writeOverlapped[slot].hEvent = writeEvents[slot];
+		ResetEvent(writeEvents[slot]);
+
+		if (!WriteFile(writeHandle, report, TRANSFER_REPORT_BYTES, NULL, &writeOverlapped[slot]) &&
+			(GetLastError() != ERROR_IO_PENDING))
+		{
+			return false;
+		}
+		writing[slot] = true;
+		return true;
+	}
+
+	int WaitWrite(unsigned int slot, unsigned long timeoutMs)
+	{
+		DWORD bytesWritten = 0;
+		DWORD wait;
+
+		if (!writing[slot])
+		{
+			return TRANSFER_DONE;
+		}
+		wait = Wait(writeEvents[slot], timeoutMs);
+		if ((wait == WAIT_TIMEOUT) || (wait == (WAIT_OBJECT_0 + 1)))
+		{
+			return (wait == WAIT_TIMEOUT) ? TRANSFER_TIMEOUT : TRANSFER_CANCELLED;
+		}
+		writing[slot] = false;
+		if ((wait != WAIT_OBJECT_0) ||
+			!GetOverlappedResult(writeHandle, &writeOverlapped[slot], &bytesWritten, TRUE) ||
+			(bytesWritten != TRANSFER_REPORT_BYTES))
+		{
+			return TRANSFER_FAILED;
+		}
+		return TRANSFER_DONE;
+	}
+
+	int Read(unsigned char* report, unsigned long timeoutMs)
+	{
+		DWORD bytesRead = 0;
+		DWORD wait;
+
+		if (!readPending)
+		{
+			memset(&readOverlapped, 0, sizeof(OVERLAPPED));
+			readOverlapped.hEvent = readEvent;
+			ResetEvent(readEvent);
+			readBuffer[0] = 0;
+
+			if (!ReadFile(readHandle, readBuffer, TRANSFER_REPORT_BYTES, NULL, &readOverlapped) &&
+				(GetLastError() != ERROR_IO_PENDING))
+			{
+				return TRANSFER_FAILED;
+			}
+			readPending = true;
+		}
+
+		wait = Wait(readEvent, timeoutMs);
+		if ((wait == WAIT_TIMEOUT) || (wait == (WAIT_OBJECT_0 + 1)))
+		{
+			return (wait == WAIT_TIMEOUT) ? TRANSFER_TIMEOUT : TRANSFER_CANCELLED;
+		}
+		readPending = false;
+		if ((wait != WAIT_OBJECT_0) || !GetOverlappedResult(readHandle, &readOverlapped, &bytesRead, TRUE))
+		{
+			return TRANSFER_FAILED;
+		}
+		memcpy(report, readBuffer, TRANSFER_REPORT_BYTES);
+		return TRANSFER_DONE;
+	}
+
+	HANDLE ReadHandle(void) const
+	{
+		return readHandle;
+	}
+
+	void Cancel(void)
+	{
+		DWORD bytes;
+		unsigned int i;
+
+		if (writeHandle != INVALID_HANDLE_VALUE)
+		{
+			CancelIo(writeHandle);
+			for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+			{
+				if (writing[i])
+				{
+					GetOverlappedResult(writeHandle, &writeOverlapped[i], &bytes, TRUE);
+					writing[i] = false;
+				}
+			}
+		}
+		if ((readHandle != INVALID_HANDLE_VALUE) && readPending)
+		{
+			CancelIo(readHandle);
+			GetOverlappedResult(readHandle, &readOverlapped, &bytes, TRUE);
+			readPending = false;
+		}
+	}
+
+private:
+	//WAIT_OBJECT_0 when event is set, WAIT_OBJECT_0 + 1 when the port is
+	//  interrupted, WAIT_TIMEOUT
+	DWORD Wait(HANDLE event, unsigned long timeoutMs)
+	{
+		HANDLE events[2] = { event, cancelEvent };
+
+		return WaitForMultipleObjects(2, events, FALSE, timeoutMs);
+	}
+
+	HANDLE writeHandle;
+	HANDLE readHandle;
+	HANDLE cancelEvent;
+	OVERLAPPED writeOverlapped[TRANSFER_MAX_SLOTS];
+	HANDLE writeEvents[TRANSFER_MAX_SLOTS];
+	bool writing[TRANSFER_MAX_SLOTS];
+	OVERLAPPED readOverlapped;
+	HANDLE readEvent;
+	bool readPending;
+	unsigned char readBuffer[TRANSFER_REPORT_BYTES];
+};
+
+//HexCore::TransferEngine::AnswerKey of the GET_DATA answers
+static unsigned long getDataAnswerKey(const unsigned char* report)
+{
+	return ((const BOOTLOADER_COMMAND*)report)->GetDataResults.Address;
+}
+#pragma endregion
+
 unsigned char encryptionBlockSize;
 unsigned char encryptedFF[64];
 unsigned char deviceID;
@@ -465,6 +745,185 @@ namespace HIDBootLoader {
 		HANDLE hRecipient,
 		LPVOID NotificationFilter,
 		DWORD Flags);
+
+	//Drops the input reports the HID driver has buffered for a handle
+	[DllImport("hid.dll", EntryPoint = "HidD_FlushQueue")]
+	extern "C" BOOLEAN WINAPI HidD_FlushQueueUM(
+		HANDLE HidDeviceObject);
+#pragma endregion
+
+#pragma region Device Session
+	//The handles to the bootloader, opened once and shared by the worker
+	//  threads, which run one at a time, instead of a new pair per worker.
+	//  The single commands (QUERY, ERASE, RESET...) go one report at a time
+	//  on the same OverlappedHidPort the transfer engine uses, so that there
+	//  is a single read handle: the HID driver queues every IN report on each
+	//  handle open on the device.  A worker that fails closes the session and
+	//  the next one opens it again.
+	//
+	//  No wait is infinite: commands, erases and streams each get a
+	//  LatencyBudget learned on the device, and the cancel button interrupts
+	//  the port so that the worker fails at once whatever it waits for.
+	class HidDeviceSession
+	{
+	public:
+		HidDeviceSession()
+			: open(false), connects(0), connectMicroseconds(0), phaseConnectStart(0),
+			commandBudget(BUDGET_COMMAND_FLOOR, BUDGET_COMMAND_CEILING, BUDGET_COMMAND_INITIAL),
+			eraseBudget(BUDGET_ERASE_FLOOR, BUDGET_ERASE_CEILING, BUDGET_ERASE_INITIAL),
+			streamBudget(BUDGET_STREAM_FLOOR, BUDGET_STREAM_CEILING, BUDGET_STREAM_INITIAL),
+			erasing(false), lastBudget(&commandBudget), budgetDevice(0), budgetDeviceValid(false)
+		{
+		}
+
+		~HidDeviceSession()
+		{
+			Close();
+		}
+
+		//Opens the handles unless they already are; false when the device
+		//  could not be opened
+		bool Open(LPCTSTR devicePath)
+		{
+			std::chrono::steady_clock::time_point start;
+
+			if (open)
+			{
+				return true;
+			}
+			start = std::chrono::steady_clock::now();
+			if (!port.Open(devicePath))
+			{
+				return false;
+			}
+			open = true;
+			connects++;
+			connectMicroseconds += (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			return true;
+		}
+
+		//Starts the phase of a worker thread: clears an earlier cancel, opens
+		//  the device if needed and drops the IN reports an earlier phase
+		//  left unread
+		bool Begin(LPCTSTR devicePath)
+		{
+			phaseStart = std::chrono::steady_clock::now();
+			phaseConnectStart = connectMicroseconds;
+			port.Rearm();
+			//A slave answers through the master: what was learned on another
+			//  node does not hold
+			if (!budgetDeviceValid || (budgetDevice != deviceID))
+			{
+				commandBudget.Reset();
+				eraseBudget.Reset();
+				streamBudget.Reset();
+				budgetDevice = deviceID;
+				budgetDeviceValid = true;
+			}
+			if (!Open(devicePath))
+			{
+				return false;
+			}
+			HidD_FlushQueueUM(port.ReadHandle());
+			return true;
+		}
+
+		void Close(void)
+		{
+			port.Close();
+			open = false;
+		}
+
+		OverlappedHidPort& Port(void)
+		{
+			return port;
+		}
+
+		//Ends the waits of the worker with TRANSFER_CANCELLED, from any
+		//  thread, until the next Begin
+		void Interrupt(void)
+		{
+			port.Interrupt();
+		}
+
+		//Writes a report and waits for it, as WriteFile on a synchronous
+		//  handle did, within the command budget; nothing may be in flight on
+		//  the port.  The device takes no report while it erases, so the one
+		//  after an ERASE_DEVICE, and its answer, get the erase budget
+		bool Write(const unsigned char* report)
+		{
+			lastBudget = erasing ? &eraseBudget : &commandBudget;
+			if (!erasing)
+			{
+				commandStart = std::chrono::steady_clock::now();
+			}
+			erasing = (report[1] == ERASE_DEVICE);
+			return port.StartWrite(0, report) && (port.WaitWrite(0, lastBudget->TimeoutMs()) == TRANSFER_DONE);
+		}
+
+		//Waits for the answer to the last report written, as ReadFile on a
+		//  synchronous handle did; the budget counts from the write and
+		//  learns the latency of the answer
+		bool Read(unsigned char* report)
+		{
+			unsigned long elapsed = (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - commandStart).count();
+			unsigned long timeoutMs = lastBudget->TimeoutMs();
+
+			timeoutMs = ((elapsed / 1000) < timeoutMs) ? (timeoutMs - (elapsed / 1000)) : 0;
+			if (port.Read(report, timeoutMs) != TRANSFER_DONE)
+			{
+				return false;
+			}
+			lastBudget->Sample((unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - commandStart).count());
+			return true;
+		}
+
+		//Budget of the transfer engines of the workers (TransferEngine::SetBudget)
+		HexCore::LatencyBudget& StreamBudget(void)
+		{
+			return streamBudget;
+		}
+
+		//Times the device was opened and the time spent opening it, in all
+		//  and since Begin
+		unsigned long Connects(void) const
+		{
+			return connects;
+		}
+
+		unsigned long ConnectMicroseconds(void) const
+		{
+			return connectMicroseconds;
+		}
+
+		unsigned long PhaseMicroseconds(void) const
+		{
+			return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - phaseStart).count();
+		}
+
+		unsigned long PhaseConnectMicroseconds(void) const
+		{
+			return connectMicroseconds - phaseConnectStart;
+		}
+
+	private:
+		OverlappedHidPort port;
+		bool open;
+		unsigned long connects;
+		unsigned long connectMicroseconds;
+		std::chrono::steady_clock::time_point phaseStart;
+		unsigned long phaseConnectStart;
+		HexCore::LatencyBudget commandBudget;
+		HexCore::LatencyBudget eraseBudget;
+		HexCore::LatencyBudget streamBudget;
+		//An ERASE_DEVICE was the last report written, at commandStart
+		bool erasing;
+		HexCore::LatencyBudget* lastBudget;
+		std::chrono::steady_clock::time_point commandStart;
+		//Device ID the budgets were learned on
+		unsigned char budgetDevice;
+		bool budgetDeviceValid;
+	};
 #pragma endregion
 
 #pragma region Global Variables
@@ -476,8 +935,6 @@ namespace HIDBootLoader {
 	HANDLE HandleToMyDevice = INVALID_HANDLE_VALUE;			//Variable we use to hold the handle
 	PSP_DEVICE_INTERFACE_DETAIL_DATA MyStructureWithDetailedInterfaceDataInIt = new SP_DEVICE_INTERFACE_DETAIL_DATA;	//Make this global, so we can pass the device path to various CreateFile() calls all over the program
 	BOOL MyDeviceAttachedStatus = false;	//False = disconnected, true = connected.
-	DWORD ErrorStatusWrite = ERROR_SUCCESS;
-	DWORD ErrorStatusRead = ERROR_SUCCESS;
 	BOOL Status = false;
 
 #ifdef USE_PASSWORD
@@ -529,13 +986,20 @@ namespace HIDBootLoader {
 		bool inTimer;
 		bool deviceAttached;
 
-		unsigned char *pData;
-		unsigned char *pData0;
-		unsigned char *pData1;
-		unsigned char *pData2;
-		unsigned char *pData3;
-		unsigned char *pData4;
-		unsigned char *pData5;
+		//Host copy of the device memory, one buffer per memory region
+		HexCore::DeviceImage* deviceImage;
+
+		//PROGRAM_DEVICE reports of deviceImage, compiled by the first
+		//  programming and cleared whenever the image changes
+		HexCore::PacketPlan* programPlan;
+
+		//Handles to the device, shared by the worker threads
+		HidDeviceSession* deviceSession;
+
+		//true while the device holds deviceImage as programmed right after an
+		//  erase: the erased blocks of the image are then erased on the device
+		//  too and verify only reads the blocks holding data
+		bool sparseVerify;
 
 
 
@@ -683,6 +1147,7 @@ private: System::Windows::Forms::Label^  label1;
 private: System::Windows::Forms::Label^  label2;
 private: System::Windows::Forms::FlowLayoutPanel^  flowLayoutPanel2;
 private: System::Windows::Forms::Button^  btn_clear;
+private: System::Windows::Forms::Button^  btn_Cancel;
 
 
 
@@ -767,8 +1232,6 @@ private: System::Windows::Forms::Button^  btn_clear;
 	public:
 		Form1(void)
 		{
-			unsigned char i;
-
 			InitializeComponent();
 
 			btn_Verify_restore = btn_Verify->Enabled;
@@ -780,19 +1243,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 			btn_ReadDevice_restore = btn_ReadDevice->Enabled;
 			ckbox_ConfigWordProgramming_restore = ckbox_ConfigWordProgramming->Enabled;
 
-			//Create a new set of memory regions and an array of pointers
-			//	to what will become the allocated memory for memory space
+			//Create a new set of memory regions and the (still empty) image
+			//	of the device memory
 			memoryRegions = new MEMORY_REGION[MAX_DATA_REGIONS];
-
-			//pData = new unsigned char*[MAX_DATA_REGIONS];
 			memoryRegionsDetected = 0;
-
-			//set all of the pointers to NULL so that we know that the
-			//	memory hasn't been allocated yet.
-			for (i = 0; i < MAX_DATA_REGIONS; i++)
-			{
-				setMemoryRegion(i, 0);
-			}
+			deviceImage = new HexCore::DeviceImage();
+			programPlan = new HexCore::PacketPlan();
+			sparseVerify = false;
+			deviceSession = new HidDeviceSession();
 
 			unlockStatus = false;
 			enablePrint = false;
@@ -839,16 +1297,9 @@ private: System::Windows::Forms::Button^  btn_clear;
 			Status = TryToFindHIDDeviceFromVIDPID();
 			if (Status == TRUE)
 			{
-				HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-				HANDLE ReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
-				//Open read and write pipes to the device.
-				WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-				ErrorStatusWrite = GetLastError();
-				ReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-				ErrorStatusRead = GetLastError();
-
-				if ((ErrorStatusRead == ERROR_SUCCESS) & (ErrorStatusWrite == ERROR_SUCCESS))
+				//Open read and write pipes to the device; the worker threads
+				//  use them until the device goes away.
+				if (deviceSession->Open(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
 				{
 					MyDeviceAttachedStatus = true;
 					DeviceAttached();
@@ -882,26 +1333,20 @@ private: System::Windows::Forms::Button^  btn_clear;
 		/// </summary>
 		~Form1()
 		{
-			unsigned char i;
-
 			if (components)
 			{
 				delete components;
 			}
 
-			//For each of the possible allocated memory regions
-			for (i = 0; i < MAX_DATA_REGIONS; i++)
-			{
-				pData = getMemoryRegion(i);
-				if (pData != 0)
-				{
-					//If the pointer wasn't NULL then we must have
-					//	allocated memory to that pointer.  Free the 
-					//	pointer and set the pointer back to NULL.
-					free(pData);
-					setMemoryRegion(i, 0);
-				}
-			}
+			//Free the memory image
+			delete deviceImage;
+			deviceImage = 0;
+			delete programPlan;
+			programPlan = 0;
+
+			//Close the device
+			delete deviceSession;
+			deviceSession = 0;
 		}
 
 #pragma endregion
@@ -921,6 +1366,7 @@ private: System::Windows::Forms::Button^  btn_clear;
 			this->progressBar_Status = (gcnew System::Windows::Forms::ProgressBar());
 			this->flowLayoutPanel2 = (gcnew System::Windows::Forms::FlowLayoutPanel());
 			this->btn_clear = (gcnew System::Windows::Forms::Button());
+			this->btn_Cancel = (gcnew System::Windows::Forms::Button());
 			this->listBox1 = (gcnew System::Windows::Forms::ListBox());
 			this->ckbox_ConfigWordProgramming = (gcnew System::Windows::Forms::CheckBox());
 			this->btn_ProgramVerify = (gcnew System::Windows::Forms::Button());
@@ -1021,6 +1467,7 @@ private: System::Windows::Forms::Button^  btn_clear;
 			// flowLayoutPanel2
 			// 
 			this->flowLayoutPanel2->Controls->Add(this->btn_clear);
+			this->flowLayoutPanel2->Controls->Add(this->btn_Cancel);
 			this->flowLayoutPanel2->FlowDirection = System::Windows::Forms::FlowDirection::RightToLeft;
 			this->flowLayoutPanel2->Location = System::Drawing::Point(387, 4);
 			this->flowLayoutPanel2->Margin = System::Windows::Forms::Padding(4);
@@ -1040,6 +1487,17 @@ private: System::Windows::Forms::Button^  btn_clear;
 			this->btn_clear->UseVisualStyleBackColor = true;
 			this->btn_clear->Click += gcnew System::EventHandler(this, &Form1::btn_clear_Click);
 			// 
+			// btn_Cancel
+			// 
+			this->btn_Cancel->Location = System::Drawing::Point(91, 4);
+			this->btn_Cancel->Margin = System::Windows::Forms::Padding(4, 4, 0, 4);
+			this->btn_Cancel->Name = L"btn_Cancel";
+			this->btn_Cancel->Size = System::Drawing::Size(104, 28);
+			this->btn_Cancel->TabIndex = 1;
+			this->btn_Cancel->Text = L"C&ancel";
+			this->btn_Cancel->UseVisualStyleBackColor = true;
+			this->btn_Cancel->Click += gcnew System::EventHandler(this, &Form1::btn_Cancel_Click);
+			// 
 			// listBox1
 			// 
 			this->listBox1->Font = (gcnew System::Drawing::Font(L"Courier New", 8.25F, System::Drawing::FontStyle::Regular, System::Drawing::GraphicsUnit::Point,
@@ -1876,21 +2334,17 @@ private: System::Windows::Forms::Button^  btn_clear;
 		BOOTLOADER_COMMAND myCommand = { 0 };
 		BOOTLOADER_COMMAND myResponse = { 0 };
 
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-		DWORD BytesReceived = 0;
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-		HANDLE ReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
 		memoryRegionsDetected = 0;
 
-		//Create the write file and read file handles the to the USB device
-		//  that we want to talk to
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
-		ReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusRead = GetLastError();
+		//Get the handles to the USB device that we want to talk to, opening
+		//  them unless they are still open from the last operation
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Query", true);
+			QueryThreadResults = QUERY_WRITE_FILE_FAILED;
+			progressStatus = 100;
+			return;
+		}
 
 		//Set the progress bar to 10%
 		progressStatus = 10;
@@ -1903,22 +2357,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 		myCommand.QueryDevice.Command = GET_ENCRYPTED_FF;
 
 		//Send the command that we prepared
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-		//Get the error status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
 			//if the command was sent successfully then
 			//Set the status to 20%
 			progressStatus = 20;
 
 			//Try to read a packet from the device
-			ReadFile(ReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-			//Get the status of the read request
-			ErrorStatus = GetLastError();
-			if (ErrorStatus == ERROR_SUCCESS)
+			if (deviceSession->Read(myResponse.RawData))
 			{
 				//If we were able to successfully read from the device
 				unsigned char i;
@@ -1947,11 +2393,10 @@ private: System::Windows::Forms::Button^  btn_clear;
 			else
 			{
 				//If the read from the device failed then indicate the failure
-				//  in the results variable
+				//  in the results variable, after closing the device: the
+				//  next operation opens it again
+				endSessionPhase("Query", true);
 				QueryThreadResults = QUERY_READ_FILE_FAILED;
-				//Close the write and read files 
-				CloseHandle(WriteHandleToMyDevice);
-				CloseHandle(ReadHandleToMyDevice);
 
 				//We are done so set the progress to 100%
 				progressStatus = 100;
@@ -1961,13 +2406,11 @@ private: System::Windows::Forms::Button^  btn_clear;
 		else
 		{
 			//If the write to the device failed then indicate the failure in 
-			//  the results variable
+			//  the results variable, after closing the device: the next
+			//  operation opens it again
+			endSessionPhase("Query", true);
 			QueryThreadResults = QUERY_WRITE_FILE_FAILED;
 
-			//Close the write and read files 
-			CloseHandle(WriteHandleToMyDevice);
-			CloseHandle(ReadHandleToMyDevice);
-
 			//We are done so set the progress to 100%
 			progressStatus = 100;
 			return;
@@ -1986,22 +2429,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 #endif
 
 		//Send the command that we prepared
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-		//Get the error status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
 			//if the command was sent successfully then
 			//Set the status to 50%
 			progressStatus = 50;
 
 			//Try to read a packet from the device
-			ReadFile(ReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-			//Get the status of the read request
-			ErrorStatus = GetLastError();
-			if (ErrorStatus == ERROR_SUCCESS)
+			if (deviceSession->Read(myResponse.RawData))
 			{
 				//If we were able to successfully read from the device
 				unsigned char i;
@@ -2015,7 +2450,7 @@ private: System::Windows::Forms::Button^  btn_clear;
 				progressStatus = 90;
 
 				//for each of the possible memory regions
-				for (i = 0; i < sizeof(memoryRegions); i++)
+				for (i = 0; i < MAX_DATA_REGIONS; i++)
 				{
 					//If the type of region is 0xFF that means that we have
 					//  reached the end of the regions array.
@@ -2070,13 +2505,16 @@ private: System::Windows::Forms::Button^  btn_clear;
 				DEBUG_OUT("********************************************");
 #endif
 
-				//Mark the results of this request as successful
+				//Mark the results of this request as successful, keeping the
+				//  device open for the next operation
+				endSessionPhase("Query", false);
 				QueryThreadResults = QUERY_SUCCESS;
 			}
 			else
 			{
 				//If the read from the device failed then indicate the failure
 				//  in the results variable
+				endSessionPhase("Query", true);
 				QueryThreadResults = QUERY_READ_FILE_FAILED;
 			}
 		}
@@ -2084,13 +2522,10 @@ private: System::Windows::Forms::Button^  btn_clear;
 		{
 			//If the write to the device failed then indicate the failure in 
 			//  the results variable
+			endSessionPhase("Query", true);
 			QueryThreadResults = QUERY_WRITE_FILE_FAILED;
 		}
 
-		//Close the write and read files 
-		CloseHandle(WriteHandleToMyDevice);
-		CloseHandle(ReadHandleToMyDevice);
-
 		//We are done so set the progress to 100%
 		progressStatus = 100;
 	}
@@ -2204,14 +2639,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 	private: System::Void EraseThreadStart(void)
 	{
 		BOOTLOADER_COMMAND myCommand = { 0 };
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
 
-		//Create a new write handle to the device
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
+		//Get the handles to the device
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Erase", true);
+			EraseThreadResults = ERASE_WRITE_FILE_FAILED;
+			return;
+		}
 
 		//Create the command packet that we want to send to the device.  The
 		//  Command should be erase and the WindowsReserved byte should be
@@ -2220,16 +2655,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 		myCommand.EraseDevice.Command = ERASE_DEVICE;
 
 		//Send the command to the device
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-
-		//Get the status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
+			endSessionPhase("Erase", false);
 			EraseThreadResults = ERASE_SUCCESS;
 		}
 		else
 		{
+			endSessionPhase("Erase", true);
 			EraseThreadResults = ERASE_WRITE_FILE_FAILED;
 		}
 	}
@@ -2347,15 +2780,15 @@ private: System::Windows::Forms::Button^  btn_clear;
 	{
 		//First byte must = 0, otherwise doesn't work.  Also, must "send" 65 bytes exactly to get WriteFile to work.  Only 64 bytes are actually sent over bus.
 		BOOTLOADER_COMMAND myCommand = { 0 };
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
 
-		//Create a new write file handle to the device so that we can send 
-		//  packets to the device
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
+		//Get the handles to the device so that we can send packets to the
+		//  device
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Unlock config", true);
+			UnlockConfigThreadResults = UNLOCK_CONFIG_FAILURE;
+			return;
+		}
 
 		//Set up the command that needs to be sent to the device
 		myCommand.UnlockConfig.WindowsReserved = 0;
@@ -2370,16 +2803,14 @@ private: System::Windows::Forms::Button^  btn_clear;
 		}
 
 		//Send the command to the device
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-
-		//Get the status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
+			endSessionPhase("Unlock config", false);
 			UnlockConfigThreadResults = UNLOCK_CONFIG_SUCCESS;
 		}
 		else
 		{
+			endSessionPhase("Unlock config", true);
 			UnlockConfigThreadResults = UNLOCK_CONFIG_FAILURE;
 		}
 	}
@@ -2396,7 +2827,7 @@ private: System::Windows::Forms::Button^  btn_clear;
 					 into the memory allocated for the device
 
 				 Precondition:
-					 pData should have valid allocated memory for each of the memory
+					 deviceImage should have valid allocated memory for each of the memory
 					 ranges specified in the query results.
 
 				 Parameters:
@@ -2461,10 +2892,12 @@ private: System::Windows::Forms::Button^  btn_clear;
 
 				 Description:
 					 This function reads out all of the memory specified in the query
-					 results command and stores it in the allocated memory.
+					 results command and stores it in the allocated memory.  The GET_DATA
+					 requests go through a TransferEngine window and each answer is
+					 stored at the address it carries.
 
 				 Precondition:
-					 pData has valid pointers to allocated memory the correct size
+					 deviceImage has allocated memory of the correct size
 					 for each of the memory ranges specified in the query results
 					 command.
 
@@ -2490,16 +2923,9 @@ private: System::Windows::Forms::Button^  btn_clear;
 			 ***************************************************************************/
 	private: void ReadThreadStart()
 	{
-		BOOTLOADER_COMMAND myCommand = { 0 };
-		BOOTLOADER_COMMAND myCommand2 = { 0 };
-		BOOTLOADER_COMMAND myResponse = { 0 };
-
-		DWORD BytesWritten = 0;
-		DWORD BytesWritten2 = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-		DWORD BytesReceived = 0;
-		DWORD BytesReceived2 = 0;
-		DWORD ErrorStatusSave = 0xFFFFFFFF;
+		BOOTLOADER_COMMAND* command;
+		BOOTLOADER_COMMAND* myResponse;
+		const BOOTLOADER_COMMAND* myRequest;
 
 		DWORD packetsWritten = 0;
 		DWORD packetsRead = 0;
@@ -2508,58 +2934,23 @@ private: System::Windows::Forms::Button^  btn_clear;
 		unsigned char* p;
 		DWORD AddressToRequest;
 		unsigned long size;
-		unsigned char i, currentMemoryRegion;
-		bool foundError = false;
-
-		unsigned int PendingPackets = 0;
-
-		unsigned char* lastAddress = 0;
-
-		HANDLE AsyncWriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-		HANDLE AsyncReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
-		OVERLAPPED OverlappedWriteStructure;
-		OVERLAPPED OverlappedWriteStructure2;
-		OVERLAPPED OverlappedReadStructure;
-
-		HANDLE WriteCompleteEvent;
-		HANDLE WriteCompleteEvent2;
-		HANDLE ReadCompleteEvent;
-
-		WriteCompleteEvent = CreateEvent(NULL, TRUE, TRUE, (LPCTSTR)"WriteEvent");
-		WriteCompleteEvent2 = CreateEvent(NULL, TRUE, TRUE, (LPCTSTR)"WriteEvent2");
-		ReadCompleteEvent = CreateEvent(NULL, TRUE, TRUE, (LPCTSTR)"ReadEvent");
-
-		OverlappedWriteStructure.Internal = 0;
-		OverlappedWriteStructure.InternalHigh = 0;
-		OverlappedWriteStructure.Offset = 0;
-		OverlappedWriteStructure.OffsetHigh = 0;
-		OverlappedWriteStructure.Pointer = 0;
-		OverlappedWriteStructure.hEvent = WriteCompleteEvent;
-
-		OverlappedWriteStructure2.Internal = 0;
-		OverlappedWriteStructure2.InternalHigh = 0;
-		OverlappedWriteStructure2.Offset = 0;
-		OverlappedWriteStructure2.OffsetHigh = 0;
-		OverlappedWriteStructure2.Pointer = 0;
-		OverlappedWriteStructure2.hEvent = WriteCompleteEvent2;
-
-		OverlappedReadStructure.Internal = 0;
-		OverlappedReadStructure.InternalHigh = 0;
-		OverlappedReadStructure.Offset = 0;
-		OverlappedReadStructure.OffsetHigh = 0;
-		OverlappedReadStructure.Pointer = 0;
-		OverlappedReadStructure.hEvent = ReadCompleteEvent;
-
-		SetEvent(ReadCompleteEvent);
-		SetEvent(WriteCompleteEvent2);
-		SetEvent(WriteCompleteEvent);
-
-		/* If the function succeeds, the return value is an open handle to the specified file, device, named pipe, or mail slot. */
-		AsyncWriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-		ErrorStatus = GetLastError();
-		AsyncReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, 0);
-		ErrorStatus = GetLastError();
+		unsigned char currentMemoryRegion;
+		int result;
+
+		HexCore::TransferEngine engine(deviceSession->Port(), TRANSFER_WINDOW_PACKETS, TRANSFER_NAK_TIMEOUT, getDataAnswerKey);
+		HexCore::TransferCompletion done;
+
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Read", true);
+			ENABLE_PRINT();
+			ReadThreadResults = READ_WRITE_FILE_FAILED;
+			progressStatus = 100;
+			return;
+		}
+
+		//A device that stops answering fails the read within the stream budget
+		engine.SetBudget(&deviceSession->StreamBudget());
 
 		//Read
 		for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
@@ -2567,259 +2958,104 @@ private: System::Windows::Forms::Button^  btn_clear;
 			AddressToRequest = memoryRegions[currentMemoryRegion].Address;
 			size = memoryRegions[currentMemoryRegion].Size;
 			p = getMemoryRegion(currentMemoryRegion);
-			pSave = getMemoryRegion(currentMemoryRegion);
-
-			myCommand.GetData.Command = GET_DATA;
-			myCommand.GetData.Address = AddressToRequest;
-			myCommand.GetData.BytesPerPacket = bytesPerPacket;
-			myCommand.GetData.WindowsReserved = 0;
 
-			if ((AddressToRequest + (bytesPerPacket / bytesPerAddress)) > (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
+			//Keep the window of the transfer engine full of GET_DATA requests
+			//  and store every answer where its address says, whatever the
+			//  order it comes back in
+			while ((engine.Pending() != 0) || (AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)))
 			{
-				myCommand.GetData.BytesPerPacket = (unsigned char)(bytesPerPacket - (((AddressToRequest + (bytesPerPacket / bytesPerAddress)) - (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))*bytesPerAddress));
-			}
-
-			while ((myCommand.GetData.BytesPerPacket % bytesPerAddress) != 0)
-			{
-				myCommand.GetData.BytesPerPacket++;
-			}
+				progressStatus = (unsigned char)(((100 * AddressToRequest) / (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)));
 
-			if ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)))
-			{
-				OverlappedWriteStructure.Internal = 0;
-				OverlappedWriteStructure.InternalHigh = 0;
-				OverlappedWriteStructure.Offset = 0;
-				OverlappedWriteStructure.OffsetHigh = 0;
-				OverlappedWriteStructure.Pointer = 0;
-				OverlappedWriteStructure.hEvent = WriteCompleteEvent;
-
-				if (WriteFile(AsyncWriteHandleToMyDevice, &myCommand, 65, &BytesWritten, &OverlappedWriteStructure))
+				while ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)) && engine.CanSend())
 				{
-					PendingPackets++;
-					AddressToRequest += (bytesPerPacket / bytesPerAddress);
+					//Build the request right in the slot it is written from
+					command = (BOOTLOADER_COMMAND*)engine.Reserve();
+					prepareGetData(command, AddressToRequest, currentMemoryRegion);
+					if (!engine.Send(command->RawData, AddressToRequest, true))
+					{
+						engine.Cancel();
+						endSessionPhase("Read", true);
+						ENABLE_PRINT();
+						ReadThreadResults = READ_WRITE_FILE_FAILED;
+						progressStatus = 100;
+						return;
+					}
 					packetsWritten++;
+					AddressToRequest += (bytesPerPacket / bytesPerAddress);
 
 #if defined(DEBUG_USB) && defined(DEBUG_THREADS)
 					DEBUG_OUT(">> OUT Data packet");
-					printBuffer(myCommand.PacketData.Data, 64);
+					printBuffer(command->PacketData.Data, 64);
 					DEBUG_OUT("");
 #endif
 				}
-				else //probably because I/O pending, but need to make certain
-				{
-					ErrorStatusSave = GetLastError();
-					if (ErrorStatusSave == ERROR_IO_PENDING)
-					{
-						PendingPackets++;
-						packetsWritten++;
-						AddressToRequest += (bytesPerPacket / bytesPerAddress);
-
-#if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-						DEBUG_OUT(">> OUT Data packet");
-						printBuffer(myCommand.PacketData.Data, 64);
-						DEBUG_OUT("");
-#endif
-					}
-				}
-			}
-
-			if (PendingPackets > 0)
-			{
-				OverlappedReadStructure.Internal = 0;
-				OverlappedReadStructure.InternalHigh = 0;
-				OverlappedReadStructure.Offset = 0;
-				OverlappedReadStructure.OffsetHigh = 0;
-				OverlappedReadStructure.Pointer = 0;
-				OverlappedReadStructure.hEvent = ReadCompleteEvent;
-				SetEvent(ReadCompleteEvent);
-
-				myResponse.GetDataResults.WindowsReserved = 0;
-
-				if (ReadFile(AsyncReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, &OverlappedReadStructure))
-				{
-				}
-				else //probably because I/O pending, but need to make certain
-				{
-					ErrorStatusSave = GetLastError();
-				}
-			}
-
-
-			while ((PendingPackets != 0) || (AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)))
-			{
-				progressStatus = (unsigned char)(((100 * AddressToRequest) / (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)));
 
-				if ((HasOverlappedIoCompleted(&OverlappedWriteStructure)) && (PendingPackets < 15))
+				result = engine.Next(&done, TRANSFER_BUDGET);
+				myResponse = (BOOTLOADER_COMMAND*)done.Report;
+				myRequest = (const BOOTLOADER_COMMAND*)done.Request;
+				if ((result != TRANSFER_DONE) || (myResponse->GetDataResults.BytesPerPacket > myRequest->GetData.BytesPerPacket))
 				{
-					myCommand.GetData.Command = GET_DATA;
-					myCommand.GetData.Address = AddressToRequest;
-					myCommand.GetData.BytesPerPacket = bytesPerPacket;
-					myCommand.GetData.WindowsReserved = 0;
-
-					if ((AddressToRequest + (bytesPerPacket / bytesPerAddress)) > (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
-					{
-						myCommand.GetData.BytesPerPacket = (unsigned char)(bytesPerPacket - (((AddressToRequest + (bytesPerPacket / bytesPerAddress)) - (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))*bytesPerAddress));
-					}
-
-					while ((myCommand.GetData.BytesPerPacket % bytesPerAddress) != 0)
-					{
-						myCommand.GetData.BytesPerPacket++;
-					}
-
-					OverlappedWriteStructure.Internal = 0;
-					OverlappedWriteStructure.InternalHigh = 0;
-					OverlappedWriteStructure.Offset = 0;
-					OverlappedWriteStructure.OffsetHigh = 0;
-					OverlappedWriteStructure.Pointer = 0;
-					OverlappedWriteStructure.hEvent = WriteCompleteEvent;
-
-					if ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)))
-					{
-						if (WriteFile(AsyncWriteHandleToMyDevice, &myCommand, 65, &BytesWritten, &OverlappedWriteStructure))
-						{
-							PendingPackets++;
-							packetsWritten++;
-							AddressToRequest += (bytesPerPacket / bytesPerAddress);
-
-#if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-							DEBUG_OUT(">> OUT Data packet");
-							printBuffer(myCommand.PacketData.Data, 64);
-							DEBUG_OUT("");
-#endif
-						}
-						else //probably because I/O pending, but need to make certain
-						{
-							ErrorStatusSave = GetLastError();
-							if (ErrorStatusSave == ERROR_IO_PENDING)
-							{
-								PendingPackets++;
-								packetsWritten++;
-								AddressToRequest += (bytesPerPacket / bytesPerAddress);
-
-#if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-								DEBUG_OUT(">> OUT Data packet");
-								printBuffer(myCommand.PacketData.Data, 64);
-								DEBUG_OUT("");
-#endif
-							}
-						}
-					}//address requested is still in rage
-				}//Overlapped write complete
-
-				if ((HasOverlappedIoCompleted(&OverlappedWriteStructure2)) && (PendingPackets < 15))
-				{
-					myCommand2.GetData.Command = GET_DATA;
-					myCommand2.GetData.Address = AddressToRequest;
-					myCommand2.GetData.BytesPerPacket = bytesPerPacket;
-					myCommand2.GetData.WindowsReserved = 0;
-
-					if ((AddressToRequest + (bytesPerPacket / bytesPerAddress)) > (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
-					{
-						myCommand2.GetData.BytesPerPacket = (unsigned char)(bytesPerPacket - (((AddressToRequest + (bytesPerPacket / bytesPerAddress)) - (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))*bytesPerAddress));
-					}
-
-					while ((myCommand.GetData.BytesPerPacket % bytesPerAddress) != 0)
-					{
-						myCommand2.GetData.BytesPerPacket++;
-					}
-
-					OverlappedWriteStructure2.Internal = 0;
-					OverlappedWriteStructure2.InternalHigh = 0;
-					OverlappedWriteStructure2.Offset = 0;
-					OverlappedWriteStructure2.OffsetHigh = 0;
-					OverlappedWriteStructure2.Pointer = 0;
-					OverlappedWriteStructure2.hEvent = WriteCompleteEvent2;
-
-					if ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)))
-					{
-						if (WriteFile(AsyncWriteHandleToMyDevice, &myCommand2, 65, &BytesWritten2, &OverlappedWriteStructure2))
-						{
-							PendingPackets++;
-							packetsWritten++;
-							AddressToRequest += (bytesPerPacket / bytesPerAddress);
-
-#if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-							DEBUG_OUT(">> OUT Data packet");
-							printBuffer(myCommand2.PacketData.Data, 64);
-							DEBUG_OUT("");
-#endif
-						}
-						else //probably because I/O pending, but need to make certain
-						{
-							ErrorStatusSave = GetLastError();
-							if (ErrorStatusSave == ERROR_IO_PENDING)
-							{
-								PendingPackets++;
-								packetsWritten++;
-								AddressToRequest += (bytesPerPacket / bytesPerAddress);
-
-#if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-								DEBUG_OUT(">> OUT Data packet");
-								printBuffer(myCommand2.PacketData.Data, 64);
-								DEBUG_OUT("");
-#endif
-							}
-						}
-					}
+					//A failed read, or an answer we didn't ask for
+					engine.Cancel();
+					endSessionPhase("Read", true);
+					ENABLE_PRINT();
+					ReadThreadResults = READ_READ_FILE_FAILED;
+					progressStatus = 100;
+					return;
 				}
 
-				if (HasOverlappedIoCompleted(&OverlappedReadStructure))
-				{
-					//We have successfully received a packet so decrease the number
-					//  of transmissions that we are waiting to complete and increase
-					//  the total number of packets successfully read
-					PendingPackets--;
-					packetsRead++;
+				//We have successfully received a packet so increase the total
+				//  number of packets successfully read
+				packetsRead++;
 
-					//Get a pointer to the preallocated data
-					pSave = (p + (myResponse.GetDataResults.Address - memoryRegions[currentMemoryRegion].Address)*bytesPerAddress);
+				//Get a pointer to the preallocated data
+				pSave = (p + (myResponse->GetDataResults.Address - memoryRegions[currentMemoryRegion].Address)*bytesPerAddress);
 
-					//Copy all of the data received data in the preallocated memory
-					for (i = 0; i < myResponse.GetDataResults.BytesPerPacket; i++)
-					{
-						*pSave++ = myResponse.GetDataResults.Data[sizeof(myResponse.GetDataResults.Data) - myResponse.GetDataResults.BytesPerPacket + i];// = tempData = *pSave++;
-					}
+				//Copy all of the data received data in the preallocated memory
+				memcpy(pSave, &myResponse->GetDataResults.Data[sizeof(myResponse->GetDataResults.Data) - myResponse->GetDataResults.BytesPerPacket], myResponse->GetDataResults.BytesPerPacket);
 
 #if defined(DEBUG_USB) && defined(DEBUG_THREADS)
-					DEBUG_OUT("<< IN Data packet");
-					printBuffer(myResponse.PacketData.Data, 64);
-					DEBUG_OUT("");
+				DEBUG_OUT("<< IN Data packet");
+				printBuffer(myResponse->PacketData.Data, 64);
+				DEBUG_OUT("");
 #endif
-
-					//If we are still waiting for more packets to arrive
-					if (PendingPackets > 0)
-					{
-						//Prepare another transfer
-						OverlappedReadStructure.Internal = 0;
-						OverlappedReadStructure.InternalHigh = 0;
-						OverlappedReadStructure.Offset = 0;
-						OverlappedReadStructure.OffsetHigh = 0;
-						OverlappedReadStructure.Pointer = 0;
-						OverlappedReadStructure.hEvent = ReadCompleteEvent;
-
-						myResponse.GetDataResults.WindowsReserved = 0;
-						
-						//initiate a read from the device
-						if (ReadFile(AsyncReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, &OverlappedReadStructure))
-						{
-							//If the read was successful, do nothing.  We need to wait for the 
-							//  read to complete
-						}
-						else //probably because I/O pending, but need to make certain
-						{
-							//If the read resulted in an error then save the last error that
-							//  we received
-							ErrorStatusSave = GetLastError();
-						}
-					}
-				}//has overlapped completed
 			}	//while
 		}//for loop Read
+		endSessionPhase("Read", false);
+		updateOccupancy();
+		sparseVerify = false;
 		ENABLE_PRINT();
 		ReadThreadResults = READ_SUCCESS;
 		progressStatus = 100;
-		CloseHandle(AsyncWriteHandleToMyDevice);
-		CloseHandle(AsyncReadHandleToMyDevice);
+	}
+
+			 /****************************************************************************
+				 Function:
+					 prepareGetData
+
+				 Description:
+					 Fills command with the GET_DATA request for the packet at address
+					 of memory region region: bytesPerPacket bytes, fewer at the end of
+					 the region, rounded up to whole addresses.  command may be a slot
+					 of the transfer engine still holding an older report.
+			 ***************************************************************************/
+	private: void prepareGetData(BOOTLOADER_COMMAND* command, DWORD address, unsigned char region)
+	{
+		command->GetData.WindowsReserved = 0;
+		command->GetData.Command = GET_DATA;
+		command->GetData.Address = address;
+		command->GetData.BytesPerPacket = bytesPerPacket;
+		memset(command->GetData.Pad, 0, sizeof(command->GetData.Pad));
+
+		if ((address + (bytesPerPacket / bytesPerAddress)) > (memoryRegions[region].Address + memoryRegions[region].Size))
+		{
+			command->GetData.BytesPerPacket = (unsigned char)(bytesPerPacket - (((address + (bytesPerPacket / bytesPerAddress)) - (memoryRegions[region].Address + memoryRegions[region].Size))*bytesPerAddress));
+		}
+
+		while ((command->GetData.BytesPerPacket % bytesPerAddress) != 0)
+		{
+			command->GetData.BytesPerPacket++;
+		}
 	}
 #pragma endregion
 
@@ -2831,11 +3067,15 @@ private: System::Windows::Forms::Button^  btn_clear;
 				 Description:
 					 This function is the main body of the verification process.  This
 					 thread reads all of the memory regions reported in the query command
-					 and compares them to the contents loaded in the RAM.
+					 and compares them to the contents loaded in the RAM.  Right after a
+					 successful programming (sparseVerify) only the packets the occupancy
+					 map marks as holding data are read.  The GET_DATA requests go through
+					 a TransferEngine window; each answer is matched to its request by
+					 address and checked with CompareGetData.
 
 				 Precondition:
-					 pData should be loaded with the memory that needs to be verified
-					 against.  At a minimum pData should have allocated enough memory
+					 deviceImage should be loaded with the memory that needs to be verified
+					 against.  At a minimum deviceImage should have allocated enough memory
 					 to cover the memory regions listed in the memoryRegions array.
 
 				 Parameters:
@@ -2860,12 +3100,9 @@ private: System::Windows::Forms::Button^  btn_clear;
 			 ***************************************************************************/
 	private: void VerifyThreadStart()
 	{
-		BOOTLOADER_COMMAND myCommand = { 0 };
-		BOOTLOADER_COMMAND myResponse = { 0 };
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-		DWORD BytesReceived = 0;
-		DWORD ErrorStatusSave = 0xFFFFFFFF;
+		BOOTLOADER_COMMAND* command;
+		BOOTLOADER_COMMAND* myResponse;
+		const BOOTLOADER_COMMAND* myRequest;
 
 		DWORD packetsWritten = 0;
 		DWORD packetsRead = 0;
@@ -2875,307 +3112,191 @@ private: System::Windows::Forms::Button^  btn_clear;
 		unsigned char* p;
 		DWORD AddressToRequest;
 		unsigned long size;
-		unsigned char i, currentMemoryRegion;
-		bool foundError = false;
-		unsigned char tempData, tempData2;
-
-		unsigned char* lastAddress = 0;
+		unsigned char currentMemoryRegion;
+		unsigned long block;
+		unsigned int verifyOptions;
+		unsigned char* remapVector;
+		int failingByte;
+		int result;
 
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-		HANDLE ReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
-		ReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusRead = GetLastError();
+		HexCore::TransferEngine engine(deviceSession->Port(), TRANSFER_WINDOW_PACKETS, TRANSFER_NAK_TIMEOUT, getDataAnswerKey);
+		HexCore::TransferCompletion done;
 
 		if (deviceID == DEVICE_TINTING)
 		{
 			ENABLE_PRINT();
 			VerifyThreadResults = VERIFY_SUCCESS;
 			progressStatus = 100;
-			CloseHandle(WriteHandleToMyDevice);
-			CloseHandle(ReadHandleToMyDevice);
 			return;
 		}
-		else
+
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Verify", true);
+			ENABLE_PRINT();
+			VerifyThreadResults = VERIFY_WRITE_FILE_FAILED;
+			progressStatus = 100;
+			return;
+		}
+
+		//What may differ in an answer: the phantom byte of the PIC24
+		//  instructions and the reset vectors the bootloader rewrites
+		verifyOptions = 0;
+		remapVector = NULL;
+		if (bytesPerAddress == 2)
 		{
-			//Verify
+			verifyOptions |= VERIFY_PIC24_PHANTOM;
+#if !defined(ENCRYPTED_BOOTLOADER)
+			verifyOptions |= VERIFY_PIC24_RESET_VECTOR;
 			for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
 			{
-				//If we aren't suppose to program config words then we shouldn't
-				//  verify them.
-				if (ckbox_ConfigWordProgramming->Checked == false)
+				if (memoryRegions[currentMemoryRegion].Address == PIC24_RESET_REMAP_OFFSET)
 				{
-					//If this region is configuration memory
-					if (memoryRegions[currentMemoryRegion].Type == 0x03)
-					{
-						//continue back to the top of the loop
-						continue;
-					}
+					remapVector = getMemoryRegion(currentMemoryRegion);
 				}
+			}
+#endif
+		}
 
+		//A device that stops answering fails the verify within the stream budget
+		engine.SetBudget(&deviceSession->StreamBudget());
 
-				/* Preparazione delle variabili con i dati che dovranno poi essere inseriti nel pacchetto */
-				AddressToRequest = memoryRegions[currentMemoryRegion].Address;
-				size = memoryRegions[currentMemoryRegion].Size;
-				p = getMemoryRegion(currentMemoryRegion);
-				pSave = getMemoryRegion(currentMemoryRegion);
+		//Verify
+		for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
+		{
+			//If we aren't suppose to program config words then we shouldn't
+			//  verify them.
+			if (ckbox_ConfigWordProgramming->Checked == false)
+			{
+				//If this region is configuration memory
+				if (memoryRegions[currentMemoryRegion].Type == 0x03)
+				{
+					//continue back to the top of the loop
+					continue;
+				}
+			}
 
 
-				while (AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
-				{
-					/* Preparazone del pacchetto */
-					myCommand.GetData.Command = GET_DATA;
-					myCommand.GetData.Address = AddressToRequest;
-					myCommand.GetData.BytesPerPacket = bytesPerPacket;
-					myCommand.GetData.WindowsReserved = 0;
+			/* Preparazione delle variabili con i dati che dovranno poi essere inseriti nel pacchetto */
+			AddressToRequest = memoryRegions[currentMemoryRegion].Address;
+			size = memoryRegions[currentMemoryRegion].Size;
+			p = getMemoryRegion(currentMemoryRegion);
 
-					if ((AddressToRequest + (bytesPerPacket / bytesPerAddress)) > (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
+			//Keep the window of the transfer engine full of GET_DATA requests
+			//  and check every answer against the image as it arrives, whatever
+			//  the order it comes back in
+			while ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)) || (engine.Pending() > 0))
+			{
+				while ((AddressToRequest < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)) && engine.CanSend())
+				{
+					//Right after programming, the packets that were left out as
+					//  erased are still erased: jump to the next one holding data
+					if (sparseVerify)
 					{
-						myCommand.GetData.BytesPerPacket = (unsigned char)(bytesPerPacket - (((AddressToRequest + (bytesPerPacket / bytesPerAddress)) - (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))*bytesPerAddress));
+						block = deviceImage->NextBlockWithData(currentMemoryRegion, ((AddressToRequest - memoryRegions[currentMemoryRegion].Address) * bytesPerAddress) / bytesPerPacket);
+						if (block >= deviceImage->BlockCount(currentMemoryRegion))
+						{
+							AddressToRequest = memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size;
+							break;
+						}
+						AddressToRequest = memoryRegions[currentMemoryRegion].Address + ((block * bytesPerPacket) / bytesPerAddress);
 					}
 
-					while ((myCommand.GetData.BytesPerPacket % bytesPerAddress) != 0)
-					{
-						myCommand.GetData.BytesPerPacket++;
-					}
+					/* Preparazone del pacchetto */
+					command = (BOOTLOADER_COMMAND*)engine.Reserve();
+					prepareGetData(command, AddressToRequest, currentMemoryRegion);
 					/* incremento della progress bar */
 					progressStatus = (unsigned char)(((100 * (AddressToRequest - memoryRegions[currentMemoryRegion].Address)) / memoryRegions[currentMemoryRegion].Size));
-					/* scrittura del primo pacchetto sulla pipe */
-					WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-					ErrorStatus = GetLastError();
-					if (ErrorStatus == ERROR_SUCCESS) /* cioh non ci sono stati errori nella procedura di scrittura*/
-					{
-						packetsWritten++;
-						AddressToRequest += (bytesPerPacket / bytesPerAddress);
-						//Try to read a packet from the device
-						ReadFile(ReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, 0); //Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-						ErrorStatus = GetLastError();
-						if (ErrorStatus == ERROR_SUCCESS) // Se il pacchetto h stato letto correttamente
-						{
-							/* Controllo di non aver ricevuto nessun pacchetto nullo */
-							if ((myResponse.GetDataResults.Address == PACK_NULL) || (myResponse.GetDataResults.BytesPerPacket == PACK_NULL) || (myResponse.GetDataResults.Command == PACK_NULL))
-							{
-								ENABLE_PRINT();
-								VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
-								foundError = true;
-								progressStatus = 100;
-								return;
-							}
-							else
-							{
-								packetsRead++;
-								pSave = (p + (myResponse.GetDataResults.Address - memoryRegions[currentMemoryRegion].Address)*bytesPerAddress);
-								//Copy all of the data received data in the preallocated memory.
-								//Confronto fra i dati ricevuti e quelli in memoria
-								for (i = 0; i < myResponse.GetDataResults.BytesPerPacket; i++)
-								{
-									tempData = *pSave++;
-									tempData2 = myResponse.GetDataResults.Data[sizeof(myResponse.GetDataResults.Data) - myResponse.GetDataResults.BytesPerPacket + i];
-									if (tempData != tempData2)
-									{
-										if ((bytesPerAddress == 2) && (((i + 1) % 4) == 0))
-										{
-											//This is a PIC24 (bytesPerAddress == 2)
-											//  we are on the fourth byte of an address
-											//  we can ignore this byte
-										}
-	#if !defined(ENCRYPTED_BOOTLOADER)
-										else if ((bytesPerAddress == 2) && (myResponse.GetDataResults.Address == PIC24_RESET_REMAP_OFFSET))
-										{
-											unsigned char k;
-											unsigned char *tempPtr;
-
-											for (k = 0; k < memoryRegionsDetected; k++)
-											{
-												if (memoryRegions[k].Address == PIC24_RESET_REMAP_OFFSET)
-												{
-													tempPtr = getMemoryRegion(k);
-												}
-											}
-
-											switch (i)
-											{
-											case 0:
-												if (tempData2 == *tempPtr)
-												{
-													break;
-												}
-												//Fall-through
-											case 1:
-												if (tempData2 == *(tempPtr + 1))
-												{
-													break;
-												}
-												//Fall-through
-											case 2:
-												if (tempData2 == *(tempPtr + 2))
-												{
-													break;
-												}
-											case 3:
-												if (tempData2 == *(tempPtr + 3))
-												{
-													break;
-												}
-											case 4:
-												if (tempData2 == *(tempPtr + 4))
-												{
-													break;
-												}
-											case 5:
-												if (tempData2 == *(tempPtr + 5))
-												{
-													break;
-												}
-												//Fall-through
-											default:
-												//Any instruction other than 0x1400 that is different is an error
-	#if defined(DEBUG_THREADS) //&& defined(DEBUG_USB)
-												DEBUG_OUT("<< Failing IN packet");
-												printBuffer(myResponse.PacketData.Data, 64);
-												DEBUG_OUT("");
-	#endif
-
-	#if defined(DEBUG_THREADS)
-												DEBUG_OUT("---- Failing Address Information ----");
-												DEBUG_OUT(String::Concat(" Address = 0x", HexToString(myResponse.GetDataResults.Address + i, 4), " Expected = 0x", HexToString(tempData, 1), " Got = 0x", HexToString(tempData2, 1)));
-												DEBUG_OUT("");
-	#endif
-
-												ENABLE_PRINT();
-												VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
-												foundError = true;
-												progressStatus = 100;
-												return;
-												break;
-											}
-										}
-										else if ((bytesPerAddress == 2) && (myResponse.GetDataResults.Address == 0x00))
-										{
-											switch (i)
-											{
-											case 0:
-												if (tempData2 == 0x00)
-												{
-													break;
-												}
-												//Fall-through
-											case 1:
-												if (tempData2 == 0x04)
-												{
-													break;
-												}
-												//Fall-through
-											case 2:
-												if (tempData2 == 0x04)
-												{
-													break;
-												}
-												//Fall-through
-											case 3:
-												if (tempData2 == 0x00)
-												{
-													break;
-												}
-												//Fall-through
-											case 4:
-												if (tempData2 == 0x00)
-												{
-													break;
-												}
-												//Fall-through
-											case 5:
-												if (tempData2 == 0x00)
-												{
-													break;
-												}
-												//Fall-through
-											default:
-												//Any instruction other than 0x1400 that is different is an error
-	#if defined(DEBUG_THREADS) //&& defined(DEBUG_USB)
-												DEBUG_OUT("<< Failing IN packet");
-												printBuffer(myResponse.PacketData.Data, 64);
-												DEBUG_OUT("");
-	#endif
-
-	#if defined(DEBUG_THREADS)
-												DEBUG_OUT("---- Failing Address Information ----");
-												DEBUG_OUT(String::Concat(" Address = 0x", HexToString(myResponse.GetDataResults.Address + i, 4), " Expected = 0x", HexToString(tempData, 1), " Got = 0x", HexToString(tempData2, 1)));
-												DEBUG_OUT("");
-	#endif
-
-												ENABLE_PRINT();
-												VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
-												foundError = true;
-												progressStatus = 100;
-												return;
-												break;
-											}
-										}
-	#endif
-										else
-										{
-	#if defined(DEBUG_THREADS) //&& defined(DEBUG_USB)
-											DEBUG_OUT("<< Failing IN packet");
-											printBuffer(myResponse.PacketData.Data, 64);
-											DEBUG_OUT("");
-	#endif
-
-	#if defined(DEBUG_THREADS)
-											DEBUG_OUT("---- Failing Address Information ----");
-											DEBUG_OUT(String::Concat(" Address = 0x", HexToString(myResponse.GetDataResults.Address + i, 4), " Expected = 0x", HexToString(tempData, 1), " Got = 0x", HexToString(tempData2, 1)));
-											DEBUG_OUT("");
-	#endif
-
-											ENABLE_PRINT();
-											VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
-											foundError = true;
-											progressStatus = 100;
-											return;
-									}
-								}
-
-							}
-						}
-					}
-						else // lettura del pacchetto fallita
-						{
-							//If the read from the device failed then indicate the failure
-							//  in the results variable
-							VerifyThreadResults = VERIFY_READ_FILE_FAILED;
-							//Close the write and read files 
-							CloseHandle(WriteHandleToMyDevice);
-							CloseHandle(ReadHandleToMyDevice);
-
-							//We are done so set the progress to 100%
-							progressStatus = 100;
-							return;
-						}
-				}
-					else // scrittura del pacchetto fallita
+					/* scrittura del pacchetto sulla pipe */
+					if (!engine.Send(command->RawData, AddressToRequest, true)) // scrittura del pacchetto fallita
 					{
-						//If the read from the device failed then indicate the failure
-							//  in the results variable
+						//If the write to the device failed then indicate the failure
+						//  in the results variable
+						engine.Cancel();
+						endSessionPhase("Verify", true);
 						VerifyThreadResults = VERIFY_WRITE_FILE_FAILED;
-						//Close the write and read files 
-						CloseHandle(WriteHandleToMyDevice);
-						CloseHandle(ReadHandleToMyDevice);
 
 						//We are done so set the progress to 100%
 						progressStatus = 100;
 						return;
 					}
+					packetsWritten++;
+					AddressToRequest += (bytesPerPacket / bytesPerAddress);
+				}
+
+				if (engine.Pending() == 0)
+				{
+					break;
+				}
+
+				//Wait for the next answer
+				result = engine.Next(&done, TRANSFER_BUDGET);
+				if ((result != TRANSFER_DONE) && (result != TRANSFER_UNEXPECTED)) // lettura del pacchetto fallita
+				{
+					//If the read from the device failed then indicate the failure
+					//  in the results variable
+					engine.Cancel();
+					endSessionPhase("Verify", true);
+					VerifyThreadResults = VERIFY_READ_FILE_FAILED;
+
+					//We are done so set the progress to 100%
+					progressStatus = 100;
+					return;
+				}
+				myResponse = (BOOTLOADER_COMMAND*)done.Report;
+				myRequest = (const BOOTLOADER_COMMAND*)done.Request;
+
+				/* Controllo di non aver ricevuto nessun pacchetto nullo, ne' una
+				   risposta a una richiesta che non abbiamo in volo */
+				if ((result == TRANSFER_UNEXPECTED) ||
+					(myResponse->GetDataResults.Address == PACK_NULL) || (myResponse->GetDataResults.BytesPerPacket == PACK_NULL) || (myResponse->GetDataResults.Command == PACK_NULL) ||
+					(myResponse->GetDataResults.BytesPerPacket > myRequest->GetData.BytesPerPacket))
+				{
+					//The device is fine: drop the answers still due and keep it
+					//  open, the next operation flushes what arrives meanwhile
+					engine.Cancel();
+					endSessionPhase("Verify", false);
+					ENABLE_PRINT();
+					VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
+					progressStatus = 100;
+					return;
+				}
+				packetsRead++;
+
+				//Confronto fra i dati ricevuti e quelli in memoria (CompareGetData)
+				pSave = (p + (myResponse->GetDataResults.Address - memoryRegions[currentMemoryRegion].Address)*bytesPerAddress);
+				failingByte = HexCore::CompareGetData(pSave,
+					&myResponse->GetDataResults.Data[sizeof(myResponse->GetDataResults.Data) - myResponse->GetDataResults.BytesPerPacket],
+					myResponse->GetDataResults.BytesPerPacket, myResponse->GetDataResults.Address, verifyOptions, remapVector);
+				if (failingByte >= 0)
+				{
+#if defined(DEBUG_THREADS) //&& defined(DEBUG_USB)
+					DEBUG_OUT("<< Failing IN packet");
+					printBuffer(myResponse->PacketData.Data, 64);
+					DEBUG_OUT("");
+#endif
+
+#if defined(DEBUG_THREADS)
+					DEBUG_OUT("---- Failing Address Information ----");
+					DEBUG_OUT(String::Concat(" Address = 0x", HexToString(myResponse->GetDataResults.Address + failingByte, 4), " Expected = 0x", HexToString(pSave[failingByte], 1), " Got = 0x", HexToString(myResponse->GetDataResults.Data[sizeof(myResponse->GetDataResults.Data) - myResponse->GetDataResults.BytesPerPacket + failingByte], 1)));
+					DEBUG_OUT("");
+#endif
+
+					//The device is fine: drop the answers still due and keep it
+					//  open, the next operation flushes what arrives meanwhile
+					engine.Cancel();
+					endSessionPhase("Verify", false);
+					ENABLE_PRINT();
+					VerifyThreadResults = VERIFY_MISMATCH_FAILURE;
+					progressStatus = 100;
+					return;
+				}
 			}
 		}
-	}
+		endSessionPhase("Verify", false);
 		ENABLE_PRINT();
 		VerifyThreadResults = VERIFY_SUCCESS;
 		progressStatus = 100;
-		CloseHandle(WriteHandleToMyDevice);
-		CloseHandle(ReadHandleToMyDevice);
 	}
 
 			 /****************************************************************************
@@ -3249,7 +3370,7 @@ private: System::Windows::Forms::Button^  btn_clear;
 					 addresses in the specified ranges are saved
 
 				 Precondition:
-					 pData should have enough memory allocated to them to cover the memory
+					 deviceImage regions should have enough memory allocated to them to cover the memory
 					 regions specified in query command.
 
 				 Parameters:
@@ -3268,15 +3389,11 @@ private: System::Windows::Forms::Button^  btn_clear;
 	private: System::Void btn_OpenHexFile_Click(System::Object^  sender, System::EventArgs^  e)
 	{
 		//Variables required for reading a file
-		String ^fileSupportBuffer;
 		FileStream ^fileSupportFileStream;
-		StreamReader ^fileSupportStreamReader;
 		Stream^ myStream;
 
 		unsigned char i;
 		bool hexFileError;
-		unsigned long extendedAddress;
-		bool hexFileEOF;
 
 		DisableButtons();
 
@@ -3298,16 +3415,6 @@ private: System::Windows::Forms::Button^  btn_clear;
 		}
 		catch (...) {}
 
-		try
-		{
-			if (fileSupportStreamReader)
-			{
-				fileSupportStreamReader->Close();
-				delete (IDisposable^)fileSupportStreamReader;
-			}
-		}
-		catch (...) {}
-
 		//Set the hex file error detection to false initially
 		hexFileError = false;
 
@@ -3322,7 +3429,6 @@ private: System::Windows::Forms::Button^  btn_clear;
 				{
 					//Try to open the file to read
 					fileSupportFileStream = gcnew FileStream(openFileDialog1->FileName, FileMode::Open, FileAccess::Read);
-					fileSupportStreamReader = gcnew StreamReader(fileSupportFileStream);
 				}
 				catch (...)
 				{
@@ -3344,240 +3450,112 @@ private: System::Windows::Forms::Button^  btn_clear;
 					return;
 				}
 
-				//Initially indicate that we haven't reached the end of file
-				hexFileEOF = false;
+				array<unsigned char>^ fileContent;
+				HexCore::HEX_REGION hexRegions[MAX_DATA_REGIONS];
+				HexCore::HEX_PARSE_RESULT parseResult;
+				unsigned int parseOptions;
 
-				//Start to read the file by reading a new line
-				while ((fileSupportBuffer = fileSupportStreamReader->ReadLine()) && (hexFileEOF == false))
+				//Read the whole file in one go, the parser works on the raw bytes
+				try
 				{
-					unsigned long recordLength;
-					unsigned long addressField;
-					unsigned long recordType;
-					unsigned long checksum;
-					String^ dataPayload;
+					fileContent = gcnew array<unsigned char>((int)fileSupportFileStream->Length);
+					if (fileSupportFileStream->Read(fileContent, 0, fileContent->Length) != fileContent->Length)
+					{
+						hexFileError = true;
+					}
+				}
+				catch (...)
+				{
+					hexFileError = true;
+				}
 
-					//Trim off the white space from the line
-					fileSupportBuffer = fileSupportBuffer->Trim();
+				if (hexFileError == false)
+				{
+					//Describe the memory allocated for each region in hex file
+					//  addresses (device address * bytesPerAddress)
+					for (i = 0; i < memoryRegionsDetected; i++)
+					{
+						hexRegions[i].Address = memoryRegions[i].Address * bytesPerAddress;
+						hexRegions[i].Size = (unsigned long)deviceImage->RegionBytes(i);
+						hexRegions[i].Data = deviceImage->RegionData(i);
+					}
 
-					//If the line wasn't blank
-					if (fileSupportBuffer->Length > 0)
+					parseOptions = 0;
+#if !defined(ENCRYPTED_BOOTLOADER)
+					if (bytesPerAddress == 2)
 					{
-						if (fileSupportBuffer[0] != ':')
-						{
-							//If the first character of the line wasn't ":" then
-							//  something is wrong with the hex file
-							DEBUG_OUT("ERROR: no leading ':' in row");
-							hexFileError = true;
-						}
-						else
-						{
-							//remove the ":" from the record
-							fileSupportBuffer = fileSupportBuffer->Substring(1, (fileSupportBuffer->Length - 1));
-						}
+						parseOptions |= HEX_PARSE_PIC24_RESET_REMAP;
+					}
+#endif
 
-						//get the record length, address, record type, data, and checksum of the line
-						recordLength = StringToHex(fileSupportBuffer->Substring(0, 2));
-						String^ temp = fileSupportBuffer->Substring(2, 4);
-						addressField = StringToHex(fileSupportBuffer->Substring(2, 4));
-						recordType = StringToHex(fileSupportBuffer->Substring(6, 2));
-						dataPayload = fileSupportBuffer->Substring(8, recordLength * 2);
-						checksum = StringToHex(fileSupportBuffer->Substring((recordLength * 2) + 8, 2));
+					if (fileContent->Length > 0)
+					{
+						pin_ptr<unsigned char> pinnedContent = &fileContent[0];
 
-						unsigned char j;
-						unsigned checksumCalculated;
+						parseResult = HexCore::ParseHexParallel((const char*)pinnedContent, fileContent->Length, hexRegions, memoryRegionsDetected, parseOptions, 0);
+					}
+					else
+					{
+						parseResult.Status = HEX_PARSE_SUCCESS;
+						parseResult.Line = 0;
+						parseResult.Records = 0;
+					}
 
-						//Initialize the checksum value to 0
-						checksumCalculated = 0;
+					switch (parseResult.Status)
+					{
+					case HEX_PARSE_SUCCESS:
+						break;
+					case HEX_PARSE_NO_COLON:
+						DEBUG_OUT(String::Concat("ERROR: no leading ':' in row ", parseResult.Line.ToString()));
+						hexFileError = true;
+						break;
+					case HEX_PARSE_CHECKSUM_ERROR:
+						DEBUG_OUT(String::Concat("ERROR: Checksum error in row ", parseResult.Line.ToString()));
+						hexFileError = true;
+						break;
+					default:
+						DEBUG_OUT(String::Concat("ERROR: malformed record in row ", parseResult.Line.ToString()));
+						hexFileError = true;
+						break;
+					}
+				}
 
-						//For each byte in the data payload length
-						for (j = 0; j < (recordLength + 4); j++)
-						{
-							//Calculate it into the checksum
-							checksumCalculated += StringToHex(fileSupportBuffer->Substring(j * 2, 2));
-						}
-						//complete the checksum calculation
-						checksumCalculated = (~checksumCalculated) + 1;
+				if (hexFileError == true)
+				{
+					//If there was an error in the hex file then 
+					//  return from the function
+					DEBUG_OUT("ERROR: Error in hex file somewhere");
 
-						//If the calculated checksum doesn't match the checksum read
-						//  from the file
-						if ((checksumCalculated & 0x000000FF) != checksum)
+					try
+					{
+						if (fileSupportFileStream)
 						{
-							//then error out of the function
-							DEBUG_OUT("ERROR: Checksum error");
-							hexFileError = true;
+							fileSupportFileStream->Close();
+							delete fileSupportFileStream;
 						}
+					}
+					catch (...) {}
 
-						if (hexFileError == false)
-						{
-							switch (recordType)
-							{
-							case HEX_FILE_EXTENDED_LINEAR_ADDRESS:
-								//if this record is an extended address record then 
-								//  save off the extended address value so we can later
-								//  add it to each of the address fields that we read
-								extendedAddress = StringToHex(dataPayload);
-								break;
-							case HEX_FILE_EOF:
-								hexFileEOF = true;
-								break;
-							case HEX_FILE_DATA:
-							{
-								unsigned long totalAddress;
-DWORD pippo;
-								bool savedData;
-								bool foundMemoryRegion;
-
-								savedData = false;
-								foundMemoryRegion = false;
-
-								//The total address is the extended address plus the current
-								//  address field.
-								totalAddress = (extendedAddress << 16) + addressField;
-								if (totalAddress >= 0x5800)
-									pippo = 1;
-								//for each of the valid memory regions we got from the query
-								//  command
-								for (i = 0; i < memoryRegionsDetected; i++)
-								{
-									pData = getMemoryRegion(i);
-									//If the total address read from the hex file falls within 
-									//  the valid memory range found in the query results
-									if ((totalAddress >= (memoryRegions[i].Address * bytesPerAddress)) && (totalAddress < ((memoryRegions[i].Address + memoryRegions[i].Size) * bytesPerAddress)))
-									{
-										for (j = 0; j < (recordLength); j++)
-										{
-											unsigned long data;
-											unsigned char *p;
-											unsigned char *limit;
-
-											//Record the data from the hex file into the memory allocated
-											//  for that specific memory region.
-											p = (unsigned char*)((totalAddress - (memoryRegions[i].Address * bytesPerAddress)) + j);
-											data = StringToHex(dataPayload->Substring(j * 2, 2));
-											p = (unsigned char*)(pData + (totalAddress - (memoryRegions[i].Address * bytesPerAddress)) + j);
-											limit = (unsigned char*)(pData + ((memoryRegions[i].Size + 1)*bytesPerAddress));
-											if (p >= limit)
-											{
-												break;
-											}
-											if (bytesPerAddress == 2)
-											{
-#if !defined(ENCRYPTED_BOOTLOADER)
-												if ((totalAddress + j) < 0x6)
-												{
-													unsigned char k;
-													unsigned char *userResetVectorPtr;
-
-													switch ((totalAddress + j))
-													{
-													case 0:
-														*pData = 0x00;
-														break;
-													case 1:
-													case 2:
-														*(pData + j) = 0x04;
-														break;
-													case 3:
-													case 4:
-													case 5:
-														*(pData + j) = 0x00;
-													default:
-														*pData = (unsigned char)(data);
-														break;
-													}
-
-													for (k = 0; k < memoryRegionsDetected; k++)
-													{
-														if (memoryRegions[k].Address == PIC24_RESET_REMAP_OFFSET)
-														{
-															pData = getMemoryRegion(k);
-															userResetVectorPtr = (unsigned char*)(pData + totalAddress + j);
-															*userResetVectorPtr = (unsigned char)(data);
-															pData = getMemoryRegion(i);
-														}
-													}
-												}
-												else if ((totalAddress + j) == (PIC24_RESET_REMAP_OFFSET * 2))
-												{
-												}
-												else if ((totalAddress + j) == ((PIC24_RESET_REMAP_OFFSET * 2) + 1))
-												{
-												}
-												else if ((totalAddress + j) == ((PIC24_RESET_REMAP_OFFSET * 2) + 2))
-												{
-												}
-												else if ((totalAddress + j) == ((PIC24_RESET_REMAP_OFFSET * 2) + 3))
-												{
-												}
-												else if ((totalAddress + j) == ((PIC24_RESET_REMAP_OFFSET * 2) + 4))
-												{
-												}
-												else if ((totalAddress + j) == ((PIC24_RESET_REMAP_OFFSET * 2) + 5))
-												{
-												}
-												else
-#endif
-												{
-													*p = (unsigned char)(data);
-												}
-											}
-											else
-											{
-												*p = (unsigned char)(data);
-											}
-										}
-										break;
-									}
-								}
-								break;
-							}
-							default:
-								break;
-							}
-						}
-						else
+					try
+					{
+						if (myStream)
 						{
-							//If there was an error in the hex file then 
-							//  return from the function
-							DEBUG_OUT("ERROR: Error in hex file somewhere");
-
-							try
-							{
-								if (fileSupportFileStream)
-								{
-									fileSupportFileStream->Close();
-									delete fileSupportFileStream;
-								}
-							}
-							catch (...) {}
-
-							try
-							{
-								if (fileSupportStreamReader)
-								{
-									fileSupportStreamReader->Close();
-									delete (IDisposable^)fileSupportStreamReader;
-								}
-							}
-							catch (...) {}
-
-							try
-							{
-								if (myStream)
-								{
-									myStream->Close();
-									delete myStream;
-								}
-							}
-							catch (...) {}
-
-							return;
+							myStream->Close();
+							delete myStream;
 						}
 					}
+					catch (...) {}
+
+					return;
 				}
 
 				DEBUG_OUT("Loading Hex File Complete");
 
+				//Find the packets holding data once, here, rather than testing
+				//  every byte while programming
+				updateOccupancy();
+				sparseVerify = false;
+
 				//If the hex file completed successfully, then enable any buttons
 				//  that are valid now that we have loaded data.
 				btn_ProgramVerify_restore = true;
@@ -3600,17 +3578,7 @@ DWORD pippo;
 			if (fileSupportFileStream)
 			{
 				fileSupportFileStream->Close();
-				delete fileSupportFileStream;
-			}
-		}
-		catch (...) {}
-
-		try
-		{
-			if (fileSupportStreamReader)
-			{
-				fileSupportStreamReader->Close();
-				delete (IDisposable^)fileSupportStreamReader;
+				delete fileSupportFileStream;
 			}
 		}
 		catch (...) {}
@@ -3634,10 +3602,13 @@ DWORD pippo;
 					 This function opens a "save as" box and allows the user to select
 					 where they want to save the contents of the allocated memory.
 					 This function then writes all of the data in the allocated memory to
-					 the specified file
+					 the specified file, HEX_EXPORT_BYTES_PER_LINE data bytes per record.
+					 With HEX_EXPORT_SKIP_ERASED defined, only the runs of packets the
+					 occupancy map marks as holding data are written, and records
+					 holding only erased memory are left out of those too.
 
 				 Precondition:
-					 pData should contain the data that needs to be exported.
+					 deviceImage should contain the data that needs to be exported.
 
 				 Parameters:
 					 Object^  sender - the source of the event that caused this function
@@ -3656,156 +3627,85 @@ DWORD pippo;
 			 ***************************************************************************/
 	private: System::Void btn_ExportHex_Click(System::Object^  sender, System::EventArgs^  e)
 	{
-		FileStream ^fileSupportFileStream;
-		StreamWriter ^fileSupportStreamWriter;
+		HexCore::HexWriter* writer;
+		pin_ptr<const wchar_t> fileName;
+		FILE* file = NULL;
+		unsigned int options = 0;
+		unsigned char currentMemoryRegion;
+		bool ok = true;
+#if defined(HEX_EXPORT_SKIP_ERASED)
+		unsigned long block, end, blocks, blockBytes;
+#endif
 
 		DisableButtons();
 
 		//Open a show dialog box for the "Save As" for the hex file
 		if (dialog_ExportHex->ShowDialog() == ::System::Windows::Forms::DialogResult::OK)
 		{
-			try
-			{
-				//Try to create a write stream to the specified file
-				fileSupportStreamWriter = gcnew StreamWriter(dialog_ExportHex->FileName, false);
-			}
-			catch (Exception^ e)
+			//Try to create the specified file
+			fileName = PtrToStringChars(dialog_ExportHex->FileName);
+			if ((_wfopen_s(&file, fileName, L"wb") != 0) || (file == NULL))
 			{
-				std::string unmanaged
-					(msclr::interop::marshal_as<std::string>(e->Message));
-				
-				//If there was an error, print it out and delete any created 
-				//  objects
-				PRINT_STATUS(unmanaged);
-
-				if (fileSupportFileStream)
-				{
-					delete fileSupportFileStream;
-				}
+				PRINT_STATUS("ERROR: unable to create the hex file");
 				//There was an error
 				return;
 			}
 
-			DWORD BytesWritten = 0;
-			DWORD ErrorStatus = ERROR_SUCCESS;
-			DWORD BytesReceived = 0;
-
-			unsigned char* p;
-			DWORD address;
-			unsigned long size;
-			unsigned char i, currentMemoryRegion;
-			unsigned char bytesThisLine;
-			unsigned char checksum;
-			unsigned char dataByte;
-			String ^ printString;
-			unsigned int lastVector, thisVector;
-
-			//Verify
-			for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
+#if defined(HEX_EXPORT_SKIP_ERASED)
+			options |= HEX_WRITE_SKIP_ERASED;
+			if (bytesPerAddress == 2)
 			{
-				//get the address, size, and pointer to the data for the current memory region
-				address = (memoryRegions[currentMemoryRegion].Address * bytesPerAddress);
-				size = memoryRegions[currentMemoryRegion].Size;
-				p = getMemoryRegion(currentMemoryRegion);
-
-				//calculate the checksum for the initial extended address vector for this memory region
-				checksum = 0x01 + ~(0x02 + 0x04 + (unsigned char)((address >> 24) & 0xFF) + (unsigned char)((address >> 16) & 0xFF));
+				options |= HEX_WRITE_PIC24_PHANTOM;
+			}
+#endif
 
-				//write the extended address vector for this memory region
-				fileSupportStreamWriter->WriteLine(String::Concat(":02000004", HexToString((address >> 16), 2), HexToString(checksum, 1)));
+			//The writer formats whole records into its own buffer and hands it
+			//  to the file in large blocks; extended address records are added
+			//  whenever a record starts on a new 64KB page
+			writer = new HexCore::HexWriter(HexCore::HexFileSink, file, HEX_EXPORT_BYTES_PER_LINE, options);
 
-				//preconfigure the last vector as the one we just wrote
-				lastVector = ((address >> 16) & 0xFFFF);;
+#if defined(HEX_EXPORT_SKIP_ERASED)
+			if (deviceImage->OccupancyBlockBytes() == 0)
+			{
+				updateOccupancy();
+			}
+			blockBytes = deviceImage->OccupancyBlockBytes();
+#endif
 
-				while (1)
+			for (currentMemoryRegion = 0; ok && (currentMemoryRegion < memoryRegionsDetected); currentMemoryRegion++)
+			{
+#if defined(HEX_EXPORT_SKIP_ERASED)
+				//Write each run of consecutive packets holding data
+				blocks = deviceImage->BlockCount(currentMemoryRegion);
+				for (block = deviceImage->NextBlockWithData(currentMemoryRegion, 0); ok && (block < blocks); block = deviceImage->NextBlockWithData(currentMemoryRegion, end))
 				{
-					//calculate the vector that we are on
-					thisVector = ((address >> 16) & 0xFFFF);
-
-					//if the last vector doesn't match the vector for this address
-					if (thisVector != lastVector)
-					{
-						//We need to write a new vector address to the hex file for
-						//  this memory address.  First calculate a new checksum for
-						//  this entry.
-						checksum = 0x01 + ~(0x02 + 0x04 + (unsigned char)((address >> 24) & 0xFF) + (unsigned char)((address >> 16) & 0xFF));
-
-						//Then write the extended address vector to the hex file
-						fileSupportStreamWriter->WriteLine(String::Concat(":02000004", HexToString((address >> 16), 2), HexToString(checksum, 1)));
-					}
-
-					//zero out the checksum so we can start calcluating
-					//  the checksum for the data row
-					checksum = 0x00;
-
-					//Add the ":" as the first item of the line
-					printString = ":";
-
-					//preset the number of bytes on this line as the maximum
-					//  bytes per line as defined in the constants section
-					bytesThisLine = HEX_FILE_BYTES_PER_LINE;
-
-					//If the remaining size of the memory region doesn't have
-					//  that many bytes left in it
-					if ((address + HEX_FILE_BYTES_PER_LINE) > ((memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)*bytesPerAddress))
-					{
-						//then readjust the size of the number of bytes in this line
-						//  to be the number of remaining bytes
-						bytesThisLine = (unsigned char)(HEX_FILE_BYTES_PER_LINE - ((address + HEX_FILE_BYTES_PER_LINE) - ((memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)*bytesPerAddress)));
-					}
-
-					//add the number of bytes in this line to the line
-					printString = String::Concat(printString, HexToString(bytesThisLine, 1));
-
-					//Add the number of bytes in this line to the checksum calculation
-					checksum += ~(bytesThisLine)+1;
-
-					//add the address of this line to the line
-					printString = String::Concat(printString, HexToString(address, 2));
-
-					//add the address of this line to the checksum
-					checksum += ~((unsigned char)(address & 0xFF)) + 1;
-					checksum += ~((unsigned char)((address >> 8) & 0xFF)) + 1;
-
-					//specify that this is a data row
-					printString = String::Concat(printString, "00");
-
-					for (i = 0; i < bytesThisLine; i++)
-					{
-						//Get the data from the allocated memory region, add it to
-						//  the line that will be printed to the hex file, and also
-						//  add it to the checksum calculation
-						dataByte = *p++;
-						printString = String::Concat(printString, HexToString(dataByte, 1));
-						checksum += ~dataByte + 1;
-					}
-
-					//Finally add the checksum on to the end of the line that we will
-					//  be printing
-					printString = String::Concat(printString, HexToString(checksum, 1));
-
-					//Write the line to the hex file
-					fileSupportStreamWriter->WriteLine(printString);
-
-					//increase the address to point to the address of the next line
-					address += bytesThisLine;
-
-					//If the resulting address is outside or at the end of the memory
-					//  region, then we are done and we should break out of this loop
-					if (address >= ((memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size)*bytesPerAddress))
+					for (end = block + 1; (end < blocks) && deviceImage->BlockHasData(currentMemoryRegion, end); end++)
 					{
-						break;
 					}
+					ok = writer->Write((memoryRegions[currentMemoryRegion].Address * bytesPerAddress) + (block * blockBytes),
+						getMemoryRegion(currentMemoryRegion) + (block * blockBytes),
+						((end < blocks) ? (end * blockBytes) : (memoryRegions[currentMemoryRegion].Size * bytesPerAddress)) - (block * blockBytes));
+				}
+#else
+				ok = writer->Write(memoryRegions[currentMemoryRegion].Address * bytesPerAddress,
+					getMemoryRegion(currentMemoryRegion),
+					memoryRegions[currentMemoryRegion].Size * bytesPerAddress);
+#endif
+			}
 
-					//Copy the last extended vector used for the next loop
-					lastVector = thisVector;
-				}//while
-			}//verify
+			//Write the end of file record, close the file, and notify the user
+			ok = ok && writer->End();
+			delete writer;
+			ok = (fclose(file) == 0) && ok;
 
-			//Write the end of file command, close the file, and notify the user
-			fileSupportStreamWriter->WriteLine(":00000001FF");
-			fileSupportStreamWriter->Close();
-			PRINT_STATUS("Export completed successfully");
+			if (ok)
+			{
+				PRINT_STATUS("Export completed successfully");
+			}
+			else
+			{
+				PRINT_STATUS("ERROR: writing the hex file failed");
+			}
 		}
 	}
 #pragma endregion
@@ -3822,7 +3722,7 @@ DWORD pippo;
 					 verify functions
 
 				 Precondition:
-					 pData should be loaded with the memory that needs to be programmed
+					 deviceImage should be loaded with the memory that needs to be programmed
 					 and verified.
 
 				 Parameters:
@@ -3892,6 +3792,31 @@ DWORD pippo;
 #endif
 	}
 
+			 /****************************************************************************
+				 Function:
+					 sendProgramComplete
+
+				 Description:
+					 Sends a PROGRAM_COMPLETE command once every report in flight is
+					 written and waits for it too, so that the flush the device does
+					 on PROGRAM_COMPLETE never overlaps other reports, as in
+					 lock-step.
+
+				 Return Values:
+					 true - the command was written
+					 false - a write failed, stalled past the stream budget or was
+						cancelled
+			 ***************************************************************************/
+	private: bool sendProgramComplete(HexCore::TransferEngine* engine)
+	{
+		BOOTLOADER_COMMAND cmdProgrammingComplete = { 0 };
+
+		cmdProgrammingComplete.ProgramComplete.Command = PROGRAM_COMPLETE;
+		return engine->Drain() &&
+			engine->Post(cmdProgrammingComplete.RawData) &&
+			engine->Drain();
+	}
+
 			 /****************************************************************************
 				 Function:
 					 ProgramThreadStart
@@ -3899,10 +3824,15 @@ DWORD pippo;
 				 Description:
 					 This function is the main body of the programming process.  This
 					 thread programs the contents of the allocated memory into the device
-					 and verifies the results.
+					 and verifies the results.  The reports are those of programPlan,
+					 compiled from the packets the occupancy map of deviceImage marks as
+					 holding data and kept until the image changes; they are sent
+					 through a TransferEngine window of overlapped writes.  The HID
+					 driver writes the reports of a handle in order, so the device sees
+					 them as with a blocking WriteFile.
 
 				 Precondition:
-					 pData should be loaded with the memory that needs to be programmed
+					 deviceImage should be loaded with the memory that needs to be programmed
 					 against.
 
 				 Parameters:
@@ -3931,28 +3861,12 @@ DWORD pippo;
 		BOOTLOADER_COMMAND myCommand = { 0 };
 		BOOTLOADER_COMMAND myResponse = { 0 };
 
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-		DWORD BytesReceived = 0;
-
-		unsigned char* p;
-		DWORD address;
-		unsigned long size;
-		unsigned char i, currentByteInAddress, currentMemoryRegion;
-		bool configsProgrammed, everythingElseProgrammed;
-		bool skipBlock, blockSkipped;
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-		HANDLE ReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
-		//Create a write handle to the USB device
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
-		ReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusRead = GetLastError();
-
-		configsProgrammed = false;
-		everythingElseProgrammed = false;
+		unsigned char currentMemoryRegion;
+		unsigned char regionOrder[MAX_DATA_REGIONS];
+		unsigned int regionCount;
+		bool planReady;
+		size_t i;
+		HexCore::TransferEngine engine(deviceSession->Port(), TRANSFER_WINDOW_PACKETS, TRANSFER_NAK_TIMEOUT, NULL);
 
 		//Enable the main thread to print a new message that will say 
 		//  that this thread has started
@@ -3965,6 +3879,29 @@ DWORD pippo;
 		//Change the status of the progress bar to 0%
 		progressStatus = 0;
 
+		//Get the handles to the USB device; the single commands and the
+		//  program reports share them
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			ENABLE_PRINT();
+			endSessionPhase("Program", true);
+			ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
+			return;
+		}
+
+		//A device that stops taking reports fails the programming within the
+		//  stream budget
+		engine.SetBudget(&deviceSession->StreamBudget());
+
+		//Make sure the occupancy map describes the image in program packets
+		if (deviceImage->OccupancyBlockBytes() != bytesPerPacket)
+		{
+			updateOccupancy();
+		}
+
+		//Until the programming completes the device doesn't match the image
+		sparseVerify = false;
+
 #if defined(ENCRYPTED_BOOTLOADER)
 		unsigned char encryptionBlockSize;
 		unsigned char encryptedFF[64];
@@ -3975,22 +3912,14 @@ DWORD pippo;
 		myCommand.QueryDevice.Command = GET_ENCRYPTED_FF;
 
 		//Send the command that we prepared
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-		//Get the error status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
 			//if the command was sent successfully then
 			//Set the status to 20%
 			progressStatus = 20;
 
 			//Try to read a packet from the device
-			ReadFile(ReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-			//Get the status of the read request
-			ErrorStatus = GetLastError();
-			if (ErrorStatus == ERROR_SUCCESS)
+			if (deviceSession->Read(myResponse.RawData))
 			{
 				//If we were able to successfully read from the device
 				unsigned char i;
@@ -4019,11 +3948,10 @@ DWORD pippo;
 			else
 			{
 				//If the read from the device failed then indicate the failure
-				//  in the results variable
+				//  in the results variable, after closing the device: the
+				//  next operation opens it again
+				endSessionPhase("Program", true);
 				ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
-				//Close the write and read files 
-				CloseHandle(WriteHandleToMyDevice);
-				CloseHandle(ReadHandleToMyDevice);
 
 				//We are done so set the progress to 100%
 				progressStatus = 100;
@@ -4033,13 +3961,11 @@ DWORD pippo;
 		else
 		{
 			//If the write to the device failed then indicate the failure in 
-			//  the results variable
+			//  the results variable, after closing the device: the next
+			//  operation opens it again
+			endSessionPhase("Program", true);
 			ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
 
-			//Close the write and read files 
-			CloseHandle(WriteHandleToMyDevice);
-			CloseHandle(ReadHandleToMyDevice);
-
 			//We are done so set the progress to 100%
 			progressStatus = 100;
 			return;
@@ -4050,10 +3976,7 @@ DWORD pippo;
 		myCommand.EraseDevice.Command = ERASE_DEVICE;
 
 		//Send the command in the myCommand variable to the device
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		if (deviceSession->Write(myCommand.RawData))
 		{
 			//If we were able to successfully send the erase command to
 			//  the device then let's prepare a query command to determine
@@ -4071,26 +3994,22 @@ DWORD pippo;
 			progressStatus = 50;
 
 			//send the command to the device
-			WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-			ErrorStatus = GetLastError();
-			if (ErrorStatus != ERROR_SUCCESS)
+			if (!deviceSession->Write(myCommand.RawData))
 			{
 				ENABLE_PRINT();
+				endSessionPhase("Program", true);
 				ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
 				return;
 			}
 
 			//Try to read a packet from the device
-			ReadFile(ReadHandleToMyDevice, myResponse.RawData, 65, &BytesReceived, 0);	//Shouldn't really do this.  Becomes infinite blocking function if it can't successfully write, for example, because the USB firmware on the microcontroller never sets the UOWN bit for the OUT endpoint.
-
-			//Get the status of the read request
-			ErrorStatus = GetLastError();
-			if (ErrorStatus != ERROR_SUCCESS)
+			if (!deviceSession->Read(myResponse.RawData))
 			{
 				//if there was an error in reading from the device
 				//  then enable the main state machine to print an
 				//  error, indicate the failure, and exit this thread
 				ENABLE_PRINT();
+				endSessionPhase("Program", true);
 				ProgramThreadResults = PROGRAM_READ_FILE_FAILED;
 				return;
 			}
@@ -4103,294 +4022,157 @@ DWORD pippo;
 			ENABLE_PRINT();
 			ProgramThreadResults = PROGRAM_RUNNING_PROGRAM;
 
-			//if the program config words box is not checked
-			if (ckbox_ConfigWordProgramming->Checked == false)
-			{
-				//then we don't need to program the configuration bits
-				//  so mark that we already have programmed them
-				configsProgrammed = true;
-			}
-
-			//While we haven't programmed everything in the device yet
-			while ((configsProgrammed == false) || (everythingElseProgrammed == false))
+			//The program reports go through the transfer engine so that we
+			//  don't wait for a USB round trip on every packet
+
+			//List the memory regions in the order we program them.  If the
+			//  program config words box is checked the configuration regions
+			//  come first.  The problem is that if we have erased the
+			//  configuration words and we receive a device reset before we
+			//  reprogram the configuration words, then the device may not be
+			//  capable of running on the USB any more.  Programming them first
+			//  minimizes the time that the configuration words are left
+			//  unprogrammed.  If the box is not checked they are not programmed.
+			regionCount = 0;
+			if (ckbox_ConfigWordProgramming->Checked == true)
 			{
 				for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
 				{
-					//If we haven't programmed the configuration words then we want
-					//  to do this first.  The problem is that if we have erased the
-					//  configuration words and we receive a device reset before we
-					//  reprogram the configuration words, then the device may not be
-					//  capable of running on the USB any more.  To try to minimize the
-					//  possibility of this occurrance, we first search all of the
-					//  memory regions and look for any configuration regions and program
-					//  these regions first.  This minimizes the time that the configuration
-					//  words are left unprogrammed.
-
-					//If the configuration words are not programmed yet
-					if (configsProgrammed == false)
-					{
-						//If the current memory region is not a configuration section
-						//  then continue to the top of the for loop and look at the
-						//  next memory region.  We don't want to waste time yet looking
-						//  at the other memory regions.  We will come back later for
-						//  the other regions.
-						if (memoryRegions[currentMemoryRegion].Type != MEMORY_REGION_CONFIG)
-						{
-							continue;
-						}
-					}
-					else
+					if (memoryRegions[currentMemoryRegion].Type == MEMORY_REGION_CONFIG)
 					{
-						//If the configuration words are already programmed then if this
-						//  region is a configuration region then we want to continue
-						//  back to the top of the for loop and skip over this region.
-						//  We don't want to program the configuration regions twice.
-						if (memoryRegions[currentMemoryRegion].Type == MEMORY_REGION_CONFIG)
-						{
-							continue;
-						}
+						regionOrder[regionCount++] = currentMemoryRegion;
 					}
+				}
+			}
+			for (currentMemoryRegion = 0; currentMemoryRegion < memoryRegionsDetected; currentMemoryRegion++)
+			{
+				if (memoryRegions[currentMemoryRegion].Type != MEMORY_REGION_CONFIG)
+				{
+					regionOrder[regionCount++] = currentMemoryRegion;
+				}
+			}
 
-					//Get the address, size, and data for the current memory region
-					address = memoryRegions[currentMemoryRegion].Address;
-					size = memoryRegions[currentMemoryRegion].Size;
-					p = getMemoryRegion(currentMemoryRegion);
-
-					//Mark that we intend to skip the first block unless we find a non-0xFF
-					//  byte in the packet
-					skipBlock = true;
-
-					//Mark that we didn't skip the last block
-					blockSkipped = false;
-
-					//indicate that we are at the first byte of the current address
-					currentByteInAddress = 1;
-
-					//while the current address is less than the end address
-					while (address < (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
-					{
-						//prepare a program device command to send to the device
- 						myCommand.ProgramDevice.WindowsReserved = 0;
-						myCommand.ProgramDevice.Command = PROGRAM_DEVICE;
-						myCommand.ProgramDevice.Address = address;
-
-						//Update the progress status with a percentage of how many
-						//  bytes are in the memory region vs how many have already been
-						//  programmed
-						progressStatus = (unsigned char)(((100 * (address - memoryRegions[currentMemoryRegion].Address)) / memoryRegions[currentMemoryRegion].Size));
-						//progressStatus = (unsigned char)(address - memoryRegions[currentMemoryRegion].Address);
-
-						//for as many bytes as we can fit in a packet
-						for (i = 0; i < bytesPerPacket; i++)
-						{
-							unsigned char data;
-
-							//load up the byte from the allocated memory into the packet
-							data = *p++;
-							myCommand.ProgramDevice.Data[i + (sizeof(myCommand.ProgramDevice.Data) - bytesPerPacket)] = data;
-
-#if !defined(ENCRYPTED_BOOTLOADER)
-							//if the byte wasn't 0xFF
-							if (data != 0xFF)
-							{
-								if (bytesPerAddress == 2)
-								{
-									if ((address % 2) != 0)
-									{
-										if (currentByteInAddress == 2)
-										{
-											//We can skip this block because we don't care about this byte
-											//  it is byte 4 of a 3 word instruction on PIC24
-											//myCommand.ProgramDevice.Data[i+(sizeof(myCommand.ProgramDevice.Data)-bytesPerPacket)] = 0;
-										}
-										else
-										{
-											//Then we can't skip this block of data
-											skipBlock = false;
-										}
-									}
-									else
-									{
-										//Then we can't skip this block of data
-										skipBlock = false;
-									}
-								}
-								else
-								{
-									//Then we can't skip this block of data
-									skipBlock = false;
-								}
-							}
+			//The packets of the image, the blocks left out and the programming
+			//  complete commands after each gap are compiled once; programming
+			//  the next board with the same image only posts the reports
+#if defined(ENCRYPTED_BOOTLOADER)
+			//The occupancy map can't tell encrypted erased memory, so the plan
+			//  also leaves out the blocks holding nothing but encrypted 0xFF
+			planReady = programPlan->Compiled(regionOrder, regionCount, bytesPerPacket, encryptedFF, encryptionBlockSize) ||
+				programPlan->Compile(*deviceImage, regionOrder, regionCount, bytesPerPacket, bytesPerAddress, encryptedFF, encryptionBlockSize);
 #else
-							if (data != encryptedFF[i%encryptionBlockSize])
-							{
-								//Then we can't skip this block of data
-								skipBlock = false;
-							}
-#endif
-
-							if (currentByteInAddress == bytesPerAddress)
-							{
-								//If we have written enough bytes per address to be
-								//  at the next address, then increment the address
-								//  variable and reset the count.  
-								address++;
-								currentByteInAddress = 1;
-							}
-							else
-							{
-								//If we haven't written enough bytes to fill this 
-								//  address then increment the number of bytes that
-								//  we have added for this address
-								currentByteInAddress++;
-							}
-
-							//If we have reached the end of the memory region, then we
-							//  need to pad the data at the end of the packet instead
-							//  of the front of the packet so we need to shift the data
-							//  to the back of the packet.
-							if (address >= (memoryRegions[currentMemoryRegion].Address + memoryRegions[currentMemoryRegion].Size))
-							{
-								unsigned char n;
-
-								i++;
-
-								//for each byte of the packet
-								for (n = 0; n < sizeof(myCommand.ProgramDevice.Data); n++)
-								{
-									if (n < i)
-									{
-										//move it from where it is to the the back of the packet thus
-										//  shifting all of the data down
-										myCommand.ProgramDevice.Data[sizeof(myCommand.ProgramDevice.Data) - n - 1] = myCommand.ProgramDevice.Data[i + (sizeof(myCommand.ProgramDevice.Data) - bytesPerPacket) - n - 1];
-									}
-									else
-									{
-										//set the remaining data values to 0
-										myCommand.ProgramDevice.Data[sizeof(myCommand.ProgramDevice.Data) - n - 1] = 0;
-
-									}
-								}
-
-								//If this was the last address then break out of the for loop
-								//  that is writing bytes to the packet
-								break;
-							}
-							}
-
-						//The number of bytes programmed is still contained in the last loop
-						//  index, i.  Copy that number into the packet that is going to the device
-						myCommand.ProgramDevice.BytesPerPacket = i;
-
-						//If the block was all 0xFF then we can just skip actually programming
-						//  this device.  Otherwise enter the programming sequence
-						if (skipBlock == false)
-						{
-							//If we skipped one block before this block then we may need
-							//  to send a proramming complete command to the device before
-							//  sending the data for this command.
-							if (blockSkipped == true)
-							{
-								BOOTLOADER_COMMAND cmdProgrammingComplete = { 0 };
-
-								//Send the programming complete command
-								cmdProgrammingComplete.ProgramComplete.Command = PROGRAM_COMPLETE;
-								WriteFile(WriteHandleToMyDevice, cmdProgrammingComplete.RawData, 65, &BytesWritten, 0);
-
-								ErrorStatus = GetLastError();
-
-								if (ErrorStatus != ERROR_SUCCESS)
-								{
-									ENABLE_PRINT();
-									ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
-									return;
-								}
-
-								//since we have now indicated that the programming is complete
-								//  then we now mark that we haven't skipped any blocks
-								blockSkipped = false;
-							}
-
-#if defined(DEBUG_THREADS) && defined(DEBUG_USB)
-							DEBUG_OUT(">>> USB OUT Packet >>>");
-							printBuffer(myCommand.PacketData.Data, 64);
+			planReady = programPlan->Compiled(regionOrder, regionCount, bytesPerPacket, NULL, 0) ||
+				programPlan->Compile(*deviceImage, regionOrder, regionCount, bytesPerPacket, bytesPerAddress, NULL, 0);
 #endif
-							//Send the program command to the device
-							WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-							ErrorStatus = GetLastError();
-							if (ErrorStatus != ERROR_SUCCESS)
-							{
-								ENABLE_PRINT();
-								ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
-								return;
-							}
-
-							//initially mark that we are skipping the block.  We will
-							//  set this back to false on the first byte we find that is 
-							//  not 0xFF.
-							skipBlock = true;
-						}
-						else
-						{
-							//If we are skipping this block then mark that we have skipped
-							//  a block and initially mark that we will be skipping the
-							//  next block.  We will set skipBlock to false if we find
-							//  a byte that is non-0xFF in the next packet
-							blockSkipped = true;
-							skipBlock = true;
-						}
-						} //while
+			if (!planReady)
+			{
+				ENABLE_PRINT();
+				endSessionPhase("Program", true);
+				ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
+				return;
+			}
 
-						//Now that we are done with all of the addresses in this memory region,
-						//  before we move on we need to send a programming complete command to
-						//  the device.
-					myCommand.ProgramComplete.WindowsReserved = 0;
-					myCommand.ProgramComplete.Command = PROGRAM_COMPLETE;
-					WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
+			for (i = 0; i < programPlan->Count(); i++)
+			{
+				const HexCore::PACKET_PLAN_ENTRY& entry = programPlan->Entry(i);
 
-					ErrorStatus = GetLastError();
-					if (ErrorStatus != ERROR_SUCCESS)
+				//The device needs a programming complete command after a gap and
+				//  at the end of each memory region, once the packets before it
+				//  are written
+				if (entry.Complete)
+				{
+					if (!sendProgramComplete(&engine))
 					{
+						engine.Cancel();
 						ENABLE_PRINT();
+						endSessionPhase("Program", true);
 						ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
 						return;
 					}
+					continue;
+				}
 
-					}//for each memory region
-
+				//Update the progress status with a percentage of how many
+				//  bytes are in the memory region vs how many have already been
+				//  programmed
+				progressStatus = (unsigned char)(((100 * (entry.Address - memoryRegions[entry.Region].Address)) / memoryRegions[entry.Region].Size));
 
-				if (configsProgrammed == false)
-				{
-					//If the configuration bits haven't been programmed yet then the first
-					//  pass through the for loop that just completed will have programmed
-					//  just the configuration bits so mark them as complete.
-					configsProgrammed = true;
-				}
-				else
+				//Queue the program command, waiting only if the window is full
+				if (!engine.Post(programPlan->Report(i)))
 				{
-					//If the configuration bits were already programmed then this loop must
-					//  have programmed all of the other memory regions.  Mark everything
-					//  else as being complete.
-					everythingElseProgrammed = true;
+					engine.Cancel();
+					ENABLE_PRINT();
+					endSessionPhase("Program", true);
+					ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
+					return;
 				}
-				}//while
+			}
+
+			if (engine.LockStep())
+			{
+				DEBUG_OUT("Device NAKing, programming went on lock-step");
+			}
 			} //If write file
 		else
 		{
 			//If the write file failed then notify the user
 			ENABLE_PRINT();
+			endSessionPhase("Program", true);
 			ProgramThreadResults = PROGRAM_WRITE_FILE_FAILED;
 			return;
 		}
 
 		//If we make it to this point then the programming completed successfully.
-		//  Notify the user and mark this thread as successful
+		//  The blocks we left out are still erased on the device, so a verify
+		//  can leave them out too.  Notify the user and mark this thread as
+		//  successful
+		sparseVerify = true;
+		endSessionPhase("Program", false);
 		ENABLE_PRINT();
 		ProgramThreadResults = PROGRAM_SUCCESS;
 		}
 #pragma endregion
 
 #pragma region USB Functions
+			 /****************************************************************************
+				 Function:
+					 endSessionPhase
+
+				 Description:
+					 Ends the phase of a worker thread on the device session.  After
+					 a failed transfer the session is closed, so that the next worker
+					 opens the device again; otherwise the handles stay open for it.
+
+				 Precondition:
+					 deviceSession->Begin() was called by the worker
+
+				 Parameters:
+					 String^ phase - name of the phase, for the debug output
+					 bool failed - true when a transfer failed
+
+				 Return Values:
+					 None
+
+				 Other:
+					 None
+
+				 Remarks:
+					 With DEBUG_THREADS prints how long the phase took and how much
+					 of it went in opening the device.
+			 ***************************************************************************/
+	private: void endSessionPhase(String^ phase, bool failed)
+	{
+		if (failed)
+		{
+			deviceSession->Close();
+		}
+
+#if defined(DEBUG_THREADS)
+		DEBUG_OUT(String::Concat(phase, ": ", (deviceSession->PhaseMicroseconds() / 1000).ToString(), " ms, opening the device ",
+			(deviceSession->PhaseConnectMicroseconds() / 1000).ToString(), " ms (", deviceSession->Connects().ToString(), " opens in all)"));
+#endif
+	}
+
 			 /****************************************************************************
 				 Function:
 					 WndProc
@@ -4462,21 +4244,13 @@ DWORD pippo;
 			DEBUG_OUT("WM_DEVICECHANGE: DBT_DEVICEREMOVEPENDING");
 		}
 
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
-		HANDLE ReadHandleToMyDevice = INVALID_HANDLE_VALUE;
-
 		Status = TryToFindHIDDeviceFromVIDPID();
 		if (Status == TRUE)
 		{
 			//Open read and write pipes to the device, but only if they weren't already open.  We would know if they were open if MyDeviceAttachedStatus was set to true.
 			if (MyDeviceAttachedStatus == false)
 			{
-				WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-				ErrorStatusWrite = GetLastError();
-				ReadHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-				ErrorStatusRead = GetLastError();
-
-				if ((ErrorStatusRead == ERROR_SUCCESS) && (ErrorStatusWrite == ERROR_SUCCESS))
+				if (deviceSession->Open(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
 				{
 					DeviceAttached();
 					MyDeviceAttachedStatus = true;
@@ -4494,8 +4268,7 @@ DWORD pippo;
 		{
 			MyDeviceAttachedStatus = false;
 			DeviceRemoved();
-			CloseHandle(WriteHandleToMyDevice);		//Close any previously open handles in case user presses button more than once.  This won't necessarily be a problem.  Depending upon the sharing
-			CloseHandle(ReadHandleToMyDevice);		//access rights, we may not be allowed to have multiple open handles of some types to the same device at once.  Therefore, we close them before opening them.
+			deviceSession->Close();		//The handles of a device that went away are of no use; a new one gets new handles
 			DEBUG_OUT("Could not find device: " + MY_DEVICE_ID);
 		}
 	}
@@ -4756,8 +4529,6 @@ DWORD pippo;
 			 ***************************************************************************/
 	private: System::Void DeviceRemoved(void)
 	{
-		unsigned char i;
-
 #if !defined(DEBUGGING)
 		listBox1->Items->Clear();
 #endif
@@ -4791,15 +4562,8 @@ DWORD pippo;
 		ckbox_ConfigWordProgramming_restore = true;
 #endif
 
-		for (i = 0; i < MAX_DATA_REGIONS; i++)
-		{
-			pData = getMemoryRegion(i);
-			if (pData != 0)
-			{
-				free(pData);
-				setMemoryRegion(i, 0);
-			}
-		}
+		deviceImage->Release();
+		sparseVerify = false;
 
 	}
 #pragma endregion
@@ -4915,17 +4679,18 @@ DWORD pippo;
 	private: System::Void ResetThreadStart(void)
 	{
 		BOOTLOADER_COMMAND myCommand = { 0 };
-		DWORD BytesWritten = 0;
-		DWORD ErrorStatus = ERROR_SUCCESS;
-
-		HANDLE WriteHandleToMyDevice = INVALID_HANDLE_VALUE;
 
 		//Update the progress status to 0%
 		progressStatus = 0;
 
-		//Create a new write handle to the device
-		WriteHandleToMyDevice = CreateFile(MyStructureWithDetailedInterfaceDataInIt->DevicePath, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0);
-		ErrorStatusWrite = GetLastError();
+		//Get the handles to the device
+		if (!deviceSession->Begin(MyStructureWithDetailedInterfaceDataInIt->DevicePath))
+		{
+			endSessionPhase("Reset", true);
+			ResetThreadResults = RESET_WRITE_FILE_FAILED;
+			progressStatus = 100;
+			return;
+		}
 
 		//Create the command packet that we want to send to the device.  The
 		//  Command should be erase and the WindowsReserved byte should be
@@ -4936,17 +4701,16 @@ DWORD pippo;
 		//Update the progress status to 10%
 		progressStatus = 10;
 
-		//Send the command to the device
-		WriteFile(WriteHandleToMyDevice, myCommand.RawData, 65, &BytesWritten, 0);
-
-		//Get the status of the last transmission
-		ErrorStatus = GetLastError();
-		if (ErrorStatus == ERROR_SUCCESS)
+		//Send the command to the device.  The device drops off the bus after
+		//  the reset: the handles are closed either way
+		if (deviceSession->Write(myCommand.RawData))
 		{
+			endSessionPhase("Reset", true);
 			ResetThreadResults = RESET_SUCCESS;
 		}
 		else
 		{
+			endSessionPhase("Reset", true);
 			ResetThreadResults = RESET_WRITE_FILE_FAILED;
 		}
 
@@ -5646,10 +5410,8 @@ DWORD pippo;
 
 			case QUERY_SUCCESS:
 			{
+				HexCore::DEVICE_REGION deviceRegions[MAX_DATA_REGIONS];
 				unsigned char loopCounter;
-				unsigned long tempLong;
-				unsigned char *tempPointer;
-				bool mallocFailed;
 
 				//If the query was successful, notify the user
 				//ENABLE_PRINT();
@@ -5667,75 +5429,18 @@ DWORD pippo;
 					btn_EraseDevice_restore = false;
 				}
 
-				//initialize a variable to keep track if we were
-				//  able to allocate memory for each of the specified
-				//  memory regions
-				mallocFailed = false;
-
-				//for each of the possible memory regions
-				for (loopCounter = 0; loopCounter < MAX_DATA_REGIONS; loopCounter++)
-				{
-					pData = getMemoryRegion(loopCounter);
-					//If the current pointer isn't NULL
-					if (pData != 0)
-					{
-						//Free the old data and set the pointer to 0
-						free(pData);
-						setMemoryRegion(loopCounter, 0);
-					}
-				}
-
-				loopCounter = 0;
-				while (loopCounter != 0)
-				{
-					loopCounter = 0;
-				}
-				//For each of the memory regions detected
+				//Lay out the memory image for the regions detected.  The
+				//  image keeps its buffer if the geometry did not change
+				//  since the last query.
 				for (loopCounter = 0; loopCounter < memoryRegionsDetected; loopCounter++)
 				{
-					unsigned long size, b;
-
-					//Get the size of the data
-					size = memoryRegions[loopCounter].Size;
-					b = bytesPerAddress;
-
-					//Allocate enough memory for the memory region
-					pData = (unsigned char*)malloc((memoryRegions[loopCounter].Size + 1) * bytesPerAddress);
-					setMemoryRegion(loopCounter, pData);
-
-					//If the malloc failed
-					if (pData == 0)
-					{
-						//Print out an error message, if in debug mode
-						DEBUG_OUT("??? malloc failed ???");
-						DEBUG_OUT(HexToString(size, 4));
-						DEBUG_OUT(HexToString(b, 4));
-
-						//indicate that we had a malloc failure
-						mallocFailed = true;
-						break;
-					}
+					deviceRegions[loopCounter].Type = memoryRegions[loopCounter].Type;
+					deviceRegions[loopCounter].Address = memoryRegions[loopCounter].Address;
+					deviceRegions[loopCounter].Size = memoryRegions[loopCounter].Size;
 				}
 
-				//If we were unable to malloc memory for each of
-				//  the memory regions then we should free the data
-				//  for all of the regions and report a failure
-				if (mallocFailed == true)
+				if (!deviceImage->Configure(deviceRegions, memoryRegionsDetected, bytesPerAddress))
 				{
-					//Then for every region
-					for (loopCounter = 0; loopCounter < MAX_DATA_REGIONS; loopCounter++)
-					{
-						pData = getMemoryRegion(loopCounter);
-
-						//If we did allocate some memory
-						if (pData != 0)
-						{
-							//free the memory and set the pointer to 0
-							free(pData);
-							setMemoryRegion(loopCounter, 0);
-						}
-					}
-
 					//Notify the user of the failure
 					ENABLE_PRINT();
 					PRINT_STATUS("Application unable to allocate enough memory for the specified memory regions");
@@ -5747,30 +5452,25 @@ DWORD pippo;
 					return;
 				}
 
-				//If all of the memory allocations where successful
-				//  then for each memory region
+				//The image is erased below: its program plan is stale
+				programPlan->Clear();
+
+				//Set all of the data in the memory regions defaultly to erased
+#if !defined(ENCRYPTED_BOOTLOADER)
+				//  (0xFF, with every 4th byte zeroed on the PIC24)
+				deviceImage->Erase(bytesPerAddress == 2);
+#else
 				for (loopCounter = 0; loopCounter < memoryRegionsDetected; loopCounter++)
 				{
-					tempPointer = getMemoryRegion(loopCounter);
+					unsigned char *tempPointer = deviceImage->RegionData(loopCounter);
+					unsigned long tempLong;
 
-					//Set all of the data in that memory region defaultly to 0xFF
 					for (tempLong = 0; tempLong < (memoryRegions[loopCounter].Size * bytesPerAddress); tempLong++)
 					{
-#if !defined(ENCRYPTED_BOOTLOADER)
-						if ((bytesPerAddress == 2) && (((tempLong + 1) % 4) == 0))
-						{
-							//zero out every 4th byte on the PIC24
-							*tempPointer++ = 0;
-						}
-						else
-						{
-							*tempPointer++ = 0xFF;
-						}
-#else
 						*tempPointer++ = encryptedFF[tempLong%encryptionBlockSize];
-#endif
-						}
 					}
+				}
+#endif
 
 				//return the bootloader and the query thread to the idle state
 				bootloaderState = BOOTLOADER_IDLE;
@@ -5829,36 +5529,15 @@ DWORD pippo;
 ***************************************************************************/
 			 String^ HexToString(unsigned long input, unsigned char bytes)
 			 {
-				 String^ returnString;
-				 wchar_t returnArray[9];
-
-				 unsigned char i;
-				 unsigned char c;
-
-				 for (i = 0; i < 9; i++)
-				 {
-					 returnArray[i] = '0';
-				 }
+				 wchar_t returnArray[8];
+				 wchar_t* end;
 
-				 for (i = 0; i < bytes * 2; i++)
+				 if (bytes > 4)
 				 {
-					 c = (unsigned char)(input & 0x0000000F);
-
-					 if (c <= 9)
-					 {
-						 returnArray[7 - i] = c + '0';
-					 }
-					 else
-					 {
-						 returnArray[7 - i] = c + 'A' - 10;
-					 }
-
-					 input >>= 4;
+					 bytes = 4;
 				 }
-				 returnArray[9] = 0;
-				 returnString = gcnew String(returnArray);
-				 returnString = returnString->Substring(8 - (bytes * 2), bytes * 2);
-				 return returnString;
+				 end = HexCore::EncodeHexNumber(input, bytes, returnArray);
+				 return gcnew String(returnArray, 0, (int)(end - returnArray));
 			 }
 
 			 /****************************************************************************
@@ -5885,34 +5564,17 @@ DWORD pippo;
 			 ***************************************************************************/
 			 unsigned long StringToHex(String^ s)
 			 {
+				 pin_ptr<const wchar_t> chars = PtrToStringChars(s);
 				 unsigned long returnAddress;
-				 unsigned long placeMultiplier;
-				 unsigned char i;
-				 wchar_t c;
+				 int length = s->Length;
 
-				 returnAddress = 0;
-				 placeMultiplier = 1;
-
-				 for (i = 0; i < s->Length; i++)
+				 //only the last 8 digits fit
+				 if (length > 8)
 				 {
-					 c = s[s->Length - 1 - i];
-					 if ((c >= 'A') && (c <= 'F'))
-					 {
-						 c = 10 + (c - 'A');
-					 }
-					 else if ((c >= 'a') && (c <= 'f'))
-					 {
-						 c = 10 + (c - 'a');
-					 }
-					 else
-					 {
-						 c = c - '0';
-					 }
-
-					 returnAddress += (c * placeMultiplier);
-					 placeMultiplier *= 16;
+					 chars += length - 8;
+					 length = 8;
 				 }
-
+				 HexCore::DecodeHexNumber((const wchar_t*)chars, (size_t)length, &returnAddress);
 				 return returnAddress;
 			 }
 #pragma endregion
@@ -6069,80 +5731,64 @@ DWORD pippo;
 	private: System::Void printBuffer(unsigned char* buffer, DWORD size)
 	{
 #define NUM_BYTES_PER_ROW 32
+		wchar_t line[1 + (3 * NUM_BYTES_PER_ROW)];
+		wchar_t* end;
 		DWORD i;
-		String^ s;
-
-		s = "";
+		DWORD n;
 
-		for (i = 0; i < size; i++)
+		for (i = 0; i < size; i += n)
 		{
-			if ((i%NUM_BYTES_PER_ROW) == 0)
-			{
-				if (i != 0)
-				{
-					DEBUG_OUT(s);
-					s = "";
-				}
-				s = String::Concat("  ", HexToString(*(buffer + i), 1));
-			}
-			else
-			{
-				s = String::Concat(s, " ", HexToString(*(buffer + i), 1));
-			}
-		}
+			n = ((size - i) < NUM_BYTES_PER_ROW) ? (size - i) : NUM_BYTES_PER_ROW;
 
-		if (String::Compare(s, "") != 0)
-		{
-			DEBUG_OUT(s);
+			//"  AA BB CC ..."
+			line[0] = ' ';
+			end = HexCore::EncodeHexSeparated(buffer + i, n, (wchar_t)' ', line + 1);
+			DEBUG_OUT(gcnew String(line, 0, (int)(end - line)));
 		}
 	}
 
 
 	private: System::Void dumpMemoryRegions(void)
 	{
+#define NUM_ADDRESSES_PER_ROW 16
+		//"AAAAAAAA: " then every address most significant byte first, followed by a space
+		wchar_t line[10 + (NUM_ADDRESSES_PER_ROW * ((2 * 4) + 1))];
+		wchar_t* end;
 		unsigned char i, k;
 		unsigned char *p;
 		unsigned long j;
-		String^ s;
 		unsigned long size;
 
 		for (i = 0; i < memoryRegionsDetected; i++)
 		{
-			j = 0;
-			k = bytesPerAddress;
+			end = line;
 			p = getMemoryRegion(i);
 			size = memoryRegions[i].Size;
 			size *= bytesPerAddress;
 
 			DEBUG_OUT(String::Concat("****** MEMORY REGION ", HexToString(i, 1), " ******"));
-			while (j < size)
+			for (j = 0; j < size; j += bytesPerAddress)
 			{
-				if ((j % (16 * bytesPerAddress)) == 0)
+				if ((j % (NUM_ADDRESSES_PER_ROW * bytesPerAddress)) == 0)
 				{
 					if (j != 0)
 					{
-						DEBUG_OUT(s);
+						DEBUG_OUT(gcnew String(line, 0, (int)(end - line)));
 					}
-					s = String::Concat(HexToString((memoryRegions[i].Address + (j / bytesPerAddress)), 4), ": ", HexToString(*(p + (2 * k) - bytesPerAddress + j - 1), 1));
-				}
-				else
-				{
-					s = String::Concat(s, HexToString(*(p + (2 * k) - bytesPerAddress + j - 1), 1));
+					end = HexCore::EncodeHexNumber(memoryRegions[i].Address + (j / bytesPerAddress), 4, line);
+					*end++ = ':';
+					*end++ = ' ';
 				}
 
-				k--;
-				if (k == 0)
+				for (k = bytesPerAddress; k > 0; k--)
 				{
-					s = String::Concat(s, " ");
-					k = bytesPerAddress;
+					end = HexCore::EncodeHex(p + j + k - 1, 1, end);
 				}
-
-
-				j++;
+				*end++ = ' ';
 			}
-			if (((j - 1) % (16 * bytesPerAddress)) != 0)
+			if (end != line)
 			{
-				DEBUG_OUT(s);
+				DEBUG_OUT(gcnew String(line, 0, (int)(end - line)));
 			}
 		}
 	}
@@ -6151,50 +5797,20 @@ DWORD pippo;
 
 			 unsigned char* getMemoryRegion(unsigned char region)
 			 {
-				 switch (region)
-				 {
-				 case 0:
-					 return pData0;
-				 case 1:
-					 return pData1;
-				 case 2:
-					 return pData2;
-				 case 3:
-					 return pData3;
-				 case 4:
-					 return pData4;
-				 case 5:
-					 return pData5;
-				 default:
-					 return 0;
-				 }
+				 return deviceImage->RegionData(region);
 			 }
 
-			 void setMemoryRegion(unsigned char region, unsigned char* p)
+			 //Rebuilds the occupancy map of deviceImage, one block per program
+			 //  packet, after its content changed; the program plan of the old
+			 //  content is dropped
+			 void updateOccupancy(void)
 			 {
-				 switch (region)
-				 {
-				 case 0:
-					 pData0 = p;
-					 break;
-				 case 1:
-					 pData1 = p;
-					 break;
-				 case 2:
-					 pData2 = p;
-					 break;
-				 case 3:
-					 pData3 = p;
-					 break;
-				 case 4:
-					 pData4 = p;
-					 break;
-				 case 5:
-					 pData5 = p;
-					 break;
-				 default:
-					 return;
-				 }
+				 programPlan->Clear();
+#if !defined(ENCRYPTED_BOOTLOADER)
+				 deviceImage->BuildOccupancy(bytesPerPacket, bytesPerAddress == 2);
+#else
+				 deviceImage->FillOccupancy(bytesPerPacket);
+#endif
 			 }
 
 	private: System::Void btn_Query_Click(System::Object^  sender, System::EventArgs^  e) {
@@ -6730,6 +6346,14 @@ private: System::Void btn_clear_Click(System::Object^  sender, System::EventArgs
 	ENABLE_PRINT();
 	PRINT_STATUS("Log cleared.");
 }
+//Interrupts the transfers of the worker thread running, if any: its waits
+//  end at once and it fails as on a device that stopped answering
+private: System::Void btn_Cancel_Click(System::Object^  sender, System::EventArgs^  e) {
+	deviceSession->Interrupt();
+
+	ENABLE_PRINT();
+	PRINT_STATUS("Cancelling the operation in progress.");
+}
 private: System::Void Form1_Load(System::Object^  sender, System::EventArgs^  e) {
 	}
 private: System::Void label2_Click(System::Object^  sender, System::EventArgs^  e) {
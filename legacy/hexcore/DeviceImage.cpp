@@ -0,0 +1,236 @@
+/*********************************************************************
+ *
+ *                Device memory image
+ *
+ *********************************************************************
+ * FileName:        DeviceImage.cpp
+ ********************************************************************/
+
+#include "DeviceImage.h"
+#include "HexImage.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace HexCore {
+
+	namespace {
+
+		//true when length bytes hold nothing but 0xFF, not looking at the
+		//  bytes set in ignore (8 bytes, the phantom byte mask)
+		bool BlockErased(const unsigned char* data, size_t length, const unsigned char* ignore)
+		{
+			uint64_t mask, word;
+			uint64_t all = ~(uint64_t)0;
+			size_t i;
+
+			memcpy(&mask, ignore, 8);
+			for (i = 0; (i + 8) <= length; i += 8)
+			{
+				memcpy(&word, data + i, 8);
+				all &= word | mask;
+			}
+			for (; i < length; i++)
+			{
+				if ((unsigned char)(data[i] | ignore[i % 8]) != 0xFF)
+				{
+					return false;
+				}
+			}
+			return all == ~(uint64_t)0;
+		}
+
+		unsigned int LowestSetBit(uint32_t word)
+		{
+#if defined(_MSC_VER)
+			unsigned long index;
+
+			_BitScanForward(&index, word);
+			return (unsigned int)index;
+#else
+			return (unsigned int)__builtin_ctz(word);
+#endif
+		}
+	}
+
+	DeviceImage::DeviceImage()
+		: occupancyBlockBytes(0), bytesPerAddress(0), block(0), arena(0)
+	{
+	}
+
+	DeviceImage::~DeviceImage()
+	{
+		Release();
+	}
+
+	bool DeviceImage::SameGeometry(const DEVICE_REGION* newRegions, unsigned int count, unsigned int newBytesPerAddress) const
+	{
+		unsigned int i;
+
+		if ((arena == 0) || (count != regions.size()) || (newBytesPerAddress != bytesPerAddress))
+		{
+			return false;
+		}
+		for (i = 0; i < count; i++)
+		{
+			if ((newRegions[i].Type != regions[i].Type) ||
+				(newRegions[i].Address != regions[i].Address) ||
+				(newRegions[i].Size != regions[i].Size))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool DeviceImage::Configure(const DEVICE_REGION* newRegions, unsigned int count, unsigned int newBytesPerAddress)
+	{
+		size_t total = 0;
+		unsigned int i;
+
+		if (SameGeometry(newRegions, count, newBytesPerAddress))
+		{
+			ResetOccupancy(0);
+			return true;
+		}
+
+		Release();
+		regions.assign(newRegions, newRegions + count);
+		bytesPerAddress = newBytesPerAddress;
+		offsets.resize(count);
+		for (i = 0; i < count; i++)
+		{
+			offsets[i] = total;
+			total += (RegionBytes(i) + (DEVICE_IMAGE_ALIGNMENT - 1)) & ~(size_t)(DEVICE_IMAGE_ALIGNMENT - 1);
+		}
+
+		block = (unsigned char*)malloc(total + DEVICE_IMAGE_ALIGNMENT);
+		if (block == 0)
+		{
+			Release();
+			return false;
+		}
+		arena = (unsigned char*)(((uintptr_t)block + (DEVICE_IMAGE_ALIGNMENT - 1)) & ~(uintptr_t)(DEVICE_IMAGE_ALIGNMENT - 1));
+		return true;
+	}
+
+	void DeviceImage::Erase(bool phantomBytes)
+	{
+		unsigned int i;
+
+		for (i = 0; i < offsets.size(); i++)
+		{
+			FillErased(RegionData(i), RegionBytes(i), regions[i].Address * bytesPerAddress, phantomBytes);
+		}
+		ResetOccupancy(0);
+	}
+
+	void DeviceImage::ResetOccupancy(unsigned int blockBytes)
+	{
+		size_t total = 0;
+		unsigned int i;
+
+		occupancyBlockBytes = blockBytes;
+		occupancy.clear();
+		occupancyOffsets.clear();
+		if (blockBytes == 0)
+		{
+			return;
+		}
+
+		occupancyOffsets.resize(regions.size());
+		for (i = 0; i < regions.size(); i++)
+		{
+			occupancyOffsets[i] = total;
+			total += (BlockCount(i) + 31) / 32;
+		}
+		occupancy.assign(total, 0);
+	}
+
+	void DeviceImage::BuildOccupancy(unsigned int blockBytes, bool phantomBytes)
+	{
+		unsigned int i, j;
+
+		ResetOccupancy(blockBytes);
+		for (i = 0; i < regions.size(); i++)
+		{
+			const unsigned char* data = RegionData(i);
+			size_t bytes = (size_t)regions[i].Size * bytesPerAddress;
+			unsigned long address = regions[i].Address * bytesPerAddress;
+			unsigned long blocks = BlockCount(i);
+			unsigned long b;
+
+			for (b = 0; b < blocks; b++)
+			{
+				size_t offset = (size_t)b * blockBytes;
+				size_t length = ((bytes - offset) < blockBytes) ? (bytes - offset) : blockBytes;
+				unsigned char ignore[8] = { 0 };
+
+				if (phantomBytes)
+				{
+					for (j = 0; j < 8; j++)
+					{
+						if (((address + offset + j) % 4) == 3)
+						{
+							ignore[j] = 0xFF;
+						}
+					}
+				}
+				if (!BlockErased(data + offset, length, ignore))
+				{
+					occupancy[occupancyOffsets[i] + (b / 32)] |= (uint32_t)1 << (b % 32);
+				}
+			}
+		}
+	}
+
+	void DeviceImage::FillOccupancy(unsigned int blockBytes)
+	{
+		unsigned int i;
+		unsigned long b;
+
+		ResetOccupancy(blockBytes);
+		for (i = 0; i < regions.size(); i++)
+		{
+			for (b = 0; b < BlockCount(i); b++)
+			{
+				occupancy[occupancyOffsets[i] + (b / 32)] |= (uint32_t)1 << (b % 32);
+			}
+		}
+	}
+
+	unsigned long DeviceImage::NextBlockWithData(unsigned int region, unsigned long block) const
+	{
+		unsigned long blocks = BlockCount(region);
+
+		while (block < blocks)
+		{
+			uint32_t word = occupancy[occupancyOffsets[region] + (block / 32)] >> (block % 32);
+
+			if (word != 0)
+			{
+				//bits past the last block are never set
+				return block + LowestSetBit(word);
+			}
+			block = ((block / 32) + 1) * 32;
+		}
+		return blocks;
+	}
+
+	void DeviceImage::Release(void)
+	{
+		free(block);
+		block = 0;
+		arena = 0;
+		ResetOccupancy(0);
+		regions.clear();
+		offsets.clear();
+		bytesPerAddress = 0;
+	}
+
+}
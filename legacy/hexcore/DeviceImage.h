@@ -0,0 +1,149 @@
+/*********************************************************************
+ *
+ *                Device memory image
+ *
+ *********************************************************************
+ * FileName:        DeviceImage.h
+ *
+ * Host copy of the memory regions reported by QUERY_DEVICE.  All of the
+ * regions live in one arena allocated once, each one starting on a
+ * DEVICE_IMAGE_ALIGNMENT boundary; the offset of each region is kept in
+ * a table so that RegionData() is a single lookup.  Configuring the
+ * image again with the same geometry keeps the arena.
+ *
+ * BuildOccupancy() splits each region in blocks (the PROGRAM_DEVICE
+ * packets) and keeps one bit per block telling whether it holds anything
+ * other than erased flash; programming, verify and export walk the set
+ * bits instead of testing every byte.
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define DEVICE_IMAGE_ALIGNMENT		64
+
+namespace HexCore {
+
+	//A QUERY_DEVICE memory region; Address and Size in device addresses
+	struct DEVICE_REGION
+	{
+		unsigned char Type;
+		unsigned long Address;
+		unsigned long Size;
+	};
+
+	class DeviceImage
+	{
+	public:
+		DeviceImage();
+		~DeviceImage();
+
+		/****************************************************************************
+			Function:
+				Configure
+
+			Description:
+				Lays out count regions of bytesPerAddress bytes per address.  Each
+				region gets (Size + 1) * bytesPerAddress bytes, as Form1 always
+				allocated, so that a hex record ending on the last address still
+				fits.  The arena is kept when the geometry did not change,
+				otherwise it is replaced; the content is undefined in both
+				cases (see Erase).
+
+			Return Values:
+				true - the regions are available
+				false - the allocation failed; the image is left empty
+		***************************************************************************/
+		bool Configure(const DEVICE_REGION* regions, unsigned int count, unsigned int bytesPerAddress);
+
+		//Fills every region with erased flash (see FillErased); forgets the
+		//  occupancy map
+		void Erase(bool phantomBytes);
+
+		/****************************************************************************
+			Function:
+				BuildOccupancy
+
+			Description:
+				Splits the Size * bytesPerAddress bytes of each region in blocks of
+				blockBytes bytes (the last one may be shorter) and marks the blocks
+				holding at least one byte other than 0xFF.  With phantomBytes the
+				4th byte of each PIC24 instruction word is not looked at, as the
+				device ignores it.  The blocks are compared 8 bytes at a time
+				against a mask of the phantom bytes.
+
+				Call it again whenever the content of the regions changed.
+		***************************************************************************/
+		void BuildOccupancy(unsigned int blockBytes, bool phantomBytes);
+
+		//Marks every block as holding data, for images whose erased content
+		//  is not known (encrypted bootloader)
+		void FillOccupancy(unsigned int blockBytes);
+
+		//Block size of the occupancy map, 0 when there is none
+		unsigned int OccupancyBlockBytes(void) const
+		{
+			return occupancyBlockBytes;
+		}
+
+		//Number of blocks of a region in the occupancy map
+		unsigned long BlockCount(unsigned int region) const
+		{
+			return (unsigned long)((((size_t)regions[region].Size * bytesPerAddress) + occupancyBlockBytes - 1) / occupancyBlockBytes);
+		}
+
+		bool BlockHasData(unsigned int region, unsigned long block) const
+		{
+			return ((occupancy[occupancyOffsets[region] + (block / 32)] >> (block % 32)) & 1) != 0;
+		}
+
+		//First block at or after block that holds data, BlockCount(region)
+		//  when there is none
+		unsigned long NextBlockWithData(unsigned int region, unsigned long block) const;
+
+		//Frees the arena and forgets the regions
+		void Release(void);
+
+		unsigned int RegionCount(void) const
+		{
+			return (unsigned int)regions.size();
+		}
+
+		const DEVICE_REGION& Region(unsigned int region) const
+		{
+			return regions[region];
+		}
+
+		//First byte of a region, NULL for a region that does not exist
+		unsigned char* RegionData(unsigned int region) const
+		{
+			return (region < offsets.size()) ? (arena + offsets[region]) : 0;
+		}
+
+		//Bytes allocated to a region: (Size + 1) * bytesPerAddress
+		size_t RegionBytes(unsigned int region) const
+		{
+			return (size_t)(regions[region].Size + 1) * bytesPerAddress;
+		}
+
+	private:
+		DeviceImage(const DeviceImage&);
+		DeviceImage& operator=(const DeviceImage&);
+
+		bool SameGeometry(const DEVICE_REGION* regions, unsigned int count, unsigned int bytesPerAddress) const;
+		void ResetOccupancy(unsigned int blockBytes);
+
+		std::vector<DEVICE_REGION> regions;
+		std::vector<size_t> offsets;
+		std::vector<uint32_t> occupancy;
+		std::vector<size_t> occupancyOffsets;
+		unsigned int occupancyBlockBytes;
+		unsigned int bytesPerAddress;
+		unsigned char* block;
+		unsigned char* arena;
+	};
+
+}
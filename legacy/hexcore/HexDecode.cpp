@@ -0,0 +1,222 @@
+/*********************************************************************
+ *
+ *                Hex digit decoding kernels
+ *
+ *********************************************************************
+ * FileName:        HexDecode.cpp
+ *
+ * The vector kernels classify each character as digit or letter with
+ * range compares (case folded with | 0x20), map it to its nibble, merge
+ * nibble pairs inside 16-bit lanes and pack the lanes to bytes.  The
+ * byte sum comes from a SAD against zero.  Characters >= 0x80 compare
+ * as negative and are rejected like any other non hex digit.
+ ********************************************************************/
+
+#include "HexDecode.h"
+#include "HexTables.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define HEXCORE_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(HEXCORE_HAVE_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define HEXCORE_HAVE_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HEXCORE_TARGET_AVX2
+#else
+#define HEXCORE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace HexCore {
+
+	namespace {
+
+		bool DecodeScalar(const char* text, unsigned char* out, size_t count, unsigned int* sum)
+		{
+			return DecodeHexTable((const unsigned char*)text, out, count, sum);
+		}
+
+#if defined(HEXCORE_HAVE_SSE2)
+		//16 characters to 8 bytes.  Returns the byte sum in the low 32 bits
+		//  and sets *valid to false if any character is not a hex digit.
+		inline __m128i Decode16(__m128i v, bool* valid)
+		{
+			const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+			const __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+			const __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+			__m128i nib, hi, lo;
+
+			if (_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)) != 0xFFFF)
+			{
+				*valid = false;
+			}
+
+			nib = _mm_or_si128(
+				_mm_and_si128(isDigit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+				_mm_and_si128(isAlpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+
+			//each 16-bit lane holds (low nibble << 8) | high nibble
+			hi = _mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00FF)), 4);
+			lo = _mm_srli_epi16(nib, 8);
+			return _mm_packus_epi16(_mm_or_si128(hi, lo), _mm_setzero_si128());
+		}
+
+		bool DecodeSse2(const char* text, unsigned char* out, size_t count, unsigned int* sum)
+		{
+			bool valid = true;
+			size_t i = 0;
+			__m128i total = _mm_setzero_si128();
+
+			for (; (i + 8) <= count; i += 8)
+			{
+				__m128i bytes = Decode16(_mm_loadu_si128((const __m128i*)(text + (2 * i))), &valid);
+
+				_mm_storel_epi64((__m128i*)(out + i), bytes);
+				total = _mm_add_epi64(total, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+			}
+			*sum += (unsigned int)_mm_cvtsi128_si32(total);
+
+			return DecodeScalar(text + (2 * i), out + i, count - i, sum) && valid;
+		}
+#endif
+
+#if defined(HEXCORE_HAVE_AVX2)
+		HEXCORE_TARGET_AVX2 bool DecodeAvx2(const char* text, unsigned char* out, size_t count, unsigned int* sum)
+		{
+			const __m256i zero = _mm256_setzero_si256();
+			__m256i total = zero;
+			__m256i invalid = zero;
+			__m128i folded;
+			size_t i = 0;
+
+			for (; (i + 16) <= count; i += 16)
+			{
+				const __m256i v = _mm256_loadu_si256((const __m256i*)(text + (2 * i)));
+				const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+				const __m256i isDigit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+				const __m256i isAlpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+				__m256i nib, pairs, bytes;
+
+				invalid = _mm256_or_si256(invalid, _mm256_cmpeq_epi8(_mm256_or_si256(isDigit, isAlpha), zero));
+
+				nib = _mm256_or_si256(
+					_mm256_and_si256(isDigit, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+					_mm256_and_si256(isAlpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+				pairs = _mm256_or_si256(
+					_mm256_slli_epi16(_mm256_and_si256(nib, _mm256_set1_epi16(0x00FF)), 4),
+					_mm256_srli_epi16(nib, 8));
+
+				//packus works per 128-bit lane: gather qwords 0 and 2
+				bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, zero), 0xD8);
+				_mm_storeu_si128((__m128i*)(out + i), _mm256_castsi256_si128(bytes));
+				total = _mm256_add_epi64(total, _mm256_sad_epu8(bytes, zero));
+			}
+
+			folded = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+			folded = _mm_add_epi64(folded, _mm_unpackhi_epi64(folded, folded));
+			*sum += (unsigned int)_mm_cvtsi128_si32(folded);
+
+			if (!_mm256_testz_si256(invalid, invalid))
+			{
+				return false;
+			}
+
+			//finish with one SSE2 block and the scalar tail
+			return DecodeSse2(text + (2 * i), out + i, count - i, sum);
+		}
+#endif
+
+		bool CpuHasAvx2(void)
+		{
+#if defined(HEXCORE_HAVE_AVX2)
+#if defined(_MSC_VER)
+			int info[4];
+
+			__cpuid(info, 0);
+			if (info[0] < 7)
+			{
+				return false;
+			}
+			//OSXSAVE and AVX, then the OS must save the YMM state
+			__cpuid(info, 1);
+			if (((info[2] & (1 << 27)) == 0) || ((info[2] & (1 << 28)) == 0))
+			{
+				return false;
+			}
+			if ((_xgetbv(0) & 0x6) != 0x6)
+			{
+				return false;
+			}
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+#else
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") != 0;
+#endif
+#else
+			return false;
+#endif
+		}
+
+		typedef bool(*DECODE_KERNEL)(const char*, unsigned char*, size_t, unsigned int*);
+
+		unsigned int BestKernel(void)
+		{
+			if (CpuHasAvx2())
+			{
+				return HEX_KERNEL_AVX2;
+			}
+#if defined(HEXCORE_HAVE_SSE2)
+			return HEX_KERNEL_SSE2;
+#else
+			return HEX_KERNEL_SCALAR;
+#endif
+		}
+
+		DECODE_KERNEL KernelFunction(unsigned int kernel)
+		{
+			switch (kernel)
+			{
+#if defined(HEXCORE_HAVE_AVX2)
+			case HEX_KERNEL_AVX2:
+				return DecodeAvx2;
+#endif
+#if defined(HEXCORE_HAVE_SSE2)
+			case HEX_KERNEL_SSE2:
+				return DecodeSse2;
+#endif
+			default:
+				return DecodeScalar;
+			}
+		}
+
+		unsigned int currentKernel = BestKernel();
+		DECODE_KERNEL currentDecode = KernelFunction(currentKernel);
+	}
+
+	bool DecodeHex(const char* text, unsigned char* out, size_t count, unsigned int* sum)
+	{
+		return currentDecode(text, out, count, sum);
+	}
+
+	unsigned int GetHexKernel(void)
+	{
+		return currentKernel;
+	}
+
+	bool SetHexKernel(unsigned int kernel)
+	{
+		if ((kernel > BestKernel()) || (kernel > HEX_KERNEL_AVX2))
+		{
+			return false;
+		}
+		currentKernel = kernel;
+		currentDecode = KernelFunction(kernel);
+		return true;
+	}
+
+}
@@ -0,0 +1,59 @@
+/*********************************************************************
+ *
+ *                Hex digit decoding kernels
+ *
+ *********************************************************************
+ * FileName:        HexDecode.h
+ *
+ * Converts runs of ASCII hex digit pairs to bytes and adds the decoded
+ * bytes to a running sum, which is all an Intel HEX record checksum
+ * needs.  A scalar, an SSE2 and an AVX2 version are provided; the
+ * fastest one supported by the CPU is selected the first time the
+ * decoder is used.
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+//*********************** DECODE KERNELS ***********************************
+#define HEX_KERNEL_SCALAR	0x00
+#define HEX_KERNEL_SSE2		0x01
+#define HEX_KERNEL_AVX2		0x02
+
+namespace HexCore {
+
+	/****************************************************************************
+		Function:
+			DecodeHex
+
+		Description:
+			Decodes count bytes (2 * count characters) from text into out and
+			adds every decoded byte to *sum.
+
+		Parameters:
+			const char* text - the hex digits, upper or lower case
+			unsigned char* out - destination, count bytes
+			size_t count - number of bytes to decode
+			unsigned int* sum - running byte sum, updated on success
+
+		Return Values:
+			true - all of the characters were hex digits
+			false - at least one character was not a hex digit; out and *sum
+				are undefined
+	***************************************************************************/
+	bool DecodeHex(const char* text, unsigned char* out, size_t count, unsigned int* sum);
+
+	/****************************************************************************
+		Function:
+			GetHexKernel / SetHexKernel
+
+		Description:
+			Report or force the kernel used by DecodeHex (HEX_KERNEL_xxx).
+			SetHexKernel returns false, leaving the current kernel in place,
+			when the CPU or the build does not support the requested one.
+	***************************************************************************/
+	unsigned int GetHexKernel(void);
+	bool SetHexKernel(unsigned int kernel);
+
+}
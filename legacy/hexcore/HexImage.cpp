@@ -0,0 +1,111 @@
+/*********************************************************************
+ *
+ *                Memory image helpers
+ *
+ *********************************************************************
+ * FileName:        HexImage.cpp
+ ********************************************************************/
+
+#include "HexImage.h"
+
+#include <string.h>
+
+namespace HexCore {
+
+	namespace {
+
+		//Slicing-by-4 tables: Table[0] is the classic byte table, Table[k]
+		//  advances a byte through k more zero bytes
+		struct CrcTables
+		{
+			unsigned short Table[4][256];
+
+			CrcTables()
+			{
+				unsigned int i, k;
+
+				for (i = 0; i < 256; i++)
+				{
+					unsigned short crc = (unsigned short)(i << 8);
+
+					for (k = 0; k < 8; k++)
+					{
+						crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+					}
+					Table[0][i] = crc;
+				}
+				for (k = 1; k < 4; k++)
+				{
+					for (i = 0; i < 256; i++)
+					{
+						unsigned short prev = Table[k - 1][i];
+
+						Table[k][i] = (unsigned short)((prev << 8) ^ Table[0][prev >> 8]);
+					}
+				}
+			}
+		};
+
+		const CrcTables crcTables;
+	}
+
+	void FillErased(unsigned char* buffer, size_t length, unsigned long address, bool phantomBytes)
+	{
+		size_t i;
+
+		memset(buffer, 0xFF, length);
+		if (!phantomBytes)
+		{
+			return;
+		}
+
+		//first phantom byte at or after address
+		for (i = (3 - (address % 4)) % 4; i < length; i += 4)
+		{
+			buffer[i] = 0;
+		}
+	}
+
+	bool IsErased(const unsigned char* data, size_t length, unsigned long address, bool phantomBytes)
+	{
+		unsigned char diff = 0;
+		size_t i;
+
+		if (!phantomBytes)
+		{
+			for (i = 0; i < length; i++)
+			{
+				diff |= (unsigned char)~data[i];
+			}
+			return diff == 0;
+		}
+
+		for (i = 0; i < length; i++)
+		{
+			diff |= (unsigned char)(data[i] ^ ((((address + i) % 4) == 3) ? 0x00 : 0xFF));
+		}
+		return diff == 0;
+	}
+
+	unsigned short Crc16Ccitt(const unsigned char* data, size_t length, unsigned short crc)
+	{
+		const unsigned short(*t)[256] = crcTables.Table;
+
+		while (length >= 4)
+		{
+			crc = (unsigned short)(
+				t[3][(crc >> 8) ^ data[0]] ^
+				t[2][(crc & 0xFF) ^ data[1]] ^
+				t[1][data[2]] ^
+				t[0][data[3]]);
+			data += 4;
+			length -= 4;
+		}
+		while (length-- > 0)
+		{
+			crc = (unsigned short)((crc << 8) ^ t[0][(crc >> 8) ^ *data++]);
+		}
+		return crc;
+	}
+
+}
@@ -0,0 +1,55 @@
+/*********************************************************************
+ *
+ *                Memory image helpers
+ *
+ *********************************************************************
+ * FileName:        HexImage.h
+ *
+ * Erased memory fill and the CRC16 the Alfa bootloaders keep as the
+ * digest of the application (PROGRAM_COMPLETE / QUERY).
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+namespace HexCore {
+
+	/****************************************************************************
+		Function:
+			FillErased
+
+		Description:
+			Fills buffer with the content of erased flash: 0xFF, except for
+			the phantom byte (the 4th byte of each instruction word) of
+			PIC24 devices, which always reads as 0.
+
+		Parameters:
+			unsigned char* buffer - memory to fill
+			size_t length - number of bytes
+			unsigned long address - hex file byte address of buffer[0]
+			bool phantomBytes - true for PIC24 (bytesPerAddress == 2)
+	***************************************************************************/
+	void FillErased(unsigned char* buffer, size_t length, unsigned long address, bool phantomBytes);
+
+	/****************************************************************************
+		Function:
+			IsErased
+
+		Description:
+			Tells whether length bytes at hex file byte address hold exactly
+			what FillErased would write there.
+	***************************************************************************/
+	bool IsErased(const unsigned char* data, size_t length, unsigned long address, bool phantomBytes);
+
+	/****************************************************************************
+		Function:
+			Crc16Ccitt
+
+		Description:
+			CRC16-CCITT (polynomial 0x1021, no reflection, no final xor) of
+			length bytes, continuing from crc (0 for a new calculation).
+	***************************************************************************/
+	unsigned short Crc16Ccitt(const unsigned char* data, size_t length, unsigned short crc);
+
+}
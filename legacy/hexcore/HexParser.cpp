@@ -0,0 +1,522 @@
+/*********************************************************************
+ *
+ *                Intel HEX parser for the USB HID bootloader
+ *
+ *********************************************************************
+ * FileName:        HexParser.cpp
+ ********************************************************************/
+
+#include "HexParser.h"
+#include "HexDecode.h"
+
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace HexCore {
+
+	namespace {
+
+		//bytes written at address 0 when the reset vector is relocated
+		const unsigned char pic24ResetGoto[6] = { 0x00, 0x04, 0x04, 0x00, 0x00, 0x00 };
+
+		inline bool IsBlank(char c)
+		{
+			return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+		}
+
+		int FindRegion(const HEX_REGION* regions, unsigned int regionCount, unsigned long address, int hint)
+		{
+			unsigned int i;
+
+			if ((hint >= 0) && (address >= regions[hint].Address) && (address < (regions[hint].Address + regions[hint].Size)))
+			{
+				return hint;
+			}
+
+			for (i = 0; i < regionCount; i++)
+			{
+				if ((address >= regions[i].Address) && (address < (regions[i].Address + regions[i].Size)))
+				{
+					return (int)i;
+				}
+			}
+			return -1;
+		}
+
+		//Per-byte store used only for records touching the PIC24 reset
+		//  vector or its relocated copy
+		void StorePic24(HEX_REGION* regions, unsigned int regionCount, int region,
+			unsigned long address, const unsigned char* data, unsigned int count)
+		{
+			unsigned int j, k;
+
+			for (j = 0; j < count; j++)
+			{
+				unsigned long a = address + j;
+				unsigned long offset = a - regions[region].Address;
+
+				if (offset >= regions[region].Size)
+				{
+					break;
+				}
+
+				if (a < sizeof(pic24ResetGoto))
+				{
+					regions[region].Data[offset] = pic24ResetGoto[a];
+
+					for (k = 0; k < regionCount; k++)
+					{
+						if ((regions[k].Address == (PIC24_RESET_REMAP_OFFSET * 2)) && (a < regions[k].Size))
+						{
+							regions[k].Data[a] = data[j];
+						}
+					}
+				}
+				else if ((a >= (PIC24_RESET_REMAP_OFFSET * 2)) && (a < ((PIC24_RESET_REMAP_OFFSET * 2) + sizeof(pic24ResetGoto))))
+				{
+					//the user reset vector lives here, it is filled from address 0
+				}
+				else
+				{
+					regions[region].Data[offset] = data[j];
+				}
+			}
+		}
+
+		//Hex file byte range written by consecutive data records
+		typedef struct _WRITE_RUN
+		{
+			unsigned long Start;
+			unsigned long End;
+		} WRITE_RUN;
+
+		//Parse the records in [p, end) starting from the given extended
+		//  address and line number.  When writes is not NULL the address
+		//  ranges stored in the regions are appended to it; callback, if
+		//  any, gets every data record (use it with no regions, so that the
+		//  data is decoded in the scratch buffer).
+		HEX_PARSE_RESULT ParseRange(const char* p, const char* end,
+			HEX_REGION* regions, unsigned int regionCount, unsigned int options,
+			unsigned long extendedAddress, unsigned long line, std::vector<WRITE_RUN>* writes,
+			HEX_DATA_CALLBACK callback = NULL, void* context = NULL)
+		{
+			HEX_PARSE_RESULT result = { HEX_PARSE_SUCCESS, 0, 0 };
+			int lastRegion = -1;
+
+			while (p < end)
+			{
+				unsigned char header[4];
+				unsigned char scratch[256];
+				unsigned char checksum;
+				unsigned int sum;
+				unsigned int recordLength;
+				unsigned int recordType;
+				unsigned long totalAddress;
+				unsigned char* dest;
+				int region;
+
+				//skip blank lines and leading white space
+				while ((p < end) && IsBlank(*p))
+				{
+					if (*p == '\n')
+					{
+						line++;
+					}
+					p++;
+				}
+				if (p >= end)
+				{
+					break;
+				}
+
+				if (*p != ':')
+				{
+					result.Status = HEX_PARSE_NO_COLON;
+					result.Line = line;
+					return result;
+				}
+				p++;
+
+				//record length, address and type
+				if ((end - p) < 10)
+				{
+					result.Status = HEX_PARSE_TRUNCATED_RECORD;
+					result.Line = line;
+					return result;
+				}
+
+				sum = 0;
+				if (!DecodeHex(p, header, 4, &sum))
+				{
+					result.Status = HEX_PARSE_BAD_CHARACTER;
+					result.Line = line;
+					return result;
+				}
+				p += 8;
+
+				recordLength = header[0];
+				recordType = header[3];
+
+				if ((unsigned long)(end - p) < ((recordLength + 1) * 2UL))
+				{
+					result.Status = HEX_PARSE_TRUNCATED_RECORD;
+					result.Line = line;
+					return result;
+				}
+
+				totalAddress = (extendedAddress << 16) + ((unsigned long)header[1] << 8) + header[2];
+
+				//Data records are decoded straight into the region buffer when
+				//  the whole record fits and no reset vector fixup applies;
+				//  everything else goes through the scratch buffer.
+				dest = scratch;
+				region = -1;
+				if (recordType == HEX_FILE_DATA)
+				{
+					region = FindRegion(regions, regionCount, totalAddress, lastRegion);
+					if (region >= 0)
+					{
+						unsigned long offset = totalAddress - regions[region].Address;
+						bool remap = ((options & HEX_PARSE_PIC24_RESET_REMAP) != 0) &&
+							((totalAddress < sizeof(pic24ResetGoto)) ||
+							(((totalAddress + recordLength) > (PIC24_RESET_REMAP_OFFSET * 2)) &&
+							(totalAddress < ((PIC24_RESET_REMAP_OFFSET * 2) + sizeof(pic24ResetGoto)))));
+
+						lastRegion = region;
+						if (!remap && ((offset + recordLength) <= regions[region].Size))
+						{
+							dest = regions[region].Data + offset;
+						}
+					}
+				}
+
+				if (!DecodeHex(p, dest, recordLength, &sum) || !DecodeHex(p + (recordLength * 2), &checksum, 1, &sum))
+				{
+					result.Status = HEX_PARSE_BAD_CHARACTER;
+					result.Line = line;
+					return result;
+				}
+				p += (recordLength + 1) * 2;
+
+				//the sum of all of the bytes, checksum included, must be 0
+				if ((sum & 0xFF) != 0)
+				{
+					result.Status = HEX_PARSE_CHECKSUM_ERROR;
+					result.Line = line;
+					return result;
+				}
+				result.Records++;
+
+				switch (recordType)
+				{
+				case HEX_FILE_EXTENDED_LINEAR_ADDRESS:
+				{
+					unsigned int i;
+
+					extendedAddress = 0;
+					for (i = 0; i < recordLength; i++)
+					{
+						extendedAddress = (extendedAddress << 8) | scratch[i];
+					}
+					break;
+				}
+				case HEX_FILE_EOF:
+					return result;
+				case HEX_FILE_DATA:
+					if (callback != NULL)
+					{
+						callback(context, totalAddress, scratch, recordLength);
+					}
+					if ((region >= 0) && (writes != NULL))
+					{
+						if (!writes->empty() && (writes->back().End == totalAddress))
+						{
+							writes->back().End = totalAddress + recordLength;
+						}
+						else
+						{
+							WRITE_RUN run = { totalAddress, totalAddress + recordLength };
+							writes->push_back(run);
+						}
+					}
+					if ((region >= 0) && (dest == scratch))
+					{
+						if ((options & HEX_PARSE_PIC24_RESET_REMAP) != 0)
+						{
+							StorePic24(regions, regionCount, region, totalAddress, scratch, recordLength);
+						}
+						else
+						{
+							//record crosses the end of the region: keep what fits
+							unsigned long offset = totalAddress - regions[region].Address;
+							memcpy(regions[region].Data + offset, scratch, regions[region].Size - offset);
+						}
+					}
+					break;
+				default:
+					break;
+				}
+
+				//ignore anything else up to the end of the line
+				while ((p < end) && (*p != '\n'))
+				{
+					p++;
+				}
+			}
+
+			return result;
+		}
+
+
+		//What a chunk contributes to the state of the chunks after it
+		typedef struct _CHUNK_SCAN
+		{
+			unsigned long Lines;			//'\n' found before End
+			bool HasExtendedAddress;		//a type 04 record was found
+			unsigned long ExtendedAddress;	//value of the last one
+			const char* End;				//end of the chunk, or of the EOF record line
+			bool Eof;						//the chunk holds the EOF record
+		} CHUNK_SCAN;
+
+		//Light first pass: only the record headers are looked at.  Malformed
+		//  records are left to ParseRange, which reports them.
+		void ScanChunk(const char* p, const char* end, CHUNK_SCAN* scan)
+		{
+			scan->Lines = 0;
+			scan->HasExtendedAddress = false;
+			scan->ExtendedAddress = 0;
+			scan->End = end;
+			scan->Eof = false;
+
+			while (p < end)
+			{
+				const char* eol = (const char*)memchr(p, '\n', end - p);
+				const char* next = (eol != NULL) ? (eol + 1) : end;
+				unsigned char header[4];
+				unsigned int sum = 0;
+
+				while ((p < next) && IsBlank(*p))
+				{
+					p++;
+				}
+
+				if ((p < next) && (*p == ':') && ((next - p) >= 11) && DecodeHex(p + 1, header, 4, &sum))
+				{
+					if ((header[3] == HEX_FILE_EXTENDED_LINEAR_ADDRESS) && ((unsigned long)(next - p) >= (9 + (header[0] * 2UL))))
+					{
+						unsigned char payload[256];
+						unsigned int i;
+
+						if (DecodeHex(p + 9, payload, header[0], &sum))
+						{
+							scan->HasExtendedAddress = true;
+							scan->ExtendedAddress = 0;
+							for (i = 0; i < header[0]; i++)
+							{
+								scan->ExtendedAddress = (scan->ExtendedAddress << 8) | payload[i];
+							}
+						}
+					}
+					else if (header[3] == HEX_FILE_EOF)
+					{
+						scan->End = next;
+						scan->Eof = true;
+						return;
+					}
+				}
+
+				if (eol != NULL)
+				{
+					scan->Lines++;
+				}
+				p = next;
+			}
+		}
+
+		//true if a byte is written by two different chunks, in which case
+		//  the order between them matters
+		bool ChunksOverlap(const std::vector<std::vector<WRITE_RUN> >& writes)
+		{
+			struct TaggedRun
+			{
+				WRITE_RUN Run;
+				size_t Chunk;
+
+				bool operator<(const TaggedRun& other) const
+				{
+					return Run.Start < other.Run.Start;
+				}
+			};
+			std::vector<TaggedRun> runs;
+			size_t i, j;
+			unsigned long bestEnd = 0, otherEnd = 0;
+			size_t bestChunk = (size_t)-1;
+
+			for (i = 0; i < writes.size(); i++)
+			{
+				for (j = 0; j < writes[i].size(); j++)
+				{
+					TaggedRun t = { writes[i][j], i };
+					runs.push_back(t);
+				}
+			}
+			std::sort(runs.begin(), runs.end());
+
+			//bestEnd is the furthest end seen so far, otherEnd the furthest
+			//  end seen in any chunk other than bestChunk
+			for (i = 0; i < runs.size(); i++)
+			{
+				const TaggedRun& t = runs[i];
+				unsigned long limit = (t.Chunk == bestChunk) ? otherEnd : bestEnd;
+
+				if (t.Run.Start < limit)
+				{
+					return true;
+				}
+
+				if (t.Run.End > bestEnd)
+				{
+					if (t.Chunk != bestChunk)
+					{
+						otherEnd = bestEnd;
+						bestChunk = t.Chunk;
+					}
+					bestEnd = t.Run.End;
+				}
+				else if ((t.Chunk != bestChunk) && (t.Run.End > otherEnd))
+				{
+					otherEnd = t.Run.End;
+				}
+			}
+			return false;
+		}
+	}
+
+	HEX_PARSE_RESULT ParseHex(const char* buffer, size_t length,
+		HEX_REGION* regions, unsigned int regionCount, unsigned int options)
+	{
+		return ParseRange(buffer, buffer + length, regions, regionCount, options, 0, 1, NULL);
+	}
+
+	HEX_PARSE_RESULT ParseHexRecords(const char* buffer, size_t length,
+		HEX_DATA_CALLBACK callback, void* context)
+	{
+		return ParseRange(buffer, buffer + length, NULL, 0, 0, 0, 1, NULL, callback, context);
+	}
+
+	HEX_PARSE_RESULT ParseHexParallel(const char* buffer, size_t length,
+		HEX_REGION* regions, unsigned int regionCount, unsigned int options, unsigned int threadCount)
+	{
+		HEX_PARSE_RESULT result = { HEX_PARSE_SUCCESS, 0, 0 };
+		std::vector<const char*> starts;
+		std::vector<CHUNK_SCAN> scans;
+		std::vector<unsigned long> extendedAddresses, lines;
+		std::vector<HEX_PARSE_RESULT> results;
+		std::vector<std::vector<WRITE_RUN> > writes;
+		std::vector<std::thread> workers;
+		const char* end = buffer + length;
+		size_t chunks, i;
+
+		if (threadCount == 0)
+		{
+			threadCount = std::thread::hardware_concurrency();
+		}
+		chunks = std::min((size_t)threadCount, length / HEX_PARSE_MIN_CHUNK);
+		if (chunks <= 1)
+		{
+			return ParseHex(buffer, length, regions, regionCount, options);
+		}
+
+		//split on line boundaries
+		starts.push_back(buffer);
+		for (i = 1; i < chunks; i++)
+		{
+			const char* p = buffer + ((length / chunks) * i);
+			const char* eol;
+
+			if (p < starts.back())
+			{
+				p = starts.back();
+			}
+			eol = (const char*)memchr(p, '\n', end - p);
+			if (eol == NULL)
+			{
+				break;
+			}
+			starts.push_back(eol + 1);
+		}
+		chunks = starts.size();
+		starts.push_back(end);
+
+		//first pass: lines, last extended address and EOF of each chunk
+		scans.resize(chunks);
+		for (i = 0; i < chunks; i++)
+		{
+			workers.push_back(std::thread(ScanChunk, starts[i], starts[i + 1], &scans[i]));
+		}
+		for (i = 0; i < chunks; i++)
+		{
+			workers[i].join();
+		}
+		workers.clear();
+
+		//prefix scan of the context each chunk starts with; nothing after
+		//  the EOF record is parsed
+		extendedAddresses.resize(chunks);
+		lines.resize(chunks);
+		extendedAddresses[0] = 0;
+		lines[0] = 1;
+		for (i = 0; i < chunks; i++)
+		{
+			if (scans[i].Eof)
+			{
+				chunks = i + 1;
+				break;
+			}
+			if ((i + 1) < chunks)
+			{
+				extendedAddresses[i + 1] = scans[i].HasExtendedAddress ? scans[i].ExtendedAddress : extendedAddresses[i];
+				lines[i + 1] = lines[i] + scans[i].Lines;
+			}
+		}
+
+		//second pass: every chunk decodes straight into the regions
+		results.resize(chunks);
+		writes.resize(chunks);
+		for (i = 0; i < chunks; i++)
+		{
+			workers.push_back(std::thread([&, i]()
+			{
+				results[i] = ParseRange(starts[i], scans[i].End, regions, regionCount, options,
+					extendedAddresses[i], lines[i], &writes[i]);
+			}));
+		}
+		for (i = 0; i < chunks; i++)
+		{
+			workers[i].join();
+		}
+
+		for (i = 0; i < chunks; i++)
+		{
+			if (results[i].Status != HEX_PARSE_SUCCESS)
+			{
+				results[i].Records += result.Records;
+				return results[i];
+			}
+			result.Records += results[i].Records;
+		}
+
+		//Records written by different chunks to the same address must end
+		//  up in file order: replaying the whole file sequentially rewrites
+		//  every one of those bytes with the value the last record gives it
+		if (ChunksOverlap(writes))
+		{
+			return ParseHex(buffer, length, regions, regionCount, options);
+		}
+
+		return result;
+	}
+
+}
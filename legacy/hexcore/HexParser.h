@@ -0,0 +1,135 @@
+/*********************************************************************
+ *
+ *                Intel HEX parser for the USB HID bootloader
+ *
+ *********************************************************************
+ * FileName:        HexParser.h
+ *
+ * Portable (no CLR, no Win32) decoder used by Form1 to load hex files
+ * straight into the memory region buffers reported by the QUERY
+ * command.  The whole file is decoded from a single buffer in one pass:
+ * nibbles go through a lookup table and the record checksum is
+ * accumulated while the data bytes are stored.
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+//*********************** HEX RECORD TYPES *********************************
+#define HEX_FILE_EXTENDED_LINEAR_ADDRESS 0x04
+#define HEX_FILE_EOF 0x01
+#define HEX_FILE_DATA 0x00
+
+//*********************** PARSE RESULTS ************************************
+#define HEX_PARSE_SUCCESS			0x00
+#define HEX_PARSE_NO_COLON			0x01
+#define HEX_PARSE_BAD_CHARACTER		0x02
+#define HEX_PARSE_TRUNCATED_RECORD	0x03
+#define HEX_PARSE_CHECKSUM_ERROR	0x04
+
+//*********************** PARSE OPTIONS ************************************
+//Relocate the user reset vector (bytes 0..5) to the region starting at
+//  PIC24_RESET_REMAP_OFFSET, as done for bootloaders with bytesPerAddress == 2
+#define HEX_PARSE_PIC24_RESET_REMAP	0x01
+
+//Files smaller than this per thread are not worth splitting
+#define HEX_PARSE_MIN_CHUNK	(64 * 1024)
+
+#ifndef PIC24_RESET_REMAP_OFFSET
+#define PIC24_RESET_REMAP_OFFSET 0x1400
+#endif
+
+namespace HexCore {
+
+	//Destination of the decoded data.  Address and Size are expressed in
+	//  hex file bytes (i.e. device address * bytesPerAddress).
+	typedef struct _HEX_REGION
+	{
+		unsigned long Address;
+		unsigned long Size;
+		unsigned char* Data;
+	} HEX_REGION;
+
+	typedef struct _HEX_PARSE_RESULT
+	{
+		unsigned char Status;		//one of HEX_PARSE_xxx
+		unsigned long Line;			//1-based line of the failing record
+		unsigned long Records;		//number of records decoded
+	} HEX_PARSE_RESULT;
+
+	//Receives the data records in file order.  address is the full hex file
+	//  byte address; data is only valid during the call.
+	typedef void(*HEX_DATA_CALLBACK)(void* context, unsigned long address, const unsigned char* data, unsigned int length);
+
+	/****************************************************************************
+		Function:
+			ParseHex
+
+		Description:
+			Decodes an Intel HEX image held in memory and scatters every data
+			record into the region that contains its address.  Data falling
+			outside all of the regions is dropped, as the per-line loader in
+			Form1 always did.
+
+		Parameters:
+			const char* buffer - the content of the hex file (no terminator needed)
+			size_t length - number of bytes in buffer
+			HEX_REGION* regions - destination regions, in QUERY order
+			unsigned int regionCount - number of entries in regions
+			unsigned int options - HEX_PARSE_xxx option flags
+
+		Return Values:
+			HEX_PARSE_RESULT - Status is HEX_PARSE_SUCCESS or the first error
+			found; Line points to the record that caused it.
+	***************************************************************************/
+	HEX_PARSE_RESULT ParseHex(const char* buffer, size_t length,
+		HEX_REGION* regions, unsigned int regionCount, unsigned int options);
+
+	/****************************************************************************
+		Function:
+			ParseHexParallel
+
+		Description:
+			Same as ParseHex, with the file split in up to threadCount chunks
+			on line boundaries.  A first pass finds the last extended linear
+			address record, the line count and the EOF record of each chunk;
+			a prefix scan of those gives every chunk the context it starts
+			with, then the chunks are decoded in parallel.  The regions end
+			up byte for byte as ParseHex leaves them: when two chunks write
+			the same address the file is replayed sequentially.
+
+		Parameters:
+			as ParseHex, plus
+			unsigned int threadCount - maximum number of threads, 0 for one
+				per hardware thread
+
+		Return Values:
+			HEX_PARSE_RESULT - as ParseHex.  On error the content of the
+			regions is unspecified, as it is with ParseHex.
+	***************************************************************************/
+	HEX_PARSE_RESULT ParseHexParallel(const char* buffer, size_t length,
+		HEX_REGION* regions, unsigned int regionCount, unsigned int options, unsigned int threadCount);
+
+	/****************************************************************************
+		Function:
+			ParseHexRecords
+
+		Description:
+			Decodes an Intel HEX image and hands every data record to callback
+			instead of storing it in memory regions; used when the memory
+			layout is not known in advance.
+
+		Parameters:
+			const char* buffer - the content of the hex file
+			size_t length - number of bytes in buffer
+			HEX_DATA_CALLBACK callback - called for each data record
+			void* context - passed back to callback
+
+		Return Values:
+			HEX_PARSE_RESULT - as ParseHex
+	***************************************************************************/
+	HEX_PARSE_RESULT ParseHexRecords(const char* buffer, size_t length,
+		HEX_DATA_CALLBACK callback, void* context);
+
+}
@@ -0,0 +1,224 @@
+/*********************************************************************
+ *
+ *                Hex digit encode and decode tables
+ *
+ *********************************************************************
+ * FileName:        HexTables.h
+ *
+ * Header only.  The tables are built at compile time: encoding is one
+ * 16-bit table read per byte, decoding one table read per character
+ * with the validity of the whole run checked once at the end, so none
+ * of the bulk functions branch on the data.  Used by the hex file
+ * import and export, by the packet and memory dumps of the GUI and by
+ * the Python extension.
+ *
+ * The Char template parameter lets the same code fill char buffers
+ * (files, Python) and wchar_t buffers (System::String).
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+namespace HexCore {
+
+	//"00".."FF", upper case, two characters per byte value
+	struct HEX_ENCODE_TABLE
+	{
+		char Digits[256][2];
+
+		constexpr HEX_ENCODE_TABLE() : Digits()
+		{
+			const char digits[] = "0123456789ABCDEF";
+
+			for (unsigned int i = 0; i < 256; i++)
+			{
+				Digits[i][0] = digits[i >> 4];
+				Digits[i][1] = digits[i & 0x0F];
+			}
+		}
+	};
+
+	//nibble value of every 7-bit character; 0xF0 marks non hex digits
+	struct HEX_DECODE_TABLE
+	{
+		unsigned char Value[128];
+
+		constexpr HEX_DECODE_TABLE() : Value()
+		{
+			//constexpr constructors need initialized locals
+			for (unsigned int c = 0; c < 128; c++)
+			{
+				Value[c] = 0xF0;
+			}
+			for (unsigned int c = '0'; c <= '9'; c++)
+			{
+				Value[c] = (unsigned char)(c - '0');
+			}
+			for (unsigned int c = 'A'; c <= 'F'; c++)
+			{
+				Value[c] = (unsigned char)(10 + c - 'A');
+				Value[c + ('a' - 'A')] = (unsigned char)(10 + c - 'A');
+			}
+		}
+	};
+
+	constexpr HEX_ENCODE_TABLE hexEncodeTable;
+	constexpr HEX_DECODE_TABLE hexDecodeTable;
+
+	/****************************************************************************
+		Function:
+			EncodeHex
+
+		Description:
+			Writes 2 * count upper case hex digits of data to out.
+
+		Return Values:
+			Char* - the position just after the last digit written
+	***************************************************************************/
+	template <typename Char>
+	inline Char* EncodeHex(const unsigned char* data, size_t count, Char* out)
+	{
+		size_t i;
+
+		for (i = 0; i < count; i++)
+		{
+			const char* pair = hexEncodeTable.Digits[data[i]];
+
+			out[0] = (Char)pair[0];
+			out[1] = (Char)pair[1];
+			out += 2;
+		}
+		return out;
+	}
+
+	/****************************************************************************
+		Function:
+			EncodeHexSeparated
+
+		Description:
+			Writes the bytes of data as hex pairs, each one preceded by
+			separator ("AA BB CC" dumps with separator ' ').  3 * count
+			characters are written.
+
+		Return Values:
+			Char* - the position just after the last digit written
+	***************************************************************************/
+	template <typename Char>
+	inline Char* EncodeHexSeparated(const unsigned char* data, size_t count, Char separator, Char* out)
+	{
+		size_t i;
+
+		for (i = 0; i < count; i++)
+		{
+			const char* pair = hexEncodeTable.Digits[data[i]];
+
+			out[0] = separator;
+			out[1] = (Char)pair[0];
+			out[2] = (Char)pair[1];
+			out += 3;
+		}
+		return out;
+	}
+
+	/****************************************************************************
+		Function:
+			EncodeHexNumber
+
+		Description:
+			Writes the low bytes (1..4) of value as 2 * bytes hex digits, most
+			significant first, like the address fields of a hex record.
+
+		Return Values:
+			Char* - the position just after the last digit written
+	***************************************************************************/
+	template <typename Char>
+	inline Char* EncodeHexNumber(unsigned long value, unsigned int bytes, Char* out)
+	{
+		while (bytes > 0)
+		{
+			const char* pair;
+
+			bytes--;
+			pair = hexEncodeTable.Digits[(value >> (8 * bytes)) & 0xFF];
+			out[0] = (Char)pair[0];
+			out[1] = (Char)pair[1];
+			out += 2;
+		}
+		return out;
+	}
+
+	/****************************************************************************
+		Function:
+			DecodeHexTable
+
+		Description:
+			Table based equivalent of DecodeHex (HexDecode.h): decodes count
+			bytes from 2 * count upper or lower case hex digits and adds them
+			to *sum.  DecodeHex uses it for short runs and as the scalar
+			kernel.
+
+		Return Values:
+			true - all of the characters were hex digits
+			false - at least one character was not a hex digit; out and *sum
+				are undefined
+	***************************************************************************/
+	template <typename Char>
+	inline bool DecodeHexTable(const Char* text, unsigned char* out, size_t count, unsigned int* sum)
+	{
+		unsigned int s = *sum;
+		unsigned int bad = 0;
+		unsigned int wide = 0;
+		size_t i;
+
+		for (i = 0; i < count; i++)
+		{
+			unsigned int c0 = (unsigned int)text[2 * i];
+			unsigned int c1 = (unsigned int)text[2 * i + 1];
+			unsigned int hi = hexDecodeTable.Value[c0 & 0x7F];
+			unsigned int lo = hexDecodeTable.Value[c1 & 0x7F];
+			unsigned char b = (unsigned char)((hi << 4) | (lo & 0x0F));
+
+			bad |= hi | lo;
+			//characters outside 7-bit ASCII are folded into the table range
+			//  and rejected here
+			wide |= c0 | c1;
+			out[i] = b;
+			s += b;
+		}
+		*sum = s;
+		return ((bad & 0xF0) | (wide & ~0x7Fu)) == 0;
+	}
+
+	/****************************************************************************
+		Function:
+			DecodeHexNumber
+
+		Description:
+			Value of up to 8 hex digits (no prefix, no sign).
+
+		Return Values:
+			true - all of the characters were hex digits
+			false - at least one character was not a hex digit or length
+				is above 8; *value is undefined
+	***************************************************************************/
+	template <typename Char>
+	inline bool DecodeHexNumber(const Char* text, size_t length, unsigned long* value)
+	{
+		unsigned long v = 0;
+		unsigned int bad = (length > 8) ? 0x100 : 0;
+		size_t i;
+
+		for (i = 0; (i < length) && (i < 8); i++)
+		{
+			unsigned int c = (unsigned int)text[i];
+			unsigned int n = hexDecodeTable.Value[c & 0x7F];
+
+			bad |= n | (c & ~0x7Fu);
+			v = (v << 4) | (n & 0x0F);
+		}
+		*value = v;
+		return (bad & ~0x0Fu) == 0;
+	}
+
+}
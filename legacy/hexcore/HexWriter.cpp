@@ -0,0 +1,133 @@
+/*********************************************************************
+ *
+ *                Intel HEX writer for the USB HID bootloader
+ *
+ *********************************************************************
+ * FileName:        HexWriter.cpp
+ ********************************************************************/
+
+#include "HexWriter.h"
+#include "HexImage.h"
+#include "HexTables.h"
+
+#include <stdio.h>
+
+namespace HexCore {
+
+	namespace {
+
+		//longest record: ':' + (5 + 255) bytes as digits + "\r\n"
+		const size_t maxRecordText = 1 + ((5 + HEX_WRITER_MAX_RECORD_LENGTH) * 2) + 2;
+	}
+
+	HexWriter::HexWriter(HEX_WRITE_CALLBACK sink, void* context, unsigned int recordLength, unsigned int options)
+		: sink(sink), context(context), recordLength(recordLength), options(options),
+		extendedAddress(0), extendedAddressValid(false), failed(false), used(0)
+	{
+		if ((this->recordLength == 0) || (this->recordLength > HEX_WRITER_MAX_RECORD_LENGTH))
+		{
+			this->recordLength = 16;
+		}
+	}
+
+	void HexWriter::Record(unsigned char type, unsigned int address, const unsigned char* data, unsigned int length)
+	{
+		unsigned char header[4];
+		unsigned int sum = 0;
+		unsigned int i;
+		char* p;
+
+		if ((used + maxRecordText) > sizeof(buffer))
+		{
+			Flush();
+		}
+		p = buffer + used;
+
+		header[0] = (unsigned char)length;
+		header[1] = (unsigned char)(address >> 8);
+		header[2] = (unsigned char)address;
+		header[3] = type;
+
+		*p++ = ':';
+		p = EncodeHex(header, 4, p);
+		sum = header[0] + header[1] + header[2] + header[3];
+		//digits and checksum in the same pass
+		for (i = 0; i < length; i++)
+		{
+			const char* pair = hexEncodeTable.Digits[data[i]];
+
+			p[0] = pair[0];
+			p[1] = pair[1];
+			p += 2;
+			sum += data[i];
+		}
+		p = EncodeHexNumber((~sum + 1) & 0xFF, 1, p);
+		*p++ = '\r';
+		*p++ = '\n';
+
+		used = p - buffer;
+	}
+
+	bool HexWriter::Write(unsigned long address, const unsigned char* data, size_t length)
+	{
+		while ((length > 0) && !failed)
+		{
+			unsigned int count = recordLength;
+
+			//records never cross a 64KB boundary
+			if (count > length)
+			{
+				count = (unsigned int)length;
+			}
+			if (((address & 0xFFFF) + count) > 0x10000)
+			{
+				count = (unsigned int)(0x10000 - (address & 0xFFFF));
+			}
+
+			//extended address records are only written before data records,
+			//  so a skipped page gets none
+			if (((options & HEX_WRITE_SKIP_ERASED) == 0) ||
+				!IsErased(data, count, address, (options & HEX_WRITE_PIC24_PHANTOM) != 0))
+			{
+				if (!extendedAddressValid || (extendedAddress != (address >> 16)))
+				{
+					unsigned char page[2];
+
+					extendedAddress = address >> 16;
+					extendedAddressValid = true;
+					page[0] = (unsigned char)(extendedAddress >> 8);
+					page[1] = (unsigned char)extendedAddress;
+					Record(0x04, 0, page, 2);
+				}
+
+				Record(0x00, (unsigned int)(address & 0xFFFF), data, count);
+			}
+			address += count;
+			data += count;
+			length -= count;
+		}
+		return !failed;
+	}
+
+	bool HexWriter::Flush(void)
+	{
+		if ((used > 0) && !failed)
+		{
+			failed = !sink(context, buffer, used);
+		}
+		used = 0;
+		return !failed;
+	}
+
+	bool HexWriter::End(void)
+	{
+		Record(0x01, 0, 0, 0);
+		return Flush();
+	}
+
+	bool HexFileSink(void* context, const char* text, size_t length)
+	{
+		return fwrite(text, 1, length, (FILE*)context) == length;
+	}
+
+}
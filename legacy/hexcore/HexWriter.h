@@ -0,0 +1,72 @@
+/*********************************************************************
+ *
+ *                Intel HEX writer for the USB HID bootloader
+ *
+ *********************************************************************
+ * FileName:        HexWriter.h
+ *
+ * Encodes memory to Intel HEX records into a fixed output buffer that
+ * is handed to a sink callback whenever it fills up.  Extended linear
+ * address records are emitted when a record crosses into a new 64KB
+ * page; the record checksum is computed while the digits are written.
+ * Records holding only erased memory can be left out, which shrinks
+ * full device read-backs a lot and makes them faster to load again.
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+#define HEX_WRITER_BUFFER_SIZE		(64 * 1024)
+#define HEX_WRITER_MAX_RECORD_LENGTH	255
+
+//*********************** WRITER OPTIONS ***********************************
+#define HEX_WRITE_SKIP_ERASED		0x01	//leave out records of erased memory
+#define HEX_WRITE_PIC24_PHANTOM		0x02	//erased memory has PIC24 phantom bytes (0x00)
+
+namespace HexCore {
+
+	//Receives the encoded text; returns false to abort the export
+	typedef bool(*HEX_WRITE_CALLBACK)(void* context, const char* text, size_t length);
+
+	class HexWriter
+	{
+	public:
+		/****************************************************************************
+			Function:
+				HexWriter
+
+			Parameters:
+				HEX_WRITE_CALLBACK sink - where the text goes
+				void* context - passed back to sink
+				unsigned int recordLength - data bytes per record (1..255)
+				unsigned int options - HEX_WRITE_xxx flags
+		***************************************************************************/
+		HexWriter(HEX_WRITE_CALLBACK sink, void* context, unsigned int recordLength, unsigned int options = 0);
+
+		//Encode length bytes that belong at hex file byte address
+		bool Write(unsigned long address, const unsigned char* data, size_t length);
+
+		//Append the EOF record and flush the buffer
+		bool End(void);
+
+		bool Flush(void);
+
+	private:
+		void Record(unsigned char type, unsigned int address, const unsigned char* data, unsigned int length);
+
+		HEX_WRITE_CALLBACK sink;
+		void* context;
+		unsigned int recordLength;
+		unsigned int options;
+		unsigned long extendedAddress;
+		bool extendedAddressValid;
+		bool failed;
+		size_t used;
+		char buffer[HEX_WRITER_BUFFER_SIZE];
+	};
+
+	//HEX_WRITE_CALLBACK for a FILE* opened in binary mode
+	bool HexFileSink(void* context, const char* text, size_t length);
+
+}
@@ -0,0 +1,59 @@
+/*********************************************************************
+ *
+ *                Latency budget
+ *
+ *********************************************************************
+ * FileName:        LatencyBudget.cpp
+ ********************************************************************/
+
+#include "LatencyBudget.h"
+
+namespace HexCore {
+
+	LatencyBudget::LatencyBudget(unsigned long floorMs, unsigned long ceilingMs, unsigned long initialMs)
+		: floorMs(floorMs), ceilingMs(ceilingMs), initialMs(initialMs), smoothed(0), deviation(0), sampled(false)
+	{
+	}
+
+	void LatencyBudget::Reset(void)
+	{
+		smoothed = 0;
+		deviation = 0;
+		sampled = false;
+	}
+
+	void LatencyBudget::Sample(unsigned long microseconds)
+	{
+		unsigned long error;
+
+		if (!sampled)
+		{
+			smoothed = microseconds;
+			deviation = microseconds / 2;
+			sampled = true;
+			return;
+		}
+
+		//RTTVAR = 3/4 RTTVAR + 1/4 |SRTT - R|, then SRTT = 7/8 SRTT + 1/8 R
+		error = (smoothed > microseconds) ? (smoothed - microseconds) : (microseconds - smoothed);
+		deviation = ((deviation * 3) + error) / 4;
+		smoothed = ((smoothed * 7) + microseconds) / 8;
+	}
+
+	unsigned long LatencyBudget::TimeoutMs(void) const
+	{
+		unsigned long timeout;
+
+		if (!sampled)
+		{
+			return initialMs;
+		}
+		timeout = (smoothed + (4 * deviation) + 999) / 1000;
+		if (timeout < floorMs)
+		{
+			return floorMs;
+		}
+		return (timeout > ceilingMs) ? ceilingMs : timeout;
+	}
+
+}
@@ -0,0 +1,53 @@
+/*********************************************************************
+ *
+ *                Latency budget
+ *
+ *********************************************************************
+ * FileName:        LatencyBudget.h
+ *
+ * How long to wait for a transfer before calling the device stalled,
+ * derived from the latencies it showed so far the way TCP derives its
+ * retransmission timeout (RFC 6298): the smoothed latency plus four
+ * times its mean deviation, kept between a floor and a ceiling.  Until
+ * the first sample the budget is the initial one.
+ *
+ * Form1 keeps one budget per kind of wait, since a command answered at
+ * once, an erase and a window of streamed reports take times orders of
+ * magnitude apart.
+ ********************************************************************/
+
+#pragma once
+
+namespace HexCore {
+
+	class LatencyBudget
+	{
+	public:
+		//floorMs <= initialMs <= ceilingMs
+		LatencyBudget(unsigned long floorMs, unsigned long ceilingMs, unsigned long initialMs);
+
+		//Records the latency of a transfer that completed
+		void Sample(unsigned long microseconds);
+
+		//The wait allowed to the next transfer
+		unsigned long TimeoutMs(void) const;
+
+		//Forgets the samples: back to the initial budget
+		void Reset(void);
+
+		//Smoothed latency, 0 until sampled
+		unsigned long SmoothedMicroseconds(void) const
+		{
+			return smoothed;
+		}
+
+	private:
+		unsigned long floorMs;
+		unsigned long ceilingMs;
+		unsigned long initialMs;
+		unsigned long smoothed;
+		unsigned long deviation;
+		bool sampled;
+	};
+
+}
@@ -0,0 +1,169 @@
+/*********************************************************************
+ *
+ *                Precompiled program packets
+ *
+ *********************************************************************
+ * FileName:        PacketPlan.cpp
+ ********************************************************************/
+
+#include "PacketPlan.h"
+
+#include <string.h>
+
+namespace HexCore {
+
+	namespace {
+
+		//true when length bytes repeat pattern, patternBytes bytes long
+		bool MatchesPattern(const unsigned char* data, size_t length, const unsigned char* pattern, unsigned int patternBytes)
+		{
+			size_t i;
+
+			for (i = 0; i < length; i++)
+			{
+				if (data[i] != pattern[i % patternBytes])
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	}
+
+	PacketPlan::PacketPlan()
+		: packets(0), valid(false), packetBytes(0)
+	{
+	}
+
+	void PacketPlan::Clear(void)
+	{
+		reports.clear();
+		entries.clear();
+		packets = 0;
+		valid = false;
+	}
+
+	unsigned char* PacketPlan::Add(unsigned char command, unsigned long address, unsigned char region, unsigned char bytes)
+	{
+		PACKET_PLAN_ENTRY entry;
+		unsigned char* report;
+
+		entry.Address = address;
+		entry.Region = region;
+		entry.Complete = (command == PACKET_PLAN_PROGRAM_COMPLETE);
+		entries.push_back(entry);
+
+		reports.resize(reports.size() + PACKET_PLAN_REPORT_BYTES);
+		report = &reports[reports.size() - PACKET_PLAN_REPORT_BYTES];
+		memset(report, 0, PACKET_PLAN_REPORT_BYTES);
+		report[1] = command;
+		report[2] = (unsigned char)address;
+		report[3] = (unsigned char)(address >> 8);
+		report[4] = (unsigned char)(address >> 16);
+		report[5] = (unsigned char)(address >> 24);
+		report[6] = bytes;
+		return report;
+	}
+
+	bool PacketPlan::Compile(const DeviceImage& image, const unsigned char* regionOrder, unsigned int regionCount,
+		unsigned int bytesPerPacket, unsigned int bytesPerAddress, const unsigned char* erasedPattern, unsigned int patternBytes)
+	{
+		unsigned int i;
+		unsigned long block, blocks, reserve;
+
+		Clear();
+		if ((bytesPerPacket == 0) || (bytesPerPacket > PACKET_PLAN_DATA_BYTES) || (image.OccupancyBlockBytes() != bytesPerPacket))
+		{
+			return false;
+		}
+
+		//One report per block holding data and a PROGRAM_COMPLETE for each
+		//  region: the gaps may add a few more
+		reserve = 0;
+		for (i = 0; i < regionCount; i++)
+		{
+			if (regionOrder[i] >= image.RegionCount())
+			{
+				return false;
+			}
+			blocks = image.BlockCount(regionOrder[i]);
+			for (block = image.NextBlockWithData(regionOrder[i], 0); block < blocks; block = image.NextBlockWithData(regionOrder[i], block + 1))
+			{
+				reserve++;
+			}
+			reserve++;
+		}
+		reports.reserve(reserve * PACKET_PLAN_REPORT_BYTES);
+		entries.reserve(reserve);
+
+		for (i = 0; i < regionCount; i++)
+		{
+			const DEVICE_REGION& region = image.Region(regionOrder[i]);
+			size_t regionBytes = (size_t)region.Size * bytesPerAddress;
+			const unsigned char* data = image.RegionData(regionOrder[i]);
+			unsigned long nextBlock = 0;
+			bool skipped = false;
+
+			blocks = image.BlockCount(regionOrder[i]);
+			for (block = image.NextBlockWithData(regionOrder[i], 0); block < blocks; block = image.NextBlockWithData(regionOrder[i], block + 1))
+			{
+				size_t offset = (size_t)block * bytesPerPacket;
+				unsigned char bytes = (unsigned char)(((regionBytes - offset) < bytesPerPacket) ? (regionBytes - offset) : bytesPerPacket);
+				unsigned char* report;
+
+				if (block != nextBlock)
+				{
+					skipped = true;
+				}
+				nextBlock = block + 1;
+
+				if ((erasedPattern != 0) && (patternBytes > 0) && MatchesPattern(data + offset, bytes, erasedPattern, patternBytes))
+				{
+					skipped = true;
+					continue;
+				}
+
+				//The device needs a programming complete command before data
+				//  that follows a gap
+				if (skipped)
+				{
+					Add(PACKET_PLAN_PROGRAM_COMPLETE, 0, regionOrder[i], 0);
+					skipped = false;
+				}
+				report = Add(PACKET_PLAN_PROGRAM_DEVICE, region.Address + (unsigned long)(offset / bytesPerAddress), regionOrder[i], bytes);
+				memcpy(report + 7 + PACKET_PLAN_DATA_BYTES - bytes, data + offset, bytes);
+				packets++;
+			}
+			Add(PACKET_PLAN_PROGRAM_COMPLETE, 0, regionOrder[i], 0);
+		}
+
+		order.assign(regionOrder, regionOrder + regionCount);
+		if ((erasedPattern != 0) && (patternBytes > 0))
+		{
+			pattern.assign(erasedPattern, erasedPattern + patternBytes);
+		}
+		else
+		{
+			pattern.clear();
+		}
+		packetBytes = bytesPerPacket;
+		valid = true;
+		return true;
+	}
+
+	bool PacketPlan::Compiled(const unsigned char* regionOrder, unsigned int regionCount,
+		unsigned int bytesPerPacket, const unsigned char* erasedPattern, unsigned int patternBytes) const
+	{
+		if (!valid || (packetBytes != bytesPerPacket) || (order.size() != regionCount) ||
+			((regionCount > 0) && (memcmp(&order[0], regionOrder, regionCount) != 0)))
+		{
+			return false;
+		}
+		if ((erasedPattern == 0) || (patternBytes == 0))
+		{
+			return pattern.empty();
+		}
+		return (pattern.size() == patternBytes) && (memcmp(&pattern[0], erasedPattern, patternBytes) == 0);
+	}
+
+}
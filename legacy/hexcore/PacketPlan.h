@@ -0,0 +1,118 @@
+/*********************************************************************
+ *
+ *                Precompiled program packets
+ *
+ *********************************************************************
+ * FileName:        PacketPlan.h
+ *
+ * The PROGRAM_DEVICE and PROGRAM_COMPLETE reports ProgramThreadStart
+ * sends for an image, compiled once into one flat array of reports.
+ * The skip decisions (erased blocks, and with an encrypted bootloader
+ * the blocks holding nothing but the encrypted 0xFF pattern) and the
+ * PROGRAM_COMPLETE markers after each gap and at the end of each region
+ * are taken while compiling; programming the next board with the same
+ * image and geometry only posts the reports in order.
+ *
+ * Reports use the BOOTLOADER_COMMAND layout of Form1: report ID,
+ * command, 32-bit address, byte count, data right-aligned in 58 bytes.
+ * The report of a PROGRAM_DEVICE packet is also the GET_DATA answer
+ * the device gives for it once programmed, apart from the command byte.
+ ********************************************************************/
+
+#pragma once
+
+#include "DeviceImage.h"
+
+#include <stddef.h>
+#include <vector>
+
+//HID report with the leading report ID byte
+#define PACKET_PLAN_REPORT_BYTES		65
+#define PACKET_PLAN_DATA_BYTES			58
+
+#define PACKET_PLAN_PROGRAM_DEVICE		0x05
+#define PACKET_PLAN_PROGRAM_COMPLETE	0x06
+
+namespace HexCore {
+
+	//What a report of the plan is for; Address is the device address of a
+	//  PROGRAM_DEVICE packet, 0 for PROGRAM_COMPLETE
+	struct PACKET_PLAN_ENTRY
+	{
+		unsigned long Address;
+		unsigned char Region;
+		bool Complete;
+	};
+
+	class PacketPlan
+	{
+	public:
+		PacketPlan();
+
+		/****************************************************************************
+			Function:
+				Compile
+
+			Description:
+				Builds the reports that program the regions of image listed in
+				regionOrder, in that order: one PROGRAM_DEVICE per block the
+				occupancy map marks as holding data, a PROGRAM_COMPLETE before a
+				packet that follows left out blocks, and one at the end of each
+				region.  With erasedPattern a block holding nothing but the
+				pattern (repeated every patternBytes bytes) is left out too.
+
+			Precondition:
+				The occupancy map of image is built in blocks of bytesPerPacket
+				bytes.
+
+			Return Values:
+				true - the plan is ready
+				false - the occupancy map does not match bytesPerPacket, or a
+					region does not exist; the plan is left empty
+		***************************************************************************/
+		bool Compile(const DeviceImage& image, const unsigned char* regionOrder, unsigned int regionCount,
+			unsigned int bytesPerPacket, unsigned int bytesPerAddress, const unsigned char* erasedPattern, unsigned int patternBytes);
+
+		//true when the plan was compiled with the same inputs and not cleared
+		//  since; the caller clears it whenever the content of the image changes
+		bool Compiled(const unsigned char* regionOrder, unsigned int regionCount,
+			unsigned int bytesPerPacket, const unsigned char* erasedPattern, unsigned int patternBytes) const;
+
+		void Clear(void);
+
+		//Number of reports, PROGRAM_COMPLETE included
+		size_t Count(void) const
+		{
+			return entries.size();
+		}
+
+		const unsigned char* Report(size_t index) const
+		{
+			return &reports[index * PACKET_PLAN_REPORT_BYTES];
+		}
+
+		const PACKET_PLAN_ENTRY& Entry(size_t index) const
+		{
+			return entries[index];
+		}
+
+		//PROGRAM_DEVICE reports of the plan
+		size_t Packets(void) const
+		{
+			return packets;
+		}
+
+	private:
+		//Appends a report, without data
+		unsigned char* Add(unsigned char command, unsigned long address, unsigned char region, unsigned char bytes);
+
+		std::vector<unsigned char> reports;
+		std::vector<PACKET_PLAN_ENTRY> entries;
+		size_t packets;
+		bool valid;
+		std::vector<unsigned char> order;
+		std::vector<unsigned char> pattern;
+		unsigned int packetBytes;
+	};
+
+}
@@ -0,0 +1,245 @@
+/*********************************************************************
+ *
+ *                HID report transfer engine
+ *
+ *********************************************************************
+ * FileName:        TransferEngine.cpp
+ ********************************************************************/
+
+#include "TransferEngine.h"
+
+#include <string.h>
+
+namespace HexCore {
+
+	namespace {
+
+		//Window the adaptive sizing starts from, so that the first round
+		//  trips are measured without a queue in front of them
+		const unsigned int startWindow = 2;
+	}
+
+	TransferEngine::TransferEngine(TransferPort& port, unsigned int depth, unsigned long nakTimeoutMs, AnswerKey answerKey)
+		: port(port), answerKey(answerKey), budget(0), pending(0), depth(depth), nakTimeout(nakTimeoutMs), adaptive(true), lockStep(false),
+		minRtt(0), interval(0), lastValid(false)
+	{
+		unsigned int i;
+
+		if (this->depth < 1)
+		{
+			this->depth = 1;
+		}
+		if (this->depth > TRANSFER_MAX_SLOTS)
+		{
+			this->depth = TRANSFER_MAX_SLOTS;
+		}
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			order[i] = i;
+		}
+		window = (this->depth < startWindow) ? this->depth : startWindow;
+	}
+
+	void TransferEngine::SetAdaptive(bool on)
+	{
+		adaptive = on;
+		if (!lockStep)
+		{
+			window = adaptive ? ((depth < startWindow) ? depth : startWindow) : depth;
+		}
+	}
+
+	bool TransferEngine::Send(const unsigned char* report, unsigned long key, bool answered)
+	{
+		unsigned int slot;
+
+		if (!CanSend())
+		{
+			return false;
+		}
+
+		slot = order[pending];
+		if (report != slots[slot].Report)
+		{
+			memcpy(slots[slot].Report, report, TRANSFER_REPORT_BYTES);
+		}
+		slots[slot].Key = key;
+		slots[slot].Answered = answered;
+		slots[slot].Sent = std::chrono::steady_clock::now();
+		if (!port.StartWrite(slot, slots[slot].Report))
+		{
+			return false;
+		}
+		pending++;
+		return true;
+	}
+
+	int TransferEngine::Next(TransferCompletion* done, unsigned long timeoutMs)
+	{
+		unsigned int head, i;
+		unsigned long key;
+		int result;
+
+		if (pending == 0)
+		{
+			return TRANSFER_FAILED;
+		}
+		if (timeoutMs == TRANSFER_BUDGET)
+		{
+			timeoutMs = (budget != 0) ? budget->TimeoutMs() : TRANSFER_INFINITE;
+		}
+
+		head = order[0];
+		if (!slots[head].Answered)
+		{
+			if (!lockStep && (nakTimeout < timeoutMs))
+			{
+				result = port.WaitWrite(head, nakTimeout);
+				if (result == TRANSFER_TIMEOUT)
+				{
+					//The device is NAKing: go on one report at a time
+					lockStep = true;
+					window = 1;
+					result = port.WaitWrite(head, (timeoutMs == TRANSFER_INFINITE) ? TRANSFER_INFINITE : (timeoutMs - nakTimeout));
+				}
+			}
+			else
+			{
+				result = port.WaitWrite(head, timeoutMs);
+			}
+			if (result != TRANSFER_DONE)
+			{
+				return result;
+			}
+			Retire(0, done);
+			return TRANSFER_DONE;
+		}
+
+		result = port.Read(done->Report, timeoutMs);
+		if (result != TRANSFER_DONE)
+		{
+			return result;
+		}
+
+		key = (answerKey != 0) ? answerKey(done->Report) : slots[head].Key;
+		for (i = 0; i < pending; i++)
+		{
+			if (slots[order[i]].Answered && (slots[order[i]].Key == key))
+			{
+				break;
+			}
+		}
+		if (i == pending)
+		{
+			return TRANSFER_UNEXPECTED;
+		}
+
+		//The device answered, so the OUT report is long written; the slot
+		//  is only reused once the port is done with it
+		if (port.WaitWrite(order[i], TRANSFER_INFINITE) != TRANSFER_DONE)
+		{
+			return TRANSFER_FAILED;
+		}
+		Retire(i, done);
+		return TRANSFER_DONE;
+	}
+
+	void TransferEngine::Retire(unsigned int index, TransferCompletion* done)
+	{
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		unsigned int slot = order[index];
+		unsigned long rtt, sample;
+
+		done->Key = slots[slot].Key;
+		done->Answered = slots[slot].Answered;
+		done->Request = slots[slot].Report;
+
+		pending--;
+		memmove(&order[index], &order[index + 1], (pending - index) * sizeof(order[0]));
+		order[pending] = slot;
+
+		//Latency figures: the smallest round trip seen and the average time
+		//  between two completions while the ring is busy.  The minimum is
+		//  never measured again: the round trips of a full window include
+		//  the wait behind the reports ahead, and would keep it full
+		rtt = (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(now - slots[slot].Sent).count();
+		if ((minRtt == 0) || (rtt < minRtt))
+		{
+			minRtt = (rtt > 0) ? rtt : 1;
+		}
+		if (lastValid)
+		{
+			sample = (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+			interval = (interval == 0) ? sample : ((interval * 7) + sample) / 8;
+		}
+		else
+		{
+			sample = rtt;
+		}
+		//A wait lasts from one completion to the next, or from the send
+		//  when nothing completed before
+		if (budget != 0)
+		{
+			budget->Sample(sample);
+		}
+		last = now;
+		lastValid = (pending > 0);
+
+		if (adaptive && !lockStep && (interval > 0))
+		{
+			unsigned long fit = ((minRtt + interval - 1) / interval) + 1;
+
+			window = (fit < depth) ? (unsigned int)fit : depth;
+		}
+	}
+
+	bool TransferEngine::Post(const unsigned char* report)
+	{
+		return (Reserve() != 0) && Send(report, 0, false);
+	}
+
+	unsigned char* TransferEngine::Reserve(void)
+	{
+		TransferCompletion done;
+
+		while (!CanSend())
+		{
+			if (Next(&done, TRANSFER_BUDGET) != TRANSFER_DONE)
+			{
+				return 0;
+			}
+		}
+		return slots[order[pending]].Report;
+	}
+
+	bool TransferEngine::Drain(void)
+	{
+		TransferCompletion done;
+
+		while (pending > 0)
+		{
+			if (slots[order[0]].Answered || (Next(&done, TRANSFER_BUDGET) != TRANSFER_DONE))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void TransferEngine::Cancel(void)
+	{
+		unsigned int i;
+
+		if (pending > 0)
+		{
+			port.Cancel();
+		}
+		pending = 0;
+		lastValid = false;
+		for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+		{
+			order[i] = i;
+		}
+	}
+
+}
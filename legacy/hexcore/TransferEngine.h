@@ -0,0 +1,246 @@
+/*********************************************************************
+ *
+ *                HID report transfer engine
+ *
+ *********************************************************************
+ * FileName:        TransferEngine.h
+ *
+ * Keeps a ring of OUT reports in flight on a TransferPort and hands back
+ * their completions one at a time, so that read, verify and program share
+ * one implementation of the window Form1 used to hand-code in each
+ * thread.  A request either waits for an answer (GET_DATA), matched back
+ * by the key the AnswerKey function finds in the IN report whatever the
+ * order it arrives in, or completes once its OUT report is written
+ * (PROGRAM_DEVICE, PROGRAM_COMPLETE).
+ *
+ * The caller refills the window whenever a completion frees a slot:
+ *
+ *     while (more || engine.Pending() > 0)
+ *     {
+ *         while (more && engine.CanSend())
+ *             engine.Send(...);
+ *         engine.Next(&done, TRANSFER_INFINITE);
+ *     }
+ *
+ * The reports live in the slots of the ring, each on its own cache lines.
+ * A report built in place in the buffer Reserve hands out is sent as it
+ * is; any other is copied into the slot first.
+ *
+ * The window adapts to the observed latency: it is kept at the number of
+ * reports that fit in the smallest round trip seen at the rate the
+ * completions come back, plus one, never above the depth asked for.  A
+ * write still pending after the NAK timeout means the device does not
+ * keep up; the engine then goes on lock-step, one report at a time.
+ *
+ * With a LatencyBudget set, the time between two completions is sampled
+ * into it and the waits given TRANSFER_BUDGET (those of Post, Reserve and
+ * Drain among them) last its timeout: a device that stops answering is
+ * reported within a few round trips, not after a fixed wait.
+ ********************************************************************/
+
+#pragma once
+
+#include "LatencyBudget.h"
+
+#include <chrono>
+
+//Slots of the ring, and reports in flight at most
+#define TRANSFER_MAX_SLOTS		15
+//HID report with the leading report ID byte
+#define TRANSFER_REPORT_BYTES	65
+
+//*********************** WAIT RESULTS *************************************
+#define TRANSFER_DONE			1
+#define TRANSFER_TIMEOUT		0
+#define TRANSFER_FAILED			(-1)
+#define TRANSFER_UNEXPECTED		(-2)	//an answer no request in flight asked for
+#define TRANSFER_CANCELLED		(-3)	//the port was interrupted
+
+#define TRANSFER_INFINITE		0xFFFFFFFFUL
+//The timeout of the budget set with SetBudget, TRANSFER_INFINITE without one
+#define TRANSFER_BUDGET			0xFFFFFFFEUL
+
+namespace HexCore {
+
+	//The device side of the engine: overlapped HID handles in Form1, a
+	//  simulated device in the benchmarks
+	class TransferPort
+	{
+	public:
+		virtual ~TransferPort() {}
+
+		//Starts writing report from slot (0..TRANSFER_MAX_SLOTS-1); report
+		//  stays untouched until WaitWrite reports the slot done.  false when
+		//  the write could not be started
+		virtual bool StartWrite(unsigned int slot, const unsigned char* report) = 0;
+
+		//Waits up to timeoutMs for the write of slot: TRANSFER_DONE,
+		//  TRANSFER_TIMEOUT or TRANSFER_FAILED; a port that can be
+		//  interrupted from another thread returns TRANSFER_CANCELLED from
+		//  its waits until rearmed
+		virtual int WaitWrite(unsigned int slot, unsigned long timeoutMs) = 0;
+
+		//Waits up to timeoutMs for the next IN report; a read that timed out
+		//  is still pending and completes on the next call
+		virtual int Read(unsigned char* report, unsigned long timeoutMs) = 0;
+
+		//Aborts every transfer in flight and waits for them to end
+		virtual void Cancel(void) = 0;
+	};
+
+	struct TransferCompletion
+	{
+		unsigned long Key;
+		bool Answered;
+		//The request as sent; valid until the next Send
+		const unsigned char* Request;
+		//The answer of an answered request
+		unsigned char Report[TRANSFER_REPORT_BYTES];
+	};
+
+	class TransferEngine
+	{
+	public:
+		//Key of an IN report, compared with the key its request was sent with
+		typedef unsigned long (*AnswerKey)(const unsigned char* report);
+
+		//depth is clamped to 1..TRANSFER_MAX_SLOTS; answerKey may be NULL
+		//  when the answers come back in order
+		TransferEngine(TransferPort& port, unsigned int depth, unsigned long nakTimeoutMs, AnswerKey answerKey);
+
+		//Reports in flight at most
+		unsigned int Depth(void) const
+		{
+			return depth;
+		}
+
+		//Reports in flight at most right now (adaptive, <= Depth)
+		unsigned int Window(void) const
+		{
+			return window;
+		}
+
+		unsigned int Pending(void) const
+		{
+			return pending;
+		}
+
+		bool CanSend(void) const
+		{
+			return pending < window;
+		}
+
+		//true once a NAK timeout forced the engine to one report at a time
+		bool LockStep(void) const
+		{
+			return lockStep;
+		}
+
+		//With adaptive off the window stays at Depth
+		void SetAdaptive(bool on);
+
+		//Budget sampled with the time between two completions and used by
+		//  the waits given TRANSFER_BUDGET; NULL for none
+		void SetBudget(LatencyBudget* budget)
+		{
+			this->budget = budget;
+		}
+
+		//Smallest round trip seen and average time between two completions,
+		//  0 until measured
+		unsigned long MinRttMicroseconds(void) const
+		{
+			return minRtt;
+		}
+
+		unsigned long IntervalMicroseconds(void) const
+		{
+			return interval;
+		}
+
+		/****************************************************************************
+			Function:
+				Send
+
+			Description:
+				Starts the transfer of a copy of report.  An answered request is
+				done when an IN report with the same key comes back, the others
+				once the report is written.
+
+			Return Values:
+				true - the report is in flight
+				false - the window is full or the write could not be started
+		***************************************************************************/
+		bool Send(const unsigned char* report, unsigned long key, bool answered);
+
+		/****************************************************************************
+			Function:
+				Next
+
+			Description:
+				Waits up to timeoutMs for the next completion.  While the oldest
+				request in flight is not answered its write is waited for (the
+				HID driver writes the reports of a handle in order), otherwise
+				the next IN report is read and matched to its request.
+
+			Return Values:
+				TRANSFER_DONE - *done describes the completed request and its
+					slot is free
+				TRANSFER_TIMEOUT - nothing completed in time
+				TRANSFER_FAILED - a transfer failed, or nothing is in flight
+				TRANSFER_UNEXPECTED - the IN report in done->Report matches no
+					request in flight
+				TRANSFER_CANCELLED - the port was interrupted
+		***************************************************************************/
+		int Next(TransferCompletion* done, unsigned long timeoutMs);
+
+		//Sends a report that gets no answer, first waiting for the writes in
+		//  flight if the window is full; false when a write failed, timed
+		//  out past the budget or was cancelled
+		bool Post(const unsigned char* report);
+
+		//The buffer of the slot the next Send or Post writes from, waiting
+		//  as Post does if the window is full (so only with no answered
+		//  request in flight, or once CanSend); NULL when a write failed.
+		//  The buffer is only claimed by the Send or Post it is passed to,
+		//  with no other call on the engine in between
+		unsigned char* Reserve(void);
+
+		//Waits for every write in flight; false when a write failed or an
+		//  answered request was in flight
+		bool Drain(void);
+
+		//Aborts the transfers in flight
+		void Cancel(void);
+
+	private:
+		struct alignas(64) Slot
+		{
+			unsigned char Report[TRANSFER_REPORT_BYTES];
+			unsigned long Key;
+			bool Answered;
+			std::chrono::steady_clock::time_point Sent;
+		};
+
+		//Frees order[index] and updates the latency figures and the window
+		void Retire(unsigned int index, TransferCompletion* done);
+
+		TransferPort& port;
+		AnswerKey answerKey;
+		LatencyBudget* budget;
+		Slot slots[TRANSFER_MAX_SLOTS];
+		//Slots in flight, oldest first, then the free ones
+		unsigned int order[TRANSFER_MAX_SLOTS];
+		unsigned int pending;
+		unsigned int depth;
+		unsigned int window;
+		unsigned long nakTimeout;
+		bool adaptive;
+		bool lockStep;
+		unsigned long minRtt;
+		unsigned long interval;
+		bool lastValid;
+		std::chrono::steady_clock::time_point last;
+	};
+
+}
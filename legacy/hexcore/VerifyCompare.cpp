@@ -0,0 +1,79 @@
+/*********************************************************************
+ *
+ *                GET_DATA verify compare
+ *
+ *********************************************************************
+ * FileName:        VerifyCompare.cpp
+ ********************************************************************/
+
+#include "VerifyCompare.h"
+
+#include <string.h>
+
+namespace HexCore {
+
+	namespace {
+
+		//What the bootloader keeps at address 0 of a PIC24: goto 0x000400
+		const unsigned char bootResetVector[6] = { 0x00, 0x04, 0x04, 0x00, 0x00, 0x00 };
+
+		//The switch VerifyThreadStart used falls through from case i to the
+		//  last one: value passes if any of vector[i..5] equals it
+		bool InVectorFrom(const unsigned char* vector, unsigned int i, unsigned char value)
+		{
+			for (; i < sizeof(bootResetVector); i++)
+			{
+				if (vector[i] == value)
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+	}
+
+	int CompareGetData(const unsigned char* expected, const unsigned char* received, unsigned int length,
+		unsigned long address, unsigned int options, const unsigned char* remapVector)
+	{
+		unsigned int i;
+
+		if (memcmp(expected, received, length) == 0)
+		{
+			return -1;
+		}
+
+		for (i = 0; i < length; i++)
+		{
+			if (expected[i] == received[i])
+			{
+				continue;
+			}
+			if (((options & VERIFY_PIC24_PHANTOM) != 0) && (((i + 1) % 4) == 0))
+			{
+				continue;
+			}
+			if ((options & VERIFY_PIC24_RESET_VECTOR) != 0)
+			{
+				if (address == PIC24_RESET_REMAP_OFFSET)
+				{
+					if ((remapVector != 0) && InVectorFrom(remapVector, i, received[i]))
+					{
+						continue;
+					}
+					return (int)i;
+				}
+				if (address == 0x00)
+				{
+					if (InVectorFrom(bootResetVector, i, received[i]))
+					{
+						continue;
+					}
+					return (int)i;
+				}
+			}
+			return (int)i;
+		}
+		return -1;
+	}
+
+}
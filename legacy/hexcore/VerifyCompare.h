@@ -0,0 +1,55 @@
+/*********************************************************************
+ *
+ *                GET_DATA verify compare
+ *
+ *********************************************************************
+ * FileName:        VerifyCompare.h
+ *
+ * CompareGetData holds the rules VerifyThreadStart applies to every
+ * GET_DATA answer.
+ ********************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+//*********************** COMPARE OPTIONS **********************************
+#define VERIFY_PIC24_PHANTOM		0x01	//the 4th byte of each instruction is not compared
+#define VERIFY_PIC24_RESET_VECTOR	0x02	//answers at 0 and PIC24_RESET_REMAP_OFFSET follow the reset vector rules
+
+#ifndef PIC24_RESET_REMAP_OFFSET
+#define PIC24_RESET_REMAP_OFFSET 0x1400
+#endif
+
+namespace HexCore {
+
+	/****************************************************************************
+		Function:
+			CompareGetData
+
+		Description:
+			Compares length bytes a GET_DATA answer returned for device address
+			with the expected image, skipping the bytes VerifyThreadStart always
+			allowed to differ: the phantom byte of each PIC24 instruction and,
+			in the first 6 bytes at address 0 and at PIC24_RESET_REMAP_OFFSET,
+			any byte found at the same or a later position of the bootloader
+			reset vector (0x00 0x04 0x04 0x00 0x00 0x00) or of the relocated
+			application one.
+
+		Parameters:
+			const unsigned char* expected - the image at address
+			const unsigned char* received - the data of the answer
+			unsigned int length - GetDataResults.BytesPerPacket
+			unsigned long address - GetDataResults.Address
+			unsigned int options - VERIFY_xxx flags
+			const unsigned char* remapVector - first 6 bytes of the region at
+				PIC24_RESET_REMAP_OFFSET, NULL if there is none
+
+		Return Values:
+			-1 when the answer matches, otherwise the index of the first byte
+			that does not
+	***************************************************************************/
+	int CompareGetData(const unsigned char* expected, const unsigned char* received, unsigned int length,
+		unsigned long address, unsigned int options, const unsigned char* remapVector);
+
+}
@@ -0,0 +1,382 @@
+/*********************************************************************
+ *
+ *                Device memory image benchmark
+ *
+ *********************************************************************
+ * FileName:        DeviceImageBench.cpp
+ *
+ * Checks the DeviceImage layout (alignment, disjoint regions, arena kept
+ * on a re-query with the same geometry, erased content) and compares
+ * the cost of a QUERY_SUCCESS with what Form1 did before: free, malloc
+ * and a per-byte erase loop for each region.
+ *
+ * The occupancy map is checked against a port of the per-byte skip test
+ * ProgramThreadStart ran while filling each packet, and both are timed
+ * on a sparse image.
+ *
+ * usage: DeviceImageBench [--check]
+ *
+ * --check skips the timing; it is what ctest runs.
+ ********************************************************************/
+
+#include "DeviceImage.h"
+#include "HexImage.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+
+namespace {
+
+	//PIC24 with the bootloader at the bottom of the flash, device addresses
+	const DEVICE_REGION pic24Geometry[] =
+	{
+		{ 0x01, 0x00000000, 0x00001400 },
+		{ 0x01, 0x00001400, 0x0002AC00 },
+		{ 0x03, 0x00F80000, 0x00000010 },
+	};
+	const unsigned int pic24Regions = sizeof(pic24Geometry) / sizeof(pic24Geometry[0]);
+
+	//PROGRAM_DEVICE payload of the PIC24 bootloaders
+	const unsigned int bytesPerPacket = 56;
+
+	//Sparse application: a few code runs separated by erased flash, with
+	//  random phantom bytes that must not count as data
+	void FillSparse(DeviceImage& image, unsigned int seed)
+	{
+		std::mt19937 rng(seed);
+		unsigned int i;
+
+		image.Erase(true);
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			unsigned char* p = image.RegionData(i);
+			size_t bytes = image.Region(i).Size * 2;
+			size_t j;
+
+			for (j = 0; j < bytes; j++)
+			{
+				if (((j % 4) == 3) && ((rng() % 8) == 0))
+				{
+					p[j] = (unsigned char)rng();
+				}
+			}
+			for (j = 0; j < 24; j++)
+			{
+				size_t start = rng() % bytes;
+				size_t length = 1 + (rng() % ((j < 4) ? 4096 : 8));
+				size_t k;
+
+				for (k = start; (k < (start + length)) && (k < bytes); k++)
+				{
+					if ((k % 4) != 3)
+					{
+						p[k] = (unsigned char)rng();
+					}
+				}
+			}
+		}
+	}
+
+	//ProgramThreadStart skip test as it was: true when the packet starting
+	//  at byte offset of the region must be sent
+	bool LegacyPacketHasData(const unsigned char* p, size_t offset, size_t bytes, unsigned long address)
+	{
+		unsigned char currentByteInAddress = 1;
+		bool skipBlock = true;
+		unsigned int i;
+
+		address += (unsigned long)(offset / 2);
+		for (i = 0; (i < bytesPerPacket) && ((offset + i) < bytes); i++)
+		{
+			if (p[offset + i] != 0xFF)
+			{
+				if (!(((address % 2) != 0) && (currentByteInAddress == 2)))
+				{
+					skipBlock = false;
+				}
+			}
+			if (currentByteInAddress == 2)
+			{
+				address++;
+				currentByteInAddress = 1;
+			}
+			else
+			{
+				currentByteInAddress++;
+			}
+		}
+		return !skipBlock;
+	}
+
+	int CheckOccupancy(void)
+	{
+		DeviceImage image;
+		int failures = 0;
+		unsigned int seed, i;
+
+		if (!image.Configure(pic24Geometry, pic24Regions, 2))
+		{
+			return 1;
+		}
+		for (seed = 0; seed < 20; seed++)
+		{
+			FillSparse(image, seed);
+			image.BuildOccupancy(bytesPerPacket, true);
+			for (i = 0; i < image.RegionCount(); i++)
+			{
+				size_t bytes = image.Region(i).Size * 2;
+				unsigned long blocks = image.BlockCount(i);
+				unsigned long b, next;
+
+				if (blocks != ((bytes + bytesPerPacket - 1) / bytesPerPacket))
+				{
+					failures++;
+				}
+				next = image.NextBlockWithData(i, 0);
+				for (b = 0; b < blocks; b++)
+				{
+					bool expected = LegacyPacketHasData(image.RegionData(i), (size_t)b * bytesPerPacket, bytes, image.Region(i).Address);
+
+					if (image.BlockHasData(i, b) != expected)
+					{
+						std::cout << "region " << i << " block " << b << " occupancy differs" << std::endl;
+						failures++;
+					}
+					if (expected)
+					{
+						if (next != b)
+						{
+							failures++;
+						}
+						next = image.NextBlockWithData(i, b + 1);
+					}
+				}
+				if (next != blocks)
+				{
+					failures++;
+				}
+			}
+		}
+
+		//erasing forgets the map
+		image.Erase(true);
+		if (image.OccupancyBlockBytes() != 0)
+		{
+			failures++;
+		}
+		image.FillOccupancy(bytesPerPacket);
+		if (image.NextBlockWithData(1, 1000) != 1000)
+		{
+			failures++;
+		}
+		return failures;
+	}
+
+	int Check(void)
+	{
+		DeviceImage image;
+		std::vector<DEVICE_REGION> many;
+		unsigned char* first;
+		int failures = 0;
+		unsigned int i, j;
+
+		if (!image.Configure(pic24Geometry, pic24Regions, 2))
+		{
+			return 1;
+		}
+		first = image.RegionData(0);
+		image.Erase(true);
+
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			unsigned char* p = image.RegionData(i);
+			std::vector<unsigned char> expected(image.RegionBytes(i));
+
+			if (((uintptr_t)p % DEVICE_IMAGE_ALIGNMENT) != 0)
+			{
+				std::cout << "region " << i << " not aligned" << std::endl;
+				failures++;
+			}
+			if ((i > 0) && ((image.RegionData(i - 1) + image.RegionBytes(i - 1)) > p))
+			{
+				std::cout << "region " << i << " overlaps" << std::endl;
+				failures++;
+			}
+			FillErased(expected.data(), expected.size(), image.Region(i).Address * 2, true);
+			if (memcmp(p, expected.data(), expected.size()) != 0)
+			{
+				std::cout << "region " << i << " not erased" << std::endl;
+				failures++;
+			}
+		}
+		if (image.RegionData(pic24Regions) != 0)
+		{
+			failures++;
+		}
+
+		//re-query with the same geometry keeps the arena
+		if (!image.Configure(pic24Geometry, pic24Regions, 2) || (image.RegionData(0) != first))
+		{
+			std::cout << "arena not reused" << std::endl;
+			failures++;
+		}
+
+		//more regions than a QUERY_DEVICE packet can describe
+		for (i = 0; i < 40; i++)
+		{
+			DEVICE_REGION r = { 0x01, i * 0x1000UL, 0x0FFF };
+
+			many.push_back(r);
+		}
+		if (!image.Configure(many.data(), (unsigned int)many.size(), 1))
+		{
+			return failures + 1;
+		}
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			memset(image.RegionData(i), (int)i, image.RegionBytes(i));
+		}
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			for (j = 0; j < image.RegionBytes(i); j++)
+			{
+				if (image.RegionData(i)[j] != (unsigned char)i)
+				{
+					std::cout << "region " << i << " overwritten" << std::endl;
+					failures++;
+					break;
+				}
+			}
+		}
+		return failures;
+	}
+
+	//QUERY_SUCCESS as Form1 handled it before
+	void LegacyQuery(unsigned char* pData[], unsigned int bytesPerAddress)
+	{
+		unsigned int i;
+
+		for (i = 0; i < pic24Regions; i++)
+		{
+			free(pData[i]);
+			pData[i] = 0;
+		}
+		for (i = 0; i < pic24Regions; i++)
+		{
+			pData[i] = (unsigned char*)malloc((pic24Geometry[i].Size + 1) * bytesPerAddress);
+		}
+		for (i = 0; i < pic24Regions; i++)
+		{
+			unsigned char* tempPointer = pData[i];
+			unsigned long tempLong;
+
+			for (tempLong = 0; tempLong < (pic24Geometry[i].Size * bytesPerAddress); tempLong++)
+			{
+				if ((bytesPerAddress == 2) && (((tempLong + 1) % 4) == 0))
+				{
+					*tempPointer++ = 0;
+				}
+				else
+				{
+					*tempPointer++ = 0xFF;
+				}
+			}
+		}
+	}
+
+	void Benchmark(void)
+	{
+		const unsigned int iterations = 200;
+		unsigned char* pData[pic24Regions] = { 0 };
+		DeviceImage image;
+		std::chrono::steady_clock::time_point t0, t1, t2;
+		unsigned int n, i;
+
+		t0 = std::chrono::steady_clock::now();
+		for (n = 0; n < iterations; n++)
+		{
+			LegacyQuery(pData, 2);
+		}
+		t1 = std::chrono::steady_clock::now();
+		for (n = 0; n < iterations; n++)
+		{
+			image.Configure(pic24Geometry, pic24Regions, 2);
+			image.Erase(true);
+		}
+		t2 = std::chrono::steady_clock::now();
+
+		for (i = 0; i < pic24Regions; i++)
+		{
+			free(pData[i]);
+		}
+		std::cout << "query: legacy " << (std::chrono::duration<double>(t1 - t0).count() * 1000.0 / iterations)
+			<< " ms, DeviceImage " << (std::chrono::duration<double>(t2 - t1).count() * 1000.0 / iterations)
+			<< " ms" << std::endl;
+
+		//packets of a sparse image: per-byte test vs occupancy map
+		{
+			unsigned long legacyPackets = 0, mapPackets = 0;
+
+			FillSparse(image, 1);
+			t0 = std::chrono::steady_clock::now();
+			for (n = 0; n < iterations; n++)
+			{
+				for (i = 0; i < image.RegionCount(); i++)
+				{
+					size_t bytes = image.Region(i).Size * 2;
+					size_t offset;
+
+					for (offset = 0; offset < bytes; offset += bytesPerPacket)
+					{
+						legacyPackets += LegacyPacketHasData(image.RegionData(i), offset, bytes, image.Region(i).Address) ? 1 : 0;
+					}
+				}
+			}
+			t1 = std::chrono::steady_clock::now();
+			for (n = 0; n < iterations; n++)
+			{
+				image.BuildOccupancy(bytesPerPacket, true);
+				for (i = 0; i < image.RegionCount(); i++)
+				{
+					unsigned long b;
+
+					for (b = image.NextBlockWithData(i, 0); b < image.BlockCount(i); b = image.NextBlockWithData(i, b + 1))
+					{
+						mapPackets++;
+					}
+				}
+			}
+			t2 = std::chrono::steady_clock::now();
+
+			std::cout << "sparse image: " << (mapPackets / iterations) << " of "
+				<< ((image.RegionBytes(0) + image.RegionBytes(1) + image.RegionBytes(2)) / bytesPerPacket) << " packets hold data"
+				<< (legacyPackets == mapPackets ? "" : " (LEGACY COUNT DIFFERS)") << std::endl;
+			std::cout << "packet scan: per-byte " << (std::chrono::duration<double>(t1 - t0).count() * 1000.0 / iterations)
+				<< " ms, occupancy map " << (std::chrono::duration<double>(t2 - t1).count() * 1000.0 / iterations)
+				<< " ms" << std::endl;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool check = (argc > 1) && (strcmp(argv[1], "--check") == 0);
+	int failures = Check();
+	int occupancyFailures = CheckOccupancy();
+
+	std::cout << "DeviceImage: " << ((failures == 0) ? "layout ok" : "LAYOUT ERRORS") << std::endl;
+	std::cout << "DeviceImage: " << ((occupancyFailures == 0) ? "occupancy matches the per-byte test" : "OCCUPANCY ERRORS") << std::endl;
+	failures += occupancyFailures;
+	if (!check && (failures == 0))
+	{
+		Benchmark();
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/*********************************************************************
+ *
+ *                Hex digit decoding kernel benchmark
+ *
+ *********************************************************************
+ * FileName:        HexDecodeBench.cpp
+ *
+ * Checks that every DecodeHex kernel supported by this CPU agrees with
+ * the scalar one (bytes, sum and rejection of non hex characters) and
+ * prints the decode throughput of each of them.
+ *
+ * usage: HexDecodeBench [--check]
+ *
+ * --check skips the timing and only runs the comparison; it is what
+ * ctest runs.
+ ********************************************************************/
+
+#include "HexDecode.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+
+namespace {
+
+	const char* kernelNames[] = { "scalar", "sse2", "avx2" };
+
+	struct Outcome
+	{
+		bool Valid;
+		unsigned int Sum;
+		std::vector<unsigned char> Bytes;
+	};
+
+	Outcome Run(unsigned int kernel, const std::vector<char>& text, size_t count)
+	{
+		Outcome o;
+
+		SetHexKernel(kernel);
+		o.Sum = 0x1234;
+		o.Bytes.assign(count + 1, 0xA5);
+		o.Valid = DecodeHex(text.data(), o.Bytes.data(), count, &o.Sum);
+		return o;
+	}
+
+	//Returns the number of mismatches between kernel and the scalar kernel
+	int Compare(unsigned int kernel)
+	{
+		static const char digits[] = "0123456789abcdefABCDEF";
+		std::mt19937 rng(12345);
+		int failures = 0;
+		size_t count;
+		int round;
+
+		for (count = 0; count <= 300; count++)
+		{
+			for (round = 0; round < 8; round++)
+			{
+				std::vector<char> text(count * 2 + 1, 0);
+				Outcome expected, got;
+				size_t i;
+
+				for (i = 0; i < (count * 2); i++)
+				{
+					text[i] = digits[rng() % (sizeof(digits) - 1)];
+				}
+
+				//half of the rounds carry one character just outside the
+				//  digit and letter ranges, or with the high bit set
+				if (((round & 1) != 0) && (count > 0))
+				{
+					static const char bad[] = { '/', ':', '@', 'G', '`', 'g', ' ', (char)0xB0, (char)0xC6 };
+
+					text[rng() % (count * 2)] = bad[rng() % sizeof(bad)];
+				}
+
+				expected = Run(HEX_KERNEL_SCALAR, text, count);
+				got = Run(kernel, text, count);
+
+				if (expected.Valid != got.Valid)
+				{
+					failures++;
+				}
+				else if (expected.Valid && ((expected.Sum != got.Sum) || (expected.Bytes != got.Bytes)))
+				{
+					failures++;
+				}
+			}
+		}
+		return failures;
+	}
+
+	double Throughput(unsigned int kernel, size_t recordBytes)
+	{
+		const size_t total = 16 * 1024 * 1024;
+		std::vector<char> text(recordBytes * 2);
+		std::vector<unsigned char> out(recordBytes);
+		std::chrono::steady_clock::time_point t0, t1;
+		unsigned int sum = 0;
+		size_t done;
+		size_t i;
+
+		for (i = 0; i < text.size(); i++)
+		{
+			text[i] = "0123456789ABCDEF"[i % 16];
+		}
+
+		SetHexKernel(kernel);
+		t0 = std::chrono::steady_clock::now();
+		for (done = 0; done < total; done += recordBytes)
+		{
+			DecodeHex(text.data(), out.data(), recordBytes, &sum);
+		}
+		t1 = std::chrono::steady_clock::now();
+
+		if (sum == 0x5A5A5A5A)
+		{
+			std::cout << "";
+		}
+		return ((double)total * 2) / (std::chrono::duration<double>(t1 - t0).count() * 1024.0 * 1024.0);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool check = (argc > 1) && (strcmp(argv[1], "--check") == 0);
+	unsigned int best = GetHexKernel();
+	int failures = 0;
+	unsigned int kernel;
+
+	for (kernel = HEX_KERNEL_SCALAR; kernel <= best; kernel++)
+	{
+		int mismatches = Compare(kernel);
+
+		std::cout << kernelNames[kernel] << ": " << ((mismatches == 0) ? "matches scalar" : "MISMATCH");
+		if (!check)
+		{
+			std::cout << ", 16 byte records " << Throughput(kernel, 16) << " MB/s"
+				<< ", 64 byte records " << Throughput(kernel, 64) << " MB/s"
+				<< ", 4 KB blocks " << Throughput(kernel, 4096) << " MB/s";
+		}
+		std::cout << std::endl;
+		failures += mismatches;
+	}
+
+	SetHexKernel(best);
+	return (failures == 0) ? 0 : 1;
+}
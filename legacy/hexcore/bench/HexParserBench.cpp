@@ -0,0 +1,404 @@
+/*********************************************************************
+ *
+ *                Intel HEX parser benchmark
+ *
+ *********************************************************************
+ * FileName:        HexParserBench.cpp
+ *
+ * Loads each hex file given on the command line with HexCore::ParseHex,
+ * HexCore::ParseHexParallel and with a native port of the per-line loader that Form1 used before
+ * (ReadLine/Trim/Substring/StringToHex), then compares the two images
+ * and prints the throughput of both.
+ *
+ * usage: HexParserBench [--check] [--iterations N] [--threads N] file.hex ...
+ *
+ * --check runs a single iteration and returns non zero if the images
+ * differ; it is what ctest runs.  Every file is also parsed doubled (so
+ * that chunks overlap) and with a corrupted record, to check that the
+ * parallel parser falls back and reports errors like the sequential one.
+ ********************************************************************/
+
+#include "HexParser.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+
+namespace {
+
+	//Geometry of a PIC24 with the bootloader at the bottom of the flash:
+	//  the boot block, the application (starting at the relocated reset
+	//  vector) and the configuration words.  Byte addresses.
+	const HEX_REGION benchGeometry[] =
+	{
+		{ 0x00000000, 0x00002800, 0 },
+		{ PIC24_RESET_REMAP_OFFSET * 2, 0x00055800, 0 },
+		{ 0x01F00000, 0x00000020, 0 },
+	};
+	const unsigned int benchRegions = sizeof(benchGeometry) / sizeof(benchGeometry[0]);
+
+	struct Image
+	{
+		std::vector<unsigned char> Data[benchRegions];
+		HEX_REGION Regions[benchRegions];
+
+		Image()
+		{
+			unsigned int i;
+
+			for (i = 0; i < benchRegions; i++)
+			{
+				Regions[i] = benchGeometry[i];
+				Data[i].assign(Regions[i].Size, 0xFF);
+				Regions[i].Data = Data[i].data();
+			}
+		}
+
+		bool operator==(const Image& other) const
+		{
+			unsigned int i;
+
+			for (i = 0; i < benchRegions; i++)
+			{
+				if (Data[i] != other.Data[i])
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	//Same digit handling as Form1::StringToHex
+	unsigned long StringToHex(const std::string& s)
+	{
+		unsigned long returnAddress = 0;
+		unsigned long placeMultiplier = 1;
+		int i;
+
+		for (i = (int)s.length() - 1; i >= 0; i--)
+		{
+			char c = s[i];
+			unsigned long v;
+
+			if ((c >= '0') && (c <= '9'))
+			{
+				v = c - '0';
+			}
+			else if ((c >= 'A') && (c <= 'F'))
+			{
+				v = c - 'A' + 10;
+			}
+			else if ((c >= 'a') && (c <= 'f'))
+			{
+				v = c - 'a' + 10;
+			}
+			else
+			{
+				v = 0;
+			}
+			returnAddress += v * placeMultiplier;
+			placeMultiplier *= 16;
+		}
+		return returnAddress;
+	}
+
+	std::string Trim(const std::string& s)
+	{
+		size_t first = s.find_first_not_of(" \t\r\n");
+		size_t last = s.find_last_not_of(" \t\r\n");
+
+		if (first == std::string::npos)
+		{
+			return std::string();
+		}
+		return s.substr(first, last - first + 1);
+	}
+
+	//Native port of the loop btn_OpenHexFile_Click ran before ParseHex,
+	//  with the reset vector switch fall-through fixed
+	bool LegacyLoad(const std::string& content, Image& image, bool pic24Remap)
+	{
+		std::istringstream reader(content);
+		std::string line;
+		unsigned long extendedAddress = 0;
+
+		while (std::getline(reader, line))
+		{
+			unsigned long recordLength, addressField, recordType, checksum;
+			unsigned long checksumCalculated;
+			std::string dataPayload;
+			unsigned int i, j;
+
+			line = Trim(line);
+			if (line.length() == 0)
+			{
+				continue;
+			}
+			if (line[0] != ':')
+			{
+				return false;
+			}
+			line = line.substr(1, line.length() - 1);
+
+			recordLength = StringToHex(line.substr(0, 2));
+			addressField = StringToHex(line.substr(2, 4));
+			recordType = StringToHex(line.substr(6, 2));
+			dataPayload = line.substr(8, recordLength * 2);
+			checksum = StringToHex(line.substr((recordLength * 2) + 8, 2));
+
+			checksumCalculated = 0;
+			for (j = 0; j < (recordLength + 4); j++)
+			{
+				checksumCalculated += StringToHex(line.substr(j * 2, 2));
+			}
+			checksumCalculated = (~checksumCalculated) + 1;
+			if ((checksumCalculated & 0xFF) != checksum)
+			{
+				return false;
+			}
+
+			if (recordType == HEX_FILE_EXTENDED_LINEAR_ADDRESS)
+			{
+				extendedAddress = StringToHex(dataPayload);
+			}
+			else if (recordType == HEX_FILE_EOF)
+			{
+				break;
+			}
+			else if (recordType == HEX_FILE_DATA)
+			{
+				unsigned long totalAddress = (extendedAddress << 16) + addressField;
+
+				for (i = 0; i < benchRegions; i++)
+				{
+					HEX_REGION& r = image.Regions[i];
+
+					if ((totalAddress < r.Address) || (totalAddress >= (r.Address + r.Size)))
+					{
+						continue;
+					}
+
+					for (j = 0; j < recordLength; j++)
+					{
+						unsigned long a = totalAddress + j;
+						unsigned char data = (unsigned char)StringToHex(dataPayload.substr(j * 2, 2));
+
+						if ((a - r.Address) >= r.Size)
+						{
+							break;
+						}
+
+						if (pic24Remap && (a < 6))
+						{
+							static const unsigned char resetGoto[6] = { 0x00, 0x04, 0x04, 0x00, 0x00, 0x00 };
+							unsigned int k;
+
+							r.Data[a - r.Address] = resetGoto[a];
+							for (k = 0; k < benchRegions; k++)
+							{
+								if (image.Regions[k].Address == (PIC24_RESET_REMAP_OFFSET * 2))
+								{
+									image.Regions[k].Data[a] = data;
+								}
+							}
+						}
+						else if (pic24Remap && (a >= (PIC24_RESET_REMAP_OFFSET * 2)) && (a < ((PIC24_RESET_REMAP_OFFSET * 2) + 6)))
+						{
+						}
+						else
+						{
+							r.Data[a - r.Address] = data;
+						}
+					}
+					break;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool ReadFile(const char* name, std::string& content)
+	{
+		std::ifstream file(name, std::ios::binary);
+
+		if (!file)
+		{
+			return false;
+		}
+		content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+	double MegabytesPerSecond(size_t bytes, unsigned int iterations, std::chrono::steady_clock::duration elapsed)
+	{
+		double seconds = std::chrono::duration<double>(elapsed).count();
+
+		if (seconds <= 0)
+		{
+			return 0;
+		}
+		return ((double)bytes * iterations) / (seconds * 1024.0 * 1024.0);
+	}
+
+	//Parallel and sequential parse of content must agree on the result
+	//  and on the image
+	bool SameAsSequential(const std::string& content, unsigned int options, unsigned int threads)
+	{
+		Image sequential, parallel;
+		HEX_PARSE_RESULT r1 = ParseHex(content.data(), content.size(), sequential.Regions, benchRegions, options);
+		HEX_PARSE_RESULT r2 = ParseHexParallel(content.data(), content.size(), parallel.Regions, benchRegions, options, threads);
+
+		if ((r1.Status != r2.Status) || (r1.Line != r2.Line))
+		{
+			return false;
+		}
+		return (r1.Status != HEX_PARSE_SUCCESS) || ((r1.Records == r2.Records) && (sequential == parallel));
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int iterations = 20;
+	unsigned int threads = 0;
+	int failures = 0;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			iterations = 1;
+		}
+		else if ((strcmp(argv[i], "--iterations") == 0) && ((i + 1) < argc))
+		{
+			iterations = (unsigned int)atoi(argv[++i]);
+		}
+		else if ((strcmp(argv[i], "--threads") == 0) && ((i + 1) < argc))
+		{
+			threads = (unsigned int)atoi(argv[++i]);
+		}
+		else
+		{
+			std::string content;
+			unsigned int pass;
+
+			if (!ReadFile(argv[i], content))
+			{
+				std::cerr << argv[i] << ": cannot read" << std::endl;
+				failures++;
+				continue;
+			}
+
+			for (pass = 0; pass < 2; pass++)
+			{
+				bool remap = (pass == 1);
+				unsigned int options = remap ? HEX_PARSE_PIC24_RESET_REMAP : 0;
+				std::chrono::steady_clock::time_point t0, t1, t2, t3;
+				HEX_PARSE_RESULT result = { HEX_PARSE_SUCCESS, 0, 0 };
+				HEX_PARSE_RESULT parallelResult = { HEX_PARSE_SUCCESS, 0, 0 };
+				bool legacyOk = true;
+				unsigned int n;
+				Image fast, parallel, legacy;
+
+				t0 = std::chrono::steady_clock::now();
+				for (n = 0; n < iterations; n++)
+				{
+					Image img;
+					legacyOk = LegacyLoad(content, img, remap);
+					if (n == 0)
+					{
+						legacy = img;
+					}
+				}
+				t1 = std::chrono::steady_clock::now();
+				for (n = 0; n < iterations; n++)
+				{
+					Image img;
+					result = ParseHex(content.data(), content.size(), img.Regions, benchRegions, options);
+					if (n == 0)
+					{
+						fast = img;
+					}
+				}
+				t2 = std::chrono::steady_clock::now();
+				for (n = 0; n < iterations; n++)
+				{
+					Image img;
+					parallelResult = ParseHexParallel(content.data(), content.size(), img.Regions, benchRegions, options, threads);
+					if (n == 0)
+					{
+						parallel = img;
+					}
+				}
+				t3 = std::chrono::steady_clock::now();
+
+				std::cout << argv[i] << (remap ? " [pic24 remap]" : "")
+					<< ": records " << result.Records
+					<< ", legacy " << MegabytesPerSecond(content.size(), iterations, t1 - t0) << " MB/s"
+					<< ", ParseHex " << MegabytesPerSecond(content.size(), iterations, t2 - t1) << " MB/s"
+					<< ", ParseHexParallel " << MegabytesPerSecond(content.size(), iterations, t3 - t2) << " MB/s";
+
+				if (!legacyOk || (result.Status != HEX_PARSE_SUCCESS) || (parallelResult.Status != HEX_PARSE_SUCCESS))
+				{
+					std::cout << ", parse error (status " << (int)result.Status << " line " << result.Line << ")" << std::endl;
+					failures++;
+				}
+				else if (!(fast == legacy) || !(parallel == legacy) || (parallelResult.Records != result.Records))
+				{
+					std::cout << ", IMAGES DIFFER" << std::endl;
+					failures++;
+				}
+				else
+				{
+					std::cout << ", identical" << std::endl;
+				}
+			}
+
+			//the same file twice without the first EOF record: every record
+			//  is written twice, by different chunks
+			{
+				std::string twice = content;
+				size_t eof = twice.find(":00000001FF");
+
+				if (eof != std::string::npos)
+				{
+					twice.erase(eof, 11);
+				}
+				twice += content;
+				if (!SameAsSequential(twice, HEX_PARSE_PIC24_RESET_REMAP, threads))
+				{
+					std::cout << argv[i] << ": overlapping chunks DIFFER" << std::endl;
+					failures++;
+				}
+			}
+
+			//a bad checksum in the last quarter must be reported on the
+			//  same line by both parsers
+			{
+				std::string broken = content;
+				size_t colon = broken.find(':', (broken.size() * 3) / 4);
+
+				if ((colon != std::string::npos) && ((colon + 10) < broken.size()))
+				{
+					broken[colon + 9] = (broken[colon + 9] == '0') ? '1' : '0';
+				}
+				if (!SameAsSequential(broken, 0, threads))
+				{
+					std::cout << argv[i] << ": error report DIFFERS" << std::endl;
+					failures++;
+				}
+			}
+		}
+	}
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,349 @@
+/*********************************************************************
+ *
+ *                Hex table benchmark
+ *
+ *********************************************************************
+ * FileName:        HexTablesBench.cpp
+ *
+ * Compares the HexTables.h functions with native ports of the Form1
+ * helpers they replace (HexToString, StringToHex and the printBuffer
+ * dump, with std::wstring standing in for System::String), checks that
+ * they produce the same results and prints the throughput of both.
+ *
+ * usage: HexTablesBench [--check]
+ *
+ * --check skips the timing and only runs the comparison; it is what
+ * ctest runs.
+ ********************************************************************/
+
+#include "HexDecode.h"
+#include "HexTables.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+
+namespace {
+
+	//Form1::HexToString as it was
+	std::wstring LegacyHexToString(unsigned long input, unsigned char bytes)
+	{
+		wchar_t returnArray[10];
+		unsigned char i;
+		unsigned char c;
+
+		for (i = 0; i < 9; i++)
+		{
+			returnArray[i] = '0';
+		}
+
+		for (i = 0; i < bytes * 2; i++)
+		{
+			c = (unsigned char)(input & 0x0000000F);
+
+			if (c <= 9)
+			{
+				returnArray[7 - i] = c + '0';
+			}
+			else
+			{
+				returnArray[7 - i] = c + 'A' - 10;
+			}
+
+			input >>= 4;
+		}
+		returnArray[9] = 0;
+		return std::wstring(returnArray).substr(8 - (bytes * 2), bytes * 2);
+	}
+
+	//Form1::StringToHex as it was
+	unsigned long LegacyStringToHex(const std::wstring& s)
+	{
+		unsigned long returnAddress;
+		unsigned long placeMultiplier;
+		unsigned char i;
+		wchar_t c;
+
+		returnAddress = 0;
+		placeMultiplier = 1;
+
+		for (i = 0; i < s.length(); i++)
+		{
+			c = s[s.length() - 1 - i];
+			if ((c >= 'A') && (c <= 'F'))
+			{
+				c = 10 + (c - 'A');
+			}
+			else if ((c >= 'a') && (c <= 'f'))
+			{
+				c = 10 + (c - 'a');
+			}
+			else
+			{
+				c = c - '0';
+			}
+
+			returnAddress += (c * placeMultiplier);
+			placeMultiplier *= 16;
+		}
+
+		return returnAddress;
+	}
+
+	//Form1::printBuffer as it was, rows collected instead of DEBUG_OUT
+	void LegacyDump(const unsigned char* buffer, size_t size, std::vector<std::wstring>& rows)
+	{
+		std::wstring s;
+		size_t i;
+
+		for (i = 0; i < size; i++)
+		{
+			if ((i % 32) == 0)
+			{
+				if (i != 0)
+				{
+					rows.push_back(s);
+				}
+				s = L"  " + LegacyHexToString(buffer[i], 1);
+			}
+			else
+			{
+				s = s + L" " + LegacyHexToString(buffer[i], 1);
+			}
+		}
+		if (!s.empty())
+		{
+			rows.push_back(s);
+		}
+	}
+
+	//Form1::printBuffer with the tables
+	void TableDump(const unsigned char* buffer, size_t size, std::vector<std::wstring>& rows)
+	{
+		wchar_t line[1 + (3 * 32)];
+		size_t i;
+
+		for (i = 0; i < size; i += 32)
+		{
+			size_t n = ((size - i) < 32) ? (size - i) : 32;
+			wchar_t* end;
+
+			line[0] = ' ';
+			end = EncodeHexSeparated(buffer + i, n, (wchar_t)' ', line + 1);
+			rows.push_back(std::wstring(line, end));
+		}
+	}
+
+	int Check(void)
+	{
+		static const char digits[] = "0123456789abcdefABCDEF";
+		std::mt19937 rng(4321);
+		int failures = 0;
+		unsigned int bytes;
+		int round;
+
+		for (round = 0; round < 100000; round++)
+		{
+			unsigned long value = rng();
+			wchar_t text[8];
+
+			bytes = 1 + (round % 4);
+			if (round < 256)
+			{
+				value = round;
+			}
+			value &= (bytes == 4) ? 0xFFFFFFFFUL : ((1UL << (8 * bytes)) - 1);
+
+			if (LegacyHexToString(value, (unsigned char)bytes) != std::wstring(text, EncodeHexNumber(value, bytes, text)))
+			{
+				failures++;
+			}
+		}
+
+		for (round = 0; round < 100000; round++)
+		{
+			std::wstring s;
+			unsigned long decoded;
+			size_t length = 1 + (rng() % 8);
+			size_t i;
+
+			for (i = 0; i < length; i++)
+			{
+				s += (wchar_t)digits[rng() % (sizeof(digits) - 1)];
+			}
+			if (!DecodeHexNumber(s.c_str(), s.length(), &decoded) || (decoded != LegacyStringToHex(s)))
+			{
+				failures++;
+			}
+		}
+
+		for (round = 0; round < 2000; round++)
+		{
+			std::vector<char> text(2 * (round % 300) + 1, 0);
+			std::vector<unsigned char> a(text.size()), b(text.size());
+			unsigned int sumA = 7, sumB = 7;
+			size_t count = round % 300;
+			size_t i;
+
+			for (i = 0; i < (2 * count); i++)
+			{
+				text[i] = digits[rng() % (sizeof(digits) - 1)];
+			}
+			if (((round & 1) != 0) && (count > 0))
+			{
+				text[rng() % (2 * count)] = "g/:@`G \xB0"[rng() % 8];
+			}
+			if ((DecodeHexTable(text.data(), a.data(), count, &sumA) != DecodeHex(text.data(), b.data(), count, &sumB)) ||
+				((sumA != sumB) && ((round & 1) == 0)) ||
+				((a != b) && ((round & 1) == 0)))
+			{
+				failures++;
+			}
+		}
+
+		for (round = 0; round < 200; round++)
+		{
+			std::vector<unsigned char> data(round);
+			std::vector<std::wstring> expected, got;
+			size_t i;
+
+			for (i = 0; i < data.size(); i++)
+			{
+				data[i] = (unsigned char)rng();
+			}
+			LegacyDump(data.data(), data.size(), expected);
+			TableDump(data.data(), data.size(), got);
+			if (expected != got)
+			{
+				failures++;
+			}
+		}
+
+		return failures;
+	}
+
+	double Seconds(std::chrono::steady_clock::time_point t0)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	void Report(const char* what, double legacyBytes, double legacySeconds, double tableBytes, double tableSeconds)
+	{
+		const double gb = 1024.0 * 1024.0 * 1024.0;
+
+		std::cout << what << ": legacy " << (legacyBytes / legacySeconds / gb) << " GB/s, tables "
+			<< (tableBytes / tableSeconds / gb) << " GB/s, x" << ((tableBytes / tableSeconds) / (legacyBytes / legacySeconds))
+			<< std::endl;
+	}
+
+	void Benchmark(void)
+	{
+		const size_t total = 16 * 1024 * 1024;
+		std::vector<unsigned char> data(total);
+		std::vector<char> text(2 * total);
+		std::vector<std::wstring> rows;
+		std::vector<std::wstring> numbers;
+		std::chrono::steady_clock::time_point t0;
+		unsigned long check = 0;
+		double legacy, table;
+		unsigned int sum = 0;
+		size_t i;
+
+		for (i = 0; i < total; i++)
+		{
+			data[i] = (unsigned char)(i * 7);
+		}
+
+		//per byte formatting, as the memory dumps do
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < (total / 16); i++)
+		{
+			check += LegacyHexToString(data[i], 1)[1];
+		}
+		legacy = Seconds(t0);
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < total; i++)
+		{
+			EncodeHexNumber(data[i], 1, text.data() + (2 * i));
+		}
+		check += text[total];
+		table = Seconds(t0);
+		Report("encode byte", total / 16, legacy, total, table);
+
+		//address and number parsing
+		for (i = 0; i < 256; i++)
+		{
+			numbers.push_back(LegacyHexToString((unsigned long)(i * 0x01010101UL + 0x00A2F3C4UL), 4));
+		}
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < (total / 64); i++)
+		{
+			check += LegacyStringToHex(numbers[i & 0xFF]);
+		}
+		legacy = Seconds(t0);
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < (total / 8); i++)
+		{
+			unsigned long v;
+
+			DecodeHexNumber(numbers[i & 0xFF].c_str(), 8, &v);
+			check += v;
+		}
+		table = Seconds(t0);
+		Report("decode number (8 digits)", total / 64 * 4, legacy, total / 8 * 4, table);
+
+		//64 byte packet dumps
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < (total / 64); i += 64)
+		{
+			rows.clear();
+			LegacyDump(data.data() + i, 64, rows);
+		}
+		legacy = Seconds(t0);
+		t0 = std::chrono::steady_clock::now();
+		for (i = 0; i < total; i += 64)
+		{
+			rows.clear();
+			TableDump(data.data() + i, 64, rows);
+		}
+		table = Seconds(t0);
+		Report("packet dump", total / 64, legacy, total, table);
+
+		//bulk
+		t0 = std::chrono::steady_clock::now();
+		EncodeHex(data.data(), total, text.data());
+		table = Seconds(t0);
+		std::cout << "bulk encode: " << (total / table / (1024.0 * 1024.0 * 1024.0)) << " GB/s" << std::endl;
+		t0 = std::chrono::steady_clock::now();
+		DecodeHexTable(text.data(), data.data(), total, &sum);
+		table = Seconds(t0);
+		std::cout << "bulk decode (table): " << (total / table / (1024.0 * 1024.0 * 1024.0)) << " GB/s" << std::endl;
+		t0 = std::chrono::steady_clock::now();
+		DecodeHex(text.data(), data.data(), total, &sum);
+		table = Seconds(t0);
+		std::cout << "bulk decode (DecodeHex): " << (total / table / (1024.0 * 1024.0 * 1024.0)) << " GB/s" << std::endl;
+
+		if ((check + sum) == 1)
+		{
+			std::cout << "";
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool check = (argc > 1) && (strcmp(argv[1], "--check") == 0);
+	int failures = Check();
+
+	std::cout << "tables: " << ((failures == 0) ? "match the Form1 helpers" : "MISMATCH") << std::endl;
+	if (!check && (failures == 0))
+	{
+		Benchmark();
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,283 @@
+/*********************************************************************
+ *
+ *                Intel HEX writer benchmark
+ *
+ *********************************************************************
+ * FileName:        HexWriterBench.cpp
+ *
+ * Loads each hex file given on the command line, exports the image with
+ * a native port of the record loop Form1::btn_ExportHex_Click used
+ * before (String::Concat of HexToString per byte, one WriteLine per
+ * record) and with HexCore::HexWriter (16 and 64 byte records, with and
+ * without HEX_WRITE_SKIP_ERASED), checks that every export loads back to
+ * the same image and prints time and size of each.
+ *
+ * usage: HexWriterBench [--check] [--iterations N] file.hex ...
+ *
+ * --check runs a single iteration; it is what ctest runs.
+ ********************************************************************/
+
+#include "HexImage.h"
+#include "HexParser.h"
+#include "HexWriter.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+
+namespace {
+
+	//Same geometry as HexParserBench, byte addresses
+	const HEX_REGION benchGeometry[] =
+	{
+		{ 0x00000000, 0x00002800, 0 },
+		{ PIC24_RESET_REMAP_OFFSET * 2, 0x00055800, 0 },
+		{ 0x01F00000, 0x00000020, 0 },
+	};
+	const unsigned int benchRegions = sizeof(benchGeometry) / sizeof(benchGeometry[0]);
+
+	struct Image
+	{
+		std::vector<unsigned char> Data[benchRegions];
+		HEX_REGION Regions[benchRegions];
+
+		Image()
+		{
+			unsigned int i;
+
+			for (i = 0; i < benchRegions; i++)
+			{
+				Regions[i] = benchGeometry[i];
+				Data[i].resize(Regions[i].Size);
+				FillErased(Data[i].data(), Data[i].size(), Regions[i].Address, true);
+				Regions[i].Data = Data[i].data();
+			}
+		}
+
+		bool operator==(const Image& other) const
+		{
+			unsigned int i;
+
+			for (i = 0; i < benchRegions; i++)
+			{
+				if (Data[i] != other.Data[i])
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	//Form1::HexToString as it was
+	std::string HexToString(unsigned long input, unsigned char bytes)
+	{
+		char returnArray[10];
+		unsigned char i;
+		unsigned char c;
+
+		for (i = 0; i < 9; i++)
+		{
+			returnArray[i] = '0';
+		}
+		for (i = 0; i < bytes * 2; i++)
+		{
+			c = (unsigned char)(input & 0x0000000F);
+			returnArray[7 - i] = (c <= 9) ? (char)(c + '0') : (char)(c + 'A' - 10);
+			input >>= 4;
+		}
+		returnArray[9] = 0;
+		return std::string(returnArray).substr(8 - (bytes * 2), bytes * 2);
+	}
+
+	//Form1::btn_ExportHex_Click record loop as it was, WriteLine appending
+	//  to out
+	void LegacyExport(const Image& image, std::string& out)
+	{
+		unsigned int region;
+
+		for (region = 0; region < benchRegions; region++)
+		{
+			const unsigned char* p = image.Regions[region].Data;
+			unsigned long address = image.Regions[region].Address;
+			unsigned long end = image.Regions[region].Address + image.Regions[region].Size;
+			unsigned int lastVector, thisVector;
+			unsigned char checksum;
+
+			checksum = 0x01 + ~(0x02 + 0x04 + (unsigned char)((address >> 24) & 0xFF) + (unsigned char)((address >> 16) & 0xFF));
+			out += ":02000004" + HexToString((address >> 16), 2) + HexToString(checksum, 1) + "\r\n";
+			lastVector = ((address >> 16) & 0xFFFF);
+
+			while (1)
+			{
+				std::string printString;
+				unsigned char bytesThisLine;
+				unsigned char i;
+
+				thisVector = ((address >> 16) & 0xFFFF);
+				if (thisVector != lastVector)
+				{
+					checksum = 0x01 + ~(0x02 + 0x04 + (unsigned char)((address >> 24) & 0xFF) + (unsigned char)((address >> 16) & 0xFF));
+					out += ":02000004" + HexToString((address >> 16), 2) + HexToString(checksum, 1) + "\r\n";
+				}
+
+				checksum = 0x00;
+				printString = ":";
+				bytesThisLine = 16;
+				if ((address + 16) > end)
+				{
+					bytesThisLine = (unsigned char)(end - address);
+				}
+				printString = printString + HexToString(bytesThisLine, 1);
+				checksum += ~(bytesThisLine)+1;
+				printString = printString + HexToString(address, 2);
+				checksum += ~((unsigned char)(address & 0xFF)) + 1;
+				checksum += ~((unsigned char)((address >> 8) & 0xFF)) + 1;
+				printString = printString + "00";
+				for (i = 0; i < bytesThisLine; i++)
+				{
+					unsigned char dataByte = *p++;
+
+					printString = printString + HexToString(dataByte, 1);
+					checksum += ~dataByte + 1;
+				}
+				printString = printString + HexToString(checksum, 1);
+				out += printString + "\r\n";
+
+				address += bytesThisLine;
+				if (address >= end)
+				{
+					break;
+				}
+				lastVector = thisVector;
+			}
+		}
+		out += ":00000001FF\r\n";
+	}
+
+	bool AppendText(void* context, const char* text, size_t length)
+	{
+		((std::string*)context)->append(text, length);
+		return true;
+	}
+
+	void WriterExport(const Image& image, unsigned int recordLength, unsigned int options, std::string& out)
+	{
+		HexWriter* writer = new HexWriter(AppendText, &out, recordLength, options);
+		unsigned int region;
+
+		for (region = 0; region < benchRegions; region++)
+		{
+			writer->Write(image.Regions[region].Address, image.Regions[region].Data, image.Regions[region].Size);
+		}
+		writer->End();
+		delete writer;
+	}
+
+	bool ReadFile(const char* name, std::string& content)
+	{
+		std::ifstream file(name, std::ios::binary);
+
+		if (!file)
+		{
+			return false;
+		}
+		content.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int iterations = 10;
+	int failures = 0;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			iterations = 1;
+		}
+		else if ((strcmp(argv[i], "--iterations") == 0) && ((i + 1) < argc))
+		{
+			iterations = (unsigned int)atoi(argv[++i]);
+		}
+		else
+		{
+			static const struct
+			{
+				const char* Name;
+				unsigned int RecordLength;
+				unsigned int Options;
+			} exports[] =
+			{
+				{ "legacy", 16, 0 },
+				{ "HexWriter 16", 16, 0 },
+				{ "HexWriter 64", 64, 0 },
+				{ "HexWriter 16 skip erased", 16, HEX_WRITE_SKIP_ERASED | HEX_WRITE_PIC24_PHANTOM },
+				{ "HexWriter 64 skip erased", 64, HEX_WRITE_SKIP_ERASED | HEX_WRITE_PIC24_PHANTOM },
+			};
+			std::string content;
+			Image image;
+			unsigned int e;
+
+			if (!ReadFile(argv[i], content) ||
+				(ParseHex(content.data(), content.size(), image.Regions, benchRegions, HEX_PARSE_PIC24_RESET_REMAP).Status != HEX_PARSE_SUCCESS))
+			{
+				std::cerr << argv[i] << ": cannot load" << std::endl;
+				failures++;
+				continue;
+			}
+
+			std::cout << argv[i] << ":" << std::endl;
+			for (e = 0; e < (sizeof(exports) / sizeof(exports[0])); e++)
+			{
+				std::chrono::steady_clock::time_point t0, t1;
+				std::string text;
+				Image loaded;
+				unsigned int n;
+
+				t0 = std::chrono::steady_clock::now();
+				for (n = 0; n < iterations; n++)
+				{
+					text.clear();
+					if (e == 0)
+					{
+						LegacyExport(image, text);
+					}
+					else
+					{
+						WriterExport(image, exports[e].RecordLength, exports[e].Options, text);
+					}
+				}
+				t1 = std::chrono::steady_clock::now();
+
+				std::cout << "  " << exports[e].Name << ": "
+					<< (std::chrono::duration<double>(t1 - t0).count() * 1000.0 / iterations) << " ms, "
+					<< text.size() << " bytes";
+
+				//loaded back without the remap, the image must be the same
+				if ((ParseHex(text.data(), text.size(), loaded.Regions, benchRegions, 0).Status != HEX_PARSE_SUCCESS) ||
+					!(loaded == image))
+				{
+					std::cout << ", LOADS BACK DIFFERENT" << std::endl;
+					failures++;
+				}
+				else
+				{
+					std::cout << ", loads back identical" << std::endl;
+				}
+			}
+		}
+	}
+
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+/*********************************************************************
+ *
+ *                Packet plan benchmark
+ *
+ *********************************************************************
+ * FileName:        PacketPlanBench.cpp
+ *
+ * Programs the simulated device from a PacketPlan and checks that it
+ * ends up holding the image, with a PROGRAM_COMPLETE after each gap and
+ * at the end of each region, and that blocks holding an erased pattern
+ * are left out.  Then times preparing the packets of a sparse image for
+ * each board, as ProgramThreadStart did, against compiling the plan once
+ * and copying its reports.
+ *
+ * usage: PacketPlanBench [--check] [--boards N]
+ *
+ * --check skips the timing; it is what ctest runs.
+ ********************************************************************/
+
+#include "DeviceImage.h"
+#include "PacketPlan.h"
+#include "TransferEngine.h"
+#include "SimulatedHid.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace HexCore;
+using namespace Bench;
+
+namespace {
+
+	const unsigned int bytesPerAddress = 2;
+	const unsigned int bytesPerPacket = 56;
+
+	//Small enough for the simulated device to hold the whole address space;
+	//  the configuration region last, as QUERY_DEVICE reports it
+	const DEVICE_REGION geometry[] =
+	{
+		{ 0x01, 0x00000000, 0x00001400 },
+		{ 0x01, 0x00001400, 0x00002BF3 },
+		{ 0x03, 0x00004000, 0x00000010 },
+	};
+	const unsigned int regionCount = sizeof(geometry) / sizeof(geometry[0]);
+
+	//Configuration region first, as ProgramThreadStart programs them
+	const unsigned char regionOrder[] = { 2, 0, 1 };
+
+	void FillSparse(DeviceImage& image, unsigned int seed)
+	{
+		std::mt19937 rng(seed);
+		unsigned int i, j;
+
+		image.Erase(false);
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			unsigned char* p = image.RegionData(i);
+			size_t bytes = image.Region(i).Size * bytesPerAddress;
+
+			for (j = 0; j < 16; j++)
+			{
+				size_t start = rng() % bytes;
+				size_t length = 1 + (rng() % ((j < 4) ? 2048 : 100));
+				size_t k;
+
+				for (k = start; (k < (start + length)) && (k < bytes); k++)
+				{
+					p[k] = (unsigned char)rng();
+				}
+			}
+		}
+	}
+
+	//Posts the reports of plan, as ProgramThreadStart does
+	bool Program(TransferEngine& engine, const PacketPlan& plan)
+	{
+		size_t i;
+
+		for (i = 0; i < plan.Count(); i++)
+		{
+			//The packets before a PROGRAM_COMPLETE are written first
+			if (plan.Entry(i).Complete && !engine.Drain())
+			{
+				return false;
+			}
+			if (!engine.Post(plan.Report(i)))
+			{
+				return false;
+			}
+			if (plan.Entry(i).Complete && !engine.Drain())
+			{
+				return false;
+			}
+		}
+		return engine.Drain();
+	}
+
+	//The device memory after programming image: erased but for the blocks
+	//  the occupancy map keeps
+	std::vector<unsigned char> Expected(const DeviceImage& image, size_t deviceBytes)
+	{
+		std::vector<unsigned char> expected(deviceBytes, 0xFF);
+		unsigned int i;
+
+		for (i = 0; i < image.RegionCount(); i++)
+		{
+			size_t bytes = image.Region(i).Size * bytesPerAddress;
+			size_t base = image.Region(i).Address * bytesPerAddress;
+			unsigned long b;
+
+			for (b = image.NextBlockWithData(i, 0); b < image.BlockCount(i); b = image.NextBlockWithData(i, b + 1))
+			{
+				size_t offset = (size_t)b * bytesPerPacket;
+				size_t length = ((bytes - offset) < bytesPerPacket) ? (bytes - offset) : bytesPerPacket;
+
+				memcpy(&expected[base + offset], image.RegionData(i) + offset, length);
+			}
+		}
+		return expected;
+	}
+
+	int Check(void)
+	{
+		const size_t deviceBytes = (geometry[regionCount - 1].Address + geometry[regionCount - 1].Size) * bytesPerAddress;
+		DeviceImage image;
+		PacketPlan plan;
+		int failures = 0;
+		unsigned int seed;
+
+		if (!image.Configure(geometry, regionCount, bytesPerAddress))
+		{
+			return 1;
+		}
+		for (seed = 0; seed < 4; seed++)
+		{
+			std::vector<unsigned char> target(deviceBytes, 0xFF);
+			SimulatedHid hid(target, bytesPerAddress, std::chrono::microseconds(20), 1, false);
+			TransferEngine engine(hid, 8, 250, 0);
+			unsigned long completes = 0;
+			size_t i;
+
+			FillSparse(image, seed);
+			image.BuildOccupancy(bytesPerPacket, false);
+			if (!plan.Compile(image, regionOrder, regionCount, bytesPerPacket, bytesPerAddress, 0, 0))
+			{
+				return failures + 1;
+			}
+			for (i = 0; i < plan.Count(); i++)
+			{
+				completes += plan.Entry(i).Complete ? 1 : 0;
+				//no PROGRAM_COMPLETE right after another one in a region
+				if ((i > 0) && plan.Entry(i).Complete && plan.Entry(i - 1).Complete &&
+					(plan.Entry(i).Region == plan.Entry(i - 1).Region))
+				{
+					failures++;
+				}
+			}
+			if (!Program(engine, plan) || (target != Expected(image, deviceBytes)) ||
+				(hid.ProgramReports() != plan.Packets()) || (hid.CompleteReports() != completes) ||
+				(plan.Entry(0).Region != regionOrder[0]))
+			{
+				std::cout << "plan, seed " << seed << ": FAILED" << std::endl;
+				failures++;
+			}
+		}
+
+		//blocks holding the erased pattern are left out, with a
+		//  PROGRAM_COMPLETE before the next packet
+		{
+			const unsigned char pattern[4] = { 0x12, 0x34, 0x56, 0x78 };
+			unsigned char* p = image.RegionData(0);
+			size_t i, packets;
+
+			image.Erase(false);
+			for (i = 0; i < (3 * bytesPerPacket); i++)
+			{
+				p[i] = (i < bytesPerPacket) ? 0x00 : pattern[i % 4];
+			}
+			p[(2 * bytesPerPacket) + 5] = 0x00;
+			image.FillOccupancy(bytesPerPacket);
+			if (!plan.Compile(image, regionOrder + 1, 1, bytesPerPacket, bytesPerAddress, pattern, 4) ||
+				(plan.Count() < 4) || plan.Entry(0).Complete || !plan.Entry(1).Complete || plan.Entry(2).Complete ||
+				(plan.Entry(2).Address != ((2 * bytesPerPacket) / bytesPerAddress)))
+			{
+				std::cout << "erased pattern: FAILED" << std::endl;
+				failures++;
+			}
+			packets = plan.Packets();
+			if (!plan.Compiled(regionOrder + 1, 1, bytesPerPacket, pattern, 4) ||
+				plan.Compiled(regionOrder + 1, 1, bytesPerPacket, 0, 0) || plan.Compiled(regionOrder, 1, bytesPerPacket, pattern, 4))
+			{
+				failures++;
+			}
+			plan.Clear();
+			if (plan.Compiled(regionOrder + 1, 1, bytesPerPacket, pattern, 4) || (plan.Count() != 0) || (packets == 0))
+			{
+				failures++;
+			}
+		}
+
+		//a map in other blocks than the packets is refused
+		image.BuildOccupancy(bytesPerPacket / 2, false);
+		if (plan.Compile(image, regionOrder, regionCount, bytesPerPacket, bytesPerAddress, 0, 0) || (plan.Count() != 0))
+		{
+			failures++;
+		}
+		return failures;
+	}
+
+	//ProgramThreadStart before the plan: one report prepared per packet
+	//  holding data, for every board
+	unsigned long PreparePackets(const DeviceImage& image, unsigned char* report)
+	{
+		unsigned long sent = 0;
+		unsigned int i;
+
+		for (i = 0; i < regionCount; i++)
+		{
+			const DEVICE_REGION& region = image.Region(regionOrder[i]);
+			size_t bytes = region.Size * bytesPerAddress;
+			unsigned long b;
+
+			for (b = image.NextBlockWithData(regionOrder[i], 0); b < image.BlockCount(regionOrder[i]); b = image.NextBlockWithData(regionOrder[i], b + 1))
+			{
+				size_t offset = (size_t)b * bytesPerPacket;
+				unsigned char length = (unsigned char)(((bytes - offset) < bytesPerPacket) ? (bytes - offset) : bytesPerPacket);
+
+				PutPacket(report, SIM_PROGRAM_DEVICE, region.Address + (unsigned long)(offset / bytesPerAddress), length);
+				memcpy(PacketData(report), image.RegionData(regionOrder[i]) + offset, length);
+				sent += report[7 + SIM_DATA_BYTES - 1];
+			}
+		}
+		return sent;
+	}
+
+	void Benchmark(unsigned int boards)
+	{
+		DeviceImage image;
+		PacketPlan plan;
+		unsigned char report[TRANSFER_REPORT_BYTES];
+		std::chrono::steady_clock::time_point t0, t1, t2;
+		volatile unsigned long sink = 0;
+		unsigned int n;
+		size_t i;
+
+		image.Configure(geometry, regionCount, bytesPerAddress);
+		FillSparse(image, 7);
+		image.BuildOccupancy(bytesPerPacket, false);
+
+		t0 = std::chrono::steady_clock::now();
+		for (n = 0; n < boards; n++)
+		{
+			sink += PreparePackets(image, report);
+		}
+		t1 = std::chrono::steady_clock::now();
+		plan.Compile(image, regionOrder, regionCount, bytesPerPacket, bytesPerAddress, 0, 0);
+		for (n = 0; n < boards; n++)
+		{
+			for (i = 0; i < plan.Count(); i++)
+			{
+				memcpy(report, plan.Report(i), TRANSFER_REPORT_BYTES);
+				sink += report[TRANSFER_REPORT_BYTES - 1];
+			}
+		}
+		t2 = std::chrono::steady_clock::now();
+
+		std::cout << boards << " boards, " << plan.Packets() << " packets each: prepared per board "
+			<< (std::chrono::duration<double>(t1 - t0).count() * 1000.0) << " ms, plan "
+			<< (std::chrono::duration<double>(t2 - t1).count() * 1000.0) << " ms"
+			<< ((sink == 0) ? " " : "") << std::endl;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned int boards = 20;
+	bool check = false;
+	int failures;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			check = true;
+		}
+		else if ((strcmp(argv[i], "--boards") == 0) && ((i + 1) < argc))
+		{
+			boards = (unsigned int)atoi(argv[++i]);
+		}
+	}
+
+	failures = Check();
+	std::cout << "PacketPlan: " << ((failures == 0) ? "programs the image, gaps and erased pattern ok" : "ERRORS") << std::endl;
+	if (!check && (failures == 0))
+	{
+		Benchmark(boards);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,307 @@
+/*********************************************************************
+ *
+ *                Simulated HID bootloader
+ *
+ *********************************************************************
+ * FileName:        SimulatedHid.h
+ *
+ * A TransferPort backed by a thread that plays the device: it takes one
+ * OUT report per frame (none while stalled, as a device NAKing), programs
+ * PROGRAM_DEVICE data into its image and answers GET_DATA a fixed number
+ * of frames later, one IN report per frame.  Answers can be swapped in
+ * pairs so that the matching by address is exercised.  Interrupt makes
+ * the waits return TRANSFER_CANCELLED, as the cancel button does with the
+ * HID handles of Form1.
+ *
+ * Reports use the BOOTLOADER_COMMAND layout of Form1: report ID, command,
+ * 32-bit address, byte count, data right-aligned in 58 bytes.
+ ********************************************************************/
+
+#pragma once
+
+#include "TransferEngine.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace Bench {
+
+	const unsigned char SIM_PROGRAM_DEVICE = 0x05;
+	const unsigned char SIM_PROGRAM_COMPLETE = 0x06;
+	const unsigned char SIM_GET_DATA = 0x07;
+
+	const unsigned int SIM_DATA_BYTES = 58;
+
+	inline void PutPacket(unsigned char* report, unsigned char command, unsigned long address, unsigned char bytes)
+	{
+		memset(report, 0, TRANSFER_REPORT_BYTES);
+		report[1] = command;
+		report[2] = (unsigned char)address;
+		report[3] = (unsigned char)(address >> 8);
+		report[4] = (unsigned char)(address >> 16);
+		report[5] = (unsigned char)(address >> 24);
+		report[6] = bytes;
+	}
+
+	inline unsigned long PacketAddress(const unsigned char* report)
+	{
+		return (unsigned long)report[2] | ((unsigned long)report[3] << 8) |
+			((unsigned long)report[4] << 16) | ((unsigned long)report[5] << 24);
+	}
+
+	inline unsigned char PacketBytes(const unsigned char* report)
+	{
+		return report[6];
+	}
+
+	//Data of a packet, right-aligned as the bootloader wants it
+	inline unsigned char* PacketData(unsigned char* report)
+	{
+		return report + 7 + SIM_DATA_BYTES - report[6];
+	}
+
+	inline const unsigned char* PacketData(const unsigned char* report)
+	{
+		return report + 7 + SIM_DATA_BYTES - report[6];
+	}
+
+	//TransferEngine::AnswerKey of GET_DATA answers
+	inline unsigned long AnswerAddress(const unsigned char* report)
+	{
+		return PacketAddress(report);
+	}
+
+	class SimulatedHid : public HexCore::TransferPort
+	{
+	public:
+		SimulatedHid(std::vector<unsigned char>& image, unsigned int bytesPerAddress, std::chrono::microseconds frame, unsigned int latency, bool swapAnswers)
+			: image(image), bytesPerAddress(bytesPerAddress), frame(frame), latency(latency), swapAnswers(swapAnswers),
+			stalled(0), programReports(0), completeReports(0), interrupted(false), stop(false)
+		{
+			unsigned int i;
+
+			for (i = 0; i < TRANSFER_MAX_SLOTS; i++)
+			{
+				written[i] = true;
+			}
+			worker = std::thread(&SimulatedHid::Run, this);
+		}
+
+		~SimulatedHid()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stop = true;
+			}
+			worker.join();
+		}
+
+		//The device takes no OUT report for the next frames frames
+		void Stall(unsigned int frames)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stalled = frames;
+		}
+
+		//Ends the waits in progress and the next ones with TRANSFER_CANCELLED,
+		//  until Rearm
+		void Interrupt(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			interrupted = true;
+			changed.notify_all();
+		}
+
+		void Rearm(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			interrupted = false;
+		}
+
+		unsigned long ProgramReports(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return programReports;
+		}
+
+		unsigned long CompleteReports(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			return completeReports;
+		}
+
+		bool StartWrite(unsigned int slot, const unsigned char* report)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Out o;
+
+			o.Slot = slot;
+			memcpy(o.Report, report, TRANSFER_REPORT_BYTES);
+			written[slot] = false;
+			out.push_back(o);
+			return true;
+		}
+
+		int WaitWrite(unsigned int slot, unsigned long timeoutMs)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			if (!Wait(lock, timeoutMs, [this, slot] { return written[slot] || interrupted; }))
+			{
+				return TRANSFER_TIMEOUT;
+			}
+			return interrupted ? TRANSFER_CANCELLED : TRANSFER_DONE;
+		}
+
+		int Read(unsigned char* report, unsigned long timeoutMs)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			if (!Wait(lock, timeoutMs, [this] { return !in.empty() || interrupted; }))
+			{
+				return TRANSFER_TIMEOUT;
+			}
+			if (interrupted)
+			{
+				return TRANSFER_CANCELLED;
+			}
+			memcpy(report, in.front().Report, TRANSFER_REPORT_BYTES);
+			in.pop_front();
+			return TRANSFER_DONE;
+		}
+
+		void Cancel(void)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			while (!out.empty())
+			{
+				written[out.front().Slot] = true;
+				out.pop_front();
+			}
+			changed.notify_all();
+		}
+
+	private:
+		struct Out
+		{
+			unsigned int Slot;
+			unsigned char Report[TRANSFER_REPORT_BYTES];
+		};
+
+		struct In
+		{
+			unsigned char Report[TRANSFER_REPORT_BYTES];
+			unsigned long Frame;
+		};
+
+		template <typename Predicate>
+		bool Wait(std::unique_lock<std::mutex>& lock, unsigned long timeoutMs, Predicate ready)
+		{
+			if (timeoutMs == TRANSFER_INFINITE)
+			{
+				changed.wait(lock, ready);
+				return true;
+			}
+			return changed.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+		}
+
+		void Take(const Out& o, unsigned long frameNumber, std::deque<In>& delayed)
+		{
+			unsigned long offset = PacketAddress(o.Report) * bytesPerAddress;
+			unsigned char bytes = PacketBytes(o.Report);
+
+			written[o.Slot] = true;
+			switch (o.Report[1])
+			{
+			case SIM_PROGRAM_DEVICE:
+				if ((offset + bytes) <= image.size())
+				{
+					memcpy(&image[offset], PacketData(o.Report), bytes);
+				}
+				programReports++;
+				break;
+			case SIM_PROGRAM_COMPLETE:
+				completeReports++;
+				break;
+			case SIM_GET_DATA:
+				{
+					In answer;
+
+					memcpy(answer.Report, o.Report, TRANSFER_REPORT_BYTES);
+					if ((offset + bytes) <= image.size())
+					{
+						memcpy(PacketData(answer.Report), &image[offset], bytes);
+					}
+					answer.Frame = frameNumber + latency;
+					delayed.push_back(answer);
+				}
+				break;
+			}
+		}
+
+		void Run(void)
+		{
+			std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+			std::deque<In> delayed;
+			unsigned long frameNumber = 0;
+
+			while (true)
+			{
+				next += frame;
+				std::this_thread::sleep_until(next);
+				frameNumber++;
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (stop)
+				{
+					return;
+				}
+				//one OUT report per frame, none while stalled
+				if (stalled > 0)
+				{
+					stalled--;
+				}
+				else if (!out.empty())
+				{
+					Take(out.front(), frameNumber, delayed);
+					out.pop_front();
+				}
+				//one IN report per frame
+				if (!delayed.empty() && (delayed.front().Frame <= frameNumber))
+				{
+					if (swapAnswers && (delayed.size() > 1) && ((frameNumber % 3) == 0))
+					{
+						std::swap(delayed[0], delayed[1]);
+					}
+					in.push_back(delayed.front());
+					delayed.pop_front();
+				}
+				changed.notify_all();
+			}
+		}
+
+		std::vector<unsigned char>& image;
+		unsigned int bytesPerAddress;
+		std::chrono::microseconds frame;
+		unsigned int latency;
+		bool swapAnswers;
+		unsigned int stalled;
+		unsigned long programReports;
+		unsigned long completeReports;
+		bool written[TRANSFER_MAX_SLOTS];
+		bool interrupted;
+		bool stop;
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::deque<Out> out;
+		std::deque<In> in;
+		std::thread worker;
+	};
+
+}
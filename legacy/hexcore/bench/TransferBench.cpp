@@ -0,0 +1,398 @@
+/*********************************************************************
+ *
+ *                Transfer engine benchmark
+ *
+ *********************************************************************
+ * FileName:        TransferBench.cpp
+ *
+ * Drives a TransferEngine against the simulated device: reads with the
+ * answers out of order, programs with PROGRAM_COMPLETE after gaps, falls
+ * back to lock-step when the device NAKs and reports a stray answer.
+ * A stalled device is reported within the latency budget learned on the
+ * transfers before, and an interrupted port ends the waits at once.
+ * Then times a read lock-step, with a fixed window of TRANSFER_MAX_SLOTS
+ * and with the adaptive window.
+ *
+ * usage: TransferBench [--check] [--frame US] [--latency FRAMES]
+ *
+ * --check skips the timing and uses short frames; it is what ctest runs.
+ ********************************************************************/
+
+#include "TransferEngine.h"
+#include "SimulatedHid.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+using namespace HexCore;
+using namespace Bench;
+
+namespace {
+
+	const unsigned int bytesPerAddress = 2;
+	const unsigned int bytesPerPacket = 56;
+	const unsigned long waitMs = 2000;
+
+	unsigned char PacketBytesAt(unsigned long address, unsigned long size)
+	{
+		if ((address + (bytesPerPacket / bytesPerAddress)) > size)
+		{
+			return (unsigned char)((size - address) * bytesPerAddress);
+		}
+		return (unsigned char)bytesPerPacket;
+	}
+
+	//Reads size device addresses from 0 into image with GET_DATA, as
+	//  ReadThreadStart does: the requests are built in the slots
+	int ReadAll(TransferEngine& engine, std::vector<unsigned char>& image, unsigned long size)
+	{
+		unsigned char* report;
+		unsigned long address = 0;
+		TransferCompletion done;
+		int result;
+
+		while ((address < size) || (engine.Pending() > 0))
+		{
+			while ((address < size) && engine.CanSend())
+			{
+				report = engine.Reserve();
+				PutPacket(report, SIM_GET_DATA, address, PacketBytesAt(address, size));
+				if (!engine.Send(report, address, true))
+				{
+					return TRANSFER_FAILED;
+				}
+				address += bytesPerPacket / bytesPerAddress;
+			}
+
+			result = engine.Next(&done, waitMs);
+			if (result != TRANSFER_DONE)
+			{
+				return result;
+			}
+			if (!done.Answered || (PacketBytes(done.Report) != PacketBytes(done.Request)))
+			{
+				return TRANSFER_FAILED;
+			}
+			memcpy(&image[done.Key * bytesPerAddress], PacketData(done.Report), PacketBytes(done.Report));
+		}
+		return TRANSFER_DONE;
+	}
+
+	bool Complete(TransferEngine& engine)
+	{
+		unsigned char report[TRANSFER_REPORT_BYTES];
+
+		PutPacket(report, SIM_PROGRAM_COMPLETE, 0, 0);
+		return engine.Drain() && engine.Post(report) && engine.Drain();
+	}
+
+	//Programs size device addresses from 0, leaving out every gap-th packet
+	//  (0 for none) and sending PROGRAM_COMPLETE after each gap, as
+	//  ProgramThreadStart does: the data is copied once, into the slot
+	bool ProgramAll(TransferEngine& engine, const std::vector<unsigned char>& image, unsigned long size, unsigned int gap, unsigned long* completes)
+	{
+		unsigned char* report;
+		unsigned long address;
+		unsigned int packet = 0;
+		bool skipped = false;
+
+		*completes = 0;
+		for (address = 0; address < size; address += bytesPerPacket / bytesPerAddress, packet++)
+		{
+			if ((gap != 0) && ((packet % gap) == (gap - 1)))
+			{
+				skipped = true;
+				continue;
+			}
+			if (skipped)
+			{
+				if (!Complete(engine))
+				{
+					return false;
+				}
+				(*completes)++;
+				skipped = false;
+			}
+			report = engine.Reserve();
+			if (report == 0)
+			{
+				return false;
+			}
+			PutPacket(report, SIM_PROGRAM_DEVICE, address, PacketBytesAt(address, size));
+			memcpy(PacketData(report), &image[address * bytesPerAddress], PacketBytes(report));
+			if (!engine.Post(report))
+			{
+				return false;
+			}
+		}
+		(*completes)++;
+		return Complete(engine);
+	}
+
+	std::vector<unsigned char> RandomImage(unsigned long size, unsigned int seed)
+	{
+		std::vector<unsigned char> image(size * bytesPerAddress);
+		std::mt19937 rng(seed);
+		size_t i;
+
+		for (i = 0; i < image.size(); i++)
+		{
+			image[i] = (unsigned char)rng();
+		}
+		return image;
+	}
+
+	//The RFC 6298 figures, between the floor and the ceiling
+	int CheckBudget(void)
+	{
+		LatencyBudget budget(20, 500, 300);
+		int failures = 0;
+		int i;
+
+		if (budget.TimeoutMs() != 300)
+		{
+			failures++;
+		}
+		budget.Sample(1000);
+		if (budget.TimeoutMs() != 20)
+		{
+			failures++;
+		}
+		//10 ms steady: 10 ms plus a deviation decaying from 5 ms
+		budget.Reset();
+		for (i = 0; i < 40; i++)
+		{
+			budget.Sample(10000);
+		}
+		if ((budget.TimeoutMs() != 20) || (budget.SmoothedMicroseconds() != 10000))
+		{
+			failures++;
+		}
+		//one late answer widens the budget by four times the deviation
+		budget.Sample(50000);
+		if ((budget.TimeoutMs() < 50) || (budget.TimeoutMs() > 70))
+		{
+			failures++;
+		}
+		budget.Sample(10000000);
+		if (budget.TimeoutMs() != 500)
+		{
+			failures++;
+		}
+		if (failures != 0)
+		{
+			std::cout << "latency budget: FAILED" << std::endl;
+		}
+		return failures;
+	}
+
+	int Check(std::chrono::microseconds frame)
+	{
+		const unsigned long size = 0x400 + 3;
+		std::vector<unsigned char> device = RandomImage(size, 1);
+		int failures = 0;
+		unsigned int depth;
+
+		//reads, in and out of order
+		for (depth = 1; depth <= TRANSFER_MAX_SLOTS; depth += 7)
+		{
+			SimulatedHid hid(device, bytesPerAddress, frame, 2, depth > 1);
+			TransferEngine engine(hid, depth, 250, AnswerAddress);
+			std::vector<unsigned char> read(device.size(), 0);
+
+			if ((ReadAll(engine, read, size) != TRANSFER_DONE) || (read != device))
+			{
+				std::cout << "read, depth " << depth << ": FAILED" << std::endl;
+				failures++;
+			}
+			if ((engine.Window() < 1) || (engine.Window() > depth))
+			{
+				failures++;
+			}
+		}
+
+		//programming with gaps
+		{
+			std::vector<unsigned char> expected = RandomImage(size, 2);
+			std::vector<unsigned char> target(device.size(), 0xFF);
+			SimulatedHid hid(target, bytesPerAddress, frame, 1, false);
+			TransferEngine engine(hid, 8, 250, 0);
+			unsigned long completes, i;
+			bool ok;
+
+			ok = ProgramAll(engine, expected, size, 5, &completes);
+			for (i = 0; i < size; i++)
+			{
+				unsigned long packet = (i * bytesPerAddress) / bytesPerPacket;
+
+				if ((packet % 5) == 4)
+				{
+					expected[i * bytesPerAddress] = 0xFF;
+					expected[(i * bytesPerAddress) + 1] = 0xFF;
+				}
+			}
+			if (!ok || (target != expected) || (hid.CompleteReports() != completes))
+			{
+				std::cout << "program: FAILED" << std::endl;
+				failures++;
+			}
+		}
+
+		//a device NAKing longer than the timeout: lock-step, still correct
+		{
+			std::vector<unsigned char> target(device.size(), 0xFF);
+			SimulatedHid hid(target, bytesPerAddress, frame, 1, false);
+			TransferEngine engine(hid, 8, 2, 0);
+			unsigned long completes;
+
+			hid.Stall((unsigned int)(std::chrono::microseconds(20000) / frame));
+			if (!ProgramAll(engine, device, size, 0, &completes) || (target != device) ||
+				!engine.LockStep() || (engine.Window() != 1))
+			{
+				std::cout << "NAK fallback: FAILED" << std::endl;
+				failures++;
+			}
+		}
+
+		//an answer nothing asked for
+		{
+			SimulatedHid hid(device, bytesPerAddress, frame, 1, false);
+			TransferEngine engine(hid, 4, 250, AnswerAddress);
+			unsigned char report[TRANSFER_REPORT_BYTES];
+			TransferCompletion done;
+
+			PutPacket(report, SIM_GET_DATA, 0x40, (unsigned char)bytesPerPacket);
+			if (!engine.Send(report, 0x41, true) || (engine.Next(&done, waitMs) != TRANSFER_UNEXPECTED) ||
+				(PacketAddress(done.Report) != 0x40))
+			{
+				std::cout << "stray answer: FAILED" << std::endl;
+				failures++;
+			}
+			engine.Cancel();
+			if (engine.Pending() != 0)
+			{
+				failures++;
+			}
+		}
+
+		//a device that stops taking reports: reported within the budget
+		//  learned while it worked, not after the initial one
+		{
+			std::vector<unsigned char> target(device.size(), 0xFF);
+			SimulatedHid hid(target, bytesPerAddress, frame, 1, false);
+			TransferEngine engine(hid, 8, 5, 0);
+			LatencyBudget budget(20, 5000, 5000);
+			std::chrono::steady_clock::time_point t0;
+			unsigned long completes, elapsedMs;
+			bool ok;
+
+			engine.SetBudget(&budget);
+			ok = ProgramAll(engine, device, size, 0, &completes) && (budget.TimeoutMs() < 1000);
+			hid.Stall(0xFFFFFFFFU);
+			t0 = std::chrono::steady_clock::now();
+			ok = ok && !ProgramAll(engine, device, size, 0, &completes);
+			elapsedMs = (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+			if (!ok || (elapsedMs >= 1000))
+			{
+				std::cout << "stall, " << elapsedMs << " ms: FAILED" << std::endl;
+				failures++;
+			}
+			engine.Cancel();
+		}
+
+		//an interrupted port ends an infinite wait, and works again once
+		//  rearmed
+		{
+			SimulatedHid hid(device, bytesPerAddress, frame, 1, false);
+			TransferEngine engine(hid, 4, 250, AnswerAddress);
+			std::vector<unsigned char> read(device.size(), 0);
+			unsigned char report[TRANSFER_REPORT_BYTES];
+			TransferCompletion done;
+			std::thread canceller;
+			int result;
+
+			hid.Stall(0xFFFFFFFFU);
+			PutPacket(report, SIM_GET_DATA, 0, (unsigned char)bytesPerPacket);
+			engine.Send(report, 0, true);
+			canceller = std::thread([&hid] {
+				std::this_thread::sleep_for(std::chrono::milliseconds(20));
+				hid.Interrupt();
+			});
+			result = engine.Next(&done, TRANSFER_BUDGET);
+			canceller.join();
+			engine.Cancel();
+			hid.Rearm();
+			hid.Stall(0);
+			if ((result != TRANSFER_CANCELLED) || (ReadAll(engine, read, size) != TRANSFER_DONE) || (read != device))
+			{
+				std::cout << "cancel: FAILED" << std::endl;
+				failures++;
+			}
+		}
+		return failures;
+	}
+
+	void Benchmark(std::chrono::microseconds frame, unsigned int latency)
+	{
+		const unsigned long size = 0x4000;
+		std::vector<unsigned char> device = RandomImage(size, 3);
+		const char* names[] = { "lock-step", "fixed window", "adaptive window" };
+		unsigned int run;
+
+		for (run = 0; run < 3; run++)
+		{
+			SimulatedHid hid(device, bytesPerAddress, frame, latency, false);
+			TransferEngine engine(hid, (run == 0) ? 1 : TRANSFER_MAX_SLOTS, 250, AnswerAddress);
+			std::vector<unsigned char> read(device.size());
+			std::chrono::steady_clock::time_point t0, t1;
+			double seconds;
+
+			engine.SetAdaptive(run == 2);
+			t0 = std::chrono::steady_clock::now();
+			ReadAll(engine, read, size);
+			t1 = std::chrono::steady_clock::now();
+			seconds = std::chrono::duration<double>(t1 - t0).count();
+			std::cout << names[run] << ": " << (seconds * 1000.0) << " ms, " << (device.size() / 1024.0 / seconds)
+				<< " KB/s, window " << engine.Window() << ", min RTT " << engine.MinRttMicroseconds()
+				<< " us, interval " << engine.IntervalMicroseconds() << " us" << std::endl;
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::chrono::microseconds frame(1000);
+	unsigned int latency = 1;
+	bool check = false;
+	int failures;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			check = true;
+		}
+		else if ((strcmp(argv[i], "--frame") == 0) && ((i + 1) < argc))
+		{
+			frame = std::chrono::microseconds(atoi(argv[++i]));
+		}
+		else if ((strcmp(argv[i], "--latency") == 0) && ((i + 1) < argc))
+		{
+			latency = (unsigned int)atoi(argv[++i]);
+		}
+	}
+
+	failures = CheckBudget() + Check(std::chrono::microseconds(50));
+	std::cout << "TransferEngine: " << ((failures == 0) ? "read, program, NAK, stray answers, stall and cancel ok" : "ERRORS") << std::endl;
+	if (!check && (failures == 0))
+	{
+		Benchmark(frame, latency);
+	}
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,251 @@
+/*********************************************************************
+ *
+ *                GET_DATA verify benchmark
+ *
+ *********************************************************************
+ * FileName:        VerifyBench.cpp
+ *
+ * Checks CompareGetData against a port of the compare loop
+ * VerifyThreadStart ran on every answer, then verifies an image against
+ * the simulated HID device (SimulatedHid.h) through a TransferEngine,
+ * lock-step (one request, one answer, as VerifyThreadStart did) and with
+ * several requests in flight, the answers partly out of order.
+ *
+ * usage: VerifyBench [--check] [--frame US] [--latency FRAMES]
+ *
+ * --check verifies a small image with short frames; it is what ctest
+ * runs.
+ ********************************************************************/
+
+#include "SimulatedHid.h"
+#include "TransferEngine.h"
+#include "VerifyCompare.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace Bench;
+using namespace HexCore;
+
+namespace {
+
+	const unsigned int bytesPerAddress = 2;
+	const unsigned int bytesPerPacket = 56;
+
+	//VerifyThreadStart compare loop as it was; the index of the first byte
+	//  that fails, -1 when the answer matches
+	int LegacyCompare(const unsigned char* expected, const unsigned char* received, unsigned int length,
+		unsigned long address, const unsigned char* tempPtr)
+	{
+		unsigned char tempData, tempData2;
+		unsigned int i;
+
+		for (i = 0; i < length; i++)
+		{
+			tempData = expected[i];
+			tempData2 = received[i];
+			if (tempData != tempData2)
+			{
+				if (((i + 1) % 4) == 0)
+				{
+				}
+				else if (address == PIC24_RESET_REMAP_OFFSET)
+				{
+					switch (i)
+					{
+					case 0: if (tempData2 == *tempPtr) { break; } /* fall through */
+					case 1: if (tempData2 == *(tempPtr + 1)) { break; } /* fall through */
+					case 2: if (tempData2 == *(tempPtr + 2)) { break; } /* fall through */
+					case 3: if (tempData2 == *(tempPtr + 3)) { break; } /* fall through */
+					case 4: if (tempData2 == *(tempPtr + 4)) { break; } /* fall through */
+					case 5: if (tempData2 == *(tempPtr + 5)) { break; } /* fall through */
+					default: return (int)i;
+					}
+				}
+				else if (address == 0x00)
+				{
+					switch (i)
+					{
+					case 0: if (tempData2 == 0x00) { break; } /* fall through */
+					case 1: if (tempData2 == 0x04) { break; } /* fall through */
+					case 2: if (tempData2 == 0x04) { break; } /* fall through */
+					case 3: if (tempData2 == 0x00) { break; } /* fall through */
+					case 4: if (tempData2 == 0x00) { break; } /* fall through */
+					case 5: if (tempData2 == 0x00) { break; } /* fall through */
+					default: return (int)i;
+					}
+				}
+				else
+				{
+					return (int)i;
+				}
+			}
+		}
+		return -1;
+	}
+
+	int CheckCompare(void)
+	{
+		static const unsigned long addresses[] = { 0x00, PIC24_RESET_REMAP_OFFSET, 0x2000 };
+		std::mt19937 rng(99);
+		int failures = 0;
+		int round;
+
+		for (round = 0; round < 200000; round++)
+		{
+			unsigned char expected[64], received[64], vector[6];
+			unsigned long address = addresses[round % 3];
+			unsigned int length = 1 + (rng() % bytesPerPacket);
+			unsigned int i, changes = rng() % 4;
+
+			for (i = 0; i < length; i++)
+			{
+				expected[i] = received[i] = (unsigned char)(rng() % 6);
+			}
+			for (i = 0; i < 6; i++)
+			{
+				vector[i] = (unsigned char)(rng() % 6);
+			}
+			while (changes-- > 0)
+			{
+				i = rng() % ((rng() & 1) ? 8 : length);
+				if (i < length)
+				{
+					received[i] = (unsigned char)(rng() % 6);
+				}
+			}
+
+			if (CompareGetData(expected, received, length, address, VERIFY_PIC24_PHANTOM | VERIFY_PIC24_RESET_VECTOR, vector) !=
+				LegacyCompare(expected, received, length, address, vector))
+			{
+				failures++;
+			}
+		}
+		return failures;
+	}
+
+	//Verifies size device addresses from 0 against expected through engine,
+	//  as VerifyThreadStart does; the index of the first failing packet or
+	//  -1 when everything matches, -2 for an answer nothing asked for
+	long Verify(TransferEngine& engine, const std::vector<unsigned char>& expected, unsigned long size)
+	{
+		unsigned char report[TRANSFER_REPORT_BYTES];
+		unsigned long addressToRequest = 0;
+		TransferCompletion done;
+
+		while ((addressToRequest < size) || (engine.Pending() > 0))
+		{
+			while ((addressToRequest < size) && engine.CanSend())
+			{
+				unsigned char bytes = (unsigned char)bytesPerPacket;
+
+				if ((addressToRequest + (bytesPerPacket / bytesPerAddress)) > size)
+				{
+					bytes = (unsigned char)((size - addressToRequest) * bytesPerAddress);
+				}
+				PutPacket(report, SIM_GET_DATA, addressToRequest, bytes);
+				engine.Send(report, addressToRequest, true);
+				addressToRequest += bytesPerPacket / bytesPerAddress;
+			}
+
+			if ((engine.Next(&done, TRANSFER_INFINITE) != TRANSFER_DONE) || (PacketBytes(done.Report) != PacketBytes(done.Request)))
+			{
+				return -2;
+			}
+			if (CompareGetData(&expected[done.Key * bytesPerAddress], PacketData(done.Report), PacketBytes(done.Report), done.Key, VERIFY_PIC24_PHANTOM, 0) >= 0)
+			{
+				return (long)(done.Key / (bytesPerPacket / bytesPerAddress));
+			}
+		}
+		return -1;
+	}
+
+	int Run(bool check, std::chrono::microseconds frame, unsigned int latency)
+	{
+		const unsigned long size = check ? 0x800 : 0x8000;
+		std::vector<unsigned char> image(size * bytesPerAddress);
+		std::vector<unsigned char> expected;
+		std::mt19937 rng(5);
+		int failures = 0;
+		unsigned int depth;
+		size_t i;
+
+		for (i = 0; i < image.size(); i++)
+		{
+			image[i] = ((i % 4) == 3) ? 0 : (unsigned char)rng();
+		}
+		expected = image;
+
+		for (depth = 1; depth <= TRANSFER_MAX_SLOTS; depth = (depth == 1) ? 4 : (depth + 11))
+		{
+			std::chrono::steady_clock::time_point t0, t1;
+			long result;
+
+			{
+				SimulatedHid device(image, bytesPerAddress, frame, latency, depth > 1);
+				TransferEngine engine(device, depth, 250, AnswerAddress);
+
+				t0 = std::chrono::steady_clock::now();
+				result = Verify(engine, expected, size);
+				t1 = std::chrono::steady_clock::now();
+			}
+			if (result != -1)
+			{
+				std::cout << "window " << depth << ": verify failed (" << result << ")" << std::endl;
+				failures++;
+			}
+			std::cout << "window " << depth << ": " << (std::chrono::duration<double>(t1 - t0).count() * 1000.0) << " ms, "
+				<< (size * bytesPerAddress / 1024.0 / std::chrono::duration<double>(t1 - t0).count()) << " KB/s" << std::endl;
+		}
+
+		//a wrong byte must be found whatever the window
+		expected[(size * bytesPerAddress) / 2 + 1] ^= 0x10;
+		{
+			SimulatedHid device(image, bytesPerAddress, frame, latency, true);
+			TransferEngine engine(device, TRANSFER_MAX_SLOTS, 250, AnswerAddress);
+
+			if (Verify(engine, expected, size) != (long)(((size * bytesPerAddress) / 2 + 1) / bytesPerPacket))
+			{
+				std::cout << "mismatch not found" << std::endl;
+				failures++;
+			}
+			engine.Cancel();
+		}
+		return failures;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::chrono::microseconds frame(1000);
+	unsigned int latency = 1;
+	bool check = false;
+	int failures;
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--check") == 0)
+		{
+			check = true;
+			frame = std::chrono::microseconds(50);
+		}
+		else if ((strcmp(argv[i], "--frame") == 0) && ((i + 1) < argc))
+		{
+			frame = std::chrono::microseconds(atoi(argv[++i]));
+		}
+		else if ((strcmp(argv[i], "--latency") == 0) && ((i + 1) < argc))
+		{
+			latency = (unsigned int)atoi(argv[++i]);
+		}
+	}
+
+	failures = CheckCompare();
+	std::cout << "CompareGetData: " << ((failures == 0) ? "matches the VerifyThreadStart rules" : "MISMATCH") << std::endl;
+	failures += Run(check, frame, latency);
+	return (failures == 0) ? 0 : 1;
+}
@@ -6,7 +6,7 @@
 import os
 import glob
 
-from setuptools import setup, find_packages
+from setuptools import setup, find_packages, Extension
 from runpy import run_path
 
 here = os.path.abspath(os.path.dirname(__file__))
@@ -19,6 +19,20 @@ with open(os.path.join(here, 'README.md'), encoding='utf-8') as f:
 
 __app_name__ = 'alfa_fw_upgrader'
 
+# native helpers shared with the Windows GUI (legacy/hexcore); optional:
+# hexutils falls back to pure Python when the build fails
+hexcore_dir = os.path.join('legacy', 'hexcore')
+hexcore_ext = Extension(
+    'alfa_fw_upgrader._hexcore',
+    sources=[os.path.join('src', 'alfa_fw_upgrader', '_hexcore.cpp')] + [
+        os.path.join(hexcore_dir, f) for f in (
+            'HexDecode.cpp', 'HexImage.cpp', 'HexParser.cpp', 'HexWriter.cpp')],
+    include_dirs=[hexcore_dir],
+    language='c++',
+    extra_compile_args=[] if os.name == 'nt' else ['-std=c++14', '-O2'],
+    optional=True,
+)
+
 
 def main():
     setup(
@@ -40,6 +54,7 @@ def main():
         packages=find_packages(where='src'),
         package_dir={'': 'src'},
         package_data={'alfa_fw_upgrader': ['data/templates/*']},
+        ext_modules=[hexcore_ext],
         scripts=[
             'bin/alfa_fw_upgrader_gui',
             'bin/alfa_fw_upgrader_gui.py',
@@ -57,6 +72,10 @@ def main():
             'crc',
             'dataclasses'
         ],
+        extras_require={
+            # asynchronous USB backend, see alfa_fw_upgrader.usb_async
+            'async': ['libusb1'],
+        },
 
 
     )
@@ -0,0 +1,258 @@
+/*
+ * alfa_fw_upgrader._hexcore - native Intel HEX and memory image helpers.
+ *
+ * Thin CPython wrapper around the portable core in legacy/hexcore, the
+ * same code the Windows GUI uses.  hexutils.py falls back to its pure
+ * Python implementation when this module is not built.
+ *
+ * decode(text) -> (extents, top)
+ *     extents is a list of (address, bytearray) with the data of
+ *     consecutive records joined, in file order; top is the highest
+ *     address written.  Raises ValueError("line N: ...") on bad records.
+ * encode(extents, record_length=16) -> bytes
+ *     Intel HEX text (EOF record included) of an iterable of
+ *     (address, buffer).
+ * fill_erased(buffer, address, phantom=True)
+ *     fills a writable buffer with erased flash content.
+ * crc16_ccitt(buffer, crc=0) -> int
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <string>
+
+#include "HexImage.h"
+#include "HexParser.h"
+#include "HexWriter.h"
+
+namespace {
+
+struct DecodeContext
+{
+    PyObject *extents;
+    PyObject *current;
+    unsigned long start;
+    unsigned long end;
+    unsigned long top;
+    bool failed;
+};
+
+bool flush_extent(DecodeContext *ctx)
+{
+    if (ctx->current == NULL)
+        return true;
+
+    PyObject *item = Py_BuildValue("(kO)", ctx->start, ctx->current);
+    Py_CLEAR(ctx->current);
+    if (item == NULL)
+        return false;
+    int rc = PyList_Append(ctx->extents, item);
+    Py_DECREF(item);
+    return rc == 0;
+}
+
+void on_record(void *context, unsigned long address, const unsigned char *data, unsigned int length)
+{
+    DecodeContext *ctx = static_cast<DecodeContext *>(context);
+
+    if (ctx->failed || length == 0)
+        return;
+
+    if (address + length - 1 > ctx->top)
+        ctx->top = address + length - 1;
+
+    // records usually follow each other: grow the current extent in place
+    if (ctx->current != NULL && address == ctx->end) {
+        Py_ssize_t size = PyByteArray_GET_SIZE(ctx->current);
+        if (PyByteArray_Resize(ctx->current, size + length) < 0) {
+            ctx->failed = true;
+            return;
+        }
+        memcpy(PyByteArray_AS_STRING(ctx->current) + size, data, length);
+        ctx->end += length;
+        return;
+    }
+
+    if (!flush_extent(ctx)) {
+        ctx->failed = true;
+        return;
+    }
+    ctx->current = PyByteArray_FromStringAndSize(reinterpret_cast<const char *>(data), length);
+    if (ctx->current == NULL) {
+        ctx->failed = true;
+        return;
+    }
+    ctx->start = address;
+    ctx->end = address + length;
+}
+
+PyObject *hexcore_decode(PyObject *, PyObject *args)
+{
+    PyObject *source;
+    Py_buffer view;
+    const char *text;
+    Py_ssize_t length;
+
+    if (!PyArg_ParseTuple(args, "O:decode", &source))
+        return NULL;
+
+    view.obj = NULL;
+    if (PyUnicode_Check(source)) {
+        text = PyUnicode_AsUTF8AndSize(source, &length);
+        if (text == NULL)
+            return NULL;
+    } else {
+        if (PyObject_GetBuffer(source, &view, PyBUF_SIMPLE) < 0)
+            return NULL;
+        text = static_cast<const char *>(view.buf);
+        length = view.len;
+    }
+
+    DecodeContext ctx = { PyList_New(0), NULL, 0, 0, 0, false };
+    HexCore::HEX_PARSE_RESULT result = { HEX_PARSE_SUCCESS, 0, 0 };
+
+    if (ctx.extents != NULL) {
+        result = HexCore::ParseHexRecords(text, static_cast<size_t>(length), on_record, &ctx);
+        if (!ctx.failed && !flush_extent(&ctx))
+            ctx.failed = true;
+    }
+    Py_XDECREF(ctx.current);
+    if (view.obj != NULL)
+        PyBuffer_Release(&view);
+
+    if (ctx.extents == NULL || ctx.failed) {
+        Py_XDECREF(ctx.extents);
+        return NULL;
+    }
+
+    if (result.Status != HEX_PARSE_SUCCESS) {
+        const char *what;
+        switch (result.Status) {
+        case HEX_PARSE_NO_COLON:
+            what = "invalid format";
+            break;
+        case HEX_PARSE_CHECKSUM_ERROR:
+            what = "invalid checksum";
+            break;
+        case HEX_PARSE_TRUNCATED_RECORD:
+            what = "truncated record";
+            break;
+        default:
+            what = "invalid character";
+            break;
+        }
+        Py_DECREF(ctx.extents);
+        PyErr_Format(PyExc_ValueError, "line %lu: %s", result.Line, what);
+        return NULL;
+    }
+
+    return Py_BuildValue("(Nk)", ctx.extents, ctx.top);
+}
+
+bool append_text(void *context, const char *text, size_t length)
+{
+    static_cast<std::string *>(context)->append(text, length);
+    return true;
+}
+
+PyObject *hexcore_encode(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "extents", "record_length", NULL };
+    PyObject *extents;
+    unsigned int record_length = 16;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|I:encode", const_cast<char **>(keywords),
+                                     &extents, &record_length))
+        return NULL;
+
+    PyObject *iterator = PyObject_GetIter(extents);
+    if (iterator == NULL)
+        return NULL;
+
+    std::string text;
+    HexCore::HexWriter *writer = new HexCore::HexWriter(append_text, &text, record_length);
+    PyObject *item;
+    bool ok = true;
+
+    while (ok && (item = PyIter_Next(iterator)) != NULL) {
+        unsigned long address;
+        Py_buffer view;
+
+        ok = PyArg_ParseTuple(item, "ky*", &address, &view) != 0;
+        if (ok) {
+            writer->Write(address, static_cast<const unsigned char *>(view.buf), static_cast<size_t>(view.len));
+            PyBuffer_Release(&view);
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(iterator);
+
+    if (ok && !PyErr_Occurred())
+        writer->End();
+    delete writer;
+
+    if (!ok || PyErr_Occurred())
+        return NULL;
+    return PyBytes_FromStringAndSize(text.data(), static_cast<Py_ssize_t>(text.size()));
+}
+
+PyObject *hexcore_fill_erased(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = { "buffer", "address", "phantom", NULL };
+    Py_buffer view;
+    unsigned long address;
+    int phantom = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "w*k|p:fill_erased", const_cast<char **>(keywords),
+                                     &view, &address, &phantom))
+        return NULL;
+
+    HexCore::FillErased(static_cast<unsigned char *>(view.buf), static_cast<size_t>(view.len),
+                        address, phantom != 0);
+    PyBuffer_Release(&view);
+    Py_RETURN_NONE;
+}
+
+PyObject *hexcore_crc16_ccitt(PyObject *, PyObject *args)
+{
+    Py_buffer view;
+    unsigned int crc = 0;
+
+    if (!PyArg_ParseTuple(args, "y*|I:crc16_ccitt", &view, &crc))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    crc = HexCore::Crc16Ccitt(static_cast<const unsigned char *>(view.buf), static_cast<size_t>(view.len),
+                              static_cast<unsigned short>(crc));
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&view);
+    return PyLong_FromUnsignedLong(crc);
+}
+
+PyMethodDef hexcore_methods[] = {
+    { "decode", hexcore_decode, METH_VARARGS,
+      "decode(text) -> (extents, top): data records of an Intel HEX file" },
+    { "encode", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(hexcore_encode)),
+      METH_VARARGS | METH_KEYWORDS,
+      "encode(extents, record_length=16) -> bytes: Intel HEX text" },
+    { "fill_erased", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(hexcore_fill_erased)),
+      METH_VARARGS | METH_KEYWORDS,
+      "fill_erased(buffer, address, phantom=True): erased flash content" },
+    { "crc16_ccitt", hexcore_crc16_ccitt, METH_VARARGS,
+      "crc16_ccitt(buffer, crc=0) -> int" },
+    { NULL, NULL, 0, NULL }
+};
+
+struct PyModuleDef hexcore_module = {
+    PyModuleDef_HEAD_INIT, "_hexcore", "native Intel HEX and memory image helpers", -1, hexcore_methods,
+    NULL, NULL, NULL, NULL
+};
+
+}
+
+PyMODINIT_FUNC PyInit__hexcore(void)
+{
+    return PyModule_Create(&hexcore_module);
+}
@@ -11,6 +11,7 @@ alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bo
 # pylint: disable=consider-using-f-string
 
 import argparse
+import signal
 import sys
 import traceback
 import logging
@@ -25,8 +26,10 @@ import eel
 from appdirs import AppDirs
 
 from alfa_fw_upgrader.fw_loader import AlfaFirmwareLoader
-from alfa_fw_upgrader.package_loader import AlfaPackageLoader
 from alfa_fw_upgrader.hexutils import HexUtils
+from alfa_fw_upgrader.usb import USB_BACKENDS
+from alfa_fw_upgrader.package_loader import AlfaPackageLoader
+from alfa_fw_upgrader.image_cache import ImageCache
 from alfa_fw_upgrader.data import templates
 
 if sys.version_info >= (3, 9):
@@ -47,6 +50,20 @@ if __package__ is None:
 
 HERE = os.path.dirname(os.path.abspath(__file__))
 USERDIR = AppDirs("alfa_fw_upgrader", "alfa").user_data_dir
+IMAGE_CACHE = ImageCache(os.path.join(USERDIR, "image_cache"))
+
+
+def sample_rate(text):
+    """ argparse type of --unsafe-verify-sample: a fraction in (0, 1] """
+
+    try:
+        rate = float(text)
+    except ValueError:
+        rate = 0.0
+    if not 0 < rate <= 1:
+        raise argparse.ArgumentTypeError(
+            f"{text} is not a fraction between 0 and 1")
+    return rate
 
 
 class GUIApplication:
@@ -63,7 +80,11 @@ class GUIApplication:
         "expert": False,
         "http_port": 8070,
         "cmd_connect": None,
-        "cmd_disconnect": None
+        "cmd_disconnect": None,
+        "skip_identical": False,
+        "unsafe_verify_sample_rate": None,
+        "interleave_verify": False,
+        "usb_backend": "sync"
     }
 
     def _get_output(self, error_key, format_arg=None):
@@ -94,7 +115,8 @@ class GUIApplication:
                     use_serial_proto=self.settings["strategy"] == "serial",
                     polling_mode=self.settings["strategy"] == "polling",
                     serial_port=self.settings["serial_port"],
-                    is_serial_proto_duplex=self.settings["serial_mode"] == "duplex")
+                    is_serial_proto_duplex=self.settings["serial_mode"] == "duplex",
+                    usb_backend=self.settings.get("usb_backend", "sync"))
                 eel.update_process_js({"result": "ok", "output": ""})
 
             except Exception as e:
@@ -176,7 +198,10 @@ class GUIApplication:
                 return
 
             try:
-                if not self.ufl.verify(self.program_data, check_digest=False):
+                if not self.ufl.verify(
+                        self.program_data, check_digest=False,
+                        sample_rate=self.settings.get(
+                            "unsafe_verify_sample_rate")):
                     eel.update_process_js({
                         "result": "fail",
                         "output": self._get_output("VERIFY_DATA_MISMATCH")})
@@ -283,6 +308,8 @@ class GUIApplication:
 
         self.worker = None
         self.stop_request = False
+        # the AlfaPackageLoader of the worker, cancelled on stop
+        self.apl = None
 
         self.userdata_path = USERDIR
 
@@ -317,7 +344,7 @@ class GUIApplication:
             self._set_logging_stream()
             logging.info("processing hex file")
             try:
-                self.program_data = HexUtils.load_hex_to_array(file_content)
+                self.program_data = IMAGE_CACHE.load_hex(file_content)
                 eel.update_process_js({
                     "result": "ok",
                     "output": ""})
@@ -341,6 +368,10 @@ class GUIApplication:
             if setup_dict['action'] != "start":
                 logging.info("Stop request")
                 self.stop_request = True
+                apl = self.apl
+                if apl is not None:
+                    # abort the USB transfer in progress as well
+                    apl.cancel()
                 return
 
             incoming_data = setup_dict['filedata']
@@ -396,8 +427,15 @@ class GUIApplication:
 
             return self.stop_request
 
-        apl = AlfaPackageLoader(filedata, self.settings["serial_port"],
-                                callback)
+        apl = AlfaPackageLoader(
+            filedata, self.settings["serial_port"], callback,
+            image_cache=IMAGE_CACHE,
+            skip_identical=self.settings.get("skip_identical", False),
+            unsafe_verify_sample_rate=self.settings.get(
+                "unsafe_verify_sample_rate"),
+            interleave_verify=self.settings.get("interleave_verify", False),
+            usb_backend=self.settings.get("usb_backend", "sync"))
+        self.apl = apl
 
         print("Starting to update...")
         try:
@@ -414,6 +452,7 @@ class GUIApplication:
             traceback.print_exc(file=sys.stderr)
         else:
             eel.update_process_js({"result": "ok", "output": ""})
+        self.apl = None
         self.exec_disconnect()
         logging.info("Update finished")
 
@@ -486,6 +525,7 @@ class Application:
 - update: program and verify boards according to given package file
 - program: program and verify the application memory with given hex file
 - verify: verify the application memory against the given hex file
+- readback: save the application memory to the hex file given with -o
 - info: get memory parameters and boot version
 - reset: send command to reset slaves and the board
 - jump: send command to jump to main program
@@ -496,9 +536,29 @@ To perform program and verify,
  > alfa_fw_upgrader -f master_tinting-boot.hex program verify
 
 To perform verify only, with debug info and reset,
- > alfa_fw_upgrader -vv -f master_tinting-boot.hex verify reset'''
+ > alfa_fw_upgrader -vv -f master_tinting-boot.hex verify reset
+
+To save the application memory of a board,
+ > alfa_fw_upgrader -o board.hex readback
 
-    actions = ('update', 'info', 'program', 'verify', 'jump', 'reset')
+To program only the boards not already running their program of a package,
+ > alfa_fw_upgrader --skip-identical -f package.zip update
+
+To read back a random tenth of the program instead of all of it, UNSAFE:
+the rest is not checked, the digest is only the one the tool sends,
+ > alfa_fw_upgrader --unsafe-verify-sample 0.1 -f board.hex program
+
+To read back each flash row as soon as it is written, while the next ones
+are programmed,
+ > alfa_fw_upgrader --interleave-verify -f master_tinting-boot.hex program
+
+To program a simulated bootloader, started with
+ > python -m alfa_fw_upgrader.simulator --port 8071
+run
+ > alfa_fw_upgrader --simulator localhost:8071 -f master_tinting-boot.hex program'''
+
+    actions = ('update', 'info', 'program', 'verify', 'readback', 'jump',
+               'reset')
 
     errors_dict = {
         "FILENAME_REQUIRED": {
@@ -554,12 +614,45 @@ To perform verify only, with debug info and reset,
         "DIGEST_FAILED": {
             "descr": "Failed to set digest value ({})",
             "retcode": 10
+        },
+        "OUTPUT_REQUIRED": {
+            "descr": "Output filename is required with selected action(s)",
+            "retcode": 11
+        },
+        "READBACK_FAILED": {
+            "descr": "Failed to read back the application memory ({})",
+            "retcode": 12
+        },
+        "CANCELLED": {
+            "descr": "Cancelled by the user",
+            "retcode": 13
         }
     }
 
+    # the loader whose USB transfers Ctrl-C aborts, see _interrupt()
+    _running = None
+    cancelled = False
+
+    def _interrupt(self, signum, frame):
+        """ SIGINT handler: the first Ctrl-C cancels the USB transfers of the
+        loader running, which then fails within its latency budget and the
+        action in progress exits with CANCELLED; without one, or at the
+        second Ctrl-C, KeyboardInterrupt as usual """
+
+        signal.signal(signal.SIGINT, signal.default_int_handler)
+        if self._running is None:
+            raise KeyboardInterrupt
+        logging.warning("cancelling")
+        self.cancelled = True
+        self._running.cancel()
+
     def _exit_error(self, error_key, format_arg=None):
         pr_exc = self.args.verbosity is not None
 
+        if self.cancelled:
+            # the action failed because its transfers were cancelled
+            error_key, format_arg = "CANCELLED", None
+
         error_item = self.errors_dict[error_key]
         descr = error_item["descr"] if not format_arg else \
             error_item["descr"].format(format_arg)
@@ -594,6 +687,13 @@ To perform verify only, with debug info and reset,
             type=str,
             help='filename of the IntelHex file or update package to load')
 
+        parser.add_argument(
+            '-o',
+            '--output',
+            dest='output',
+            type=str,
+            help='filename of the IntelHex file written by readback')
+
         parser.add_argument(
             '-d',
             '--deviceid',
@@ -638,6 +738,62 @@ To perform verify only, with debug info and reset,
             "- duplex (default): RS232 "
             "- multidrop: RS485")
 
+        parser.add_argument(
+            '-b',
+            '--usb-backend',
+            dest='usb_backend',
+            choices=USB_BACKENDS,
+            default=os.environ.get("ALFA_FW_USB_BACKEND", "sync"),
+            help="USB implementation:"
+            "- sync (default): one pyusb call per message "
+            "- async: libusb asynchronous transfers, several messages in "
+            "flight while programming and verifying (needs python-libusb1) "
+            "- auto: async if available, otherwise sync "
+            "(default: ALFA_FW_USB_BACKEND, else sync)")
+
+        parser.add_argument(
+            '--simulator',
+            dest='simulator',
+            type=str,
+            metavar='HOST:PORT',
+            default=os.environ.get("ALFA_FW_SIMULATOR"),
+            help="talk to the bootloader simulator listening on HOST:PORT "
+            "(python -m alfa_fw_upgrader.simulator) instead of the USB "
+            "device (default: ALFA_FW_SIMULATOR)")
+
+        parser.add_argument(
+            '--skip-identical',
+            dest='skip_identical',
+            action='store_true',
+            help="with program and update, leave alone the boards whose "
+            "application digest shows they already run the given program "
+            "(needs boot protocol version > 0)")
+
+        parser.add_argument(
+            '--unsafe-verify-sample',
+            dest='sample_rate',
+            type=sample_rate,
+            metavar='RATE',
+            help="UNSAFE: with program and update, read back after "
+            "programming only this fraction (0 to 1) of the chunks, chosen at "
+            "random; the others are not checked, the bootloader only stores "
+            "the digest it is sent (default: read back all of them)")
+
+        parser.add_argument(
+            '--verify-seed',
+            dest='seed',
+            type=int,
+            help="seed of the chunks sampled by --unsafe-verify-sample, as "
+            "logged by a previous run (default: random)")
+
+        parser.add_argument(
+            '--interleave-verify',
+            dest='interleave',
+            action='store_true',
+            help="with program and update, read back each flash row right "
+            "after it is written, while the next ones are programmed, rather "
+            "than all of them after programming")
+
         parser.add_argument("-v", "--verbosity", action="count",
                             help="increase output verbosity")
 
@@ -659,6 +815,10 @@ To perform verify only, with debug info and reset,
             format="[%(asctime)s]%(levelname)s %(funcName)s() "
                    "%(filename)s:%(lineno)d %(message)s")
 
+        if self.args.sample_rate is not None:
+            print("WARNING: --unsafe-verify-sample reads back only part of "
+                  "the program, the rest is not checked")
+
         if 'update' in self.args.actions:
             if self.args.filename is None:
                 self._exit_error("FILENAME_REQUIRED")
@@ -685,7 +845,17 @@ To perform verify only, with debug info and reset,
                     problems.append(problem)
                     print("WARNING: ", problem)
 
-            apl = AlfaPackageLoader(zip_data, self.args.serialport, callback)
+            apl = AlfaPackageLoader(zip_data, self.args.serialport, callback,
+                                    image_cache=IMAGE_CACHE,
+                                    skip_identical=self.args.skip_identical,
+                                    unsafe_verify_sample_rate=(
+                                        self.args.sample_rate),
+                                    verify_seed=self.args.seed,
+                                    interleave_verify=self.args.interleave,
+                                    usb_backend=self.args.usb_backend,
+                                    simulator=self.args.simulator)
+            self._running = apl
+            signal.signal(signal.SIGINT, self._interrupt)
 
             print("Starting to update...")
             try:
@@ -694,6 +864,8 @@ To perform verify only, with debug info and reset,
                 self._exit_error("UPDATE_FAILED", str(e))
 
             print("Update finished")
+            for name in apl.up_to_date:
+                print(f" - {name} up to date")
 
             if len(problems) > 0:
                 print("but the following problem occurred:")
@@ -710,22 +882,27 @@ To perform verify only, with debug info and reset,
                     self._exit_error("FILENAME_REQUIRED")
                 fn = self.args.filename
                 try:
-                    with open(fn, 'r') as f:
-                        file_content = f.read()
-                        program_data = HexUtils.load_hex_to_array(
-                            file_content)
+                    with open(fn, 'rb') as f:
+                        program_data = IMAGE_CACHE.load_hex(f.read())
                 except BaseException:
                     self._exit_error("FILE_LOAD_FAILED", fn)
 
+            if 'readback' in actions and self.args.output is None:
+                self._exit_error("OUTPUT_REQUIRED")
+
             try:
                 ufl = AlfaFirmwareLoader(
                     device_id=self.args.ID,
                     use_serial_proto=self.args.strategy == "serial",
                     is_serial_proto_duplex=self.args.serial_mode == "duplex",
                     polling_mode=self.args.strategy == "polling",
-                    serial_port=self.args.serialport)
+                    serial_port=self.args.serialport,
+                    usb_backend=self.args.usb_backend,
+                    simulator=self.args.simulator)
             except Exception as e:
                 self._exit_error("INIT_FAILED", str(e))
+            self._running = ufl
+            signal.signal(signal.SIGINT, self._interrupt)
 
             for a in actions:
                 if a == 'info':
@@ -776,20 +953,43 @@ To perform verify only, with debug info and reset,
                         print("Application digest: N/A")
 
                 elif a == 'program':
+                    try:
+                        up_to_date = self.args.skip_identical and \
+                            ufl.is_up_to_date(program_data)
+                    except BaseException as e:
+                        self._exit_error("PROGRAM_FAILED", str(e))
+                    if up_to_date:
+                        print("Application up to date")
+                        continue
                     try:
                         ufl.erase()
                     except BaseException:
                         self._exit_error("ERASE_FAILED")
-                    try:
-                        ufl.program(program_data)
-                    except BaseException:
-                        self._exit_error("PROGRAM_FAILED")
-                    try:
-                        if not ufl.verify(
-                                program_data, check_digest=False):
+                    if self.args.interleave:
+                        try:
+                            rows = ufl.program_verify(
+                                program_data,
+                                sample_rate=self.args.sample_rate,
+                                seed=self.args.seed)
+                        except BaseException:
+                            self._exit_error("PROGRAM_FAILED")
+                        if rows:
+                            print("Rows differing: {}".format(", ".join(
+                                f"{row:#x}" for row in rows)))
                             self._exit_error("VERIFY_DATA_MISMATCH")
-                    except BaseException:
-                        self._exit_error("VERIFY_FAILED")
+                    else:
+                        try:
+                            ufl.program(program_data)
+                        except BaseException:
+                            self._exit_error("PROGRAM_FAILED")
+                        try:
+                            if not ufl.verify(
+                                    program_data, check_digest=False,
+                                    sample_rate=self.args.sample_rate,
+                                    seed=self.args.seed):
+                                self._exit_error("VERIFY_DATA_MISMATCH")
+                        except BaseException:
+                            self._exit_error("VERIFY_FAILED")
                     try:
                         ufl.seal(program_data)
                     except BaseException:
@@ -801,6 +1001,13 @@ To perform verify only, with debug info and reset,
                             self._exit_error("VERIFY_DATA_MISMATCH")
                     except BaseException:
                         self._exit_error("VERIFY_FAILED")
+                elif a == 'readback':
+                    try:
+                        image = ufl.read_back()
+                        with open(self.args.output, 'w', newline='') as f:
+                            f.write(HexUtils.image_to_hex(image))
+                    except BaseException as e:
+                        self._exit_error("READBACK_FAILED", str(e))
                 elif a == 'reset':
                     try:
                         ufl.reset()
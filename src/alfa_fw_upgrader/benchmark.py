@@ -0,0 +1,329 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module times the whole update of a board against the bootloader
+simulator (see simulator), for regression tracking of the transports, of
+the programming pipeline and of the hex parser:
+
+  python -m alfa_fw_upgrader.benchmark -o benchmark.json [hex files]
+
+Each hex file (by default the sample images under tests/) is run with
+each USB backend on a freshly erased simulated board: load (parsing the
+hex file), connect, erase, program, verify, seal and jump, each phase
+timed on its own; with --interleave-verify a single program_verify phase
+replaces program and verify. For each phase the JSON report gives:
+
+- wall_s, and cpu_s: CPU time of the thread running the loader, the one
+  the parser and the USB backends spend; process_cpu_s adds the other
+  threads, the simulated device included;
+- packets and bytes: messages sent and data bytes carried by PROGRAM and
+  GET_DATA, with their rate over the wall time;
+- latency_ms: percentiles, by command, of the time from a message being
+  written to its answer (QUERY, GET_DATA) or to the device taking it
+  (every other command), as the host sees it.
+"""
+
+# pylint: disable=invalid-name
+# pylint: disable=logging-fstring-interpolation
+
+import argparse
+import collections
+import glob
+import json
+import logging
+import platform
+import sys
+import threading
+import time
+from typing import Callable, NoReturn
+
+from alfa_fw_upgrader import hexutils, simulator
+from alfa_fw_upgrader.fw_loader import AlfaFirmwareLoader
+from alfa_fw_upgrader.hexutils import HexUtils
+from alfa_fw_upgrader.session import DeviceSession
+from alfa_fw_upgrader.usb import USBManager
+from alfa_fw_upgrader.usb_async import AsyncUSBManager
+
+DEFAULT_IMAGES = ('tests/*.hex', 'tests/compatibility_tests/**/hex/*.hex')
+""" hex files run when none is given, relative to the current directory """
+
+BACKENDS = collections.OrderedDict((
+    ("sync", USBManager),
+    ("async", AsyncUSBManager),
+))
+
+PERCENTILES = (50, 90, 99)
+
+# commands the device answers; the others complete when it takes them
+ANSWERED = (USBManager.CMD_ID_QUERY, USBManager.CMD_ID_VERIFY,
+            USBManager.CMD_ID_BOOT_FW_VERSION_REQUEST)
+
+
+class Recorder:
+    """ the messages of a run: (command id, latency in seconds, data
+    bytes), taken a phase at a time """
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._samples = []
+
+    def add(self, command: int, seconds: float, payload: int) -> NoReturn:
+        with self._lock:
+            self._samples.append((command, seconds, payload))
+
+    def take(self) -> list:
+        """ the messages since the last call """
+
+        with self._lock:
+            samples, self._samples = self._samples, []
+        return samples
+
+
+class RecordingTransport(simulator.SimulatedTransport):
+    """ SimulatedTransport recording the latency of each message """
+
+    def __init__(self, device: simulator.BootloaderSimulator,
+                 recorder: Recorder):
+        # messages not taken by the device yet, in order: (report, time)
+        self._untaken = collections.deque()
+        # messages waiting for their answer, by answer key
+        self._unanswered = collections.defaultdict(collections.deque)
+        self._recorder = recorder
+        super().__init__(device)
+
+    @staticmethod
+    def _key(report) -> tuple:
+        # GET_DATA answers come back by address
+        if report[0] == USBManager.CMD_ID_VERIFY:
+            return (report[0], bytes(report[1:5]))
+        return (report[0],)
+
+    def _submit(self, report):
+        self._untaken.append((report, time.perf_counter()))
+        super()._submit(report)
+
+    def taken(self):
+        report, start = self._untaken.popleft()
+        if report[0] in ANSWERED:
+            self._unanswered[self._key(report)].append(start)
+        else:
+            payload = report[5] if report[0] == USBManager.CMD_ID_PROGRAM \
+                else 0
+            self._recorder.add(report[0], time.perf_counter() - start,
+                               payload)
+        super().taken()
+
+    def answer(self, report):
+        pending = self._unanswered.get(self._key(report))
+        if pending:
+            payload = report[5] if report[0] == USBManager.CMD_ID_VERIFY \
+                else 0
+            self._recorder.add(report[0], time.perf_counter()
+                               - pending.popleft(), payload)
+        super().answer(report)
+
+
+def percentile(ordered: list, p: float) -> float:
+    """ nearest-rank percentile p of a sorted, non empty list """
+
+    rank = max(int(-(-len(ordered) * p // 100)), 1)
+    return ordered[rank - 1]
+
+
+def phase_report(wall: float, cpu: float, process_cpu: float,
+                 samples: list) -> dict:
+    """ the figures of a phase, see the module documentation """
+
+    latencies = collections.defaultdict(list)
+    payload = 0
+    for command, seconds, length in samples:
+        latencies[command].append(seconds * 1000)
+        payload += length
+
+    report = collections.OrderedDict((
+        ("wall_s", wall),
+        ("cpu_s", cpu),
+        ("process_cpu_s", process_cpu),
+        ("packets", len(samples)),
+        ("bytes", payload),
+        ("packets_per_s", len(samples) / wall if wall else 0.0),
+        ("bytes_per_s", payload / wall if wall else 0.0),
+        ("latency_ms", collections.OrderedDict()),
+    ))
+    for command in sorted(latencies):
+        ordered = sorted(latencies[command])
+        figures = collections.OrderedDict(count=len(ordered))
+        for p in PERCENTILES:
+            figures[f"p{p}"] = percentile(ordered, p)
+        figures["max"] = ordered[-1]
+        name = simulator.COMMAND_NAMES.get(command, f"{command:#04x}")
+        report["latency_ms"][name] = figures
+    return report
+
+
+def run_image(filename: str, backend: str, make_device: Callable,
+              interleave=False) -> dict:
+    """ update a simulated board with the hex file filename, through the
+    USB backend backend
+
+    :parameter make_device: a callable returning a new, erased
+      BootloaderSimulator
+    :parameter interleave: program and verify with
+      AlfaFirmwareLoader.program_verify()
+    """
+
+    recorder = Recorder()
+    phases = collections.OrderedDict()
+    result = collections.OrderedDict((
+        ("image", filename),
+        ("backend", backend),
+        ("verified", False),
+        ("phases", phases),
+    ))
+
+    def phase(name, call):
+        recorder.take()
+        start = (time.perf_counter(), time.thread_time(), time.process_time())
+        try:
+            return call()
+        finally:
+            wall, cpu, process_cpu = (
+                end - begin for end, begin in zip(
+                    (time.perf_counter(), time.thread_time(),
+                     time.process_time()), start))
+            phases[name] = phase_report(wall, cpu, process_cpu,
+                                        recorder.take())
+
+    with open(filename, 'rb') as f:
+        content = f.read()
+    image = phase("load", lambda: HexUtils.load_hex_to_image(
+        content.decode()))
+
+    device = make_device()
+    manager_class = BACKENDS[backend]
+    session = DeviceSession(opener=lambda device_id: manager_class(
+        device_id, RecordingTransport(device, recorder)))
+    try:
+        loader = phase("connect", lambda: AlfaFirmwareLoader(
+            simulator.MASTER_DEVICE_ID, False, False, None, True,
+            session=session))
+        segment, _ = loader._program_data_process(image)
+        result["segment_bytes"] = len(segment)
+        phase("erase", loader.erase)
+        if interleave:
+            result["verified"] = not phase(
+                "program_verify", lambda: loader.program_verify(image))
+        else:
+            phase("program", lambda: loader.program(image))
+            # as AlfaPackageLoader does: the digest is checked by seal()
+            result["verified"] = phase("verify", lambda: loader.verify(
+                image, check_digest=False))
+        phase("seal", lambda: loader.seal(image))
+        phase("jump", loader.jump)
+    except Exception as e:
+        logging.error(f"{filename}, {backend}: {e}")
+        result["error"] = str(e)
+    finally:
+        session.close()
+        device.close()
+        result["device"] = dict(device.stats)
+
+    result["total"] = collections.OrderedDict(
+        (key, sum(p[key] for p in phases.values()))
+        for key in ("wall_s", "cpu_s", "process_cpu_s", "packets", "bytes"))
+    return result
+
+
+def run(filenames, backends, make_device: Callable, config=None,
+        verbose=True, interleave=False) -> dict:
+    """ run_image() for each hex file and backend: the JSON report
+
+    :parameter verbose: print the summary of each run
+    """
+
+    runs = []
+    for filename in filenames:
+        for backend in backends:
+            runs.append(run_image(filename, backend, make_device,
+                                  interleave))
+            if verbose:
+                summary(runs[-1])
+
+    return collections.OrderedDict((
+        ("benchmark", "alfa_fw_upgrader update"),
+        ("version", 1),
+        ("timestamp", time.strftime("%Y-%m-%dT%H:%M:%S%z")),
+        ("python", platform.python_version()),
+        ("platform", platform.platform()),
+        ("hexcore", hexutils._hexcore is not None),
+        ("config", config or {}),
+        ("runs", runs),
+    ))
+
+
+def summary(result: dict, file=sys.stderr) -> NoReturn:
+    """ print a line per phase of a run """
+
+    print(f"{result['image']} ({result['backend']}):", file=file)
+    for name, p in result["phases"].items():
+        print(f"  {name:8} {p['wall_s']:8.3f} s, cpu {p['cpu_s']:.3f} s, "
+              f"{p['packets']} packets ({p['packets_per_s']:.0f}/s, "
+              f"{p['bytes_per_s'] / 1024:.1f} KiB/s)", file=file)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="python -m alfa_fw_upgrader.benchmark",
+        description="time erase, program, verify, seal and jump of hex files "
+        "against the bootloader simulator")
+    parser.add_argument('filenames', type=str, nargs='*',
+                        help="hex files (default: {})".format(
+                            ", ".join(DEFAULT_IMAGES)))
+    parser.add_argument('-o', '--output', type=str,
+                        help="file of the JSON report (default: stdout)")
+    parser.add_argument('-b', '--usb-backend', dest='backends',
+                        action='append', choices=list(BACKENDS),
+                        help="USB backend to run, may be repeated "
+                        "(default: all)")
+    parser.add_argument('--interleave-verify', dest='interleave',
+                        action='store_true',
+                        help="program and verify in one interleaved pass")
+    simulator.add_arguments(parser)
+    parser.add_argument("-v", "--verbosity", action="count",
+                        help="increase output verbosity")
+    args = parser.parse_args()
+
+    level = "WARNING"
+    if args.verbosity is not None:
+        level = "DEBUG" if args.verbosity >= 2 else "INFO"
+    logging.basicConfig(stream=sys.stderr, level=level,
+                        format="%(levelname)s %(message)s")
+
+    filenames = args.filenames or sorted(
+        fn for pattern in DEFAULT_IMAGES
+        for fn in glob.glob(pattern, recursive=True))
+    if not filenames:
+        parser.error("no hex file")
+    backends = args.backends or list(BACKENDS)
+
+    config = {key: value for key, value in vars(args).items()
+              if key not in ("filenames", "output", "verbosity")}
+    config["backends"] = backends
+    report = run(filenames, backends,
+                 lambda: simulator.from_arguments(args), config,
+                 interleave=args.interleave)
+
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, 'w', encoding='utf-8') as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+    failed = [r for r in report["runs"]
+              if "error" in r or not r.get("verified")]
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -50,24 +50,51 @@ Caveats
 # pylint: disable=logging-fstring-interpolation
 
 import asyncio
+import collections
+import functools
 import logging
+import math
+import random
 import time
 import traceback
 import sys
-from typing import NoReturn
+from typing import Callable, NoReturn
 
-from crc import CrcCalculator, Crc16
-from alfa_fw_upgrader.usb import USBManager
+from alfa_fw_upgrader.usb import open_usb_manager
+from alfa_fw_upgrader.hexutils import HexUtils, MemoryImage
+from alfa_fw_upgrader.packet_plan import PacketPlan
 from alfa_serial_lib import Protocol, Node, Request
 
+
+def timed(phase: str):
+    """ add the time spent in the method to phase of the DeviceSession of
+    the loader, if any """
+
+    def decorator(method: Callable):
+        @functools.wraps(method)
+        def wrapper(self, *args, **kwargs):
+            if self.session is None:
+                return method(self, *args, **kwargs)
+            with self.session.phase(phase):
+                return method(self, *args, **kwargs)
+        return wrapper
+    return decorator
+
+
 class AlfaFirmwareLoader:
     """ Memory management of PIC24 based boards using USB protocol."""
 
     POLLING_INTERVAL_SEC = 10
     """ when using strategy polling, interval of time of seconds """
 
+    FLASH_PAGE_LEN = 256
+    """ bytes of a flash row (64 instructions, phantom bytes included): the
+    bootloader buffers the PROGRAM data of a row and writes it when the
+    data moves on to another row, or on PROGRAM_COMPLETE """
+
     def __init__(self, device_id, polling_mode, use_serial_proto,
-                 serial_port, is_serial_proto_duplex):
+                 serial_port, is_serial_proto_duplex, usb_backend="sync",
+                 session=None, simulator=None):
         """
         Instantiate an object of this class.
         Note: it is possible to select either the polling and serial strategies,
@@ -80,8 +107,20 @@ class AlfaFirmwareLoader:
         :parameter serial_port: serial device filename
         :parameter serial_proto_duplex: boolean if serial protocol is duplex,
          otherwise if multidrop (RS485)
+        :parameter usb_backend: "sync", "async" or "auto", see
+         usb.open_usb_manager()
+        :parameter session: a session.DeviceSession to share its USB
+         connection, opened once for many loaders and devices; None to open
+         the device for this loader only (usb_backend is then the one of the
+         session)
+        :parameter simulator: HOST:PORT of the bootloader simulator to talk
+         to, see usb.open_usb_manager(); None for the USB device (the one of
+         the session with a session)
         """
 
+        self.session = session
+        self.simulator = simulator
+
         self.fw_versions = None
         self.boot_versions = None
         self.slaves_configuration = None
@@ -98,7 +137,7 @@ class AlfaFirmwareLoader:
                 usb = None
                 while not usb and time.time() - startTime < self.POLLING_INTERVAL_SEC:
                     try:
-                        usb = USBManager(device_id)
+                        usb = self._open_usb(device_id, usb_backend)
                         self.usb = usb
                     except Exception:
                         i += 1
@@ -108,11 +147,7 @@ class AlfaFirmwareLoader:
                 if not usb:
                     raise RuntimeError('failed to connect')
             else:
-                self.usb = USBManager(device_id)
-
-            # bootloader requires to receive QUERY with device id = 0 to avoid
-            # jump-to-application
-            self.usb.QUERY(alt_device_id=0)
+                self.usb = self._open_usb(device_id, usb_backend)
         except Exception as e:
             logging.info(f"USB connection failed: {e}")
             if use_serial_proto:
@@ -124,23 +159,47 @@ class AlfaFirmwareLoader:
                     traceback.print_exc(file=sys.stderr)
                     raise RuntimeError(
                         "failed to jump to boot using serial commands") from e
+            if session is not None:
+                # the device enumerated again
+                session.invalidate()
             try:
-                self.usb = USBManager(device_id)
+                self.usb = self._open_usb(device_id, usb_backend)
             except BaseException as e:
                 raise RuntimeError("failed to init USB device") from e
 
-            self.usb.QUERY(alt_device_id=0)
-
         self.starting_address = None
         self.memory_length = None
         self.erased = False
+        # image programmed after an erase, see verify()
+        self._programmed_data = None
         self._update_from_query()
 
-    def _update_from_query(self):
-        """ update object members from answer to QUERY """
+    def _open_usb(self, device_id, usb_backend):
+        """ the USB connection to device_id: the one of the session, or a
+        new one """
+
+        if self.session is not None:
+            return self.session.open(device_id)
+
+        usb = open_usb_manager(device_id, usb_backend, self.simulator)
+        # bootloader requires to receive QUERY with device id = 0 to avoid
+        # jump-to-application
+        usb.QUERY(alt_device_id=0)
+        return usb
+
+    def _update_from_query(self, refresh=False):
+        """ update object members from answer to QUERY
+
+        :argument refresh: with a session, send QUERY even if the answer of
+          the device is known, to read back what may have changed
+        """
         try:
+            if self.session is not None:
+                answer = self.session.query(refresh)
+            else:
+                answer = self.usb.QUERY()
             address, length, proto_ver, boot_version, boot_status, digest = \
-                self.usb.QUERY()
+                answer
         except BaseException as e:
             raise RuntimeError("failed to query device") from e
 
@@ -164,11 +223,15 @@ class AlfaFirmwareLoader:
         self.boot_status = boot_status
         self.digest = digest
 
-    def _program_data_process(self, program_data) -> tuple:
+    def _program_data_process(self, program_data: MemoryImage) -> tuple:
         """ extract the segment of the program data corresponding to
-        application memory and perform CRC16 calculation """
+        application memory and perform CRC16 calculation.
+
+        The segment is returned as bytes, erased memory included; it is
+        cached for the last program_data object seen.
+        """
 
-        if self._current_program_data == program_data:
+        if self._current_program_data is program_data:
             return (self._current_program_segment, self._current_checksum)
 
         try:
@@ -179,14 +242,21 @@ class AlfaFirmwareLoader:
             raise RuntimeError(
                 "dimension of program does not fit memory") from e
 
-        try:
-            data = program_segment
-            crc_calculator = CrcCalculator(Crc16.CCITT)
-            checksum = crc_calculator.calculate_checksum(data)
-            logging.info(f"Calculated checksum is {checksum}")
-        except BaseException as e:
-            raise RuntimeError("calculation of CRC failed") from e
+        # the digest only depends on the image and on the memory geometry,
+        # it may have been calculated by a loader of another node
+        key = (self.starting_address * 2, self.memory_length * 2)
+        checksum = program_data.digests.get(key)
+        if checksum is None:
+            try:
+                checksum = HexUtils.crc16_ccitt(program_segment)
+                logging.info(f"Calculated checksum is {checksum}")
+            except BaseException as e:
+                raise RuntimeError("calculation of CRC failed") from e
+            program_data.digests[key] = checksum
+        else:
+            logging.info(f"Cached checksum is {checksum}")
 
+        self._current_program_data = program_data
         self._current_program_segment = program_segment
         self._current_checksum = checksum
         return (program_segment, checksum)
@@ -325,50 +395,105 @@ class AlfaFirmwareLoader:
         event_loop = asyncio.new_event_loop()
         event_loop.run_until_complete(operations())
 
+    def is_up_to_date(self, program_data: MemoryImage) -> bool:
+        """ check, without touching the flash, whether the device already
+        runs the given application: the digest stored by the last seal(),
+        reported by QUERY, equals the one of program_data.
+
+        Only bootloaders with protocol version > 0 report the digest; a
+        device with a non-zero boot status, or erased and not sealed since
+        (digest 0xFFFF), is never up to date.
+
+        :argument program_data: the entire application as a MemoryImage
+        """
+
+        if self.proto_ver is None or self.proto_ver < 1 or \
+                self.boot_status or self.digest in (None, 0xFFFF):
+            return False
+
+        (_, digest) = self._program_data_process(program_data)
+        logging.info(f"Device digest is {self.digest:04X}, "
+                     f"application digest is {digest:04X}")
+        return self.digest == digest
+
+    @timed("erase")
     def erase(self) -> NoReturn:
         """ erase application memory. """
 
         try:
+            if self.session is not None:
+                self.session.discard(self.usb.device_id)
             self.usb.ERASE()
             self.erased = True
+            self._programmed_data = None
         except BaseException as e:
             raise RuntimeError("failed to perform erase") from e
 
-    def program(self, program_data: list) -> NoReturn:
+    @timed("program")
+    def program(self, program_data: MemoryImage) -> NoReturn:
         """ program the application on the proper memory space.
 
-        :argument program_data: the entire application as a vector of bytes
+        After an erase the chunks holding only erased memory are left out,
+        as the Windows GUI does: the bootloader gets a PROGRAM_COMPLETE
+        before the data that follows a gap. The messages come from the
+        PacketPlan of the image, compiled by the first node programmed.
+
+        :argument program_data: the entire application as a MemoryImage
         """
 
         if not self.erased:
             logging.warning("erase procedure not performed")
 
         (program_segment, digest) = self._program_data_process(program_data)
+        self._programmed_data = None
+
+        # the messages only depend on the image, the memory geometry and the
+        # skip decisions: they are packed for the first node and sent as they
+        # are to the next ones
+        plan = PacketPlan.for_image(program_data, program_segment,
+                                    self.starting_address * 2,
+                                    self.usb.DATA_ATTACHMENT_LEN, self.erased)
+
+        # last PROGRAM message handed to the USB backend; with the async
+        # one, the messages before it may still be in flight
+        last = None
+
+        def messages():
+            nonlocal last
+            debug = logging.getLogger().isEnabledFor(logging.DEBUG)
+            for message in plan.messages():
+                if message[0] == self.usb.CMD_ID_PROGRAM:
+                    last = message
+                    if debug:
+                        address, length = PacketPlan.position(message)
+                        logging.debug("programming on address {} chunk {} "
+                                      .format(address * 2, bytes(
+                                          message[64 - length:]).hex(' ')
+                                          .upper()))
+                yield message
 
-        cursor = 0
-        while cursor < len(program_segment):
-            try:
-                chunk_len = self.usb.DATA_ATTACHMENT_LEN
-                if chunk_len + cursor > len(program_segment):
-                    chunk_len = len(program_segment) - cursor
-                    logging.debug("Chunk len is %d", chunk_len)
-                chunk = bytes(program_segment[cursor:cursor + chunk_len])
-                if logging.getLogger().isEnabledFor(logging.DEBUG):
-                    logging.debug("programming on address {} chunk {} "
-                                  .format(self.starting_address + cursor,
-                                          " ".join(["%02X" % int(b) for b in chunk])))
-                self.usb.PROGRAM(self.starting_address + cursor // 2, chunk)
-                cursor += chunk_len
-            except BaseException as e:
-                raise RuntimeError("programming failed between program "
-                                   "positions {} and {}".format(
-                                       cursor, cursor + chunk_len)) from e
-
-    def seal(self, program_data: list) -> NoReturn:
+        try:
+            self.usb.PROGRAM_MESSAGES(messages())
+        except BaseException as e:
+            cursor, length = (0, 0) if last is None else \
+                PacketPlan.position(last)
+            cursor = max(cursor - self.starting_address, 0) * 2
+            raise RuntimeError("programming failed between program "
+                               "positions {} and {}".format(
+                                   cursor, cursor + length)) from e
+
+        # the flash is no longer erased: a second pass must send every chunk
+        # and the next verify() must read them all back
+        if self.erased:
+            self._programmed_data = program_data
+            self.erased = False
+
+    @timed("seal")
+    def seal(self, program_data: MemoryImage) -> NoReturn:
         """ set the digest value. To call after programming and verifying the
         application.
 
-        :argument program_data: the entire application as a vector of bytes
+        :argument program_data: the entire application as a MemoryImage
         """
 
         (_, digest) = self._program_data_process(program_data)
@@ -377,7 +502,7 @@ class AlfaFirmwareLoader:
             self.usb.PROGRAM_COMPLETE(digest)
             if self.proto_ver > 0:
                 time.sleep(1)
-                self._update_from_query()
+                self._update_from_query(refresh=True)
                 if self.digest != digest:
                     raise RuntimeError(
                         "digest not correctly saved by bootloader")
@@ -385,47 +510,228 @@ class AlfaFirmwareLoader:
         except BaseException as e:
             raise RuntimeError("program failed during finalization") from e
 
-    def verify(self, program_data: list, check_digest=True) -> bool:
+    @timed("verify")
+    def verify(self, program_data: MemoryImage, check_digest=True,
+               sample_rate=None, seed=None) -> bool:
         """ verify the application memory on device against the given one.
 
-        :argument program_data: the entire application as a vector of bytes
+        By default the whole application is read back. With sample_rate
+        only that fraction of the chunks, chosen at random, is: this is
+        unsafe, since the rest is not checked at all. The digest does not
+        cover it: the bootloader stores the one PROGRAM_COMPLETE sends and
+        QUERY reports it back, it does not compute it on the flash.
+
+        :argument program_data: the entire application as a MemoryImage
         :argument check_digest: flag to check digest value
+        :argument sample_rate: fraction of the chunks read back, in (0, 1];
+          None to read back all of them, the only safe choice
+        :argument seed: seed of the chunks sampled, logged to reproduce a
+          run; None for a random one
         :return: a boolean
         """
 
         (program_segment, digest) = self._program_data_process(program_data)
 
-        cursor = 0
-        while cursor < len(program_segment):
+        # right after program() the chunks it left out are still erased
+        chunk_size = self.usb.DATA_ATTACHMENT_LEN
+        if self._programmed_data is program_data:
+            bitmap = program_data.occupancy(self.starting_address * 2,
+                                            len(program_segment), chunk_size)
+            blocks = MemoryImage.set_blocks(bitmap)
+        else:
+            blocks = range((len(program_segment) + chunk_size - 1)
+                           // chunk_size)
+
+        blocks = self._sample(blocks, sample_rate, seed)
+
+        # each run of consecutive blocks is read with one GET_DATA_RANGE
+        # and compared as a whole
+        for first, last in self._block_runs(blocks):
+            cursor = first * chunk_size
+            length = min(last * chunk_size, len(program_segment)) - cursor
             try:
-                chunk_len = self.usb.DATA_ATTACHMENT_LEN
-                if chunk_len + cursor > len(program_segment):
-                    chunk_len = len(program_segment) - cursor
-                    logging.debug(f"Chunk len is {chunk_len}")
-                chunk = bytes(program_segment[cursor:cursor + chunk_len])
-                read_chunk = self.usb.GET_DATA(
-                    self.starting_address + cursor // 2, chunk_len)
-
-                if chunk != read_chunk:
-                    logging.info("read {} is different from file {}"
-                                 .format(" ".join(["%02X" % int(b) for b in read_chunk]),
-                                         " ".join(["%02X" % int(b) for b in chunk])))
-                    return False
-
-                cursor += chunk_len
-            except BaseException:
+                read_data = self.usb.GET_DATA_RANGE(
+                    self.starting_address + cursor // 2, length)
+            except BaseException as e:
                 raise RuntimeError("verify failed between program "
                                    "positions {} and {}".format(
-                                       cursor, cursor + chunk_len))
+                                       cursor, cursor + length)) from e
+
+            expected = program_segment[cursor:cursor + length]
+            if read_data != expected:
+                # look for the chunk that differs only to log it
+                for offset in range(0, length, chunk_size):
+                    read_chunk = read_data[offset:offset + chunk_size]
+                    chunk = expected[offset:offset + chunk_size]
+                    if read_chunk != chunk:
+                        logging.info("read {} is different from file {}"
+                                     .format(read_chunk.hex(' ').upper(),
+                                             chunk.hex(' ').upper()))
+                        break
+                return False
 
         if check_digest and self.proto_ver > 0:
-            self._update_from_query()
+            self._update_from_query(refresh=True)
             if self.digest != digest:
                 raise RuntimeError(
                     "digest not correctly saved by bootloader")
 
         return True
 
+    @timed("program verify")
+    def program_verify(self, program_data: MemoryImage, sample_rate=None,
+                       seed=None) -> list:
+        """ program the application as program() does, and read it back as
+        verify() does in the same stream of messages: the GET_DATA of a
+        chunk follows the PROGRAM messages as soon as the flash row holding
+        it is written (see FLASH_PAGE_LEN), while the next ones are in
+        flight. A PROGRAM_COMPLETE with digest 0 ends the stream, to write
+        the last row before reading it back.
+
+        :argument program_data: the entire application as a MemoryImage
+        :argument sample_rate, seed: read back only a sample of the chunks,
+          unsafe, see verify()
+        :return: the device addresses of the rows differing from
+          program_data, in increasing order: empty if all match
+        """
+
+        if not self.erased:
+            logging.warning("erase procedure not performed")
+
+        (program_segment, _) = self._program_data_process(program_data)
+        self._programmed_data = None
+
+        plan = PacketPlan.for_image(program_data, program_segment,
+                                    self.starting_address * 2,
+                                    self.usb.DATA_ATTACHMENT_LEN, self.erased)
+
+        # device addresses of the chunks programmed, and of the ones read
+        # back
+        programs = [PacketPlan.position(message)[0]
+                    for message in plan.messages()
+                    if message[0] == self.usb.CMD_ID_PROGRAM]
+        checked = set(self._sample(programs, sample_rate, seed))
+
+        page_len = self.FLASH_PAGE_LEN
+        # (address, length) of the chunks programmed and not read back yet
+        unread = collections.deque()
+        # length of the chunks read back and not answered yet, by address
+        requested = {}
+        last = None
+
+        def read_back(end):
+            # the chunks below byte address end are written
+            while unread and unread[0][0] * 2 + unread[0][1] <= end:
+                address, length = unread.popleft()
+                requested[address] = length
+                yield self.usb.pack_GET_DATA(address, length)
+
+        def messages():
+            nonlocal last
+            for message in plan.messages():
+                yield message
+                if message[0] != self.usb.CMD_ID_PROGRAM:
+                    yield from read_back(math.inf)
+                    continue
+                last = message
+                address, length = PacketPlan.position(message)
+                # the data moved on to the row of address
+                yield from read_back(address * 2 // page_len * page_len)
+                if address in checked:
+                    unread.append((address, length))
+            yield self.usb.pack_PROGRAM_COMPLETE(0)
+            yield from read_back(math.inf)
+
+        mismatches = set()
+        try:
+            for address, chunk in self.usb.PROGRAM_VERIFY_MESSAGES(
+                    messages()):
+                length = requested.pop(address, None)
+                if length is None:
+                    raise RuntimeError(
+                        f"GET_DATA answer for address {address} not "
+                        "requested")
+                # against the image, not the messages just sent
+                cursor = (address - self.starting_address) * 2
+                expected = bytes(program_segment[cursor:cursor + length])
+                if chunk == expected:
+                    continue
+                logging.info("read {} is different from file {}".format(
+                    chunk.hex(' ').upper(), expected.hex(' ').upper()))
+                offset = next((i for i, (a, b) in enumerate(
+                    zip(chunk, expected)) if a != b),
+                              min(len(chunk), len(expected)))
+                mismatches.add((address * 2 + offset) // page_len
+                               * page_len // 2)
+            if requested:
+                raise RuntimeError("no GET_DATA answer for addresses "
+                                   f"{sorted(requested)}")
+        except BaseException as e:
+            cursor, length = (0, 0) if last is None else \
+                PacketPlan.position(last)
+            cursor = max(cursor - self.starting_address, 0) * 2
+            raise RuntimeError("program and verify failed between program "
+                               "positions {} and {}".format(
+                                   cursor, cursor + length)) from e
+
+        if self.erased:
+            self._programmed_data = program_data
+            self.erased = False
+        for page in sorted(mismatches):
+            logging.warning(f"verify failed on the row at address {page}")
+        return sorted(mismatches)
+
+    def _sample(self, blocks, sample_rate, seed) -> list:
+        """ blocks, or a random sample of them in the same order for the
+        sampled verify, see verify() """
+
+        if sample_rate is None:
+            return blocks
+        if not 0 < sample_rate <= 1:
+            raise ValueError(f"invalid sample rate {sample_rate}")
+
+        blocks = list(blocks)
+        if seed is None:
+            seed = random.randrange(1 << 32)
+        count = min(max(math.ceil(len(blocks) * sample_rate), 1),
+                    len(blocks))
+        logging.warning(f"unsafe sampled verify: {count} of {len(blocks)} "
+                        f"chunks read back, rate {sample_rate}, seed {seed}; "
+                        "the others are not checked")
+        return sorted(random.Random(seed).sample(blocks, count))
+
+    @timed("read back")
+    def read_back(self) -> MemoryImage:
+        """ read the whole application memory, e.g. to audit a board.
+
+        :return: a MemoryImage with the application memory at its place,
+          phantom bytes included, as program() and verify() take it
+        """
+
+        try:
+            data = self.usb.GET_DATA_RANGE(self.starting_address,
+                                           self.memory_length * 2)
+        except BaseException as e:
+            raise RuntimeError("failed to read application memory") from e
+
+        return MemoryImage.from_extents(
+            [(self.starting_address * 2, data)],
+            self.starting_address * 2 + len(data))
+
+    @staticmethod
+    def _block_runs(blocks):
+        """ group increasing block indices in (first, last + 1) runs """
+
+        first = end = None
+        for block in blocks:
+            if block != end:
+                if first is not None:
+                    yield (first, end)
+                first = block
+            end = block + 1
+        if first is not None:
+            yield (first, end)
+
     def reset(self) -> NoReturn:
         """ reset slaves and main boards. """
 
@@ -435,6 +741,7 @@ class AlfaFirmwareLoader:
         except BaseException as e:
             raise RuntimeError("failed to perform reset") from e
 
+    @timed("jump")
     def jump(self) -> NoReturn:
         """ jump to main program. """
 
@@ -443,5 +750,15 @@ class AlfaFirmwareLoader:
         except BaseException as e:
             raise RuntimeError("failed to jump to application") from e
 
+    def cancel(self) -> NoReturn:
+        """ abort the USB transfers, from any thread: the operation in
+        progress fails within its latency budget at most """
+
+        usb = getattr(self, "usb", None)
+        if usb is not None:
+            usb.cancel()
+
     def disconnect(self):
-        self.usb.disconnect()
+        # a session stays open for the next loader
+        if self.session is None:
+            self.usb.disconnect()
@@ -5,9 +5,215 @@ Keep in mind that Hex is a dictionary [address] -> data. In order to
 get a "binary" (array of bytes representing the whole program) we need to
 fill missing addresses.
 
+A MemoryImage keeps the same content as such a binary, but only stores
+the bytes found in the file: erased memory is generated when a range is
+read.
+
+Decoding, encoding, erased fill and CRC use the native _hexcore module
+(the C++ code of the Windows GUI) when it has been built, the pure
+Python code below otherwise.
+
 """
+import bisect
 import logging
 
+try:
+    from alfa_fw_upgrader import _hexcore
+except ImportError:
+    _hexcore = None
+
+
+class MemoryImage:
+    """ sparse program memory: sorted, non overlapping extents of bytes;
+    everything else reads as erased memory.
+
+    Indexing and slicing behave as on the list returned by
+    HexUtils.dict_to_array(): the image has a fixed length and slices are
+    clipped to it. Slices are returned as bytes.
+
+    Extents may also be read-only buffers (e.g. a memory mapped file from
+    ImageCache): they are copied the first time they are written to.
+    """
+
+    # erased memory has all bytes to 0xFF, except for "phantom" bytes
+    # (every 4th byte), always set to 0
+    ERASED_PATTERN = b'\xff\xff\xff\x00'
+
+    def __init__(self, size=0):
+        self._starts = []
+        self._extents = []
+        self.size = size
+        # CRC16 of (address, length) segments, see FwLoader
+        self.digests = {}
+        # occupancy bitmaps of (address, length, block), see occupancy()
+        self.occupancies = {}
+        # PacketPlan of (address, length, block, sparse), see packet_plan
+        self.plans = {}
+        # the ImageCache the image comes from, and its key there
+        self.cache = None
+        self.cache_key = None
+
+    def __len__(self):
+        return self.size
+
+    @classmethod
+    def erased(cls, address, length) -> bytearray:
+        """ content of erased memory in [address, address + length) """
+
+        if _hexcore is not None:
+            out = bytearray(length)
+            _hexcore.fill_erased(out, address)
+            return out
+        offset = address % 4
+        repeat = (offset + length + 3) // 4
+        return bytearray((cls.ERASED_PATTERN * repeat)[offset:offset + length])
+
+    @classmethod
+    def from_extents(cls, extents, size) -> 'MemoryImage':
+        """ build an image from (address, buffer) pairs in file order;
+        sorted, disjoint bytearrays and memoryviews are adopted without
+        copying. """
+
+        image = cls(size)
+        for address, data in extents:
+            if isinstance(data, (bytearray, memoryview)) and \
+                    (not image._starts or
+                     image._starts[-1] + len(image._extents[-1]) < address):
+                image._starts.append(address)
+                image._extents.append(data)
+            else:
+                image.write(address, data)
+        return image
+
+    def write(self, address, data):
+        """ store data at address, merging with the extents it touches.
+
+        What was calculated on the content is dropped, and the image no
+        longer matches the cache entry it was loaded from. """
+
+        end = address + len(data)
+        i = bisect.bisect_right(self._starts, address) - 1
+        self.digests.clear()
+        self.occupancies.clear()
+        self.plans.clear()
+        self.cache = None
+        self.cache_key = None
+
+        # common case while loading a file: append to the last extent
+        if i >= 0 and self._starts[i] + len(self._extents[i]) == address and \
+                (i + 1 == len(self._starts) or self._starts[i + 1] >= end):
+            if not isinstance(self._extents[i], bytearray):
+                self._extents[i] = bytearray(self._extents[i])
+            self._extents[i] += data
+            return
+
+        if i < 0 or self._starts[i] + len(self._extents[i]) < address:
+            i += 1
+        j = i
+        while j < len(self._starts) and self._starts[j] <= end:
+            j += 1
+
+        if i == j:
+            self._starts.insert(i, address)
+            self._extents.insert(i, bytearray(data))
+            return
+
+        # merge extents i..j-1 with the new data
+        start = min(address, self._starts[i])
+        last = self._starts[j - 1] + len(self._extents[j - 1])
+        merged = bytearray(max(end, last) - start)
+        for k in range(i, j):
+            offset = self._starts[k] - start
+            merged[offset:offset + len(self._extents[k])] = self._extents[k]
+        merged[address - start:end - start] = data
+        self._starts[i:j] = [start]
+        self._extents[i:j] = [merged]
+
+    def extents(self):
+        """ iterate over (address, memoryview) of the stored extents """
+
+        for start, extent in zip(self._starts, self._extents):
+            yield start, memoryview(extent)
+
+    def read(self, address, length) -> bytearray:
+        """ content of [address, address + length), erased where no data
+        was stored; not clipped to the image length. """
+
+        out = self.erased(address, length)
+        end = address + length
+        i = max(bisect.bisect_right(self._starts, address) - 1, 0)
+        while i < len(self._starts) and self._starts[i] < end:
+            start = self._starts[i]
+            extent = self._extents[i]
+            lo = max(start, address)
+            hi = min(start + len(extent), end)
+            if lo < hi:
+                out[lo - address:hi - address] = extent[lo - start:hi - start]
+            i += 1
+        return out
+
+    def occupancy(self, address, length, block) -> bytearray:
+        """ bitmap of the blocks of [address, address + length) holding
+        anything other than erased memory: bit i % 8 of byte i // 8 is set
+        for the block at address + i * block (the last one may be shorter).
+
+        Only the stored extents are compared, a block at a time; the bitmap
+        is kept until the image is written to. """
+
+        key = (address, length, block)
+        bitmap = self.occupancies.get(key)
+        if bitmap is not None:
+            return bitmap
+
+        bitmap = bytearray(((length + block - 1) // block + 7) // 8)
+        erased = bytes(self.erased(0, block + 4))
+        end = address + length
+        i = max(bisect.bisect_right(self._starts, address) - 1, 0)
+        while i < len(self._starts) and self._starts[i] < end:
+            start = self._starts[i]
+            extent = memoryview(self._extents[i])
+            lo = max(start, address)
+            hi = min(start + len(extent), end)
+            n = (lo - address) // block
+            while lo < hi:
+                stop = min(address + (n + 1) * block, hi)
+                if not bitmap[n >> 3] & (1 << (n & 7)) and \
+                        extent[lo - start:stop - start] != \
+                        erased[lo % 4:lo % 4 + stop - lo]:
+                    bitmap[n >> 3] |= 1 << (n & 7)
+                lo = stop
+                n += 1
+            i += 1
+
+        self.occupancies[key] = bitmap
+        return bitmap
+
+    @staticmethod
+    def set_blocks(bitmap):
+        """ iterate over the indices of the set bits of an occupancy
+        bitmap, skipping empty bytes. """
+
+        for i, bits in enumerate(bitmap):
+            while bits:
+                low = bits & -bits
+                yield i * 8 + low.bit_length() - 1
+                bits ^= low
+
+    def __getitem__(self, key):
+        if isinstance(key, slice):
+            start, stop, step = key.indices(self.size)
+            if step != 1:
+                raise ValueError("MemoryImage slices must be contiguous")
+            return bytes(self.read(start, max(stop - start, 0)))
+        if key < 0:
+            key += self.size
+        if not 0 <= key < self.size:
+            raise IndexError("MemoryImage index out of range")
+        return self.read(key, 1)[0]
+
+    def tobytes(self) -> bytes:
+        return bytes(self.read(0, self.size))
+
 
 class HexUtils:
     @staticmethod
@@ -40,6 +246,55 @@ class HexUtils:
                     j = j + 4
         return pData
 
+    @staticmethod
+    def load_mplab_image(filename: str) -> MemoryImage:
+        """ same as load_mplab_table(), as a MemoryImage.
+
+        The table has fixed columns: the device address (hex) at column 0
+        and up to 4 program words of 6 hex digits, most significant byte
+        first, at columns 14, 24, 34 and 44. The word columns of
+        consecutive rows are joined as text and decoded in one go, then
+        scattered to little endian byte order with the phantom byte left
+        to 0. The length of the image is the end of the last row.
+        """
+
+        image = MemoryImage()
+
+        def flush(start, fields):
+            raw = bytes.fromhex(''.join(fields))
+            words = len(raw) // 3
+            out = bytearray(words * 4)
+            out[0::4] = raw[2::3]
+            out[1::4] = raw[1::3]
+            out[2::4] = raw[0::3]
+            image.write(start, out)
+            image.size = max(image.size, start + len(out))
+
+        start = None
+        expected = None
+        fields = []
+        with open(filename, 'r') as fileHex:
+            next(fileHex, None)
+            for line in fileHex:
+                if len(line) < 20:
+                    continue
+                address = int(line[0:6], 16) * 2
+                if address != expected:
+                    if fields:
+                        flush(start, fields)
+                    start = address
+                    fields = []
+                fields.append(line[14:50])
+                expected = address + 16
+                # a short row ends the run
+                if line[44:50].isspace() or len(line) < 50:
+                    flush(start, fields)
+                    fields = []
+                    expected = None
+        if fields:
+            flush(start, fields)
+        return image
+
     @staticmethod
     def dict_to_array(src: dict, size=None) -> list:
         """ get the array of bytes from a dictionary address """
@@ -59,57 +314,154 @@ class HexUtils:
         return out
 
     @staticmethod
-    def load_hex_to_dict(filecontent):
-        """ get the dictionary from an hex file. """
+    def _decode_hex_lines(lines, first_lineno=1):
+        """ decode a run of hex file lines.
+
+        The records are grouped in segments (extendedAddress, [(address,
+        payload), ...]); extendedAddress is None for the records found
+        before the first type 04 record, whose context comes from the lines
+        before. Returns (segments, eof).
+
+        Each record is decoded in one go by bytes.fromhex(), so digits and
+        checksum are handled by C code instead of one int() per byte.
+        Errors report the (1-based) line of the offending record.
+        """
 
         HEX_FILE_EXTENDED_LINEAR_ADDRESS = 0x04
         HEX_FILE_EOF = 0x01
         HEX_FILE_DATA = 0x00
 
-        def str2hex(s): return int(s, 16)
-        extendedAddress = None
-        pData = {}
+        records = []
+        segments = [(None, records)]
 
-        lines = filecontent.split('\n')
-        for line in lines:
+        for lineno, line in enumerate(lines, start=first_lineno):
             line = line.strip()
             if len(line) <= 0:
                 continue
             if line[0] != ':':
-                raise ValueError("invalid format")
-            line = line.strip(':')
-
-            recordLength = str2hex(line[0:2])
-            addressField = str2hex(line[2:6])
-            recordType = str2hex(line[6:8])
-            dataPayload = line[8: 8 + recordLength * 2]
-            checksum = str2hex(line[8 + recordLength * 2:
-                                    10 + recordLength * 2])
-
-            checksumCalculated = 0
-            for j in range(0, recordLength + 4):
-                checksumCalculated += str2hex(line[j * 2: (j * 2) + 2])
-            checksumCalculated = ~checksumCalculated
-            checksumCalculated += 1
-            checksumCalculated = checksumCalculated & 0x000000FF
-
-            if (checksumCalculated & 0x000000FF) != checksum:
-                raise ValueError("invalid checksum (calculated:{}, read:{}"
-                                 .format(checksumCalculated, checksum))
+                raise ValueError("line {}: invalid format".format(lineno))
+
+            # length, address, type, data and checksum
+            try:
+                recordLength = int(line[1:3], 16)
+                record = bytes.fromhex(line[1:11 + recordLength * 2])
+            except ValueError:
+                raise ValueError("line {}: invalid character".format(lineno)) from None
+            if len(record) != recordLength + 5:
+                raise ValueError("line {}: truncated record".format(lineno))
 
+            # the sum of all the bytes, checksum included, must be 0
+            if sum(record) & 0xFF:
+                checksum = record[-1]
+                checksumCalculated = (checksum - sum(record)) & 0xFF
+                raise ValueError("line {}: invalid checksum (calculated:{}, read:{})"
+                                 .format(lineno, checksumCalculated, checksum))
+
+            recordType = record[3]
             if recordType == HEX_FILE_EXTENDED_LINEAR_ADDRESS:
-                extendedAddress = str2hex(dataPayload)
+                records = []
+                segments.append((int.from_bytes(record[4:-1], 'big'), records))
             elif recordType == HEX_FILE_EOF:
-                break
+                return segments, True
             elif recordType == HEX_FILE_DATA:
-                totalAddress = (extendedAddress << 16) + addressField
-                for i in range(0, recordLength):
-                    datum = str2hex(dataPayload[i * 2:i * 2 + 2])
-                    pData[totalAddress + i] = datum
+                records.append(((record[1] << 8) + record[2], record[4:-1]))
+        return segments, False
+
+    @staticmethod
+    def _merge_hex_segments(pData, segments, extendedAddress):
+        """ store decoded segments in pData, in file order; returns the
+        extended address in force after them. """
+
+        for ext, records in segments:
+            if ext is not None:
+                extendedAddress = ext
+            base = extendedAddress << 16
+            for address, payload in records:
+                totalAddress = base + address
+                pData.update(zip(range(totalAddress, totalAddress + len(payload)),
+                                 payload))
+        return extendedAddress
+
+    @staticmethod
+    def load_hex_to_dict(filecontent):
+        """ get the dictionary from an hex file. """
+
+        pData = {}
+        segments, _ = HexUtils._decode_hex_lines(filecontent.split('\n'))
+        HexUtils._merge_hex_segments(pData, segments, 0)
         return pData
 
+    @staticmethod
+    def load_hex_to_image(filecontent) -> MemoryImage:
+        """ get a MemoryImage from an hex file.
+
+        As with load_hex_to_array(), the length of the image is the highest
+        address found in the file.
+        """
+
+        if _hexcore is not None:
+            extents, top = _hexcore.decode(filecontent)
+            return MemoryImage.from_extents(extents, top)
+
+        image = MemoryImage()
+        segments, _ = HexUtils._decode_hex_lines(filecontent.split('\n'))
+        extendedAddress = 0
+        top = 0
+        for ext, records in segments:
+            if ext is not None:
+                extendedAddress = ext
+            base = extendedAddress << 16
+            for address, payload in records:
+                if payload:
+                    image.write(base + address, payload)
+                    top = max(top, base + address + len(payload) - 1)
+        image.size = top
+        return image
+
     @staticmethod
     def load_hex_to_array(file_content):
         """ get binary from an hex file. """
-        dic = HexUtils.load_hex_to_dict(file_content)
-        return HexUtils.dict_to_array(dic)
+        return list(HexUtils.load_hex_to_image(file_content).tobytes())
+
+    @staticmethod
+    def image_to_hex(image: MemoryImage, record_length=16) -> str:
+        """ Intel Hex text of the data stored in image (erased memory that
+        was never written is not exported). """
+
+        if _hexcore is not None:
+            return _hexcore.encode(image.extents(), record_length).decode()
+
+        lines = []
+        extendedAddress = None
+        for start, extent in image.extents():
+            cursor = 0
+            while cursor < len(extent):
+                address = start + cursor
+                # records never cross a 64KB boundary
+                count = min(record_length, len(extent) - cursor,
+                            0x10000 - (address & 0xFFFF))
+                if extendedAddress != address >> 16:
+                    extendedAddress = address >> 16
+                    lines.append(HexUtils._hex_record(
+                        0x04, 0, extendedAddress.to_bytes(2, 'big')))
+                lines.append(HexUtils._hex_record(
+                    0x00, address & 0xFFFF, extent[cursor:cursor + count]))
+                cursor += count
+        lines.append(HexUtils._hex_record(0x01, 0, b''))
+        return ''.join(lines)
+
+    @staticmethod
+    def _hex_record(recordType, address, data) -> str:
+        record = bytes([len(data), address >> 8, address & 0xFF, recordType]) + bytes(data)
+        checksum = (-sum(record)) & 0xFF
+        return ':' + record.hex().upper() + '%02X' % checksum + '\r\n'
+
+    @staticmethod
+    def crc16_ccitt(data) -> int:
+        """ CRC16-CCITT digest, as stored by the bootloader """
+
+        if _hexcore is not None:
+            return _hexcore.crc16_ccitt(data)
+
+        from crc import CrcCalculator, Crc16
+        return CrcCalculator(Crc16.CCITT).calculate_checksum(data)
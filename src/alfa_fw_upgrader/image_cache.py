@@ -0,0 +1,225 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module contains a persistent cache of decoded hex files.
+
+Every decoded file is stored in the user data directory under the SHA-256
+of its content. The file layout can be memory mapped as is, so a file that
+was already seen is loaded without parsing and without copying its data:
+
+======  ==============================================================
+offset  content (little endian)
+======  ==============================================================
+0       magic ``AFWIMG\\0\\1``
+8       image length (u64)
+16      number of extents (u32), CRC-32 of the rest of the file (u32)
+24      extent table: address, data offset, data length (3 x u64)
+...     extent data, each extent aligned to 8 bytes
+======  ==============================================================
+
+The extents are adopted as they are by the image loaded, so a file whose
+CRC-32 does not match is decoded again.
+
+The PacketPlan of the application segments, which depend on the memory
+geometry reported by the device, are kept next to it, in
+``<hash>.<address>-<length>-<block>-<sparse>.plan``: magic
+``AFWPLN\\0\\1``, the first 8 bytes of the SHA-256 of the messages,
+then the 64 byte messages. A plan whose messages do not match their
+digest is compiled again.
+
+The CRC16 digests of the segments are not stored: seal() writes them to
+the device, and they are cheap to calculate again on each run.
+
+"""
+
+# pylint: disable=invalid-name
+# pylint: disable=broad-except
+# pylint: disable=logging-fstring-interpolation
+
+import hashlib
+import logging
+import mmap
+import os
+import struct
+import tempfile
+import zlib
+from pathlib import Path
+
+from alfa_fw_upgrader.hexutils import HexUtils, MemoryImage
+from alfa_fw_upgrader.packet_plan import PacketPlan
+
+
+class ImageCache:
+    """ decoded hex files, stored in directory path and keyed by content """
+
+    MAGIC = b'AFWIMG\x00\x01'
+    PLAN_MAGIC = b'AFWPLN\x00\x01'
+    PLAN_HEADER = struct.Struct("<8s8s")
+    HEADER = struct.Struct("<8sQII")
+    EXTENT = struct.Struct("<QQQ")
+    MAX_ENTRIES = 64
+    """ least recently used entries are removed beyond this number """
+
+    def __init__(self, path):
+        self.path = path
+
+    @staticmethod
+    def key(content: bytes) -> str:
+        return hashlib.sha256(content).hexdigest()
+
+    def _image_filename(self, key):
+        return os.path.join(self.path, key + '.img')
+
+    def _plan_filename(self, key, plan_key):
+        address, length, block, sparse = plan_key
+        return os.path.join(self.path, f"{key}.{address}-{length}-{block}-"
+                                       f"{int(sparse)}.plan")
+
+    def load_hex(self, content) -> MemoryImage:
+        """ get the MemoryImage of an hex file content (bytes or str),
+        decoding it only if it is not in the cache yet. """
+
+        if isinstance(content, str):
+            content = content.encode()
+        key = self.key(content)
+
+        image = None
+        try:
+            image = self._load(key)
+        except FileNotFoundError:
+            pass
+        except Exception as e:
+            logging.warning(f"discarding cached image {key}: {e}")
+
+        if image is None:
+            image = HexUtils.load_hex_to_image(content.decode())
+            try:
+                self._store(key, image)
+            except Exception as e:
+                logging.warning(f"failed to cache image {key}: {e}")
+        else:
+            logging.info(f"image {key} loaded from cache")
+            # the modification time orders the entries for _prune()
+            try:
+                os.utime(self._image_filename(key))
+            except OSError:
+                pass
+
+        image.cache = self
+        image.cache_key = key
+        return image
+
+    def save_plan(self, image: MemoryImage, plan_key, plan: PacketPlan):
+        """ persist a plan compiled on an image from load_hex() """
+
+        key = getattr(image, 'cache_key', None)
+        if key is None:
+            return
+        try:
+            self._write_atomic(self._plan_filename(key, plan_key),
+                               self.PLAN_HEADER.pack(
+                                   self.PLAN_MAGIC,
+                                   self._plan_digest(plan.reports))
+                               + plan.reports)
+        except Exception as e:
+            logging.warning(f"failed to cache packet plan of {key}: {e}")
+
+    def load_plan(self, image: MemoryImage, plan_key):
+        """ the plan save_plan() stored for an image from load_hex(), memory
+        mapped; None when there is none """
+
+        key = getattr(image, 'cache_key', None)
+        if key is None:
+            return None
+        try:
+            with open(self._plan_filename(key, plan_key), 'rb') as f:
+                # copy on write: a writable view is what the async USB
+                # backend submits without copying, and it is never written
+                mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+            view = memoryview(mm)
+            magic, digest = self.PLAN_HEADER.unpack_from(view, 0)
+            if magic != self.PLAN_MAGIC:
+                raise ValueError("bad magic")
+            reports = view[self.PLAN_HEADER.size:]
+            # the messages go to the device as they are
+            if self._plan_digest(reports) != digest:
+                raise ValueError("corrupted messages")
+            return PacketPlan(reports)
+        except FileNotFoundError:
+            return None
+        except Exception as e:
+            logging.warning(f"discarding cached packet plan of {key}: {e}")
+            return None
+
+    @staticmethod
+    def _plan_digest(reports) -> bytes:
+        return hashlib.sha256(reports).digest()[:8]
+
+    def _load(self, key) -> MemoryImage:
+        with open(self._image_filename(key), 'rb') as f:
+            mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        view = memoryview(mm)
+        magic, size, count, crc = self.HEADER.unpack_from(view, 0)
+        if magic != self.MAGIC:
+            raise ValueError("bad magic")
+        if zlib.crc32(view[self.HEADER.size:]) != crc:
+            raise ValueError("corrupted content")
+
+        extents = []
+        for i in range(count):
+            address, offset, length = self.EXTENT.unpack_from(
+                view, self.HEADER.size + i * self.EXTENT.size)
+            if offset + length > len(view):
+                raise ValueError("truncated file")
+            extents.append((address, view[offset:offset + length]))
+
+        return MemoryImage.from_extents(extents, size)
+
+    def _store(self, key, image: MemoryImage):
+        extents = list(image.extents())
+        offset = self.HEADER.size + len(extents) * self.EXTENT.size
+        table = []
+        for address, data in extents:
+            offset = (offset + 7) & ~7
+            table.append((address, offset, len(data)))
+            offset += len(data)
+
+        out = bytearray(offset)
+        for i, ((address, data), entry) in enumerate(zip(extents, table)):
+            self.EXTENT.pack_into(out, self.HEADER.size + i * self.EXTENT.size,
+                                  *entry)
+            out[entry[1]:entry[1] + entry[2]] = data
+        self.HEADER.pack_into(out, 0, self.MAGIC, len(image), len(extents),
+                              zlib.crc32(memoryview(out)[self.HEADER.size:]))
+
+        self._write_atomic(self._image_filename(key), out)
+        self._prune()
+
+    def _write_atomic(self, filename, data):
+        # a temporary file of its own: other processes may be caching the
+        # same file
+        Path(self.path).mkdir(parents=True, exist_ok=True)
+        f = tempfile.NamedTemporaryFile(dir=self.path, suffix='.tmp',
+                                        delete=False)
+        try:
+            with f:
+                f.write(data)
+            os.replace(f.name, filename)
+        except BaseException:
+            try:
+                os.unlink(f.name)
+            except OSError:
+                pass
+            raise
+
+    def _prune(self):
+        images = sorted(Path(self.path).glob('*.img'),
+                        key=lambda p: p.stat().st_mtime, reverse=True)
+        for p in images[self.MAX_ENTRIES:]:
+            try:
+                p.unlink()
+                for plan in p.parent.glob(p.stem + '.*.plan'):
+                    plan.unlink()
+            except OSError:
+                pass
@@ -20,15 +20,43 @@ import yaml
 
 from alfa_fw_upgrader.hexutils import HexUtils
 from alfa_fw_upgrader.fw_loader import AlfaFirmwareLoader
+from alfa_fw_upgrader.session import DeviceSession
 
 class AlfaPackageLoader:
     class UserInterrupt(Exception):
         pass
 
-    def __init__(self, package_data, serial_port, process_callback=None):
+    def __init__(self, package_data, serial_port, process_callback=None,
+                 image_cache=None, skip_identical=False,
+                 unsafe_verify_sample_rate=None, verify_seed=None,
+                 interleave_verify=False, usb_backend="sync",
+                 simulator=None):
+        """
+        :parameter skip_identical: leave alone the boards whose digest shows
+          they already run their program of the package, see
+          AlfaFirmwareLoader.is_up_to_date(); their names are in up_to_date
+          after process()
+        :parameter unsafe_verify_sample_rate, verify_seed: read back only a
+          sample of each program after writing it, leaving the rest
+          unchecked, see AlfaFirmwareLoader.verify(); None to read back all
+          of it
+        :parameter interleave_verify: read back each program while writing
+          it, see AlfaFirmwareLoader.program_verify(), rather than after
+        :parameter usb_backend, simulator: the USB device to talk to, see
+          usb.open_usb_manager()
+        """
         self.package_data = package_data
         self.process_callback = process_callback
         self.serial_port = serial_port
+        # optional ImageCache for the decoded programs
+        self.image_cache = image_cache
+        self.skip_identical = skip_identical
+        self.unsafe_verify_sample_rate = unsafe_verify_sample_rate
+        self.verify_seed = verify_seed
+        self.interleave_verify = interleave_verify
+        self.usb_backend = usb_backend
+        self.simulator = simulator
+        self.up_to_date = []
 
         self.sts = {
             "process": {
@@ -47,6 +75,20 @@ class AlfaPackageLoader:
         self.slaves_configuration = None
         self.manifest = dict()
 
+        # the USB session of process(), see cancel()
+        self._session = None
+        self.cancelled = False
+
+    def cancel(self):
+        """ abort the update from another thread: the USB transfer in
+        progress fails at once or within its latency budget, and process()
+        raises UserInterrupt """
+
+        self.cancelled = True
+        session = self._session
+        if session is not None:
+            session.cancel()
+
     def report_problem(self, problem):
         self.process_callback(status=None, problem=problem)
 
@@ -72,10 +114,27 @@ class AlfaPackageLoader:
         if current_op is not None:
             self.sts[key]["total_steps"] = total_steps
 
-        if self.process_callback(status=self.sts, problem=None):
+        if self.process_callback(status=self.sts, problem=None) or \
+                self.cancelled:
             raise self.UserInterrupt
 
     def process(self):
+        # the master, the slaves behind it and the final jump share one USB
+        # connection, opened again only after a failure; board_init() keeps
+        # its own, since the board jumps between application and boot
+        session = DeviceSession(self.usb_backend, simulator=self.simulator)
+        self._session = session
+        if self.cancelled:
+            session.cancel()
+        self.up_to_date = []
+        try:
+            self._process(session)
+        finally:
+            self._session = None
+            session.close()
+            logging.info(f"USB session timings:\n{session.report()}")
+
+    def _process(self, session):
         current_step = 1
         self.update_status("main", "loading package", 1, 5)
         self.load_package(self.package_data)
@@ -88,7 +147,9 @@ class AlfaPackageLoader:
                       polling_mode = False,
                       serial_port = self.serial_port,
                       is_serial_proto_duplex = \
-                       self.manifest["proto_mode"] == "duplex")
+                       self.manifest["proto_mode"] == "duplex",
+                      usb_backend = self.usb_backend,
+                      simulator = self.simulator)
 
         initialize_ok = False
         try:
@@ -103,14 +164,17 @@ class AlfaPackageLoader:
         self.update_status("main", "programming master", 3, 5)
         try:
             afl = None
-            afl = AlfaFirmwareLoader(**params)
-            afl.erase()
+            afl = AlfaFirmwareLoader(**params, session=session)
             hexdata = self.programs_hex[master_prog['filename']]
-            afl.program(hexdata)
-            assert afl.verify(hexdata, check_digest=False)
-            afl.seal(hexdata)
+            if not self._is_up_to_date(afl, hexdata, "master"):
+                afl.erase()
+                self._program(afl, hexdata)
+                afl.seal(hexdata)
             afl.disconnect()
         except Exception as e:
+            session.invalidate()
+            if self.cancelled:
+                raise self.UserInterrupt from e
             self.report_problem("failed to program master 1st attempt")
             if not initialize_ok:
                 raise RuntimeError(
@@ -120,6 +184,8 @@ class AlfaPackageLoader:
                 afl.disconnect()
 
         if not initialize_ok:
+            # the master jumps to its application and back
+            session.invalidate()
             try:
                 self.board_init(params)
             except BaseException as e:
@@ -150,18 +216,23 @@ class AlfaPackageLoader:
             try:
                 program = self.programs_hex[step['filename']]
                 params["device_id"] = address
-                afl = AlfaFirmwareLoader(**params)
+                afl = None
+                afl = AlfaFirmwareLoader(**params, session=session)
                 if afl.boot_fw_version is None or afl.proto_ver < 1:
                     self.report_problem(
                         f"slave with address {address} is incompatible or "
                         f"not present - NOT upgrading")
-                else:
+                elif not self._is_up_to_date(afl, program,
+                                             f"slave #{address}"):
                     afl.erase()
-                    afl.program(program)
-                    assert afl.verify(program, check_digest=False)
+                    self._program(afl, program)
                     afl.seal(program)
 
             except BaseException as e:
+                # the next slave gets a new connection
+                session.invalidate()
+                if self.cancelled:
+                    raise self.UserInterrupt from e
                 self.report_problem(
                     f"failed to program slave with address {address}, {e}")
             finally:
@@ -173,7 +244,7 @@ class AlfaPackageLoader:
         try:
             self.update_status("main", "jumping to application", 5, 5)
             params["device_id"] = 255
-            afl = AlfaFirmwareLoader(**params)
+            afl = AlfaFirmwareLoader(**params, session=session)
             afl.jump()
             afl.disconnect()
         except BaseException as e:
@@ -181,6 +252,32 @@ class AlfaPackageLoader:
         finally:
             afl.disconnect()
 
+    def _is_up_to_date(self, afl, program, name):
+        """ with skip_identical, whether the board of afl already runs
+        program, adding name to up_to_date if so """
+
+        if not self.skip_identical or not afl.is_up_to_date(program):
+            return False
+        logging.info(f"{name} is up to date, not upgrading")
+        self.up_to_date.append(name)
+        return True
+
+    def _program(self, afl, program):
+        """ program and verify, before the seal that follows """
+
+        if self.interleave_verify:
+            rows = afl.program_verify(program,
+                                      sample_rate=self.unsafe_verify_sample_rate,
+                                      seed=self.verify_seed)
+            if rows:
+                raise RuntimeError("verify failed on the rows at {}".format(
+                    ", ".join(f"{row:#x}" for row in rows)))
+        else:
+            afl.program(program)
+            assert afl.verify(program, check_digest=False,
+                              sample_rate=self.unsafe_verify_sample_rate,
+                              seed=self.verify_seed)
+
     def board_init(self, params):
         self.update_status(
             "init", "retrieve data version and jump to boot", 1, 3)
@@ -223,7 +320,7 @@ class AlfaPackageLoader:
     def load_package(self, package_data):
         """ load package and output:
         - self.manifest (dict)
-        - self.programs_hex (data of executables as array of ints)  """
+        - self.programs_hex (data of executables as MemoryImage)  """
         fp = BytesIO(package_data)
         with zipfile.ZipFile(fp, "r") as zfp:
             with zfp.open('manifest.txt', 'r') as mfp:
@@ -233,8 +330,12 @@ class AlfaPackageLoader:
             for program in self.manifest["programs"]:
                 fn = program["filename"]
                 with zfp.open(fn) as f:
-                    self.programs_hex[fn] = HexUtils.load_hex_to_array(
-                        f.read().decode())
+                    if self.image_cache is not None:
+                        self.programs_hex[fn] = self.image_cache.load_hex(
+                            f.read())
+                    else:
+                        self.programs_hex[fn] = HexUtils.load_hex_to_image(
+                            f.read().decode())
 
             if "proto_mode" not in self.manifest:
                 logging.warning("proto_mode not defined in manifest, setting to 'duplex'")
@@ -0,0 +1,122 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module precompiles the USB messages that program an image.
+
+Programming a segment of an image always sends the same messages: a
+PROGRAM for each chunk left after the skip decisions (the chunks holding
+only erased memory are left out after an erase), and a PROGRAM_COMPLETE
+with digest 0 before the data following a gap. A PacketPlan packs them
+once, one after the other in a single buffer of 64 byte records, and
+the USB backends send the records as they are; updating the same
+firmware on many nodes pays the packing once.
+
+The PROGRAM record of a chunk is also the GET_DATA answer the device
+gives for it once programmed, apart from the command id.
+
+Plans are kept on the MemoryImage (see MemoryImage.plans) and, for an
+image from ImageCache, stored next to it.
+"""
+
+# pylint: disable=invalid-name
+
+import struct
+
+from alfa_fw_upgrader.hexutils import MemoryImage
+from alfa_fw_upgrader.usb import USBManager
+
+
+class PacketPlan:
+    """ the PROGRAM and PROGRAM_COMPLETE messages programming a segment """
+
+    REPORT_LEN = 64
+
+    def __init__(self, reports):
+        """
+        :parameter reports: a buffer of REPORT_LEN byte messages, e.g. a
+          memory mapped file from ImageCache
+        """
+
+        if len(reports) % self.REPORT_LEN:
+            raise ValueError("packet plan is not made of whole messages")
+        self.reports = memoryview(reports)
+
+    def __len__(self):
+        return len(self.reports) // self.REPORT_LEN
+
+    @property
+    def packets(self) -> int:
+        """ number of PROGRAM messages """
+
+        return bytes(self.reports[::self.REPORT_LEN]).count(
+            USBManager.CMD_ID_PROGRAM)
+
+    def messages(self):
+        """ iterate over the messages, as views on the plan """
+
+        for offset in range(0, len(self.reports), self.REPORT_LEN):
+            yield self.reports[offset:offset + self.REPORT_LEN]
+
+    @classmethod
+    def compile(cls, segment, address: int, chunk_size: int,
+                blocks) -> 'PacketPlan':
+        """ pack the messages programming segment at device address
+        address, one PROGRAM for each chunk of chunk_size bytes listed in
+        blocks (increasing chunk indices; the last chunk may be shorter) """
+
+        blocks = list(blocks)
+        segment = memoryview(segment)
+        complete = USBManager.pack_PROGRAM_COMPLETE(0)
+
+        # one message per chunk, and at most one PROGRAM_COMPLETE each
+        reports = bytearray(2 * len(blocks) * cls.REPORT_LEN)
+        offset = 0
+        next_block = 0
+        for block in blocks:
+            cursor = block * chunk_size
+            if block != next_block:
+                reports[offset:offset + cls.REPORT_LEN] = complete
+                offset += cls.REPORT_LEN
+            next_block = block + 1
+            offset += USBManager._pack_PROGRAM_into(
+                memoryview(reports)[offset:], address + cursor // 2,
+                segment[cursor:cursor + chunk_size])
+        del reports[offset:]
+        return cls(reports)
+
+    @classmethod
+    def for_image(cls, image: MemoryImage, segment, address: int,
+                  chunk_size: int, sparse: bool) -> 'PacketPlan':
+        """ the plan programming segment, the content of image at byte
+        address address, compiled only the first time: it is kept on the
+        image and by its ImageCache.
+
+        :parameter sparse: leave out the chunks holding only erased memory,
+          which is only right on an erased device
+        """
+
+        key = (address, len(segment), chunk_size, sparse)
+        plan = image.plans.get(key)
+        if plan is not None:
+            return plan
+
+        if image.cache is not None:
+            plan = image.cache.load_plan(image, key)
+        if plan is None:
+            if sparse:
+                blocks = MemoryImage.set_blocks(
+                    image.occupancy(address, len(segment), chunk_size))
+            else:
+                blocks = range((len(segment) + chunk_size - 1) // chunk_size)
+            plan = cls.compile(segment, address // 2, chunk_size, blocks)
+            if image.cache is not None:
+                image.cache.save_plan(image, key, plan)
+        image.plans[key] = plan
+        return plan
+
+    @staticmethod
+    def position(message) -> tuple:
+        """ (device address, length) of the chunk of a PROGRAM message """
+
+        _, address, length = struct.unpack_from("<BLB", message)
+        return (address, length)
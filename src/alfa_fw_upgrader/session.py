@@ -0,0 +1,146 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module keeps one USB connection to the bootloader across many nodes.
+
+Without a session every AlfaFirmwareLoader opens the device on its own:
+find, reset and set_configuration of the USB device, then the QUERY with
+device id 0 the bootloader needs at every connection. Updating a package
+did it for the master, for each slave and once more for the final jump.
+With a DeviceSession:
+
+- the device is opened once, and again only after invalidate() - that is,
+  after an operation failed or the device enumerated again;
+- the answer to QUERY is kept by device id: a QUERY is sent only to select
+  another node (QUERY is the only command taking the device id) or when
+  the caller asks for a fresh answer, e.g. to read back the digest;
+- the time spent in each phase is summed, see report();
+- cancel() aborts the transfers of whichever loader uses the connection,
+  from any thread.
+"""
+
+# pylint: disable=invalid-name
+# pylint: disable=logging-fstring-interpolation
+
+import collections
+import contextlib
+import logging
+import time
+from typing import Callable, NoReturn, Optional
+
+from alfa_fw_upgrader.usb import TransferCancelled, USBManager, \
+    open_usb_manager
+
+
+class DeviceSession:
+    """ A USB connection to the bootloader shared by the loaders of the
+    nodes behind it. """
+
+    def __init__(self, usb_backend: str = "sync",
+                 opener: Optional[Callable] = None,
+                 simulator: Optional[str] = None):
+        """
+        :parameter usb_backend, simulator: see usb.open_usb_manager()
+        :parameter opener: a callable taking the device id and returning a
+          connected USBManager; open_usb_manager() on usb_backend and
+          simulator when None
+        """
+
+        self.usb_backend = usb_backend
+        self.simulator = simulator
+        self._opener = opener
+        self.usb = None
+        # answer to QUERY, by device id
+        self.geometry = {}
+        # device id the last QUERY selected
+        self._selected = None
+        # phase name -> [count, seconds]
+        self.timings = collections.OrderedDict()
+        self.cancelled = False
+
+    @contextlib.contextmanager
+    def phase(self, name: str):
+        """ add the time spent in the with block to phase name """
+
+        start = time.perf_counter()
+        try:
+            yield
+        finally:
+            entry = self.timings.setdefault(name, [0, 0.0])
+            entry[0] += 1
+            entry[1] += time.perf_counter() - start
+
+    def open(self, device_id) -> USBManager:
+        """ the connection, opened if needed, set to talk to device_id """
+
+        if self.cancelled:
+            raise TransferCancelled("USB session cancelled")
+        if self.usb is None:
+            with self.phase("connect"):
+                if self._opener is not None:
+                    usb = self._opener(device_id)
+                else:
+                    usb = open_usb_manager(device_id, self.usb_backend,
+                                           self.simulator)
+                try:
+                    if self.cancelled:
+                        # cancel() came while the device was being opened
+                        raise TransferCancelled("USB session cancelled")
+                    # bootloader requires to receive QUERY with device id = 0
+                    # to avoid jump-to-application
+                    usb.QUERY(alt_device_id=0)
+                except BaseException:
+                    usb.disconnect()
+                    raise
+            self.usb = usb
+            self._selected = None
+        self.usb.device_id = device_id
+        return self.usb
+
+    def query(self, refresh=False) -> tuple:
+        """ answer to QUERY for the device the connection is set to, sent
+        only when that device is not the selected one or when refresh """
+
+        device_id = self.usb.device_id
+        if refresh or self._selected != device_id \
+                or device_id not in self.geometry:
+            with self.phase("query"):
+                self._selected = None
+                self.geometry[device_id] = self.usb.QUERY()
+                self._selected = device_id
+        return self.geometry[device_id]
+
+    def discard(self, device_id) -> NoReturn:
+        """ forget the answer to QUERY of device_id, e.g. after an erase """
+
+        self.geometry.pop(device_id, None)
+
+    def invalidate(self) -> NoReturn:
+        """ drop the connection: the next open() connects again """
+
+        if self.usb is not None:
+            try:
+                self.usb.disconnect()
+            except BaseException as e:
+                logging.debug(f"disconnecting USB failed: {e}")
+        self.usb = None
+        self._selected = None
+        self.geometry.clear()
+
+    def cancel(self) -> NoReturn:
+        """ abort the transfer in progress and refuse any later one: every
+        open() raises TransferCancelled. May be called from any thread. """
+
+        self.cancelled = True
+        usb = self.usb
+        if usb is not None:
+            usb.cancel()
+
+    def close(self) -> NoReturn:
+        self.invalidate()
+
+    def report(self) -> str:
+        """ the timings of the phases, one per line """
+
+        return "\n".join(f"{name}: {count} times, {seconds:.3f} s"
+                         for name, (count, seconds) in self.timings.items())
@@ -0,0 +1,806 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module simulates the PIC24 HID bootloader, so that the loaders and the
+USB backends can be run and timed without a board.
+
+BootloaderSimulator plays the bootloader of a master and of the slaves
+behind it: it takes the messages of usb.USBManager (the BOOTLOADER_COMMAND
+reports of the Windows GUI without their leading report ID) and answers as
+the device does:
+
+- QUERY, with the password and the device ID of the node to select; the
+  answer lists the memory regions, then the protocol version, the
+  bootloader version, the boot status and the digest. A wrong password or
+  a node that is not there gets no answer;
+- ERASE_DEVICE, PROGRAM_DEVICE, PROGRAM_COMPLETE (a digest other than 0
+  is stored and read back by QUERY), GET_DATA and BOOT_FW_VERSION_REQUEST;
+- RESET_DEVICE, RESET_BOOT_MMT and JUMP_TO_APPLICATION: the device leaves
+  the bus, and the next host that attaches finds it in update mode again.
+
+Timing: a report takes bus_latency to cross the bus, either way (the
+OUT transfer completes when the device took the report, so the host sees
+the round trip). The device takes an OUT report, then is busy for
+packet_latency (plus a random jitter) before it takes the next one, and
+sends the answer packet_latency after taking the command. An erase keeps
+it busy for erase_time; PROGRAM data is buffered a flash page (row) at a
+time, and each page written costs page_write_time, as does storing the
+digest. Commands for a slave pay relay_latency on top.
+
+Faults, drawn from a random generator seeded with seed: answers lost
+(drop_rate), GET_DATA answers with a byte flipped (corrupt_rate), PROGRAM
+packets not written to flash (write_fail_rate), and stalls of stall_time
+(stall_rate).
+
+SimulatedTransport connects a USBManager to a simulator in the same
+process. The standalone process serves one over TCP:
+
+  python -m alfa_fw_upgrader.simulator --port 8071 --latency-ms 1
+
+and the loaders reach it with SocketTransport, which open_usb_manager()
+uses when given its HOST:PORT (see the --simulator option of the command
+line tool). Both transports have the interface of
+usb_async.LibusbTransport.
+"""
+
+# pylint: disable=invalid-name
+# pylint: disable=logging-fstring-interpolation
+
+import argparse
+import collections
+import heapq
+import logging
+import random
+import socket
+import struct
+import threading
+import time
+from typing import NoReturn, Optional
+
+from alfa_fw_upgrader.hexutils import MemoryImage
+from alfa_fw_upgrader.usb import TransferCancelled, USBManager
+
+MEMORY_REGION_PROGRAM = 0x01
+MEMORY_REGION_CONFIG = 0x03
+MEMORY_REGION_END = 0xFF
+
+DEVICE_FAMILY_PIC24 = 2
+
+CMD_ID_UNLOCK_CONFIG = 0x03
+CMD_ID_RESET_DEVICE = 0x08
+
+MASTER_DEVICE_ID = 0xFF
+
+COMMAND_NAMES = {
+    USBManager.CMD_ID_QUERY: "QUERY",
+    CMD_ID_UNLOCK_CONFIG: "UNLOCK_CONFIG",
+    USBManager.CMD_ID_ERASE: "ERASE",
+    USBManager.CMD_ID_PROGRAM: "PROGRAM",
+    USBManager.CMD_ID_PROGRAM_COMPLETE: "PROGRAM_COMPLETE",
+    USBManager.CMD_ID_VERIFY: "GET_DATA",
+    CMD_ID_RESET_DEVICE: "RESET_DEVICE",
+    USBManager.CMD_ID_JUMP_TO_APPLICATION: "JUMP_TO_APPLICATION",
+    USBManager.CMD_ID_BOOT_FW_VERSION_REQUEST: "BOOT_FW_VERSION_REQUEST",
+    USBManager.CMD_ID_RESET_BOOT_MMT: "RESET_BOOT_MMT",
+}
+""" the bootloader commands by id """
+
+REPORT_LEN = 64
+
+
+class SimulatedNode:
+    """ A board behind the bootloader: its flash and what QUERY reports """
+
+    DEFAULT_REGIONS = ((MEMORY_REGION_PROGRAM, 0x1400, 0x29000),)
+
+    # the answer to QUERY leaves room for 5 regions, the end marker and
+    # the fields that follow it
+    MAX_REGIONS = 5
+
+    def __init__(self, device_id: int, regions=DEFAULT_REGIONS,
+                 version=(1, 0, 0), proto_ver=1):
+        """
+        :parameter regions: (type, address, size) of the memory regions,
+          addresses and sizes in device addresses; the first one is the one
+          USBManager.QUERY() returns
+        """
+
+        if not 0 < len(regions) <= self.MAX_REGIONS:
+            raise ValueError(f"a node has 1 to {self.MAX_REGIONS} regions")
+
+        self.device_id = device_id
+        self.regions = [tuple(region) for region in regions]
+        self.version = tuple(version)
+        self.proto_ver = proto_ver
+        self.boot_status = 0
+        self.digest = 0xFFFF
+        end = max(address + size for _, address, size in self.regions)
+        self.memory = MemoryImage.erased(0, end * 2)
+        # protocol errors of the host, e.g. a gap with no PROGRAM_COMPLETE
+        self.errors = []
+        # flash page buffered, and device address the next PROGRAM
+        # continues from
+        self._open_page = None
+        self._next_address = None
+
+    def in_region(self, address: int, length: int) -> bool:
+        """ whether length bytes at device address address are all in one
+        region """
+
+        return any(start <= address and
+                   address * 2 + length <= (start + size) * 2
+                   for _, start, size in self.regions)
+
+    def erase(self) -> NoReturn:
+        """ erase the program memory regions, and the digest with them """
+
+        for region_type, address, size in self.regions:
+            if region_type == MEMORY_REGION_PROGRAM:
+                self.memory[address * 2:(address + size) * 2] = \
+                    MemoryImage.erased(address * 2, size * 2)
+        self.digest = 0xFFFF
+        self._open_page = None
+        self._next_address = None
+
+    def read(self, address: int, length: int) -> bytes:
+        """ length bytes from device address address """
+
+        return bytes(self.memory[address * 2:address * 2 + length])
+
+
+class BootloaderSimulator:
+    """ The bootloader of a master and of its slaves, see the module
+    documentation. One host at a time is attached, as with USB. """
+
+    BYTES_PER_PACKET = USBManager.DATA_ATTACHMENT_LEN
+
+    def __init__(self, nodes=None, packet_latency=0.0, bus_latency=0.0,
+                 jitter=0.0, erase_time=0.0, page_write_time=0.0, page_size=256,
+                 relay_latency=0.0, drop_rate=0.0, corrupt_rate=0.0,
+                 write_fail_rate=0.0, stall_rate=0.0, stall_time=1.0,
+                 seed=None):
+        """
+        :parameter nodes: the SimulatedNode of each board, the master first;
+          a master with the default geometry when None
+        :parameter page_size: bytes of a flash page, phantom bytes included
+
+        Times are in seconds, rates are probabilities per message.
+        """
+
+        if nodes is None:
+            nodes = [SimulatedNode(MASTER_DEVICE_ID)]
+        self.nodes = collections.OrderedDict(
+            (node.device_id, node) for node in nodes)
+        self.master = next(iter(self.nodes.values()))
+
+        self.packet_latency = packet_latency
+        self.bus_latency = bus_latency
+        self.jitter = jitter
+        self.erase_time = erase_time
+        self.page_write_time = page_write_time
+        self.page_size = page_size
+        self.relay_latency = relay_latency
+        self.drop_rate = drop_rate
+        self.corrupt_rate = corrupt_rate
+        self.write_fail_rate = write_fail_rate
+        self.stall_rate = stall_rate
+        self.stall_time = stall_time
+        self._random = random.Random(seed)
+
+        # messages and events by name, e.g. PROGRAM or pages_written
+        self.stats = collections.Counter()
+
+        self._cond = threading.Condition()
+        self._host = None
+        self._selected = self.master
+        # OUT reports not taken yet: (time they reach the device, report)
+        self._queue = collections.deque()
+        # what the host is told and when: (time, sequence, host, call),
+        # call being a method of host and its arguments
+        self._events = []
+        self._sequence = 0
+        self._busy_until = 0.0
+        self._closed = False
+
+        # command id -> handler
+        self._handlers = {
+            USBManager.CMD_ID_QUERY: self._query,
+            CMD_ID_UNLOCK_CONFIG: self._unlock_config,
+            USBManager.CMD_ID_ERASE: self._erase,
+            USBManager.CMD_ID_PROGRAM: self._program,
+            USBManager.CMD_ID_PROGRAM_COMPLETE: self._program_complete,
+            USBManager.CMD_ID_VERIFY: self._get_data,
+            CMD_ID_RESET_DEVICE: self._leave,
+            USBManager.CMD_ID_JUMP_TO_APPLICATION: self._leave,
+            USBManager.CMD_ID_BOOT_FW_VERSION_REQUEST: self._boot_version,
+            USBManager.CMD_ID_RESET_BOOT_MMT: self._leave,
+        }
+
+        self._thread = threading.Thread(target=self._run,
+                                        name="bootloader simulator",
+                                        daemon=True)
+        self._thread.start()
+
+    def close(self) -> NoReturn:
+        """ stop the device thread """
+
+        with self._cond:
+            self._closed = True
+            self._cond.notify_all()
+        self._thread.join()
+
+    # host side: the transports
+
+    def attach(self, host) -> NoReturn:
+        """ plug host into the device; host has the methods taken(), called
+        when the device took an OUT report, answer(report) and detached(),
+        called when the device left the bus. They are called on the thread
+        of the device. """
+
+        with self._cond:
+            if self._host is not None:
+                raise RuntimeError("USB device already in use")
+            self._host = host
+            self._selected = self.master
+            self.stats["attach"] += 1
+
+    def detach(self, host) -> NoReturn:
+        """ unplug host: what it sent and was not taken is dropped """
+
+        with self._cond:
+            if self._host is host:
+                self._drop_host()
+
+    def submit(self, host, report) -> NoReturn:
+        """ an OUT report from host, taken by the device when it is free """
+
+        with self._cond:
+            if self._host is not host:
+                raise RuntimeError("USB device not attached")
+            self._queue.append((time.perf_counter() + self.bus_latency,
+                                bytes(report).ljust(REPORT_LEN, b'\0')))
+            self._cond.notify_all()
+
+    # device side
+
+    def _drop_host(self):
+        host, self._host = self._host, None
+        self._queue.clear()
+        self._events = [event for event in self._events
+                        if event[2] is not host]
+        heapq.heapify(self._events)
+
+    def _schedule(self, when, *call):
+        self._sequence += 1
+        heapq.heappush(self._events, (when, self._sequence, self._host, call))
+
+    def _run(self):
+        while True:
+            calls = []
+            with self._cond:
+                if self._closed:
+                    return
+                now = time.perf_counter()
+                while self._events and self._events[0][0] <= now:
+                    calls.append(heapq.heappop(self._events)[3])
+                if self._queue and self._queue[0][0] <= now and \
+                        self._busy_until <= now:
+                    host = self._host
+                    report = self._queue.popleft()[1]
+                    self._schedule(now + self.bus_latency, host.taken)
+                    busy, leave = self._process(report, now)
+                    self._busy_until = now + busy
+                    if leave:
+                        # the answers due are lost with the device
+                        self._schedule(now + self.bus_latency, host.detached)
+                        self._host = None
+                        self._queue.clear()
+                elif not calls:
+                    wakeups = [self._events[0][0]] if self._events else []
+                    if self._queue:
+                        wakeups.append(max(self._queue[0][0],
+                                           self._busy_until))
+                    self._cond.wait(min(wakeups) - now if wakeups else None)
+            for call in calls:
+                call[0](*call[1:])
+
+    def _latency(self) -> float:
+        latency = self.packet_latency
+        if self.jitter:
+            latency += self._random.uniform(0, self.jitter)
+        if self._selected is not None and self._selected is not self.master:
+            latency += self.relay_latency
+        return latency
+
+    def _chance(self, rate) -> bool:
+        return rate > 0 and self._random.random() < rate
+
+    def _process(self, report, now) -> tuple:
+        """ run a command: returns how long the device is busy with it and
+        whether it leaves the bus """
+
+        latency = self._latency()
+        busy = latency
+        if self._chance(self.stall_rate):
+            self.stats["stalls"] += 1
+            busy += self.stall_time
+
+        handler = self._handlers.get(report[0])
+        self.stats[COMMAND_NAMES.get(report[0], "unknown")] += 1
+        if handler is None:
+            return (busy, False)
+
+        answer, extra, leave = handler(report)
+        if answer is not None:
+            if self._chance(self.drop_rate):
+                self.stats["dropped_answers"] += 1
+            else:
+                self._schedule(now + latency + extra + self.bus_latency,
+                               self._host.answer,
+                               bytes(answer).ljust(REPORT_LEN, b'\0'))
+        return (busy + extra, leave)
+
+    # commands: each returns (answer or None, extra busy time, leaves)
+
+    def _query(self, report):
+        _, password, device_id = struct.unpack_from("<B8sB", report)
+        if password != bytes(USBManager.PASSWORD_QUERY):
+            self.stats["bad_password"] += 1
+            return (None, 0.0, False)
+
+        # device ID 0 is the master, as at every connection
+        if device_id == 0:
+            device_id = self.master.device_id
+        self._selected = self.nodes.get(device_id)
+        node = self._selected
+        if node is None:
+            # no answer from a slave that is not there
+            return (None, 0.0, False)
+
+        answer = bytearray(REPORT_LEN)
+        struct.pack_into("<BBB", answer, 0, USBManager.CMD_ID_QUERY,
+                         self.BYTES_PER_PACKET, DEVICE_FAMILY_PIC24)
+        offset = 3
+        for region in node.regions:
+            struct.pack_into("<BLL", answer, offset, *region)
+            offset += 9
+        struct.pack_into("<BBBBBBH", answer, offset, MEMORY_REGION_END,
+                         node.proto_ver, *node.version, node.boot_status,
+                         node.digest)
+        return (answer, 0.0, False)
+
+    def _unlock_config(self, report):
+        return (None, 0.0, False)
+
+    def _erase(self, report):
+        node = self._selected
+        if node is None:
+            return (None, 0.0, False)
+        node.erase()
+        return (None, self.erase_time, False)
+
+    def _close_page(self, node) -> float:
+        """ write the page node buffered, if any: the time it takes """
+
+        if node._open_page is None:
+            return 0.0
+        node._open_page = None
+        self.stats["pages_written"] += 1
+        return self.page_write_time
+
+    def _program(self, report):
+        node = self._selected
+        if node is None:
+            return (None, 0.0, False)
+
+        _, address, length, data = struct.unpack_from("<BLB58s", report)
+        if length > self.BYTES_PER_PACKET or \
+                not node.in_region(address, length):
+            node.errors.append(f"PROGRAM of {length} bytes at {address:#x} "
+                               "out of the memory regions")
+            return (None, 0.0, False)
+        if node._next_address is not None and address != node._next_address:
+            node.errors.append(f"PROGRAM at {address:#x} after a gap without "
+                               "PROGRAM_COMPLETE")
+        node._next_address = address + length // 2
+
+        # pages are written when the data moves on to the next one
+        extra = 0.0
+        first = address * 2 // self.page_size
+        last = (address * 2 + max(length, 1) - 1) // self.page_size
+        for page in range(first, last + 1):
+            if page != node._open_page:
+                extra += self._close_page(node)
+                node._open_page = page
+
+        if self._chance(self.write_fail_rate):
+            self.stats["failed_writes"] += 1
+        else:
+            node.memory[address * 2:address * 2 + length] = \
+                data[58 - length:]
+        return (None, extra, False)
+
+    def _program_complete(self, report):
+        node = self._selected
+        if node is None:
+            return (None, 0.0, False)
+
+        _, digest = struct.unpack_from("<BH", report)
+        extra = self._close_page(node)
+        node._next_address = None
+        if digest != 0:
+            node.digest = digest
+            extra += self.page_write_time
+        return (None, extra, False)
+
+    def _get_data(self, report):
+        node = self._selected
+        if node is None:
+            return (None, 0.0, False)
+
+        _, address, length = struct.unpack_from("<BLB", report)
+        length = min(length, 58)
+        data = bytearray(58)
+        data[58 - length:] = node.read(address, length)
+        if length and self._chance(self.corrupt_rate):
+            self.stats["corrupted_answers"] += 1
+            data[57] ^= 0x01
+        return (struct.pack("<BLB58s", USBManager.CMD_ID_VERIFY, address,
+                            length, bytes(data)), 0.0, False)
+
+    def _boot_version(self, report):
+        _, device_id = struct.unpack_from("<BB", report)
+        node = self.nodes.get(self.master.device_id if device_id == 0
+                              else device_id)
+        if node is None:
+            return (None, 0.0, False)
+        return (struct.pack("<BBBB", USBManager.CMD_ID_BOOT_FW_VERSION_REQUEST,
+                            *node.version), 0.0, False)
+
+    def _leave(self, report):
+        extra = 0.0
+        if self._selected is not None:
+            extra = self._close_page(self._selected)
+        return (None, extra, True)
+
+
+class _HostTransport:
+    """ The interface of usb_async.LibusbTransport on a simulated device:
+    up to OUT_TRANSFERS reports written and not yet taken by the device,
+    answers queued in the order they come. Subclasses send the reports. """
+
+    OUT_TRANSFERS = 8
+    REPORT_LEN = REPORT_LEN
+
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._received = collections.deque()
+        self._out_in_flight = 0
+        self._error = None
+        self._cancelled = False
+        self._detached = False
+
+    # called by the device
+
+    def taken(self):
+        with self._cond:
+            self._out_in_flight -= 1
+            self._cond.notify_all()
+
+    def answer(self, report):
+        with self._cond:
+            self._received.append(bytes(report))
+            self._cond.notify_all()
+
+    def detached(self):
+        with self._cond:
+            self._detached = True
+            self._cond.notify_all()
+
+    def _wait(self, predicate, timeout, what):
+        """ wait, with _cond held, for predicate, for the device to leave
+        the bus or for cancel() """
+
+        if not self._cond.wait_for(
+                lambda: self._cancelled or self._error or self._detached
+                or predicate(), timeout / 1000):
+            raise TimeoutError(f"timeout {what}")
+        if self._cancelled:
+            raise TransferCancelled(f"cancelled {what}")
+        if self._error is not None:
+            error, self._error = self._error, None
+            raise error
+        if not predicate():
+            raise RuntimeError(f"device disconnected {what}")
+
+    def write(self, data, timeout: int) -> NoReturn:
+        with self._cond:
+            if self._detached:
+                raise RuntimeError("device disconnected writing to device")
+            self._wait(lambda: self._out_in_flight < self.OUT_TRANSFERS,
+                       timeout, "writing to device")
+            self._out_in_flight += 1
+        try:
+            self._submit(bytes(data))
+        except BaseException:
+            with self._cond:
+                self._out_in_flight -= 1
+            raise
+
+    def flush(self, timeout: int) -> NoReturn:
+        with self._cond:
+            while self._out_in_flight:
+                in_flight = self._out_in_flight
+                self._wait(lambda: self._out_in_flight < in_flight, timeout,
+                           "writing to device")
+
+    def read(self, timeout: int) -> bytes:
+        with self._cond:
+            self._wait(lambda: self._received, timeout, "reading from device")
+            return self._received.popleft()
+
+    def cancel(self) -> NoReturn:
+        with self._cond:
+            self._cancelled = True
+            self._cond.notify_all()
+
+    def _submit(self, report):
+        raise NotImplementedError
+
+
+class SimulatedTransport(_HostTransport):
+    """ A transport on a BootloaderSimulator in the same process """
+
+    def __init__(self, simulator: BootloaderSimulator):
+        super().__init__()
+        self.simulator = simulator
+        simulator.attach(self)
+
+    def _submit(self, report):
+        self.simulator.submit(self, report)
+
+    def close(self):
+        self.simulator.detach(self)
+
+
+# frames of the TCP link of the standalone process: the host sends a length
+# byte and the report, the device a FRAME_* byte, followed by the report for
+# FRAME_ANSWER
+FRAME_ATTACHED = b'H'
+FRAME_TAKEN = b'T'
+FRAME_ANSWER = b'A'
+
+
+def _recv_exactly(sock, length) -> Optional[bytes]:
+    """ length bytes from sock, None at the end of the stream """
+
+    data = bytearray()
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            return None
+        data += chunk
+    return bytes(data)
+
+
+class SocketTransport(_HostTransport):
+    """ A transport on the standalone simulator process, over TCP """
+
+    CONNECT_TIMEOUT_SEC = 2
+
+    def __init__(self, host: str, port: int):
+        super().__init__()
+        self._send_lock = threading.Lock()
+        try:
+            self._sock = socket.create_connection(
+                (host, port), self.CONNECT_TIMEOUT_SEC)
+            self._sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            # the simulator greets a host it attached; it closes the
+            # connection when another one is attached already
+            if _recv_exactly(self._sock, 1) != FRAME_ATTACHED:
+                self._sock.close()
+                raise RuntimeError("USB device not found")
+        except OSError as e:
+            raise RuntimeError("USB device not found") from e
+        self._sock.settimeout(None)
+
+        self._thread = threading.Thread(target=self._run_reader,
+                                        name="simulator link", daemon=True)
+        self._thread.start()
+
+    @classmethod
+    def from_address(cls, address: str) -> 'SocketTransport':
+        """ connect to HOST:PORT """
+
+        host, _, port = address.rpartition(':')
+        return cls(host or 'localhost', int(port))
+
+    def _run_reader(self):
+        try:
+            while True:
+                frame = _recv_exactly(self._sock, 1)
+                if frame == FRAME_TAKEN:
+                    self.taken()
+                elif frame == FRAME_ANSWER:
+                    report = _recv_exactly(self._sock, REPORT_LEN)
+                    if report is None:
+                        break
+                    self.answer(report)
+                else:
+                    break
+        except OSError:
+            pass
+        self.detached()
+
+    def _submit(self, report):
+        with self._send_lock:
+            self._sock.sendall(bytes([len(report)]) + report)
+
+    def close(self):
+        try:
+            self._sock.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+        self._thread.join()
+        self._sock.close()
+
+
+class _SocketHost:
+    """ the simulator end of a SocketTransport """
+
+    def __init__(self, conn):
+        self.conn = conn
+        self._lock = threading.Lock()
+
+    def _send(self, frame):
+        try:
+            with self._lock:
+                self.conn.sendall(frame)
+        except OSError:
+            pass
+
+    def taken(self):
+        self._send(FRAME_TAKEN)
+
+    def answer(self, report):
+        self._send(FRAME_ANSWER + report)
+
+    def detached(self):
+        try:
+            self.conn.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+
+def serve(simulator: BootloaderSimulator, sock: socket.socket) -> NoReturn:
+    """ attach the hosts connecting to the listening socket sock to
+    simulator, one at a time, until sock is shut down """
+
+    while True:
+        try:
+            conn, peer = sock.accept()
+        except OSError:
+            return
+        conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        host = _SocketHost(conn)
+        try:
+            simulator.attach(host)
+        except RuntimeError:
+            logging.warning(f"{peer}: device already in use")
+            conn.close()
+            continue
+
+        logging.info(f"{peer}: attached")
+        host.conn.sendall(FRAME_ATTACHED)
+        threading.Thread(target=_serve_host, args=(simulator, host, peer),
+                         name="simulator host", daemon=True).start()
+
+
+def _serve_host(simulator, host, peer):
+    try:
+        while True:
+            length = _recv_exactly(host.conn, 1)
+            if length is None:
+                break
+            report = _recv_exactly(host.conn, length[0])
+            if report is None:
+                break
+            simulator.submit(host, report)
+    except (OSError, RuntimeError):
+        # RuntimeError: the device left the bus
+        pass
+    simulator.detach(host)
+    host.conn.close()
+    logging.info(f"{peer}: detached")
+
+
+def add_arguments(parser: argparse.ArgumentParser) -> NoReturn:
+    """ add the options of the simulated device to parser, see
+    from_arguments() """
+
+    parser.add_argument('--slaves', type=str, default='',
+                        help="device IDs of the slaves, comma separated")
+    parser.add_argument('--address', type=lambda s: int(s, 0),
+                        default=SimulatedNode.DEFAULT_REGIONS[0][1],
+                        help="device address of the program memory")
+    parser.add_argument('--size', type=lambda s: int(s, 0),
+                        default=SimulatedNode.DEFAULT_REGIONS[0][2],
+                        help="device addresses of the program memory")
+    parser.add_argument('--latency-ms', type=float, default=1.0,
+                        help="time the device takes for each message")
+    parser.add_argument('--bus-ms', type=float, default=1.0,
+                        help="time a report takes to cross the bus")
+    parser.add_argument('--jitter-ms', type=float, default=0.0,
+                        help="random time added to each message")
+    parser.add_argument('--erase-ms', type=float, default=500.0,
+                        help="time an erase takes")
+    parser.add_argument('--page-write-ms', type=float, default=2.0,
+                        help="time a flash page write takes")
+    parser.add_argument('--relay-ms', type=float, default=0.0,
+                        help="time added to each message for a slave")
+    parser.add_argument('--drop-rate', type=float, default=0.0,
+                        help="probability of an answer being lost")
+    parser.add_argument('--corrupt-rate', type=float, default=0.0,
+                        help="probability of a GET_DATA answer being wrong")
+    parser.add_argument('--write-fail-rate', type=float, default=0.0,
+                        help="probability of a PROGRAM not being written")
+    parser.add_argument('--stall-rate', type=float, default=0.0,
+                        help="probability of the device stalling")
+    parser.add_argument('--stall-ms', type=float, default=1000.0,
+                        help="time a stall lasts")
+    parser.add_argument('--seed', type=int, default=None,
+                        help="seed of the random jitter and faults")
+
+
+def from_arguments(args) -> BootloaderSimulator:
+    """ a simulator, with erased nodes, as the options of add_arguments()
+    describe it """
+
+    regions = ((MEMORY_REGION_PROGRAM, args.address, args.size),)
+    nodes = [SimulatedNode(MASTER_DEVICE_ID, regions)]
+    nodes += [SimulatedNode(int(device_id), regions)
+              for device_id in args.slaves.split(',') if device_id]
+    return BootloaderSimulator(
+        nodes, packet_latency=args.latency_ms / 1000,
+        bus_latency=args.bus_ms / 1000,
+        jitter=args.jitter_ms / 1000, erase_time=args.erase_ms / 1000,
+        page_write_time=args.page_write_ms / 1000,
+        relay_latency=args.relay_ms / 1000, drop_rate=args.drop_rate,
+        corrupt_rate=args.corrupt_rate, write_fail_rate=args.write_fail_rate,
+        stall_rate=args.stall_rate, stall_time=args.stall_ms / 1000,
+        seed=args.seed)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        prog="python -m alfa_fw_upgrader.simulator",
+        description="simulated PIC24 HID bootloader, reached by the loaders "
+        "with ALFA_FW_SIMULATOR=HOST:PORT or --simulator HOST:PORT")
+    parser.add_argument('--host', default='localhost',
+                        help="address to listen on (default=localhost)")
+    parser.add_argument('--port', type=int, default=8071,
+                        help="TCP port to listen on (default=8071)")
+    add_arguments(parser)
+    parser.add_argument("-v", "--verbosity", action="count",
+                        help="increase output verbosity")
+    args = parser.parse_args()
+
+    logging.basicConfig(
+        level="DEBUG" if args.verbosity else "INFO",
+        format="[%(asctime)s]%(levelname)s %(funcName)s() %(message)s")
+
+    simulator = from_arguments(args)
+    sock = socket.create_server((args.host, args.port))
+    logging.info(f"bootloader simulator listening on {args.host}:{args.port}")
+    try:
+        serve(simulator, sock)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        sock.close()
+        simulator.close()
+        logging.info(f"statistics: {dict(simulator.stats)}")
+
+
+if __name__ == "__main__":
+    main()
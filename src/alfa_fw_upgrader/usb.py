@@ -81,14 +81,27 @@ you have to strip away trailing zeros.
 In order to select the proper node, each of them has its own *device ID*.
 MAB has always a *device ID* = 0xFF. The booloader selects which node to
 update by setting a parameter of QUERY message.
+
+Timeouts
+========
+
+No transfer waits a fixed 15 seconds any more: each waits for the budget
+of a LatencyBudget learned on the device - one for commands, one for the
+QUERY answered once an erase is over, one for the messages of a stream.
+A device that stops answering is reported within a few of its round
+trips. USBManager.cancel() makes every later transfer raise
+TransferCancelled; a pyusb call in progress is not interrupted, but it
+ends within its budget.
 """
 
 import usb.core
 import usb.util
+import math
 import struct
 import logging
+import threading
 import time
-from typing import NoReturn, Callable
+from typing import NoReturn, Callable, Iterable, Iterator, Optional
 
 def repetible(method: Callable):
     def wrapper(self, *args, **kwargs):
@@ -105,12 +118,67 @@ def repetible(method: Callable):
         return
     return wrapper
 
+class TransferCancelled(Exception):
+    """ the transfers were aborted with USBManager.cancel() """
+
+
+class LatencyBudget:
+    """ How long to wait for a transfer before calling the device stalled,
+    derived from the latencies it showed so far the way TCP derives its
+    retransmission timeout (RFC 6298): the smoothed latency plus four times
+    its mean deviation, kept between a floor and a ceiling. Until the first
+    sample the budget is the initial one.
+
+    The figures of LatencyBudget in legacy/hexcore, which the GUI uses. """
+
+    def __init__(self, floor_ms: int, ceiling_ms: int, initial_ms: int):
+        self.floor_ms = floor_ms
+        self.ceiling_ms = ceiling_ms
+        self.initial_ms = initial_ms
+        self.reset()
+
+    def reset(self) -> NoReturn:
+        """ forget the samples: back to the initial budget """
+
+        # seconds, None until sampled
+        self.smoothed = None
+        self.deviation = 0.0
+
+    def sample(self, seconds: float) -> NoReturn:
+        """ record the latency of a transfer that completed """
+
+        if self.smoothed is None:
+            self.smoothed = seconds
+            self.deviation = seconds / 2
+        else:
+            self.deviation = (0.75 * self.deviation
+                              + 0.25 * abs(self.smoothed - seconds))
+            self.smoothed = 0.875 * self.smoothed + 0.125 * seconds
+
+    @property
+    def timeout_ms(self) -> int:
+        """ the wait allowed to the next transfer """
+
+        if self.smoothed is None:
+            return self.initial_ms
+        timeout = math.ceil((self.smoothed + 4 * self.deviation) * 1000)
+        return min(max(timeout, self.floor_ms), self.ceiling_ms)
+
+
 class USBManager:
     """ This class implements the USB communication with bootloader """
 
     CMD_RETRIES = 3
     CMD_TIMEOUT_MSEC = 15000
 
+    # latency budgets, (floor, ceiling, initial) in msecs: see LatencyBudget
+    COMMAND_BUDGET_MSEC = (200, 5000, 2000)
+    # ERASE waited CMD_TIMEOUT_MSEC for the QUERY answer before the
+    # budgets, and an erase is never retried: the first one keeps that wait,
+    # the ceiling leaves room for the slow slaves behind the serial relay
+    ERASE_BUDGET_MSEC = (1000, 60000, CMD_TIMEOUT_MSEC)
+    STREAM_BUDGET_MSEC = (500, 5000, 2000)
+
     PASSWORD_QUERY = [0x82, 0x14, 0x2A, 0x5D, 0x6F, 0x9A, 0x25, 0x01]
     USB_ID_VENDOR = 0x04d8
     USB_ID_PRODUCT = 0xe89b
@@ -125,17 +193,53 @@ class USBManager:
     CMD_ID_JUMP_TO_APPLICATION = 0x09
     CMD_ID_RESET_BOOT_MMT = 0x0B
 
-    def __init__(self, device_id):
+    def __init__(self, device_id, transport=None):
+        """
+        :parameter transport: an object with the interface of
+          usb_async.LibusbTransport to send the messages through, e.g. a
+          simulator.SocketTransport; pyusb on the bootloader when None
+        """
+
+        self._transport = transport
+        # a command waits for its answer, an erase for the answer to the
+        # QUERY that follows it, a stream for each of its messages
+        self.command_budget = LatencyBudget(*self.COMMAND_BUDGET_MSEC)
+        self.erase_budget = LatencyBudget(*self.ERASE_BUDGET_MSEC)
+        self.stream_budget = LatencyBudget(*self.STREAM_BUDGET_MSEC)
+        # device id the budgets were learned on, see QUERY()
+        self._budget_device = None
+        # when the last message was sent, see _read_usb_message()
+        self._sent = time.perf_counter()
+        self._cancelled = threading.Event()
         self._usb_init()
         self.device_id = device_id
 
+    def cancel(self) -> NoReturn:
+        """ abort the transfers: every later one raises TransferCancelled.
+        May be called from any thread; the manager is then only good for
+        disconnect(). """
+
+        self._cancelled.set()
+        if self._transport is not None:
+            self._transport.cancel()
+
+    def _check_cancelled(self):
+        if self._cancelled.is_set():
+            raise TransferCancelled("USB transfers cancelled")
+
     def disconnect(self):
         logging.debug("disconnecting USB")
-        usb.util.dispose_resources(self.dev)
+        if self._transport is not None:
+            self._transport.close()
+        else:
+            usb.util.dispose_resources(self.dev)
 
     def _usb_init(self):
         """ USB initialization """
 
+        if self._transport is not None:
+            return
+
         self.dev = usb.core.find(idVendor=self.USB_ID_VENDOR,
                                  idProduct=self.USB_ID_PRODUCT)
         if self.dev is None:
@@ -174,46 +278,85 @@ class USBManager:
         assert self.ep_out is not None
         assert self.ep_in is not None
 
-    def _send_usb_message(self, data, timeout=None):
-        """ send a message to USB endpoint """
+    def _send_usb_message(self, data, budget=None):
+        """ send a message to USB endpoint
+
+        :parameter data: bytes, bytearray or memoryview, handed to pyusb as
+          it is
+        :parameter budget: the LatencyBudget bounding the write,
+          command_budget when None """
 
-        data_to_send = list(data)
-        if timeout is None:
-            timeout = self.CMD_TIMEOUT_MSEC
+        self._check_cancelled()
+        if budget is None:
+            budget = self.command_budget
 
         if logging.getLogger().isEnabledFor(logging.DEBUG):
             logging.debug("Writing data: {}".format(
-                " ".join(["%02X" % int(b) for b in bytes(data_to_send)])))
-        ret = self.dev.write(self.ep_out, data_to_send, timeout)
-        if ret != len(data_to_send):
-            raise RuntimeError(
-                "Returning value {} from write operation is not "
-                "the expected one {}".format(
-                    ret, len(data_to_send)))
+                bytes(data).hex(' ').upper()))
+        self._sent = time.perf_counter()
+        self._write_usb(data, budget.timeout_ms)
 
-    def _read_usb_message(self, length=64, timeout=None):
-        """ receive a message from USB endpoint
+    def _stream_usb_message(self, data):
+        """ send a message of a stream: the write is bounded by
+        stream_budget and its time is sampled into it """
+
+        self._send_usb_message(data, self.stream_budget)
+        self.stream_budget.sample(time.perf_counter() - self._sent)
+
+    def _read_usb_message(self, length=64, budget=None):
+        """ receive the answer to the last message sent: the budget
+        (command_budget when None) counts from the message and learns the
+        latency of the answer
 
         Note that communication will hang if the length is not the right one -
         this value depends on the command. """
 
-        if timeout is None:
-            timeout = self.CMD_TIMEOUT_MSEC
-        ret = self.dev.read(self.ep_in, length, timeout)
+        self._check_cancelled()
+        if budget is None:
+            budget = self.command_budget
+        elapsed = math.floor((time.perf_counter() - self._sent) * 1000)
+        # 0 would be no timeout at all for pyusb
+        ret = self._read_usb(length, max(budget.timeout_ms - elapsed, 1))
+        budget.sample(time.perf_counter() - self._sent)
 
         if logging.getLogger().isEnabledFor(logging.DEBUG):
             logging.debug("Read data: {}".format(
-                " ".join(["%02X" % int(b) for b in bytes(ret)])))
+                bytes(ret).hex(' ').upper()))
         return ret
 
+    def _write_usb(self, data, timeout: int):
+        """ write to the OUT endpoint, waiting up to timeout msecs """
+
+        if self._transport is not None:
+            self._transport.write(data, timeout)
+            self._transport.flush(timeout)
+            return
+
+        ret = self.dev.write(self.ep_out, data, timeout)
+        if ret != len(data):
+            raise RuntimeError(
+                "Returning value {} from write operation is not "
+                "the expected one {}".format(
+                    ret, len(data)))
+
+    def _read_usb(self, length: int, timeout: int):
+        """ read from the IN endpoint, waiting up to timeout msecs """
+
+        if self._transport is not None:
+            return self._transport.read(timeout)[:length]
+        return self.dev.read(self.ep_in, length, timeout)
+
     @repetible
-    def QUERY(self, alt_device_id=None, timeout=None):
+    def QUERY(self, alt_device_id=None, budget=None):
         """ Command to obtain information about the memory layout - starting
         address and length of the application memory. It is also used to
         check for erasing operation finish and to setup the following
         operations (e.g. to setup communication with a slave node, this is
         the only command taking the device ID as argument!)
 
+        :parameter budget: the LatencyBudget of the command, command_budget
+          when None
+
         :return: a tuple:
           1. starting address of application memory
           2. length of application memory, i.e. number of available addresses
@@ -244,15 +387,20 @@ class USBManager:
         else:
             deviceId = alt_device_id
 
+        if deviceId != self._budget_device:
+            # a slave answers through the master: what was learned on
+            # another node does not hold
+            for b in (self.command_budget, self.erase_budget,
+                      self.stream_budget):
+                b.reset()
+            self._budget_device = deviceId
+
         fmt = "<B{}sB".format(len(self.PASSWORD_QUERY))
         data = struct.pack(fmt, self.CMD_ID_QUERY,
                            bytes(self.PASSWORD_QUERY), deviceId)
-        self._send_usb_message(data)
-
-        if timeout is None:
-            timeout = self.CMD_TIMEOUT_MSEC
+        self._send_usb_message(data, budget)
 
-        buff = self._read_usb_message(64, timeout=timeout)[:20]
+        buff = self._read_usb_message(64, budget)[:20]
         cmd_id, bytesPerPacket, bytesPerAddress, memoryType,  \
             address1, lenght1, type2, proto_ver, \
             ver_major, ver_minor, ver_patch, boot_status, digest = \
@@ -291,13 +439,9 @@ class USBManager:
         self._send_usb_message(data)
 
         # erase command does not produce any answer - send QUERY and wait
-        # for the answer from this command
-
-        timeout = 5000  # response takes longer time after erase command
-        if self.CMD_TIMEOUT_MSEC > timeout:
-            timeout = self.CMD_TIMEOUT_MSEC
-
-        self.QUERY(timeout=timeout)
+        # for the answer from this command: the bootloader takes it once the
+        # memory is erased
+        self.QUERY(budget=self.erase_budget)
 
     def PROGRAM(self, address: int, chunk: bytes) -> NoReturn:
         """ Write a piece of memory. No return.
@@ -316,16 +460,64 @@ class USBManager:
         #
         # No answer provided.
 
-        if len(chunk) > self.DATA_ATTACHMENT_LEN:
+        message = bytearray(64)
+        length = self._pack_PROGRAM_into(message, address, chunk)
+        self._stream_usb_message(memoryview(message)[:length])
+
+    _ZEROS = memoryview(bytes(58))
+
+    @classmethod
+    def _pack_PROGRAM_into(cls, buffer, address: int, chunk) -> int:
+        """ write the PROGRAM message at the start of buffer (a writable
+        buffer of at least 64 bytes): chunk, any bytes-like object, is
+        copied once, right-aligned, and only the bytes in front of it are
+        cleared.
+
+        :return: the length of the message """
+
+        length = len(chunk)
+        if length > cls.DATA_ATTACHMENT_LEN:
             raise ValueError("too much bytes on the PROGRAM message")
 
-        if len(chunk) < 58:
-            # align to right
-            array = [0] * (58 - len(chunk)) + list(chunk)
+        struct.pack_into("<BLB", buffer, 0, cls.CMD_ID_PROGRAM, address,
+                         length)
+        buffer[6:64 - length] = cls._ZEROS[:58 - length]
+        buffer[64 - length:64] = chunk
+        return 64
 
-        data = struct.pack("<BLB58s", self.CMD_ID_PROGRAM, address, len(chunk),
-                           bytes(array))
-        self._send_usb_message(data)
+    def PROGRAM_MESSAGES(self, messages: Iterable) -> NoReturn:
+        """ Write PROGRAM and PROGRAM_COMPLETE messages already packed, as
+        they are, e.g. the ones of a PacketPlan. No return.
+
+        :parameter messages: iterable of 64 byte bytes-like objects
+        """
+
+        for message in messages:
+            self._stream_usb_message(message)
+
+    def PROGRAM_VERIFY_MESSAGES(self, messages: Iterable) -> Iterator:
+        """ Write PROGRAM, PROGRAM_COMPLETE and GET_DATA messages already
+        packed, in order: as PROGRAM_MESSAGES, with the requests reading
+        back what is programmed among them.
+
+        :parameter messages: iterable of bytes-like objects
+        :return: an iterator of (address, chunk) tuples, one for each
+          GET_DATA, in the order the answers come back
+        """
+
+        for message in messages:
+            if message[0] == self.CMD_ID_VERIFY:
+                _, requested, _ = struct.unpack_from("<BLB", message)
+                self._send_usb_message(message, self.stream_budget)
+                address, chunk = self._unpack_GET_DATA(
+                    self._read_usb_message(64, self.stream_budget))
+                if address != requested:
+                    raise RuntimeError(
+                        f"GET_DATA answer for address {address} to the "
+                        f"request for address {requested}")
+                yield (address, chunk)
+            else:
+                self._stream_usb_message(message)
 
     @repetible
     def PROGRAM_COMPLETE(self, digest: int) -> NoReturn:
@@ -333,10 +525,15 @@ class USBManager:
         :parameter digest: 16 bit word resulting from hashing the program
         No return."""
 
+        self._send_usb_message(self.pack_PROGRAM_COMPLETE(digest))
+
+    @classmethod
+    def pack_PROGRAM_COMPLETE(cls, digest: int) -> bytes:
+        """ the PROGRAM_COMPLETE message, e.g. for PROGRAM_MESSAGES """
+
         trailing = [0xFF] * 61  # command requires trailing sequence of 0xFF
-        data = struct.pack("<BH61s", self.CMD_ID_PROGRAM_COMPLETE,
+        return struct.pack("<BH61s", cls.CMD_ID_PROGRAM_COMPLETE,
                            digest, bytes(trailing))
-        self._send_usb_message(data)
 
     def GET_DATA(self, address: int, length: int) -> bytes:
         """ Read a piece of memory.
@@ -362,16 +559,23 @@ class USBManager:
         # | <byte> |  <uint32>  |     <byte>     |                |
         # +--------+------------+----------------+----------------+
 
-        if length > self.DATA_ATTACHMENT_LEN:
+        self._send_usb_message(self.pack_GET_DATA(address, length))
+        return self._unpack_GET_DATA(self._read_usb_message(64))[1]
+
+    @classmethod
+    def pack_GET_DATA(cls, address: int, length: int) -> bytes:
+        """ the GET_DATA message, e.g. for PROGRAM_VERIFY_MESSAGES """
+
+        if length > cls.DATA_ATTACHMENT_LEN:
             raise ValueError("too much bytes on the GET_DATA message")
 
-        data = struct.pack("<BLB", self.CMD_ID_VERIFY, address, length)
+        return struct.pack("<BLB", cls.CMD_ID_VERIFY, address, length)
 
-        self._send_usb_message(data)
-        buff = self._read_usb_message(64)
+    def _unpack_GET_DATA(self, buff) -> tuple:
+        """ :return: a tuple (address, chunk) from a GET_DATA answer """
 
         cmd_id, address, bytesPerPacket, array = \
-            struct.unpack(f"<BLB58s", buff)
+            struct.unpack(f"<BLB58s", bytes(buff))
 
         try:
             assert cmd_id == self.CMD_ID_VERIFY
@@ -379,7 +583,50 @@ class USBManager:
         except BaseException:
             RuntimeError("Invalid data in GET_DATA response")
 
-        return array[58 - bytesPerPacket:]
+        return (address, array[58 - bytesPerPacket:])
+
+    def GET_DATA_STREAM(self, requests: Iterable) -> Iterator:
+        """ Read a sequence of pieces of memory, as GET_DATA does for each
+        of them.
+
+        :parameter requests: iterable of (address, length) tuples
+
+        :return: an iterator of (address, chunk) tuples, in the order the
+          answers come back - not necessarily the order of the requests
+        """
+
+        for address, length in requests:
+            self._send_usb_message(self.pack_GET_DATA(address, length),
+                                   self.stream_budget)
+            yield (address, self._unpack_GET_DATA(
+                self._read_usb_message(64, self.stream_budget))[1])
+
+    def GET_DATA_RANGE(self, address: int, length: int) -> memoryview:
+        """ Read a range of memory of any size, with GET_DATA requests of
+        DATA_ATTACHMENT_LEN bytes sent through GET_DATA_STREAM.
+
+        :parameter address: starting address
+        :parameter length: number of bytes to read
+
+        :return: a memoryview on a bytearray of length bytes; each answer is
+          placed by the address it echoes
+        """
+
+        step = self.DATA_ATTACHMENT_LEN
+        buff = bytearray(length)
+        requests = ((address + offset // 2, min(step, length - offset))
+                    for offset in range(0, length, step))
+
+        for chunk_address, chunk in self.GET_DATA_STREAM(requests):
+            offset = (chunk_address - address) * 2
+            if not 0 <= offset < length or \
+                    len(chunk) != min(step, length - offset):
+                raise RuntimeError(
+                    f"GET_DATA answer of {len(chunk)} bytes for address "
+                    f"{chunk_address} does not match the request")
+            buff[offset:offset + len(chunk)] = chunk
+
+        return memoryview(buff)
 
     @repetible
     def BOOT_FW_VERSION_REQUEST(self) -> tuple:
@@ -426,3 +673,46 @@ class USBManager:
         # ~   assert cmd_id == self.CMD_ID_RESET_BOOT_MMT
         # ~ except BaseException:
         # ~   RuntimeError("Invalid data in JUMP_TO_APPLICATION response")
+
+
+USB_BACKENDS = ("sync", "async", "auto")
+""" values of the usb_backend argument of open_usb_manager() """
+
+
+def open_usb_manager(device_id, backend: str = "sync",
+                     simulator: Optional[str] = None) -> USBManager:
+    """ Open the bootloader with the given USB backend:
+
+    - sync: USBManager, one synchronous pyusb call per message;
+    - async: AsyncUSBManager (see usb_async), libusb asynchronous transfers
+      with several messages in flight while programming and verifying;
+    - auto: async when python-libusb1 is installed, sync otherwise.
+
+    With simulator set to HOST:PORT, the device is the bootloader simulator
+    listening there (see simulator), with async for auto.
+
+    :parameter backend: one of USB_BACKENDS; the async backend is opt-in
+    :parameter simulator: HOST:PORT of the simulator; None for the USB
+      device
+    """
+
+    if backend not in USB_BACKENDS:
+        raise ValueError(f"unknown USB backend {backend}")
+
+    if simulator:
+        # imported here: both depend on this module
+        from alfa_fw_upgrader import simulator as sim, usb_async
+        transport = sim.SocketTransport.from_address(simulator)
+        if backend == "sync":
+            return USBManager(device_id, transport)
+        return usb_async.AsyncUSBManager(device_id, transport)
+
+    if backend != "sync":
+        # imported here: usb_async depends on this module
+        from alfa_fw_upgrader import usb_async
+        if usb_async.usb1 is not None:
+            return usb_async.AsyncUSBManager(device_id)
+        if backend == "async":
+            raise RuntimeError("USB backend async requires python-libusb1")
+
+    return USBManager(device_id)
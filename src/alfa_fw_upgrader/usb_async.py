@@ -0,0 +1,421 @@
+"""
+alfa_fw_upgrader - a package to program Alfa PIC based boards using USB based bootloader.
+
+This module implements the USB commands on libusb asynchronous transfers.
+
+With USBManager every message is a synchronous pyusb call: the next
+GET_DATA leaves only when the answer of the previous one is back, so the
+transfer rate is bound by the round trip of the bus and of the bootloader
+rather than by the HID bandwidth. Here:
+
+- a few IN transfers are always submitted, so the answers of the
+  bootloader are taken as soon as it has them;
+- OUT transfers come from a small pool: a message is submitted without
+  waiting for the previous ones, and the messages of a PacketPlan are the
+  buffers of their transfers;
+- an event thread runs libusb and resubmits each IN transfer as soon as
+  its report is queued.
+
+AsyncUSBManager uses this to keep messages in flight in PROGRAM_MESSAGES,
+GET_DATA_STREAM and PROGRAM_VERIFY_MESSAGES; every other command still
+waits for its message to be written, as USBManager does. Each wait of a
+stream is bounded by, and sampled into, the stream budget (see
+usb.LatencyBudget), and cancel() ends the wait in progress at once.
+
+python-libusb1 is optional: without it usb1 is None and open_usb_manager()
+falls back to USBManager.
+"""
+
+import collections
+import logging
+import struct
+import threading
+import time
+from typing import Iterable, Iterator, NoReturn
+
+try:
+    import usb1
+except (ImportError, OSError):
+    # not installed, or no libusb shared library
+    usb1 = None
+
+from alfa_fw_upgrader.usb import TransferCancelled, USBManager
+
+
+class LibusbTransport:
+    """ Asynchronous transfers on the bootloader endpoints.
+
+    Reports are written with write(), which returns as soon as the transfer
+    is submitted (flush() waits for all of them), and taken with read() in
+    the order the device sends them. A report held in a writable
+    memoryview, such as a message of a PacketPlan, is submitted as it is;
+    any other is copied into the buffer of a free transfer. """
+
+    IN_TRANSFERS = 4
+    OUT_TRANSFERS = 8
+    REPORT_LEN = 64
+    EVENT_TIMEOUT_SEC = 0.1
+
+    def __init__(self, vendor_id, product_id):
+        if usb1 is None:
+            raise RuntimeError("python-libusb1 not installed")
+
+        self._cond = threading.Condition()
+        self._received = collections.deque()
+        # (transfer, buffer) pairs
+        self._free_out = []
+        self._out_in_flight = 0
+        self._in_submitted = 0
+        self._error = None
+        self._cancelled = False
+        self._closing = False
+        self._stop = False
+
+        self.context = usb1.USBContext()
+        self.context.open()
+        try:
+            self._open(vendor_id, product_id)
+        except BaseException:
+            self.context.close()
+            raise
+
+        self._thread = threading.Thread(target=self._run_events,
+                                        name="libusb events", daemon=True)
+        self._thread.start()
+
+        self._in_transfers = []
+        for _ in range(self.IN_TRANSFERS):
+            transfer = self.handle.getTransfer()
+            self._setup_in(transfer)
+            self._in_transfers.append(transfer)
+            with self._cond:
+                self._in_submitted += 1
+            transfer.submit()
+
+        self._free_out = [(self.handle.getTransfer(),
+                           bytearray(self.REPORT_LEN))
+                          for _ in range(self.OUT_TRANSFERS)]
+        self._out_buffers = {id(transfer): (transfer, buffer)
+                             for transfer, buffer in self._free_out}
+
+    def _open(self, vendor_id, product_id):
+        self.handle = self.context.openByVendorIDAndProductID(
+            vendor_id, product_id, skip_on_error=True)
+        if self.handle is None:
+            raise RuntimeError("USB device not found")
+
+        # USB reset is needed on platform BW551
+        try:
+            self.handle.resetDevice()
+        except usb1.USBErrorNotFound:
+            # the device enumerated again: the handle is stale
+            self.handle = self.context.openByVendorIDAndProductID(
+                vendor_id, product_id, skip_on_error=True)
+            if self.handle is None:
+                raise RuntimeError("USB device not found after reset")
+
+        try:
+            # needed on linux because there is a kernel driver that
+            # take possession of our device
+            if self.handle.kernelDriverActive(0):
+                self.handle.detachKernelDriver(0)
+        except usb1.USBError:
+            logging.info("failed to detach kernel driver")
+
+        # the first configuration, as pyusb set_configuration() does
+        device = self.handle.getDevice()
+        configuration = next(iter(device.iterConfigurations()))
+        self.handle.setConfiguration(configuration.getConfigurationValue())
+        self.handle.claimInterface(0)
+
+        self._ep_in = self._ep_out = None
+        for setting in device.iterSettings():
+            if setting.getNumber() != 0 or setting.getAlternateSetting() != 0:
+                continue
+            for endpoint in setting.iterEndpoints():
+                if endpoint.getAddress() & 0x80:
+                    self._ep_in = endpoint
+                else:
+                    self._ep_out = endpoint
+
+        assert self._ep_out is not None
+        assert self._ep_in is not None
+
+    @staticmethod
+    def _setup(transfer, endpoint, buffer_or_len, callback, timeout=0):
+        # the bootloader exposes interrupt endpoints, bulk ones are
+        # accepted as well
+        if endpoint.getAttributes() & 0x3 == 0x2:
+            transfer.setBulk(endpoint.getAddress(), buffer_or_len,
+                             callback=callback, timeout=timeout)
+        else:
+            transfer.setInterrupt(endpoint.getAddress(), buffer_or_len,
+                                  callback=callback, timeout=timeout)
+
+    def _setup_in(self, transfer):
+        self._setup(transfer, self._ep_in, self.REPORT_LEN, self._on_in)
+
+    def _run_events(self):
+        while not self._stop:
+            try:
+                self.context.handleEventsTimeout(self.EVENT_TIMEOUT_SEC)
+            except usb1.USBErrorInterrupted:
+                pass
+            except BaseException as e:
+                with self._cond:
+                    self._error = e
+                    self._cond.notify_all()
+                return
+
+    def _on_in(self, transfer):
+        # called on the event thread
+        status = transfer.getStatus()
+        with self._cond:
+            if status == usb1.TRANSFER_COMPLETED:
+                self._received.append(
+                    bytes(transfer.getBuffer()[:transfer.getActualLength()]))
+            elif status != usb1.TRANSFER_CANCELLED:
+                self._error = RuntimeError(f"IN transfer failed: {status}")
+            resubmit = status == usb1.TRANSFER_COMPLETED and not self._closing
+            if not resubmit:
+                self._in_submitted -= 1
+            self._cond.notify_all()
+        if resubmit:
+            transfer.submit()
+
+    def _on_out(self, transfer):
+        # called on the event thread
+        status = transfer.getStatus()
+        with self._cond:
+            if status != usb1.TRANSFER_COMPLETED:
+                self._error = RuntimeError(f"OUT transfer failed: {status}")
+            elif transfer.getActualLength() != len(transfer.getBuffer()):
+                self._error = RuntimeError(
+                    "Returning value {} from write operation is not "
+                    "the expected one {}".format(
+                        transfer.getActualLength(), len(transfer.getBuffer())))
+            self._out_in_flight -= 1
+            self._free_out.append(self._out_buffers[id(transfer)])
+            self._cond.notify_all()
+
+    def _wait(self, predicate, timeout, what):
+        """ wait, with _cond held, for predicate, for a failed transfer or
+        for cancel() """
+
+        if not self._cond.wait_for(
+                lambda: self._cancelled or self._error or predicate(),
+                timeout / 1000):
+            raise TimeoutError(f"timeout {what}")
+        if self._cancelled:
+            raise TransferCancelled(f"cancelled {what}")
+        if self._error is not None:
+            error, self._error = self._error, None
+            raise error
+
+    def write(self, data, timeout: int) -> NoReturn:
+        """ submit a report, first waiting up to timeout msecs for a free
+        OUT transfer
+
+        :parameter data: bytes-like; a writable memoryview, e.g. on a
+          PacketPlan, is submitted without copying it and must not change
+          until the transfer is over
+        """
+
+        with self._cond:
+            self._wait(lambda: self._free_out, timeout, "writing to device")
+            transfer, buffer = self._free_out.pop()
+            self._out_in_flight += 1
+        if isinstance(data, memoryview) and not data.readonly \
+                and data.contiguous:
+            # libusb sends from this memory
+            out = data
+        else:
+            buffer[:len(data)] = data
+            out = memoryview(buffer)[:len(data)]
+        self._setup(transfer, self._ep_out, out, self._on_out, timeout)
+        try:
+            transfer.submit()
+        except BaseException:
+            with self._cond:
+                self._out_in_flight -= 1
+                self._free_out.append((transfer, buffer))
+            raise
+
+    def flush(self, timeout: int) -> NoReturn:
+        """ wait for every report written, up to timeout msecs for each of
+        them """
+
+        with self._cond:
+            while self._out_in_flight:
+                in_flight = self._out_in_flight
+                self._wait(lambda: self._out_in_flight < in_flight, timeout,
+                           "writing to device")
+
+    def read(self, timeout: int) -> bytes:
+        """ wait up to timeout msecs for the next report from device """
+
+        with self._cond:
+            self._wait(lambda: self._received, timeout, "reading from device")
+            return self._received.popleft()
+
+    def cancel(self) -> NoReturn:
+        """ make the wait in progress and every later one raise
+        TransferCancelled; may be called from any thread """
+
+        with self._cond:
+            self._cancelled = True
+            self._cond.notify_all()
+
+    def close(self):
+        with self._cond:
+            self._closing = True
+        for transfer in self._in_transfers:
+            try:
+                transfer.cancel()
+            except usb1.USBError:
+                pass
+        with self._cond:
+            self._cond.wait_for(lambda: self._in_submitted == 0
+                                and self._out_in_flight == 0, 1)
+        self._stop = True
+        self._thread.join()
+        try:
+            self.handle.releaseInterface(0)
+        except usb1.USBError:
+            pass
+        self.handle.close()
+        self.context.close()
+
+
+class AsyncUSBManager(USBManager):
+    """ USBManager on libusb asynchronous transfers (LibusbTransport). """
+
+    STREAM_DEPTH = 8
+    """ requests in flight at most in GET_DATA_STREAM """
+
+    VERIFY_DEPTH = 32
+    """ GET_DATA answers due at most in PROGRAM_VERIFY_MESSAGES: they are
+    queued as they come, so the next one is only waited for past them """
+
+    def __init__(self, device_id, transport=None):
+        """
+        :parameter transport: an object with the interface of
+          LibusbTransport; a LibusbTransport on the bootloader when None
+        """
+
+        super().__init__(device_id, transport)
+
+    def _usb_init(self):
+        if self._transport is None:
+            self._transport = LibusbTransport(self.USB_ID_VENDOR,
+                                              self.USB_ID_PRODUCT)
+
+    def _queue_usb_message(self, data):
+        """ submit a message of a stream to USB endpoint without waiting for
+        it: only for a free OUT transfer, within the stream budget """
+
+        self._check_cancelled()
+        if logging.getLogger().isEnabledFor(logging.DEBUG):
+            logging.debug("Writing data: {}".format(
+                bytes(data).hex(' ').upper()))
+        self._stream(self._transport.write, data)
+
+    def _stream(self, wait, *args):
+        """ call a wait of the transport within the stream budget, and
+        sample the time it took into it """
+
+        self._check_cancelled()
+        start = time.perf_counter()
+        ret = wait(*args, self.stream_budget.timeout_ms)
+        self.stream_budget.sample(time.perf_counter() - start)
+        return ret
+
+    def _read_stream_message(self):
+        """ the next answer of a stream """
+
+        ret = self._stream(self._transport.read)
+        if logging.getLogger().isEnabledFor(logging.DEBUG):
+            logging.debug("Read data: {}".format(
+                bytes(ret).hex(' ').upper()))
+        return ret
+
+    def PROGRAM_MESSAGES(self, messages: Iterable) -> NoReturn:
+        # PROGRAM needs no answer: the OUT transfers of the pool keep up to
+        # OUT_TRANSFERS messages in flight, in order, the messages of a
+        # PacketPlan being the buffers of their transfers
+        for message in messages:
+            if message[0] == self.CMD_ID_PROGRAM_COMPLETE:
+                # the bootloader writes what it buffered on PROGRAM_COMPLETE:
+                # the data before it must all be out
+                self._stream(self._transport.flush)
+                self._send_usb_message(message)
+            else:
+                self._queue_usb_message(message)
+        self._stream(self._transport.flush)
+
+    def GET_DATA_STREAM(self, requests: Iterable) -> Iterator:
+        requests = iter(requests)
+        # length requested, by address
+        pending = {}
+        more = True
+        try:
+            while True:
+                while more and len(pending) < self.STREAM_DEPTH:
+                    request = next(requests, None)
+                    if request is None:
+                        more = False
+                        break
+                    address, length = request
+                    self._queue_usb_message(
+                        self.pack_GET_DATA(address, length))
+                    pending[address] = length
+                if not pending:
+                    return
+
+                yield self._next_GET_DATA(pending)
+        finally:
+            self._drain_GET_DATA(pending)
+
+    def PROGRAM_VERIFY_MESSAGES(self, messages: Iterable) -> Iterator:
+        # as PROGRAM_MESSAGES, with the GET_DATA requests queued among the
+        # PROGRAM messages: the answers are taken once VERIFY_DEPTH of them
+        # are due, while the next messages are in flight
+        pending = {}
+        try:
+            for message in messages:
+                if message[0] == self.CMD_ID_PROGRAM_COMPLETE:
+                    self._stream(self._transport.flush)
+                    self._send_usb_message(message)
+                    continue
+                self._queue_usb_message(message)
+                if message[0] == self.CMD_ID_VERIFY:
+                    _, address, length = struct.unpack_from("<BLB", message)
+                    pending[address] = length
+                    if len(pending) >= self.VERIFY_DEPTH:
+                        yield self._next_GET_DATA(pending)
+            self._stream(self._transport.flush)
+            while pending:
+                yield self._next_GET_DATA(pending)
+        finally:
+            self._drain_GET_DATA(pending)
+
+    def _next_GET_DATA(self, pending: dict) -> tuple:
+        """ the next GET_DATA answer, as (address, chunk), removing its
+        request from pending (length requested, by address) """
+
+        address, chunk = self._unpack_GET_DATA(self._read_stream_message())
+        if pending.pop(address, None) is None:
+            raise RuntimeError(
+                f"GET_DATA answer for address {address} not requested")
+        return (address, chunk)
+
+    def _drain_GET_DATA(self, pending: dict) -> NoReturn:
+        """ the caller stopped early, or something failed: take the answers
+        still due, so that they do not get in the way of the next commands """
+
+        try:
+            while pending:
+                self._read_stream_message()
+                pending.popitem()
+        except BaseException:
+            logging.warning(f"{len(pending)} GET_DATA answers not drained")
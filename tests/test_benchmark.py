@@ -0,0 +1,156 @@
+#!/usr/bin/env python
+
+# Load time of an update package with the native _hexcore module and with
+# the pure Python fallback, load time of an MPLAB IPE table and cost of the
+# packet debug dumps:
+#
+#   pytest tests/test_benchmark.py --benchmark-group-by=group
+#
+# The update of a board end to end, phase by phase, has its own harness
+# against the bootloader simulator, with a JSON report:
+#
+#   python -m alfa_fw_upgrader.benchmark -o benchmark.json
+
+import json
+import os
+
+import pytest
+
+try:
+    import pytest_benchmark
+except ImportError:
+    pytest_benchmark = None
+
+import alfa_fw_upgrader.hexutils as hexutils
+from alfa_fw_upgrader import benchmark as update_benchmark
+from alfa_fw_upgrader.simulator import BootloaderSimulator
+from alfa_fw_upgrader.package_loader import AlfaPackageLoader
+
+here = os.path.dirname(os.path.abspath(__file__))
+
+with open(os.path.join(here, 'test_pkg', 'package.zip'), 'rb') as f:
+    PACKAGE = f.read()
+
+
+@pytest.fixture(params=['native', 'python'])
+def hexcore(request, monkeypatch):
+    if request.param == 'native':
+        if hexutils._hexcore is None:
+            pytest.skip("_hexcore extension not built")
+    else:
+        monkeypatch.setattr(hexutils, '_hexcore', None)
+    return request.param
+
+
+def _load():
+    loader = AlfaPackageLoader(PACKAGE, serial_port=None)
+    loader.load_package(PACKAGE)
+    return loader.programs_hex
+
+
+@pytest.mark.skipif(pytest_benchmark is None, reason="pytest-benchmark not installed")
+def test_load_package(benchmark, hexcore):
+    benchmark.group = 'load_package'
+    programs = benchmark(_load)
+    assert programs
+
+
+def test_native_matches_python(monkeypatch):
+    if hexutils._hexcore is None:
+        pytest.skip("_hexcore extension not built")
+
+    native = _load()
+    native_crc = hexutils._hexcore.crc16_ccitt
+    monkeypatch.setattr(hexutils, '_hexcore', None)
+    python = _load()
+
+    assert native.keys() == python.keys()
+    for fn, image in native.items():
+        assert len(image) == len(python[fn])
+        assert image.tobytes() == python[fn].tobytes()
+        segment = image[0x2800:0x2800 + 0x10000]
+        assert native_crc(segment) == hexutils.HexUtils.crc16_ccitt(segment)
+
+
+MPLAB_TABLE = os.path.join(here, 'TABLE_from_MPLAB_IPE.txt')
+
+
+def _mplab_table():
+    table = hexutils.HexUtils.load_mplab_table(MPLAB_TABLE)
+    return bytes(hexutils.HexUtils.dict_to_array(table, len(table)))
+
+
+def _mplab_image():
+    return hexutils.HexUtils.load_mplab_image(MPLAB_TABLE).tobytes()
+
+
+@pytest.mark.skipif(pytest_benchmark is None, reason="pytest-benchmark not installed")
+@pytest.mark.parametrize('load', [_mplab_table, _mplab_image], ids=['table', 'image'])
+def test_load_mplab(benchmark, load):
+    benchmark.group = 'load_mplab'
+    assert len(benchmark(load)) == 0x2ABF8 * 2
+
+
+# debug dumps of packets: the per byte formatting used before and the
+# bytes.hex() one used now
+DUMP = bytes(range(256)) * 4
+
+
+def _dump_join(data):
+    return " ".join(["%02X" % int(b) for b in data])
+
+
+def _dump_hex(data):
+    return data.hex(' ').upper()
+
+
+@pytest.mark.skipif(pytest_benchmark is None, reason="pytest-benchmark not installed")
+@pytest.mark.parametrize('dump', [_dump_join, _dump_hex], ids=['join', 'hex'])
+def test_hex_dump(benchmark, dump):
+    benchmark.group = 'hex_dump'
+    assert benchmark(dump, DUMP) == _dump_join(DUMP)
+
+
+def test_hex_dump_format():
+    assert _dump_hex(DUMP) == _dump_join(DUMP)
+
+
+def test_update_benchmark():
+    # the harness itself, on one image with an instant device
+    report = update_benchmark.run(
+        [os.path.join(here, 'pump-r1-siboot-dipswitch.hex')],
+        list(update_benchmark.BACKENDS), BootloaderSimulator, verbose=False)
+    json.dumps(report)
+
+    assert [r['backend'] for r in report['runs']] == ['sync', 'async']
+    for run in report['runs']:
+        assert run['verified'] and 'error' not in run
+        assert list(run['phases']) == ['load', 'connect', 'erase', 'program',
+                                       'verify', 'seal', 'jump']
+        # seal sends one more PROGRAM_COMPLETE
+        program = run['phases']['program']
+        assert program['packets'] == run['device']['PROGRAM'] + \
+            run['device']['PROGRAM_COMPLETE'] - 1
+        assert program['bytes'] == run['phases']['verify']['bytes'] > 0
+        latency = program['latency_ms']['PROGRAM']
+        assert latency['p50'] <= latency['p90'] <= latency['p99'] <= \
+            latency['max']
+        assert run['total']['packets'] == sum(
+            p['packets'] for p in run['phases'].values())
+
+    # program and verify in one pass: the same messages
+    report = update_benchmark.run(
+        [os.path.join(here, 'pump-r1-siboot-dipswitch.hex')], ['async'],
+        BootloaderSimulator, verbose=False, interleave=True)
+    run = report['runs'][0]
+    assert run['verified'] and 'error' not in run
+    assert list(run['phases']) == ['load', 'connect', 'erase',
+                                   'program_verify', 'seal', 'jump']
+    assert run['device']['GET_DATA'] == run['device']['PROGRAM'] > 0
+
+
+def test_percentile():
+    ordered = list(range(1, 101))
+    assert [update_benchmark.percentile(ordered, p)
+            for p in (50, 90, 99, 100)] == [50, 90, 99, 100]
+    assert update_benchmark.percentile([7], 50) == 7
@@ -1,7 +1,6 @@
 #!/usr/bin/env python
 
 from alfa_fw_upgrader.hexutils import HexUtils
-from alfa_fw_upgrader.lib import AlfaFirmwareLoader
 import unittest
 import logging
 import os
@@ -41,6 +40,124 @@ class TestFileDriver(unittest.TestCase):
 
             assert array1 == array2
             assert array2 == array3
+
+    def test_hex_image(self):
+        # the sparse image must read exactly as the array of ints
+        here = os.path.dirname(os.path.abspath(__file__))
+
+        for f in ('Master_Tinting-boot-nodipswitch.hex',
+                  'pump-r1-siboot-dipswitch.hex'):
+            with open(os.path.join(here, f), 'r') as fh:
+                file_content = fh.read()
+
+            array = HexUtils.load_hex_to_array(file_content)
+            image = HexUtils.load_hex_to_image(file_content)
+
+            assert len(array) == len(image)
+            assert bytes(array) == image.tobytes()
+            assert bytes(array[0x2800:0x2800 + 1000]) == image[0x2800:0x2800 + 1000]
+
+    def test_mplab_image(self):
+        # the fixed column decoder must read the table as load_mplab_table()
+        here = os.path.dirname(os.path.abspath(__file__))
+        fn = os.path.join(here, 'TABLE_from_MPLAB_IPE.txt')
+
+        dict1 = HexUtils.load_mplab_table(fn)
+        image = HexUtils.load_mplab_image(fn)
+
+        assert len(image) == len(dict1)
+        assert bytes(HexUtils.dict_to_array(dict1, len(dict1))) == image.tobytes()
+
+    def test_image_cache(self):
+        # a cached image must read exactly as the decoded one
+        import tempfile
+        from alfa_fw_upgrader.image_cache import ImageCache
+        here = os.path.dirname(os.path.abspath(__file__))
+
+        with open(os.path.join(here, 'pump-r1-siboot-dipswitch.hex'), 'rb') as fh:
+            file_content = fh.read()
+
+        with tempfile.TemporaryDirectory() as d:
+            image = ImageCache(d).load_hex(file_content)
+            image.digests[(0x2800, 0x1000)] = 0x1234
+
+            # the digests are calculated again on each run, never trusted
+            # from the disk
+            cached = ImageCache(d).load_hex(file_content)
+            assert cached.tobytes() == HexUtils.load_hex_to_image(
+                file_content.decode()).tobytes()
+            assert not cached.digests
+            cached.digests[(0x2800, 0x1000)] = 0x1234
+
+            # cached extents are read-only until written
+            cached.write(0x2800, b'\x01\x02')
+            assert cached[0x2800:0x2802] == b'\x01\x02'
+            # and no longer the cached content, nor its digests
+            assert not cached.digests and cached.cache is None
+            del cached
+
+            # a damaged file is decoded again, not adopted
+            fn, = (os.path.join(d, fn) for fn in os.listdir(d)
+                   if fn.endswith('.img'))
+            with open(fn, 'r+b') as f:
+                f.seek(-1, os.SEEK_END)
+                last = f.read(1)
+                f.seek(-1, os.SEEK_END)
+                f.write(bytes([last[0] ^ 0x01]))
+            cached = ImageCache(d).load_hex(file_content)
+            assert cached.tobytes() == image.tobytes()
+            del cached
+
+    def test_image_cache_prune(self):
+        # the entries loaded last are kept
+        import tempfile
+        from alfa_fw_upgrader.image_cache import ImageCache
+
+        def content(n):
+            record = bytes([1, 0, 0, 0, n])
+            checksum = -sum(record) & 0xFF
+            return f":{record.hex().upper()}{checksum:02X}\n:00000001FF\n"
+
+        with tempfile.TemporaryDirectory() as d:
+            cache = ImageCache(d)
+            cache.MAX_ENTRIES = 2
+            for n in (1, 2):
+                cache.load_hex(content(n))
+            for n, age in ((1, 900), (2, 1000)):
+                fn = os.path.join(d, cache.key(content(n).encode()) + '.img')
+                os.utime(fn, (age, age))
+
+            cache.load_hex(content(1))
+            cache.load_hex(content(3))
+            kept = sorted(fn for fn in os.listdir(d) if fn.endswith('.img'))
+            assert kept == sorted(cache.key(content(n).encode()) + '.img'
+                                  for n in (1, 3))
+            assert not [fn for fn in os.listdir(d) if fn.endswith('.tmp')]
+
+    def test_occupancy(self):
+        # a block is set when it differs from erased memory, and only then
+        from alfa_fw_upgrader.hexutils import MemoryImage
+        here = os.path.dirname(os.path.abspath(__file__))
+
+        with open(os.path.join(here, 'pump-r1-siboot-dipswitch.hex'), 'r') as fh:
+            image = HexUtils.load_hex_to_image(fh.read())
+
+        for address, length, block in ((0x2800, 0x55800, 56),
+                                       (0x2802, 0x1000, 30)):
+            bitmap = image.occupancy(address, length, block)
+            expected = [n for n in range((length + block - 1) // block)
+                        if image[address + n * block:
+                                 min(address + (n + 1) * block,
+                                     address + length)] !=
+                        bytes(MemoryImage.erased(
+                            address + n * block,
+                            min(block, length - n * block)))]
+            assert list(MemoryImage.set_blocks(bitmap)) == expected
+            assert 0 < len(expected) < (length + block - 1) // block
+            assert image.occupancy(address, length, block) is bitmap
+
+        image.write(0x2800, b'\x00')
+        assert image.occupancies == {}
            
 if __name__ == '__main__':
     logging.basicConfig(level=logging.INFO)
@@ -0,0 +1,733 @@
+#!/usr/bin/env python
+
+# USB backends and sessions against a simulated bootloader: no device needed.
+
+from alfa_fw_upgrader.usb import USBManager, LatencyBudget, \
+    TransferCancelled, open_usb_manager
+from alfa_fw_upgrader.usb_async import AsyncUSBManager, LibusbTransport
+from alfa_fw_upgrader.session import DeviceSession
+from alfa_fw_upgrader.packet_plan import PacketPlan
+from alfa_fw_upgrader.image_cache import ImageCache
+from alfa_fw_upgrader.hexutils import HexUtils, MemoryImage
+from alfa_fw_upgrader.fw_loader import AlfaFirmwareLoader
+from alfa_fw_upgrader.simulator import BootloaderSimulator, SimulatedNode, \
+    SimulatedTransport, SocketTransport, serve
+import collections
+import os
+import random
+import socket
+import struct
+import tempfile
+import threading
+import time
+import unittest
+import logging
+
+
+def program_messages(packets):
+    """ the PROGRAM messages of (address, chunk) packets, and a
+    PROGRAM_COMPLETE with digest 0 for each None among them """
+
+    for packet in packets:
+        if packet is None:
+            yield USBManager.pack_PROGRAM_COMPLETE(0)
+        else:
+            message = bytearray(64)
+            USBManager._pack_PROGRAM_into(message, *packet)
+            yield message
+
+
+class FakeTransport:
+    """ LibusbTransport on a simulated bootloader: PROGRAM writes the memory,
+    GET_DATA answers come back swapped in pairs, as they may with several
+    requests in flight. """
+
+    def __init__(self):
+        self.memory = bytearray(b'\xFF' * 0x1000)
+        self.received = collections.deque()
+        self.held = None
+        self.completes = 0
+        self.queries = []
+        self.closed = False
+        self.cancelled = False
+        # the timeouts of the reads, and whether the device answers
+        self.read_timeouts = []
+        self.stalled = False
+
+    def write(self, data, timeout):
+        if self.cancelled:
+            raise TransferCancelled("cancelled")
+        data = bytes(data)
+        cmd_id = data[0]
+        if cmd_id == USBManager.CMD_ID_QUERY:
+            _, _, device_id = struct.unpack("<B8sB", data)
+            self.queries.append(device_id)
+            self.received.append(struct.pack(
+                "<BBBBLLBBBBBBH", cmd_id, 56, 2, 1, 0x100, 0x700, 0xFF, 1,
+                1, 0, device_id, 0, 0x1234).ljust(64, b'\0'))
+        elif cmd_id == USBManager.CMD_ID_PROGRAM:
+            _, address, length, array = struct.unpack("<BLB58s", data)
+            self.memory[address * 2:address * 2 + length] = \
+                array[58 - length:]
+        elif cmd_id == USBManager.CMD_ID_PROGRAM_COMPLETE:
+            self.completes += 1
+        elif cmd_id == USBManager.CMD_ID_VERIFY:
+            _, address, length = struct.unpack("<BLB", data)
+            array = bytes(58 - length) + \
+                self.memory[address * 2:address * 2 + length]
+            answer = struct.pack("<BLB58s", cmd_id, address, length, array)
+            if self.held is None:
+                self.held = answer
+            else:
+                self.received.extend((answer, self.held))
+                self.held = None
+
+    def flush(self, timeout):
+        pass
+
+    def read(self, timeout):
+        self.read_timeouts.append(timeout)
+        if self.cancelled:
+            raise TransferCancelled("cancelled")
+        if self.stalled:
+            time.sleep(timeout / 1000)
+            raise TimeoutError("timeout reading from device")
+        if not self.received and self.held is not None:
+            self.received.append(self.held)
+            self.held = None
+        if not self.received:
+            raise TimeoutError("timeout reading from device")
+        return self.received.popleft()
+
+    def cancel(self):
+        self.cancelled = True
+
+    def close(self):
+        self.closed = True
+
+
+class SyncFakeManager(USBManager):
+    """ USBManager, one message at a time, on a FakeTransport """
+
+
+class TestUSBBackends(unittest.TestCase):
+    def _packets(self, image):
+        # every third chunk left out, with PROGRAM_COMPLETE after the gap
+        chunk_size = USBManager.DATA_ATTACHMENT_LEN
+        for block, cursor in enumerate(range(0, len(image), chunk_size)):
+            if block % 3 == 2:
+                continue
+            if block % 3 == 0 and block > 0:
+                yield None
+            yield (cursor // 2, image[cursor:cursor + chunk_size])
+
+    def test_stream(self):
+        rng = random.Random(3)
+        image = bytes(rng.randrange(256) for _ in range(0x1000 - 6))
+        expected = bytearray(b'\xFF' * 0x1000)
+        for packet in self._packets(image):
+            if packet is not None:
+                address, chunk = packet
+                expected[address * 2:address * 2 + len(chunk)] = chunk
+
+        for manager in (SyncFakeManager(0, FakeTransport()),
+                        AsyncUSBManager(0, FakeTransport())):
+            transport = manager._transport
+            manager.PROGRAM_MESSAGES(program_messages(self._packets(image)))
+            self.assertEqual(transport.memory, expected)
+            self.assertEqual(transport.completes, 24)
+
+            requests = [(address, min(56, 0x1000 - address * 2))
+                        for address in range(0, 0x800, 28)]
+            answers = dict(manager.GET_DATA_STREAM(requests))
+            self.assertEqual(sorted(answers), [a for a, _ in requests])
+            for address, length in requests:
+                self.assertEqual(answers[address],
+                                 expected[address * 2:address * 2 + length])
+
+    def test_get_data_range(self):
+        rng = random.Random(4)
+        for manager in (SyncFakeManager(0, FakeTransport()),
+                        AsyncUSBManager(0, FakeTransport())):
+            memory = manager._transport.memory
+            memory[:] = bytes(rng.randrange(256) for _ in range(len(memory)))
+
+            data = manager.GET_DATA_RANGE(0x101, 0x3FF)
+            self.assertIsInstance(data, memoryview)
+            self.assertEqual(data, memory[0x202:0x202 + 0x3FF])
+            self.assertEqual(len(manager.GET_DATA_RANGE(0x10, 0)), 0)
+
+    def test_pack_program(self):
+        manager = SyncFakeManager(0, FakeTransport())
+        chunk = bytes(range(1, 11))
+        # packed over a buffer still holding an older message
+        buffer = bytearray(b'\xAA' * 64)
+        length = manager._pack_PROGRAM_into(buffer, 0x1234, memoryview(chunk))
+        self.assertEqual(buffer[:length], struct.pack(
+            "<BLB58s", USBManager.CMD_ID_PROGRAM, 0x1234, 10,
+            bytes(48) + chunk))
+
+    def test_async_early_close(self):
+        transport = FakeTransport()
+        manager = AsyncUSBManager(0, transport)
+
+        answers = manager.GET_DATA_STREAM(
+            (address, 56) for address in range(0, 0x800, 28))
+        next(answers)
+        answers.close()
+        # the answers in flight are taken, the next command gets its own
+        self.assertFalse(transport.received)
+        self.assertIsNone(transport.held)
+        self.assertEqual(manager.GET_DATA(0x100, 4), b'\xFF' * 4)
+
+        manager.disconnect()
+        self.assertTrue(transport.closed)
+
+    def test_async_unexpected_answer(self):
+        transport = FakeTransport()
+        manager = AsyncUSBManager(0, transport)
+
+        transport.received.append(struct.pack(
+            "<BLB58s", USBManager.CMD_ID_VERIFY, 0x400, 0, bytes(58)))
+        with self.assertRaises(RuntimeError):
+            list(manager.GET_DATA_STREAM([(0, 56)]))
+
+    def test_libusb_write(self):
+        # the messages of a plan are the buffers of their transfers, the
+        # other reports are copied into the buffer of the transfer
+        class Transfer:
+            def submit(self):
+                pass
+
+        transport = LibusbTransport.__new__(LibusbTransport)
+        transport._cond = threading.Condition()
+        transport._error = None
+        transport._cancelled = False
+        transport._out_in_flight = 0
+        transport._free_out = [(Transfer(), bytearray(64)) for _ in range(2)]
+        transport._ep_out = transport._on_out = None
+        submitted = []
+        transport._setup = lambda transfer, endpoint, buffer, callback, \
+            timeout: submitted.append(buffer)
+
+        message = next(PacketPlan(bytearray(128)).messages())
+        transport.write(message, 100)
+        transport.write(bytes(message), 100)
+        self.assertIs(submitted[0], message)
+        self.assertIsInstance(submitted[1].obj, bytearray)
+        self.assertEqual(submitted[1], message)
+
+
+class TestLatency(unittest.TestCase):
+    def test_budget(self):
+        budget = LatencyBudget(20, 500, 300)
+        self.assertEqual(budget.timeout_ms, 300)
+        budget.sample(0.001)
+        self.assertEqual(budget.timeout_ms, 20)
+
+        # 10 ms steady, then one late answer widens the budget by four
+        # times the deviation
+        budget.reset()
+        for _ in range(40):
+            budget.sample(0.010)
+        self.assertEqual(budget.timeout_ms, 20)
+        budget.sample(0.050)
+        self.assertTrue(50 <= budget.timeout_ms <= 70)
+        budget.sample(10)
+        self.assertEqual(budget.timeout_ms, 500)
+
+    def test_stall(self):
+        for manager in (SyncFakeManager(0, FakeTransport()),
+                        AsyncUSBManager(0, FakeTransport())):
+            transport = manager._transport
+            manager.QUERY()
+            manager.ERASE()
+            manager.GET_DATA_RANGE(0, 0x400)
+            # the erase has its own budget; the others learned the fake
+            # device answers at once
+            self.assertIsNotNone(manager.erase_budget.smoothed)
+            self.assertEqual(transport.read_timeouts[-1],
+                             USBManager.STREAM_BUDGET_MSEC[0])
+            self.assertEqual(manager.command_budget.timeout_ms,
+                             USBManager.COMMAND_BUDGET_MSEC[0])
+
+            # a device that stops answering is reported within the budget
+            transport.stalled = True
+            start = time.perf_counter()
+            with self.assertRaises(TimeoutError):
+                manager.GET_DATA_RANGE(0, 0x400)
+            self.assertLess(time.perf_counter() - start, 2)
+
+            # another node starts from the initial budgets again
+            transport.stalled = False
+            manager.QUERY(alt_device_id=3)
+            self.assertEqual(transport.read_timeouts[-1],
+                             USBManager.COMMAND_BUDGET_MSEC[2])
+
+    def test_cancel(self):
+        for manager in (SyncFakeManager(0, FakeTransport()),
+                        AsyncUSBManager(0, FakeTransport())):
+            manager.cancel()
+            with self.assertRaises(TransferCancelled):
+                manager.GET_DATA(0, 4)
+            with self.assertRaises(TransferCancelled):
+                manager.PROGRAM_MESSAGES(program_messages([(0, b'\0' * 4)]))
+        self.assertTrue(manager._transport.cancelled)
+
+        # a wait of the libusb transport ends as soon as it is cancelled
+        transport = LibusbTransport.__new__(LibusbTransport)
+        transport._cond = threading.Condition()
+        transport._received = collections.deque()
+        transport._error = None
+        transport._cancelled = False
+        canceller = threading.Timer(0.05, transport.cancel)
+        canceller.start()
+        start = time.perf_counter()
+        with self.assertRaises(TransferCancelled):
+            transport.read(10000)
+        self.assertLess(time.perf_counter() - start, 2)
+        canceller.join()
+
+
+class TestPacketPlan(unittest.TestCase):
+    def test_plan(self):
+        rng = random.Random(5)
+        image = MemoryImage(0x1000)
+        for address in (0x10, 0x300, 0x800, 0xFF0):
+            image.write(address, bytes(rng.randrange(256) for _ in range(40)))
+        segment = image[0x100:0x1000]
+
+        plan = PacketPlan.for_image(image, segment, 0x100, 56, True)
+        self.assertIs(PacketPlan.for_image(image, segment, 0x100, 56, True),
+                      plan)
+
+        # the same messages as PROGRAM for each chunk with data
+        blocks = MemoryImage.set_blocks(image.occupancy(0x100, 0xF00, 56))
+        packets = []
+        next_block = 0
+        for block in blocks:
+            if block != next_block:
+                packets.append(None)
+            next_block = block + 1
+            packets.append((0x80 + block * 28, segment[block * 56:
+                                                       block * 56 + 56]))
+        self.assertEqual(plan.packets, 3)
+        self.assertEqual(len(plan), len(packets))
+        for manager in (SyncFakeManager(0, FakeTransport()),
+                        AsyncUSBManager(0, FakeTransport())):
+            transport = manager._transport
+            manager.PROGRAM_MESSAGES(plan.messages())
+            expected = FakeTransport()
+            SyncFakeManager(0, expected).PROGRAM_MESSAGES(
+                program_messages(packets))
+            self.assertEqual(transport.memory, expected.memory)
+            self.assertEqual(transport.completes, expected.completes)
+
+        # without the skip decisions every chunk is sent; writing to the
+        # image drops its plans
+        self.assertEqual(PacketPlan.for_image(image, segment, 0x100, 56,
+                                              False).packets, 69)
+        image.write(0x400, b'\0')
+        self.assertFalse(image.plans)
+
+    def test_cached_plan(self):
+        with open('tests/pump-r1-siboot-dipswitch.hex', 'rb') as f:
+            content = f.read()
+        with tempfile.TemporaryDirectory() as d:
+            image = ImageCache(d).load_hex(content)
+            segment = image[0x2000:0x3000]
+            plan = PacketPlan.for_image(image, segment, 0x2000, 56, True)
+
+            cached = ImageCache(d).load_hex(content)
+            loaded = PacketPlan.for_image(cached, segment, 0x2000, 56, True)
+            self.assertIsNot(loaded, plan)
+            self.assertEqual(loaded.reports, plan.reports)
+            # sent by the async backend without copying it
+            self.assertFalse(loaded.reports.readonly)
+
+            # a damaged plan file is compiled again, not sent to the device
+            filename, = (os.path.join(d, fn) for fn in os.listdir(d)
+                         if fn.endswith('.plan'))
+            with open(filename, 'r+b') as f:
+                f.seek(100)
+                byte = f.read(1)
+                f.seek(100)
+                f.write(bytes([byte[0] ^ 0x01]))
+            del loaded
+            cached = ImageCache(d).load_hex(content)
+            self.assertIsNone(cached.cache.load_plan(
+                cached, (0x2000, len(segment), 56, True)))
+            loaded = PacketPlan.for_image(cached, segment, 0x2000, 56, True)
+            self.assertEqual(loaded.reports, plan.reports)
+
+
+class TestSimulator(unittest.TestCase):
+    REGIONS = ((1, 0x100, 0x700),)
+
+    def _simulator(self, **kwargs):
+        simulator = BootloaderSimulator(
+            [SimulatedNode(0xFF, self.REGIONS),
+             SimulatedNode(3, self.REGIONS, version=(1, 2, 3))], **kwargs)
+        self.addCleanup(simulator.close)
+        return simulator
+
+    def _loader(self, manager_class=USBManager,
+                transport_class=SimulatedTransport, **kwargs):
+        """ a simulator built with kwargs, and the loader of its master
+        through a session of manager_class on transport_class """
+
+        simulator = self._simulator(**kwargs)
+        session = DeviceSession(opener=lambda device_id: manager_class(
+            device_id, transport_class(simulator)))
+        self.addCleanup(session.close)
+        return simulator, self._node(session)
+
+    @staticmethod
+    def _node(session, device_id=0xFF):
+        """ a loader of device_id through session """
+
+        return AlfaFirmwareLoader(device_id, False, False, None, True,
+                                  session=session)
+
+    def _image(self, seed):
+        rng = random.Random(seed)
+        image = MemoryImage(0x1000)
+        for address in (0x210, 0x300, 0x800, 0xFF0):
+            image.write(address, bytes(rng.randrange(256) for _ in range(40)))
+        return image
+
+    def test_loader(self):
+        image = self._image(6)
+        for manager_class in (USBManager, AsyncUSBManager):
+            simulator, loader = self._loader(manager_class,
+                                             packet_latency=0.0002,
+                                             erase_time=0.05,
+                                             page_write_time=0.001)
+            session = loader.session
+            self.assertEqual((loader.starting_address, loader.memory_length),
+                             (0x100, 0x700))
+            loader.erase()
+            loader.program(image)
+            self.assertTrue(loader.verify(image, check_digest=False))
+            node = simulator.nodes[0xFF]
+            self.assertEqual(node.memory[0x200:], image[0x200:0x1000])
+            self.assertEqual(node.errors, [])
+            self.assertGreater(simulator.stats["pages_written"], 0)
+
+            # a slave through the same connection, programmed over what it
+            # held
+            slave = self._node(session, 3)
+            self.assertEqual(slave.boot_fw_version, (1, 2, 3))
+            slave.program(image)
+            self.assertTrue(slave.verify(image, check_digest=False))
+            self.assertEqual(simulator.nodes[3].memory, node.memory)
+
+        # the digest is stored and read back by QUERY
+        slave.seal(image)
+        self.assertEqual(simulator.nodes[3].digest,
+                         HexUtils.crc16_ccitt(image[0x200:0x1000]))
+        self.assertEqual(node.digest, 0xFFFF)
+
+        # the device leaves the bus on jump
+        slave.jump()
+        with self.assertRaises(RuntimeError):
+            session.usb.GET_DATA(0x100, 4)
+        session.invalidate()
+        session.open(0xFF)
+        self.assertEqual(session.usb.GET_DATA(0x108, 8), image[0x210:0x218])
+        session.close()
+
+    def test_program_twice(self):
+        image = self._image(6)
+
+        class Recording(SimulatedTransport):
+            def _submit(self, report):
+                commands[report[0]] += 1
+                super()._submit(report)
+
+        commands = collections.Counter()
+        _, loader = self._loader(transport_class=Recording)
+        loader.erase()
+        commands.clear()
+        loader.program(image)
+        self.assertTrue(loader.verify(image, check_digest=False))
+        sparse = commands[USBManager.CMD_ID_PROGRAM]
+        self.assertEqual(commands[USBManager.CMD_ID_VERIFY], sparse)
+        self.assertFalse(loader.erased)
+
+        # without an erase in between, every chunk is programmed and read
+        # back again
+        commands.clear()
+        loader.program(image)
+        self.assertTrue(loader.verify(image, check_digest=False))
+        self.assertGreater(commands[USBManager.CMD_ID_PROGRAM], sparse)
+        self.assertEqual(commands[USBManager.CMD_ID_VERIFY],
+                         commands[USBManager.CMD_ID_PROGRAM])
+
+    def test_program_verify(self):
+        image = self._image(6)
+        segment = image[0x200:0x1000]
+        row = AlfaFirmwareLoader.FLASH_PAGE_LEN
+
+        class Recording(SimulatedTransport):
+            def _submit(self, report):
+                reports.append(report)
+                super()._submit(report)
+
+        for manager_class in (USBManager, AsyncUSBManager):
+            for fail_rate in (0.0, 0.3):
+                reports = []
+                simulator, loader = self._loader(
+                    manager_class, Recording, packet_latency=0.0002,
+                    page_write_time=0.001, write_fail_rate=fail_rate, seed=2)
+                loader.erase()
+                del reports[:]
+                rows = loader.program_verify(image)
+                loader.session.close()
+
+                # a row is read back only once the device has written it:
+                # the data moved on to another row, or PROGRAM_COMPLETE
+                node = simulator.nodes[0xFF]
+                self.assertEqual(node.errors, [])
+                open_row = None
+                for report in reports:
+                    command, address, length = struct.unpack_from("<BLB",
+                                                                  report)
+                    if command == USBManager.CMD_ID_PROGRAM:
+                        open_row = (address * 2 + length - 1) // row
+                    elif command == USBManager.CMD_ID_PROGRAM_COMPLETE:
+                        open_row = None
+                    elif command == USBManager.CMD_ID_VERIFY:
+                        self.assertLess((address * 2 + length - 1) // row,
+                                        open_row if open_row is not None
+                                        else 1 << 32)
+                commands = collections.Counter(r[0] for r in reports)
+                self.assertEqual(commands[USBManager.CMD_ID_VERIFY],
+                                 commands[USBManager.CMD_ID_PROGRAM])
+
+                # the rows reported are the ones holding the first wrong
+                # byte of each chunk
+                expected = set()
+                for cursor in range(0, len(segment), 56):
+                    for i in range(cursor, min(cursor + 56, len(segment))):
+                        if node.memory[0x200 + i] != segment[i]:
+                            expected.add((0x200 + i) // row * row // 2)
+                            break
+                self.assertEqual(rows, sorted(expected))
+                self.assertEqual(bool(rows), fail_rate > 0)
+
+        # the read back is checked against the image, not against the plan
+        # that programmed it
+        _, loader = self._loader()
+        loader.erase()
+        plan, = image.plans.values()
+        plan.reports[63] ^= 0xFF
+        try:
+            self.assertEqual(loader.program_verify(image), [0x100])
+        finally:
+            plan.reports[63] ^= 0xFF
+
+        # an answer more than the requests
+        class Duplicating(SimulatedTransport):
+            def answer(self, report):
+                super().answer(report)
+                if report[0] == USBManager.CMD_ID_VERIFY:
+                    super().answer(report)
+
+        for manager_class in (USBManager, AsyncUSBManager):
+            _, loader = self._loader(manager_class, Duplicating)
+            loader.erase()
+            with self.assertRaises(RuntimeError):
+                loader.program_verify(image)
+
+    def test_sampled_verify(self):
+        image = self._image(6)
+        simulator, loader = self._loader()
+        loader.erase()
+        loader.program(image)
+
+        def verify(**kwargs):
+            before = simulator.stats["GET_DATA"]
+            result = loader.verify(image, check_digest=False, **kwargs)
+            return result, simulator.stats["GET_DATA"] - before
+
+        ok, full = verify()
+        self.assertTrue(ok)
+        ok, sampled = verify(sample_rate=0.25, seed=1)
+        self.assertTrue(ok)
+        self.assertLess(sampled, full)
+        self.assertGreater(sampled, 0)
+        self.assertEqual(verify(sample_rate=1), (True, full))
+        with self.assertRaises(ValueError):
+            loader.verify(image, sample_rate=0)
+
+        # a wrong byte is found only by the samples holding it, the same
+        # ones for the same seed: the others let it through, nothing else
+        # checks the chunks left out
+        simulator.nodes[0xFF].memory[0x210] = 0x5A
+        self.assertFalse(verify()[0])
+        results = [verify(sample_rate=0.25, seed=seed)[0]
+                   for seed in range(20)]
+        self.assertIn(False, results)
+        self.assertIn(True, results)
+        self.assertEqual([verify(sample_rate=0.25, seed=seed)[0]
+                          for seed in range(20)], results)
+
+    def test_up_to_date(self):
+        image, other = self._image(6), self._image(7)
+        simulator, loader = self._loader()
+        session = loader.session
+        # erased and never sealed
+        self.assertFalse(loader.is_up_to_date(image))
+        loader.erase()
+        loader.program(image)
+        loader.seal(image)
+
+        # the answer to QUERY is enough, the flash is not read
+        stats = simulator.stats.copy()
+        loader = self._node(session)
+        self.assertTrue(loader.is_up_to_date(image))
+        self.assertFalse(loader.is_up_to_date(other))
+        self.assertEqual(simulator.stats["GET_DATA"], stats["GET_DATA"])
+
+        # a bootloader not reporting the digest
+        loader.proto_ver = 0
+        self.assertFalse(loader.is_up_to_date(image))
+
+        slave = self._node(session, 3)
+        self.assertFalse(slave.is_up_to_date(image))
+
+        # the erase clears the digest
+        self._node(session).erase()
+        loader = self._node(session)
+        self.assertFalse(loader.is_up_to_date(image))
+
+    def test_timing(self):
+        simulator = self._simulator(packet_latency=0.002, erase_time=0.2,
+                                    page_write_time=0.01, page_size=0x100)
+        manager = AsyncUSBManager(0xFF, SimulatedTransport(simulator))
+        manager.QUERY()
+        start = time.perf_counter()
+        manager.ERASE()
+        self.assertGreaterEqual(time.perf_counter() - start, 0.2)
+
+        # 8 packets over 2 pages, each written when the data moves on, the
+        # last by PROGRAM_COMPLETE
+        start = time.perf_counter()
+        manager.PROGRAM_MESSAGES(program_messages(
+            (0x100 + i * 28, bytes(range(56))) for i in range(8)))
+        manager.PROGRAM_COMPLETE(0)
+        manager.GET_DATA(0x100, 4)
+        self.assertGreaterEqual(time.perf_counter() - start,
+                                9 * 0.002 + 2 * 0.01)
+        self.assertEqual(simulator.stats["pages_written"], 2)
+        self.assertEqual(simulator.stats["PROGRAM"], 8)
+        manager.disconnect()
+
+    def test_faults(self):
+        simulator = self._simulator()
+        manager = USBManager(0xFF, SimulatedTransport(simulator))
+        manager.QUERY()
+        manager.PROGRAM(0x100, bytes(range(56)))
+
+        simulator.corrupt_rate = 1.0
+        self.assertNotEqual(manager.GET_DATA(0x100, 56), bytes(range(56)))
+        simulator.corrupt_rate = 0.0
+        simulator.write_fail_rate = 1.0
+        manager.PROGRAM(0x11C, bytes(56))
+        self.assertEqual(manager.GET_DATA(0x11C, 4), b'\xFF\xFF\xFF\x00')
+        self.assertEqual(simulator.stats["failed_writes"], 1)
+
+        # a lost answer is reported within the budget learned so far
+        simulator.drop_rate = 1.0
+        start = time.perf_counter()
+        with self.assertRaises(TimeoutError):
+            manager.GET_DATA(0x100, 4)
+        self.assertLess(time.perf_counter() - start, 1)
+
+        # a gap with no PROGRAM_COMPLETE before the data is reported
+        simulator.write_fail_rate = 0.0
+        manager.PROGRAM(0x200, bytes(56))
+        self.assertEqual(len(simulator.nodes[0xFF].errors), 1)
+        manager.disconnect()
+
+    def test_socket(self):
+        simulator = self._simulator(packet_latency=0.0002)
+        sock = socket.create_server(('localhost', 0))
+        port = sock.getsockname()[1]
+        server = threading.Thread(target=serve, args=(simulator, sock),
+                                  daemon=True)
+        server.start()
+        self.addCleanup(server.join)
+        self.addCleanup(sock.close)
+        self.addCleanup(sock.shutdown, socket.SHUT_RDWR)
+
+        manager = AsyncUSBManager(0xFF, SocketTransport('localhost', port))
+        # one host at a time
+        with self.assertRaises(RuntimeError):
+            SocketTransport('localhost', port)
+        self.assertEqual(manager.QUERY(alt_device_id=3)[3], (1, 2, 3))
+        data = bytes(range(256)) * 4
+        manager.PROGRAM_MESSAGES(program_messages(
+            (0x100 + offset // 2, data[offset:offset + 56])
+            for offset in range(0, len(data), 56)))
+        self.assertEqual(manager.GET_DATA_RANGE(0x100, len(data)), data)
+        self.assertEqual(simulator.nodes[3].read(0x100, len(data)), data)
+
+        manager.RESET_BOOT_MMT()
+        manager.disconnect()
+        # the simulator given to open_usb_manager(), not by the environment
+        manager = open_usb_manager(0xFF, "sync", f"localhost:{port}")
+        self.assertIs(type(manager), USBManager)
+        self.assertEqual(manager.QUERY()[:2], (0x100, 0x700))
+        manager.disconnect()
+
+
+class TestDeviceSession(unittest.TestCase):
+    def test_session(self):
+        opened = []
+
+        def opener(device_id):
+            opened.append(SyncFakeManager(device_id, FakeTransport()))
+            return opened[-1]
+
+        session = DeviceSession(opener=opener)
+        usb = session.open(0xFF)
+        self.assertEqual(session.query()[:2], (0x100, 0x700))
+        self.assertEqual(session.query()[3], (1, 0, 0xFF))
+
+        # one connection for every node; QUERY only to select another one,
+        # or when asked to
+        self.assertIs(session.open(3), usb)
+        self.assertEqual(session.query()[3], (1, 0, 3))
+        session.open(3)
+        session.query()
+        session.query(refresh=True)
+        self.assertEqual(len(opened), 1)
+        self.assertEqual(opened[0]._transport.queries, [0, 0xFF, 3, 3])
+
+        session.invalidate()
+        self.assertTrue(opened[0]._transport.closed)
+        session.open(3)
+        session.query()
+        self.assertEqual(len(opened), 2)
+        self.assertEqual(opened[1]._transport.queries, [0, 3])
+        self.assertEqual(session.timings["connect"][0], 2)
+        self.assertEqual(session.timings["query"][0], 4)
+        self.assertIn("connect: 2 times", session.report())
+
+        # cancel() aborts the transfers of the connection, and the ones of
+        # any later one
+        session.cancel()
+        self.assertTrue(opened[1]._cancelled.is_set())
+        with self.assertRaises(TransferCancelled):
+            session.query(refresh=True)
+        session.invalidate()
+        with self.assertRaises(TransferCancelled):
+            session.open(3)
+        self.assertEqual(len(opened), 2)
+
+
+if __name__ == '__main__':
+    logging.basicConfig(level=logging.INFO)
+    unittest.main()